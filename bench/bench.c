@@ -0,0 +1,366 @@
+// Codec benchmark matrix
+//
+//   make bench CORPUS=DIR [BENCH_FLAGS="--json -q 50,90"]
+//   ./img-bench [OPTIONS] DIR
+//
+// For every image in DIR and every compiled-in output format (at each -q
+// quality for lossy formats), encodes the decoded image to a temporary file
+// and decodes that back, and reports the best-of-N timings, throughput, output
+// size and peak RSS as CSV (default) or JSON lines. Every case runs in its own
+// forked child, so the RSS figure belongs to that case alone: it covers
+// decoding the corpus image, the encode and the decode of the result.
+
+#define main img_converter_main
+#include "../src/img-converter.c"
+#undef main
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_MAX_QUALITIES 16
+
+struct bench_opts {
+	int qualities[BENCH_MAX_QUALITIES];
+	int quality_count;
+	int effort;
+	int runs;
+	const char *tmp_dir;
+	bool json;
+};
+
+// Sent from a case's child process back to the parent
+struct bench_result {
+	bool ok;
+	char error[64];
+	int width;
+	int height;
+	int channels;
+	double encode_s;    // best of runs
+	double decode_s;
+	uint64_t output_bytes;
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_fail(struct bench_result *res, const char *what)
+{
+	res->ok = false;
+	snprintf(res->error, sizeof(res->error), "%s", what);
+}
+
+// Full-frame encode of img to `path` in format fmt
+static bool bench_write(enum format fmt, const char *path, struct image *img,
+						const struct encode_opts *opts)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+	bool ok = format_encode(fmt, f, img, opts);
+	if (fclose(f) != 0)
+		ok = false;
+	return ok;
+}
+
+// Body of a case's child process
+static void bench_case(const char *input, enum format from_fmt, enum format to_fmt, int quality,
+					   const struct bench_opts *bo, struct bench_result *res)
+{
+	memset(res, 0, sizeof(*res));
+
+	struct image img = {0};
+	if (!format_read(from_fmt, input, &img, NULL)) {
+		bench_fail(res, "failed to read input");
+		return;
+	}
+	res->width = img.width;
+	res->height = img.height;
+	res->channels = img.channels;
+
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s/img-bench-%ld.%s", bo->tmp_dir, (long)getpid(),
+			 format_extension(to_fmt));
+	struct encode_opts opts = { .quality = quality, .effort = bo->effort };
+
+	res->ok = true;
+	for (int r = 0; r < bo->runs && res->ok; r++) {
+		double t0 = now_seconds();
+		if (!bench_write(to_fmt, tmp_path, &img, &opts)) {
+			bench_fail(res, "encode failed");
+			break;
+		}
+		double t = now_seconds() - t0;
+		if (r == 0 || t < res->encode_s)
+			res->encode_s = t;
+	}
+	image_free(&img);
+
+	struct stat st;
+	if (res->ok) {
+		if (stat(tmp_path, &st) == 0)
+			res->output_bytes = (uint64_t)st.st_size;
+		else
+			bench_fail(res, "output missing");
+	}
+
+	for (int r = 0; r < bo->runs && res->ok; r++) {
+		struct image out = {0};
+		double t0 = now_seconds();
+		if (!format_read(to_fmt, tmp_path, &out, NULL)) {
+			bench_fail(res, "decode failed");
+			break;
+		}
+		double t = now_seconds() - t0;
+		image_free(&out);
+		if (r == 0 || t < res->decode_s)
+			res->decode_s = t;
+	}
+
+	unlink(tmp_path);
+}
+
+// Runs one case in a child; *peak_rss_kb gets the child's ru_maxrss
+static bool bench_run_case(const char *input, enum format from_fmt, enum format to_fmt, int quality,
+						   const struct bench_opts *bo, struct bench_result *res, long *peak_rss_kb)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return false;
+
+	FLUSH();
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		struct bench_result r;
+		bench_case(input, from_fmt, to_fmt, quality, bo, &r);
+		ssize_t n = write(fds[1], &r, sizeof(r));
+		_exit(n == (ssize_t)sizeof(r) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	size_t got = 0;
+	while (got < sizeof(*res)) {
+		ssize_t n = read(fds[0], (char *)res + got, sizeof(*res) - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += (size_t)n;
+	}
+	close(fds[0]);
+
+	int status;
+	struct rusage ru;
+	while (wait4(pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	*peak_rss_kb = ru.ru_maxrss;
+
+	if (got != sizeof(*res)) {
+		memset(res, 0, sizeof(*res));
+		bench_fail(res, WIFSIGNALED(status) ? "crashed" : "no result");
+	}
+	return true;
+}
+
+static void bench_print_header(const struct bench_opts *bo)
+{
+	if (!bo->json)
+		PUTS("file,width,height,channels,format,quality,encode_ms,decode_ms,encode_mp_s,decode_mp_s,"
+			 "encode_mb_s,decode_mb_s,output_bytes,bits_per_pixel,peak_rss_kb,status\n");
+}
+
+static void bench_print(const struct bench_opts *bo, const char *file, enum format fmt, int quality,
+						const struct bench_result *res, long peak_rss_kb)
+{
+	double mp = (double)res->width * (double)res->height / 1e6;
+	double mb = mp * res->channels;
+	double bpp = mp > 0 ? (double)res->output_bytes * 8 / (mp * 1e6) : 0;
+	char q[16] = "";
+	if (quality > 0)
+		snprintf(q, sizeof(q), "%d", quality);
+
+	if (bo->json) {
+		// File names are printed verbatim; corpus names needing escapes are not expected
+		PRINTF("{\"file\": \"%s\", \"width\": %d, \"height\": %d, \"channels\": %d, \"format\": \"%s\", "
+			   "\"quality\": %s, ", file, res->width, res->height, res->channels, format_extension(fmt),
+			   quality > 0 ? q : "null");
+		if (res->ok) {
+			PRINTF("\"encode_ms\": %.3f, \"decode_ms\": %.3f, \"encode_mp_s\": %.2f, \"decode_mp_s\": %.2f, "
+				   "\"encode_mb_s\": %.2f, \"decode_mb_s\": %.2f, \"output_bytes\": %llu, \"bits_per_pixel\": %.4f, ",
+				   res->encode_s * 1e3, res->decode_s * 1e3, mp / res->encode_s, mp / res->decode_s,
+				   mb / res->encode_s, mb / res->decode_s, (unsigned long long)res->output_bytes, bpp);
+		}
+		PRINTF("\"peak_rss_kb\": %ld, \"status\": \"%s\"}\n", peak_rss_kb, res->ok ? "ok" : res->error);
+	} else if (res->ok) {
+		PRINTF("%s,%d,%d,%d,%s,%s,%.3f,%.3f,%.2f,%.2f,%.2f,%.2f,%llu,%.4f,%ld,ok\n",
+			   file, res->width, res->height, res->channels, format_extension(fmt), q,
+			   res->encode_s * 1e3, res->decode_s * 1e3, mp / res->encode_s, mp / res->decode_s,
+			   mb / res->encode_s, mb / res->decode_s, (unsigned long long)res->output_bytes, bpp,
+			   peak_rss_kb);
+	} else {
+		PRINTF("%s,%d,%d,%d,%s,%s,,,,,,,,,%ld,%s\n", file, res->width, res->height, res->channels,
+			   format_extension(fmt), q, peak_rss_kb, res->error);
+	}
+	FLUSH();
+}
+
+static int bench_filter(const struct dirent *d)
+{
+	return d->d_name[0] != '.' && detect_format(d->d_name) != FMT_UNKNOWN;
+}
+
+static bool bench_parse_qualities(const char *arg, struct bench_opts *bo)
+{
+	bo->quality_count = 0;
+	const char *p = arg;
+	while (*p) {
+		char *end;
+		errno = 0;
+		long val = strtol(p, &end, 10);
+		if (errno != 0 || end == p || val < 1 || val > 100 || bo->quality_count == BENCH_MAX_QUALITIES)
+			return false;
+		bo->qualities[bo->quality_count++] = (int)val;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return false;
+		p = end;
+	}
+	return bo->quality_count > 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct option options[] = {
+		{ "quality", required_argument, 0, 'q' },
+		{ "effort", required_argument, 0, 'e' },
+		{ "runs", required_argument, 0, 'r' },
+		{ "tmp-dir", required_argument, 0, 't' },
+		{ "threads", required_argument, 0, 'T' },
+		{ "json", no_argument, 0, 'J' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0 }
+	};
+
+	struct bench_opts bo = {
+		.qualities = { 50, 75, 90 },
+		.quality_count = 3,
+		.effort = -1,
+		.runs = 3,
+		.tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+	};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "q:e:r:t:h", options, NULL)) != -1) {
+		switch (c) {
+		case 'q':
+			if (!bench_parse_qualities(optarg, &bo)) {
+				PRINTF_ERR("Invalid quality list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+		case 'r':
+		case 'T': {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			long max = c == 'e' ? 10 : c == 'r' ? 1000 : 1024;
+			long min = c == 'r' ? 1 : 0;
+			if (errno != 0 || end == optarg || *end != '\0' || val < min || val > max) {
+				PRINTF_ERR("Invalid %s: %s\n", c == 'e' ? "effort" : c == 'r' ? "runs" : "threads", optarg);
+				return EXIT_FAILURE;
+			}
+			if (c == 'e')
+				bo.effort = (int)val;
+			else if (c == 'r')
+				bo.runs = (int)val;
+			else
+				codec_threads = (int)val;
+			break;
+		}
+		case 't':
+			bo.tmp_dir = optarg;
+			break;
+		case 'J':
+			bo.json = true;
+			break;
+		case 'h':
+			PUTS(
+				"Usage: img-bench [OPTIONS] DIR\n"
+				"\n"
+				"Encode/decode every image in DIR to every compiled-in format.\n"
+				"\n"
+				"Options:\n"
+				"  -q, --quality LIST    Qualities for lossy formats (default: 50,75,90)\n"
+				"  -e, --effort N        Encoder effort 0-10 (default: codec defaults)\n"
+				"  -r, --runs N          Timed runs per case, best is reported (default: 3)\n"
+				"  -t, --tmp-dir DIR     Where encoded files go (default: $TMPDIR or /tmp)\n"
+				"      --threads N       Codec threads (default: CPU count)\n"
+				"      --json            One JSON object per line instead of CSV\n"
+				"  -h, --help            Show this help\n"
+			);
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		PUTS_ERR("Usage: img-bench [OPTIONS] DIR\n");
+		return EXIT_FAILURE;
+	}
+	const char *dir = argv[optind];
+
+	// The corpus is trusted; don't let the converter's safety limits skip files
+	max_pixels = 0;
+	max_bytes = 0;
+
+	struct dirent **entries;
+	int n = scandir(dir, &entries, bench_filter, alphasort);
+	if (n < 0) {
+		PRINTF_ERR("Error: cannot read directory %s\n", dir);
+		return EXIT_FAILURE;
+	}
+
+	bench_print_header(&bo);
+	int failed = 0;
+	for (int i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+		enum format from_fmt = detect_format(path);
+
+		for (int f = FMT_UNKNOWN + 1; f < FMT_COUNT; f++) {
+			enum format to_fmt = (enum format)f;
+			int qcount = format_has_quality(to_fmt) ? bo.quality_count : 1;
+			for (int qi = 0; qi < qcount; qi++) {
+				int quality = format_has_quality(to_fmt) ? bo.qualities[qi] : 0;
+				struct bench_result res;
+				long rss = 0;
+				if (!bench_run_case(path, from_fmt, to_fmt, quality, &bo, &res, &rss)) {
+					PRINTF_ERR("Error: could not run case for %s\n", path);
+					failed++;
+					continue;
+				}
+				if (!res.ok)
+					failed++;
+				bench_print(&bo, entries[i]->d_name, to_fmt, quality, &res, rss);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,366 @@
+// QOI codec microbenchmark
+//
+//   make qoi-bench
+//   ./qoi-bench FILE.qoi...
+//
+// Decodes and re-encodes each file with the current codec and with the code it
+// replaced, checks that all of them agree, and reports throughput in MB/s of
+// raw pixels (best of several runs). The reference decoders are the original
+// stdio loop pulling opcodes through fgetc_unlocked and the same byte-at-a-time
+// loop run over the mapped file; the reference encoder is the byte-array
+// memcpy/memcmp loop. Build with the same CFLAGS as img-converter so the
+// numbers compare.
+
+#define main img_converter_main
+#include "../src/img-converter.c"
+#undef main
+
+#include <time.h>
+
+#define BENCH_MIN_SECONDS 0.5
+#define BENCH_MIN_RUNS 5
+
+// ----------------------------------------------------------------------------
+// Reference decoders
+// ----------------------------------------------------------------------------
+
+static bool ref_decode_bytes(const uint8_t *p, const uint8_t *end, uint8_t *out,
+							 size_t count, int channels)
+{
+	uint8_t index[64][4] = {0};
+	uint8_t px[4] = {0, 0, 0, 255};
+	size_t px_pos = 0;
+	size_t px_end = count * (size_t)channels;
+
+	while (px_pos < px_end) {
+		if (p >= end)
+			return false;
+		uint8_t b1 = *p++;
+
+		if (b1 == QOI_OP_RGB) {
+			if (end - p < 3)
+				return false;
+			memcpy(px, p, 3);
+			p += 3;
+		} else if (b1 == QOI_OP_RGBA) {
+			if (end - p < 4)
+				return false;
+			memcpy(px, p, 4);
+			p += 4;
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+			memcpy(px, index[b1], 4);
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+			px[0] += ((b1 >> 4) & 0x03) - 2;
+			px[1] += ((b1 >> 2) & 0x03) - 2;
+			px[2] += (b1 & 0x03) - 2;
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+			if (p >= end)
+				return false;
+			uint8_t b2 = *p++;
+			int vg = (b1 & 0x3f) - 32;
+			px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+			px[1] += vg;
+			px[2] += vg - 8 + (b2 & 0x0f);
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+			int run = (b1 & 0x3f) + 1;
+			while (run-- > 0 && px_pos < px_end) {
+				memcpy(out + px_pos, px, (size_t)channels);
+				px_pos += (size_t)channels;
+			}
+			continue;
+		}
+
+		memcpy(index[qoi_hash(px[0], px[1], px[2], px[3])], px, 4);
+		memcpy(out + px_pos, px, (size_t)channels);
+		px_pos += (size_t)channels;
+	}
+	return true;
+}
+
+static bool ref_read_bytes(FILE *f, uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		int c = fgetc_unlocked(f);
+		if (c == EOF)
+			return false;
+		buf[i] = (uint8_t)c;
+	}
+	return true;
+}
+
+static bool ref_decode_stdio(const char *path, uint8_t *out, size_t count, int channels)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	if (fseek(f, QOI_HEADER_SIZE, SEEK_SET) != 0) {
+		fclose(f);
+		return false;
+	}
+
+	uint8_t index[64][4] = {0};
+	uint8_t px[4] = {0, 0, 0, 255};
+	size_t px_pos = 0;
+	size_t px_end = count * (size_t)channels;
+	bool ok = true;
+
+	while (px_pos < px_end) {
+		uint8_t b1;
+		if (!ref_read_bytes(f, &b1, 1)) { ok = false; break; }
+
+		if (b1 == QOI_OP_RGB) {
+			if (!ref_read_bytes(f, px, 3)) { ok = false; break; }
+		} else if (b1 == QOI_OP_RGBA) {
+			if (!ref_read_bytes(f, px, 4)) { ok = false; break; }
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+			memcpy(px, index[b1], 4);
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+			px[0] += ((b1 >> 4) & 0x03) - 2;
+			px[1] += ((b1 >> 2) & 0x03) - 2;
+			px[2] += (b1 & 0x03) - 2;
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+			uint8_t b2;
+			if (!ref_read_bytes(f, &b2, 1)) { ok = false; break; }
+			int vg = (b1 & 0x3f) - 32;
+			px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+			px[1] += vg;
+			px[2] += vg - 8 + (b2 & 0x0f);
+		} else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+			int run = (b1 & 0x3f) + 1;
+			while (run-- > 0 && px_pos < px_end) {
+				memcpy(out + px_pos, px, (size_t)channels);
+				px_pos += (size_t)channels;
+			}
+			continue;
+		}
+
+		memcpy(index[qoi_hash(px[0], px[1], px[2], px[3])], px, 4);
+		memcpy(out + px_pos, px, (size_t)channels);
+		px_pos += (size_t)channels;
+	}
+
+	fclose(f);
+	return ok;
+}
+
+static size_t ref_encode_bytes(const uint8_t *pixels, size_t count, int channels, uint8_t *data)
+{
+	uint8_t index[64][4] = {0};
+	uint8_t px_prev[4] = {0, 0, 0, 255};
+	uint8_t px[4] = {0, 0, 0, 255};
+	size_t p = 0;
+	int run = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		memcpy(px, pixels + i * (size_t)channels, (size_t)channels);
+		if (channels == 3) px[3] = 255;
+		bool last = i + 1 == count;
+
+		if (memcmp(px, px_prev, 4) == 0) {
+			run++;
+			if (run == 62 || last) {
+				data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+		} else {
+			if (run > 0) {
+				data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+
+			int idx = qoi_hash(px[0], px[1], px[2], px[3]);
+			if (memcmp(index[idx], px, 4) == 0) {
+				data[p++] = (uint8_t)(QOI_OP_INDEX | idx);
+			} else {
+				memcpy(index[idx], px, 4);
+
+				if (px[3] == px_prev[3]) {
+					int vr = px[0] - px_prev[0];
+					int vg = px[1] - px_prev[1];
+					int vb = px[2] - px_prev[2];
+
+					int vg_r = vr - vg;
+					int vg_b = vb - vg;
+
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						data[p++] = (uint8_t)(QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+					} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+						data[p++] = (uint8_t)(QOI_OP_LUMA | (vg + 32));
+						data[p++] = (uint8_t)(((vg_r + 8) << 4) | (vg_b + 8));
+					} else {
+						data[p++] = QOI_OP_RGB;
+						data[p++] = px[0];
+						data[p++] = px[1];
+						data[p++] = px[2];
+					}
+				} else {
+					data[p++] = QOI_OP_RGBA;
+					data[p++] = px[0];
+					data[p++] = px[1];
+					data[p++] = px[2];
+					data[p++] = px[3];
+				}
+			}
+		}
+		memcpy(px_prev, px, 4);
+	}
+	return p;
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------------
+
+enum bench_impl { DEC_STDIO, DEC_BYTES, DEC_CURRENT, ENC_BYTES, ENC_CURRENT, IMPL_COUNT };
+
+static const struct {
+	const char *op;
+	const char *name;
+} bench_impls[IMPL_COUNT] = {
+	[DEC_STDIO] = { "decode", "stdio" },
+	[DEC_BYTES] = { "decode", "bytes" },
+	[DEC_CURRENT] = { "decode", "current" },
+	[ENC_BYTES] = { "encode", "bytes" },
+	[ENC_CURRENT] = { "encode", "current" },
+};
+
+struct bench_file {
+	const char *path;
+	struct mapped_file mf;
+	struct image hdr;
+	size_t count;       // pixels
+	size_t bytes;       // raw pixel bytes
+	uint8_t *pixels;    // decoder output, then encoder input
+	uint8_t *encoded;   // encoder output
+	size_t encoded_len;
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool bench_run(enum bench_impl impl, struct bench_file *bf)
+{
+	const uint8_t *pos = bf->mf.data + QOI_HEADER_SIZE;
+	const uint8_t *end = bf->mf.data + bf->mf.size;
+	int channels = bf->hdr.channels;
+	switch (impl) {
+	case DEC_STDIO:
+		return ref_decode_stdio(bf->path, bf->pixels, bf->count, channels);
+	case DEC_BYTES:
+		return ref_decode_bytes(pos, end, bf->pixels, bf->count, channels);
+	case DEC_CURRENT: {
+		struct qoi_dec st;
+		qoi_dec_init(&st);
+		return qoi_decode_pixels(&st, &pos, end, bf->pixels, bf->count, channels);
+	}
+	case ENC_BYTES:
+		bf->encoded_len = ref_encode_bytes(bf->pixels, bf->count, channels, bf->encoded);
+		return true;
+	case ENC_CURRENT: {
+		struct qoi_enc st;
+		qoi_enc_init(&st, bf->count);
+		bf->encoded_len = qoi_encode_pixels(&st, bf->pixels, bf->count, channels, bf->encoded);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static bool bench_file(const char *path)
+{
+	struct bench_file bf = { .path = path };
+	if (!map_file(path, 0, MAP_FILE_POPULATE, &bf.mf)) {
+		PRINTF_ERR("Error: could not read %s\n", path);
+		return false;
+	}
+
+	if (bf.mf.size < QOI_HEADER_SIZE || !qoi_parse_header(bf.mf.data, &bf.hdr)) {
+		PRINTF_ERR("Error: %s is not a QOI file\n", path);
+		unmap_file(&bf.mf);
+		return false;
+	}
+
+	bf.count = (size_t)bf.hdr.width * (size_t)bf.hdr.height;
+	bf.bytes = bf.count * (size_t)bf.hdr.channels;
+	bf.pixels = malloc(bf.bytes);
+	bf.encoded = malloc(qoi_encode_bound(bf.count, bf.hdr.channels));
+	uint8_t *expect = malloc(bf.bytes > qoi_encode_bound(bf.count, bf.hdr.channels) ?
+							 bf.bytes : qoi_encode_bound(bf.count, bf.hdr.channels));
+	if (!bf.pixels || !bf.encoded || !expect) {
+		PUTS_ERR("Error: out of memory\n");
+		free(bf.pixels);
+		free(bf.encoded);
+		free(expect);
+		unmap_file(&bf.mf);
+		return false;
+	}
+
+	bool ok = true;
+	double first_mbps = 0;
+	size_t expect_len = 0;
+	for (int i = 0; i < IMPL_COUNT && ok; i++) {
+		bool first = i == 0 || strcmp(bench_impls[i].op, bench_impls[i - 1].op) != 0;
+		double best = 0;
+		double total = 0;
+		for (int run = 0; run < BENCH_MIN_RUNS || total < BENCH_MIN_SECONDS; run++) {
+			double t0 = now_seconds();
+			if (!bench_run((enum bench_impl)i, &bf)) {
+				PRINTF_ERR("Error: %s %s failed on %s\n", bench_impls[i].name, bench_impls[i].op, path);
+				ok = false;
+				break;
+			}
+			double t = now_seconds() - t0;
+			total += t;
+			if (best == 0 || t < best)
+				best = t;
+		}
+		if (!ok)
+			break;
+
+		// Every implementation of an op must produce what the first one did
+		bool decode = strcmp(bench_impls[i].op, "decode") == 0;
+		const uint8_t *got = decode ? bf.pixels : bf.encoded;
+		size_t got_len = decode ? bf.bytes : bf.encoded_len;
+		if (first) {
+			memcpy(expect, got, got_len);
+			expect_len = got_len;
+		} else if (got_len != expect_len || memcmp(got, expect, got_len) != 0) {
+			PRINTF_ERR("Error: %s %s output differs on %s\n", bench_impls[i].name, bench_impls[i].op, path);
+			ok = false;
+			break;
+		}
+
+		double mbps = (double)bf.bytes / best / 1e6;
+		if (first)
+			first_mbps = mbps;
+		PRINTF("%s\t%dx%dx%d\t%s\t%s\t%.0f\t%.2fx\n", path, bf.hdr.width, bf.hdr.height,
+			   bf.hdr.channels, bench_impls[i].op, bench_impls[i].name, mbps, mbps / first_mbps);
+	}
+
+	free(expect);
+	free(bf.encoded);
+	free(bf.pixels);
+	unmap_file(&bf.mf);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		PUTS_ERR("Usage: qoi-bench FILE.qoi...\n");
+		return 1;
+	}
+
+	PUTS("file\tsize\top\timpl\tMB/s\tspeedup\n");
+	int failed = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!bench_file(argv[i]))
+			failed++;
+		FLUSH();
+	}
+	return failed ? 1 : 0;
+}
@@ -1,1735 +1,2237 @@
 /*
  * img-converter - Convert between image formats
  * Supports: PNG, JPEG, BMP, QOI, plus optional TIFF, WebP, AVIF, HEIF, JXL
+ *
+ * The command-line front end: single, batch and server conversions over the
+ * codecs in imgconv.c.
  */
 
-#define _GNU_SOURCE
+// Builds the CLI-only parts of imgconv.c along with the library
+#define IMGCONV_CLI
+#include "imgconv.c"
 
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <strings.h>
-#include <stdint.h>
-#include <stdbool.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
-#include <limits.h>
-#include <sys/stat.h>
-#include <png.h>
-#include <jpeglib.h>
-#ifdef HAVE_TIFF
-#include <tiffio.h>
-#endif
-#ifdef HAVE_WEBP
-#include <webp/decode.h>
-#include <webp/encode.h>
-#endif
-#ifdef HAVE_AVIF
-#include <avif/avif.h>
-#endif
-#ifdef HAVE_HEIF
-#include <libheif/heif.h>
-#endif
-#ifdef HAVE_JXL
-#include <jxl/decode.h>
-#include <jxl/encode.h>
-#include <jxl/resizable_parallel_runner.h>
-#endif
-
-#include "lib/stdio_helpers.h"
-#include "lib/checked_arith.h"
-
-static size_t max_pixels = 100000000;  // 0 = unlimited
-static size_t max_bytes = 268435456;   // 0 = unlimited
-
-// QOI format implementation (inline, no library needed)
-#define QOI_OP_INDEX  0x00
-#define QOI_OP_DIFF   0x40
-#define QOI_OP_LUMA   0x80
-#define QOI_OP_RUN    0xc0
-#define QOI_OP_RGB    0xfe
-#define QOI_OP_RGBA   0xff
-#define QOI_MASK_2    0xc0
-#define QOI_MAGIC     0x716f6966  // "qoif"
-#define QOI_HEADER_SIZE 14
-#define QOI_END_MARKER_SIZE 8
-
-static inline uint32_t qoi_read32be(const uint8_t *p) {
-	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
-}
-
-static inline void qoi_write32be(uint8_t *p, uint32_t v) {
-	p[0] = (v >> 24) & 0xff;
-	p[1] = (v >> 16) & 0xff;
-	p[2] = (v >> 8) & 0xff;
-	p[3] = v & 0xff;
-}
-
-static inline int qoi_hash(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
-	return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
-}
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lib/async_io.h"
+#include "lib/file_copy.h"
+#include "lib/mem_budget.h"
+#include "lib/replay_stream.h"
+#include "lib/xxhash64.h"
 
 // ============================================================================
-// Image data
+// Conversion
 // ============================================================================
 
-// Read entire file into malloc'd buffer, returns NULL on failure
-#if defined(HAVE_WEBP) || defined(HAVE_AVIF) || defined(HAVE_JXL)
-static uint8_t *read_file(const char *path, size_t *out_size)
-{
-	FILE *f = fopen(path, "rb");
-	if (!f) return NULL;
-
-	if (fseek(f, 0, SEEK_END) != 0) {
-		fclose(f);
-		return NULL;
-	}
-	long end = ftell(f);
-	if (end < 0) {
-		fclose(f);
-		return NULL;
-	}
-	if ((unsigned long)end > SIZE_MAX) {
-		fclose(f);
-		return NULL;
-	}
-	if (fseek(f, 0, SEEK_SET) != 0) {
-		fclose(f);
-		return NULL;
-	}
-	size_t size = (size_t)end;
-	if (max_bytes != 0 && size > max_bytes) {
-		fclose(f);
-		errno = EFBIG;
-		return NULL;
-	}
-
-	uint8_t *data = malloc(size ? size : 1);
-	if (!data) {
-		fclose(f);
-		return NULL;
-	}
-
-	if (size > 0 && READ_FILE(data, size, f) != size) {
-		free(data);
-		fclose(f);
-		return NULL;
-	}
+enum convert_status {
+	CONVERT_OK,
+	CONVERT_ERR_MAX_BYTES,
+	CONVERT_ERR_INPUT_FORMAT,
+	CONVERT_ERR_READ,
+	CONVERT_ERR_WRITE,
+	CONVERT_ERR_TARGET,
+	CONVERT_ERR_DUPLICATE,
+};
 
-	fclose(f);
-	*out_size = size;
-	return data;
+// Short, path-free description used in the batch report
+static const char *convert_status_reason(enum convert_status status)
+{
+	switch (status) {
+		case CONVERT_OK: return "ok";
+		case CONVERT_ERR_MAX_BYTES: return "input exceeds --max-bytes limit";
+		case CONVERT_ERR_INPUT_FORMAT: return "cannot detect input format";
+		case CONVERT_ERR_READ: return "failed to read input";
+		case CONVERT_ERR_WRITE: return "failed to write output";
+		case CONVERT_ERR_TARGET: return "cannot get under --target-size";
+		case CONVERT_ERR_DUPLICATE: return "output path already used by an earlier input";
+	}
+	return "unknown error";
 }
-#endif
 
-static bool read_bytes(FILE *f, uint8_t *buf, size_t len)
+// --chroma / chroma=: "420", "422" or "444" (also as "4:2:0" etc.)
+static bool chroma_parse(const char *name, enum chroma_subsampling *chroma)
 {
-	if (len == 0)
-		return true;
-	return READ_FILE(buf, len, f) == len;
+	if (strcmp(name, "420") == 0 || strcmp(name, "4:2:0") == 0)
+		*chroma = CHROMA_420;
+	else if (strcmp(name, "422") == 0 || strcmp(name, "4:2:2") == 0)
+		*chroma = CHROMA_422;
+	else if (strcmp(name, "444") == 0 || strcmp(name, "4:4:4") == 0)
+		*chroma = CHROMA_444;
+	else
+		return false;
+	return true;
 }
 
-static bool read_byte(FILE *f, uint8_t *out)
+// Parses --resize / resize= dimensions: WxH, Wx or xH
+static bool parse_dims(const char *s, int *width, int *height)
 {
-	int c = GETC_FILE(f);
-	if (c == EOF)
+	const char *x = strchr(s, 'x');
+	if (!x)
+		return false;
+	long dims[2] = {0, 0};
+	const char *parts[2] = { s, x + 1 };
+	const char *ends[2] = { x, x + 1 + strlen(x + 1) };
+	for (int i = 0; i < 2; i++) {
+		if (parts[i] == ends[i])
+			continue;
+		char *end;
+		errno = 0;
+		dims[i] = strtol(parts[i], &end, 10);
+		if (errno != 0 || end != ends[i] || *parts[i] == '-' || dims[i] < 0 || dims[i] > INT_MAX)
+			return false;
+	}
+	if (dims[0] == 0 && dims[1] == 0)
 		return false;
-	*out = (uint8_t)c;
+	*width = (int)dims[0];
+	*height = (int)dims[1];
 	return true;
 }
 
-struct image {
-	uint8_t *pixels;    // RGB or RGBA
-	int width;
-	int height;
-	int channels;       // 3 = RGB, 4 = RGBA
+// "-" names stdin for input and stdout for output
+static bool path_is_stdio(const char *path)
+{
+	return strcmp(path, "-") == 0;
+}
+
+// Byte counts for "-" paths, which stat() cannot see. Only single-file mode
+// accepts "-", so one conversion at a time touches these.
+static uint64_t stdin_bytes;
+static uint64_t stdout_bytes;   // furthest byte written, like a file's size
+
+// stdio cookie over fd 1. When stdout is a file, offsets are relative to
+// where it stood at output_open(), so a seeking encoder can follow other
+// output already written to it.
+struct stdout_stream {
+	off_t base;     // -1 = not seekable
+	uint64_t pos;
 };
 
-static bool image_validate_dims(const struct image *img)
+static ssize_t stdout_write(void *cookie, const char *buf, size_t len)
 {
-	return img->width > 0 && img->height > 0 && (img->channels == 3 || img->channels == 4);
+	struct stdout_stream *ss = cookie;
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = write(STDOUT_FILENO, buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (done == 0)
+				return -1;
+			break;
+		}
+		done += (size_t)n;
+	}
+	ss->pos += done;
+	if (ss->pos > stdout_bytes)
+		stdout_bytes = ss->pos;
+	return (ssize_t)done;
 }
 
-static bool image_check_max_pixels(int width, int height)
+static int stdout_seek(void *cookie, off64_t *offset, int whence)
 {
-	size_t pixel_count;
-	if (!checked_mul_size((size_t)width, (size_t)height, &pixel_count))
-		return false;
-	return max_pixels == 0 || pixel_count <= max_pixels;
+	struct stdout_stream *ss = cookie;
+	if (ss->base < 0) {
+		errno = ESPIPE;
+		return -1;
+	}
+	off_t target = whence == SEEK_SET ? ss->base + *offset : *offset;
+	off_t pos = lseek(STDOUT_FILENO, target, whence);
+	if (pos < 0)
+		return -1;
+	if (pos < ss->base) {
+		lseek(STDOUT_FILENO, ss->base + (off_t)ss->pos, SEEK_SET);
+		errno = EINVAL;
+		return -1;
+	}
+	ss->pos = (uint64_t)(pos - ss->base);
+	*offset = (off64_t)ss->pos;
+	return 0;
 }
 
-static bool image_alloc_pixels(struct image *img, size_t rowbytes)
+static uint64_t stdout_write_all(const void *buf, size_t len)
 {
-	if (!image_validate_dims(img) || rowbytes == 0)
-		return false;
-	if (!image_check_max_pixels(img->width, img->height))
-		return false;
-	size_t total;
-	if (!checked_mul_size(rowbytes, (size_t)img->height, &total))
-		return false;
-	img->pixels = malloc(total);
-	return img->pixels != NULL;
+	struct stdout_stream ss = { .base = -1 };
+	ssize_t n = stdout_write(&ss, buf, len);
+	return n < 0 ? 0 : (uint64_t)n;
 }
 
-// ============================================================================
-// PNG
-// ============================================================================
+// Destination of one conversion: the named file, or for "-" stdout. An
+// encoder that seeks cannot write into a pipe, so its output is collected in
+// memory and copied out by output_close().
+struct output {
+	const char *path;
+	FILE *f;
+	struct stdout_stream ss;
+	struct mem_stream ms;
+	bool buffered;
+};
 
-static bool png_read(const char *path, struct image *img)
+static bool output_open(struct output *out, const char *path, enum format fmt)
 {
-	FILE *f = fopen(path, "rb");
-	if (!f) return false;
-
-	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png) {
-		fclose(f);
-		return false;
-	}
-
-	png_infop info = png_create_info_struct(png);
-	if (!info) {
-		png_destroy_read_struct(&png, NULL, NULL);
-		fclose(f);
-		return false;
-	}
-
-	if (setjmp(png_jmpbuf(png))) {
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-
-	png_init_io(png, f);
-	png_read_info(png, info);
-
-	png_uint_32 w = png_get_image_width(png, info);
-	png_uint_32 h = png_get_image_height(png, info);
-	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX) {
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-	img->width = (int)w;
-	img->height = (int)h;
-	png_byte color_type = png_get_color_type(png, info);
-	png_byte bit_depth = png_get_bit_depth(png, info);
-
-	// Convert to 8-bit RGBA
-	if (bit_depth == 16)
-		png_set_strip_16(png);
-	if (color_type == PNG_COLOR_TYPE_PALETTE)
-		png_set_palette_to_rgb(png);
-	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-		png_set_expand_gray_1_2_4_to_8(png);
-	if (png_get_valid(png, info, PNG_INFO_tRNS))
-		png_set_tRNS_to_alpha(png);
-	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-		png_set_gray_to_rgb(png);
-
-	png_read_update_info(png, info);
-
-	img->channels = (png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA) ? 4 : 3;
-	if (!image_check_max_pixels(img->width, img->height)) {
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-
-	size_t rowbytes = png_get_rowbytes(png, info);
-	img->pixels = NULL;
-	if (!image_alloc_pixels(img, rowbytes)) {
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-
-	size_t rows_bytes;
-	if (!checked_mul_size((size_t)img->height, sizeof(png_bytep), &rows_bytes)) {
-		free(img->pixels);
-		img->pixels = NULL;
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-	png_bytep *rows = malloc(rows_bytes);
-	if (!rows) {
-		free(img->pixels);
-		img->pixels = NULL;
-		png_destroy_read_struct(&png, &info, NULL);
-		fclose(f);
-		return false;
-	}
-	for (int y = 0; y < img->height; y++) {
-		size_t yoff = (size_t)y * rowbytes;
-		rows[y] = img->pixels + yoff;
+	memset(out, 0, sizeof(*out));
+	out->path = path;
+	if (!path_is_stdio(path)) {
+		out->f = fopen(path, "wb");
+		return out->f != NULL;
+	}
+
+	stdout_bytes = 0;
+	// O_APPEND (`>>`) sends every write to the end, so it cannot seek either
+	int fl = fcntl(STDOUT_FILENO, F_GETFL);
+	out->ss.base = fl >= 0 && !(fl & O_APPEND) ? lseek(STDOUT_FILENO, 0, SEEK_CUR) : -1;
+	if (out->ss.base < 0 && format_needs_seekable_output(fmt)) {
+		out->buffered = true;
+		out->f = mem_stream_open(&out->ms);
+	} else {
+		cookie_io_functions_t io = { .write = stdout_write, .seek = stdout_seek };
+		out->f = fopencookie(&out->ss, "w", io);
 	}
-
-	png_read_image(png, rows);
-	free(rows);
-
-	png_destroy_read_struct(&png, &info, NULL);
-	fclose(f);
-	return true;
+	return out->f != NULL;
 }
 
-static bool png_write(const char *path, struct image *img)
+// Closes out; ok = false (or a failed close) removes a partially written file
+static bool output_close(struct output *out, bool ok)
 {
-	FILE *f = fopen(path, "wb");
-	if (!f) return false;
-
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png) {
-		fclose(f);
-		return false;
+	if (fclose(out->f) != 0)
+		ok = false;
+	if (out->buffered) {
+		if (ok) {
+			enum stats_stage prev = stats_enter(STAGE_WRITE_IO);
+			ok = stdout_write_all(out->ms.data, out->ms.size) == out->ms.size;
+			stats_leave(prev);
+		}
+		free(out->ms.data);
+	} else if (!ok && !path_is_stdio(out->path)) {
+		unlink(out->path);
 	}
+	return ok;
+}
 
-	png_infop info = png_create_info_struct(png);
-	if (!info) {
-		png_destroy_write_struct(&png, NULL);
-		fclose(f);
-		return false;
+// Pumps rows from src to a sink for to_fmt through one reusable strip buffer.
+// Takes ownership of src. A partially written output is removed on failure.
+static enum convert_status stream_convert(struct row_source *src, const char *output_path,
+										  enum format to_fmt, const struct encode_opts *opts)
+{
+	size_t rowbytes = row_source_rowbytes(src);
+	size_t strip_bytes;
+	uint8_t *strip = NULL;
+	if (checked_mul_size(rowbytes, STREAM_STRIP_ROWS, &strip_bytes))
+		strip = pool_alloc(strip_bytes);
+	if (!strip) {
+		src->close(src);
+		return CONVERT_ERR_READ;
+	}
+	stats_alloc(strip_bytes);
+
+	struct output out;
+	if (!output_open(&out, output_path, to_fmt)) {
+		pool_free(strip);
+		src->close(src);
+		return CONVERT_ERR_WRITE;
+	}
+
+	enum stats_stage prev = stats_enter(STAGE_ENCODE);
+	struct row_sink *dst = row_sink_open(to_fmt, out.f, src->width, src->height, src->channels, opts);
+	stats_leave(prev);
+	if (!dst) {
+		output_close(&out, false);
+		pool_free(strip);
+		src->close(src);
+		return CONVERT_ERR_WRITE;
+	}
+
+	enum convert_status status = CONVERT_OK;
+	for (int y = 0; y < src->height; y += STREAM_STRIP_ROWS) {
+		int n = src->height - y < STREAM_STRIP_ROWS ? src->height - y : STREAM_STRIP_ROWS;
+		stats_enter(STAGE_DECODE);
+		bool ok = src->read(src, strip, n);
+		stats_leave(prev);
+		if (!ok) {
+			status = CONVERT_ERR_READ;
+			break;
+		}
+		stats_enter(STAGE_ENCODE);
+		ok = dst->write(dst, strip, n);
+		stats_leave(prev);
+		if (!ok) {
+			status = CONVERT_ERR_WRITE;
+			break;
+		}
 	}
 
-	if (setjmp(png_jmpbuf(png))) {
-		png_destroy_write_struct(&png, &info);
-		fclose(f);
-		return false;
+	if (status == CONVERT_OK) {
+		stats_enter(STAGE_ENCODE);
+		if (!dst->close(dst))
+			status = CONVERT_ERR_WRITE;
+		stats_leave(prev);
+	} else {
+		dst->abort(dst);
 	}
+	if (!output_close(&out, status == CONVERT_OK) && status == CONVERT_OK)
+		status = CONVERT_ERR_WRITE;
+	src->close(src);
+	pool_free(strip);
+	return status;
+}
 
-	png_init_io(png, f);
-
-	int color_type = (img->channels == 4) ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
-	png_set_IHDR(png, info, (png_uint_32)img->width, (png_uint_32)img->height, 8, color_type,
-				 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png, info);
+// Parallel candidate encodes for --target-size/--target-ssim: -j in a single
+// conversion, 1 where batch or server workers already fill the CPUs
+static int search_probes = 1;
 
-	if (!image_validate_dims(img)) {
-		png_destroy_write_struct(&png, &info);
-		fclose(f);
-		return false;
-	}
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		png_destroy_write_struct(&png, &info);
-		fclose(f);
-		return false;
-	}
-	for (int y = 0; y < img->height; y++) {
-		size_t yoff = (size_t)y * rowbytes;
-		png_write_row(png, img->pixels + yoff);
+// Encodes img to output_path in to_fmt; img is only read
+static enum convert_status image_write_output(const struct image *img, const char *output_path,
+											  enum format to_fmt, const struct encode_opts *opts)
+{
+	struct output out;
+	if (!output_open(&out, output_path, to_fmt))
+		return CONVERT_ERR_WRITE;
+	enum stats_stage prev = stats_enter(STAGE_ENCODE);
+	enum convert_status status = CONVERT_OK;
+	if (encode_wants_search(opts)) {
+		uint8_t *data;
+		size_t size;
+		int quality;
+		if (format_encode_search(to_fmt, (struct image *)img, opts, search_probes, &data, &size, &quality)) {
+			if (cur_stats)
+				cur_stats->quality = quality;
+			if (output_write(data, size, out.f) != size)
+				status = CONVERT_ERR_WRITE;
+			free(data);
+		} else {
+			status = errno == ERANGE ? CONVERT_ERR_TARGET : CONVERT_ERR_WRITE;
+		}
+	} else if (!format_encode(to_fmt, out.f, (struct image *)img, opts)) {
+		status = CONVERT_ERR_WRITE;
 	}
+	stats_leave(prev);
+	if (!output_close(&out, status == CONVERT_OK) && status == CONVERT_OK)
+		status = CONVERT_ERR_WRITE;
+	return status;
+}
 
-	png_write_end(png, NULL);
-	png_destroy_write_struct(&png, &info);
-	fclose(f);
+// Writes data converted from -> to_fmt by format_shortcut_mem() to
+// output_path. Returns false, with nothing written, when this pair or this
+// file has no shortcut and has to go through RGB instead.
+static bool shortcut_output(enum format from_fmt, const uint8_t *data, size_t size, const char *output_path,
+							 enum format to_fmt, const struct encode_opts *opts, enum convert_status *status)
+{
+	uint8_t *out;
+	size_t out_size;
+	enum stats_stage prev = stats_enter(STAGE_ENCODE);
+	bool ok = format_shortcut_mem(from_fmt, to_fmt, data, size, opts, &out, &out_size);
+	stats_leave(prev);
+	if (!ok)
+		return false;
+
+	struct output o;
+	*status = CONVERT_OK;
+	if (!output_open(&o, output_path, to_fmt))
+		*status = CONVERT_ERR_WRITE;
+	else if (!output_close(&o, output_write(out, out_size, o.f) == out_size))
+		*status = CONVERT_ERR_WRITE;
+	free(out);
 	return true;
 }
 
-// ============================================================================
-// JPEG
-// ============================================================================
-
-static bool jpeg_read(const char *path, struct image *img)
+// Converts an in-memory input into a malloc'd buffer; from_fmt may be
+// FMT_UNKNOWN to sniff it from the data
+static enum convert_status convert_mem(enum format from_fmt, const uint8_t *data, size_t size,
+									   enum format to_fmt, const struct encode_opts *opts,
+									   uint8_t **out, size_t *out_size)
 {
-	FILE *f = fopen(path, "rb");
-	if (!f) return false;
-
-	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
-	jpeg_stdio_src(&cinfo, f);
-	jpeg_read_header(&cinfo, TRUE);
-
-	cinfo.out_color_space = JCS_RGB;
-	jpeg_start_decompress(&cinfo);
+	if (from_fmt == FMT_UNKNOWN)
+		from_fmt = detect_format_data(data, size);
+	if (from_fmt == FMT_UNKNOWN)
+		return CONVERT_ERR_INPUT_FORMAT;
+
+	enum stats_stage prev = stats_enter(STAGE_ENCODE);
+	bool ok = format_shortcut_mem(from_fmt, to_fmt, data, size, opts, out, out_size);
+	stats_leave(prev);
+	if (ok)
+		return CONVERT_OK;
 
-	if (cinfo.output_width > (JDIMENSION)INT_MAX || cinfo.output_height > (JDIMENSION)INT_MAX) {
-		jpeg_destroy_decompress(&cinfo);
-		fclose(f);
-		return false;
-	}
-	img->width = (int)cinfo.output_width;
-	img->height = (int)cinfo.output_height;
-	img->channels = 3;  // JPEG doesn't support alpha
+	struct image img = {0};
+	prev = stats_enter(STAGE_DECODE);
+	ok = format_decode(from_fmt, data, size, &img, opts);
+	stats_leave(prev);
+	if (!ok)
+		return CONVERT_ERR_READ;
+	if (!image_resize(&img, opts)) {
+		image_free(&img);
+		return CONVERT_ERR_READ;
+	}
+
+	stats_enter(STAGE_ENCODE);
+	int quality;
+	if (encode_wants_search(opts))
+		ok = format_encode_search(to_fmt, &img, opts, search_probes, out, out_size, &quality);
+	else
+		ok = format_encode_mem(to_fmt, &img, opts, out, out_size);
+	bool too_large = !ok && errno == ERANGE;
+	stats_leave(prev);
+	image_free(&img);
+	return ok ? CONVERT_OK : too_large ? CONVERT_ERR_TARGET : CONVERT_ERR_WRITE;
+}
 
-	if (!image_validate_dims(img)) {
-		jpeg_destroy_decompress(&cinfo);
-		fclose(f);
-		return false;
-	}
-	if (!image_check_max_pixels(img->width, img->height)) {
-		jpeg_destroy_decompress(&cinfo);
-		fclose(f);
-		return false;
-	}
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		jpeg_destroy_decompress(&cinfo);
-		fclose(f);
-		return false;
-	}
-	img->pixels = NULL;
-	if (!image_alloc_pixels(img, rowbytes)) {
-		jpeg_destroy_decompress(&cinfo);
-		fclose(f);
-		return false;
-	}
+// Enough leading bytes for detect_format_data() to tell every format apart
+#define STDIN_MAGIC_BYTES 16
 
-	while (cinfo.output_scanline < cinfo.output_height) {
-		uint8_t *row = img->pixels + cinfo.output_scanline * rowbytes;
-		jpeg_read_scanlines(&cinfo, &row, 1);
+// Starts reading stdin into rs and sniffs its format from the magic bytes;
+// on success rs must be released with replay_stream_free()
+static enum convert_status stdin_open(struct replay_stream *rs, enum format *from_fmt)
+{
+	stdin_bytes = 0;
+	if (max_bytes != 0) {
+		struct stat st;
+		if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+			(st.st_size < 0 || (uintmax_t)st.st_size > (uintmax_t)max_bytes))
+			return CONVERT_ERR_MAX_BYTES;
 	}
 
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
-	fclose(f);
-	return true;
+	replay_stream_init(rs, STDIN_FILENO, max_bytes);
+	errno = 0;
+	enum stats_stage prev = stats_enter(STAGE_READ_IO);
+	bool ok = replay_stream_fill(rs, STDIN_MAGIC_BYTES);
+	stats_leave(prev);
+	*from_fmt = ok ? detect_format_data(rs->data, rs->size) : FMT_UNKNOWN;
+	if (*from_fmt != FMT_UNKNOWN)
+		return CONVERT_OK;
+	stdin_bytes = rs->total;
+	replay_stream_free(rs);
+	if (ok)
+		return CONVERT_ERR_INPUT_FORMAT;
+	return errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
 }
 
-static bool jpeg_write(const char *path, struct image *img, int quality)
+// Reads the rest of stdin in growing chunks and decodes all of it; releases rs
+static enum convert_status stdin_decode(struct replay_stream *rs, enum format from_fmt, struct image *img,
+										const struct encode_opts *opts)
 {
-	FILE *f = fopen(path, "wb");
-	if (!f) return false;
-
-	// If source has alpha, we need to strip it
-	if (!image_validate_dims(img)) {
-		fclose(f);
-		return false;
-	}
-	size_t src_rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &src_rowbytes)) {
-		fclose(f);
-		return false;
+	errno = 0;
+	enum stats_stage prev = stats_enter(STAGE_READ_IO);
+	bool ok = replay_stream_read_all(rs);
+	stats_leave(prev);
+	stdin_bytes = rs->total;
+	if (!ok) {
+		replay_stream_free(rs);
+		return errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
 	}
 
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, f);
-
-	cinfo.image_width = (JDIMENSION)img->width;
-	cinfo.image_height = (JDIMENSION)img->height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_start_compress(&cinfo, TRUE);
+	prev = stats_enter(STAGE_DECODE);
+	ok = format_decode(from_fmt, rs->data, rs->size, img, opts);
+	stats_leave(prev);
+	replay_stream_free(rs);
+	return ok ? CONVERT_OK : CONVERT_ERR_READ;
+}
 
-	if (img->channels == 4) {
-		size_t rgb_rowbytes;
-		if (!checked_mul_size((size_t)img->width, 3, &rgb_rowbytes)) {
-			jpeg_destroy_compress(&cinfo);
-			fclose(f);
-			return false;
-		}
-		uint8_t *row = malloc(rgb_rowbytes);
-		if (!row) {
-			jpeg_destroy_compress(&cinfo);
-			fclose(f);
-			return false;
-		}
-		for (int y = 0; y < img->height; y++) {
-			size_t yoff = (size_t)y * src_rowbytes;
-			uint8_t *src = img->pixels + yoff;
-			for (int x = 0; x < img->width; x++) {
-				row[x * 3 + 0] = src[x * 4 + 0];
-				row[x * 3 + 1] = src[x * 4 + 1];
-				row[x * 3 + 2] = src[x * 4 + 2];
-			}
-			jpeg_write_scanlines(&cinfo, &row, 1);
-		}
-		free(row);
-	} else {
-		for (int y = 0; y < img->height; y++) {
-			size_t yoff = (size_t)y * src_rowbytes;
-			uint8_t *row = img->pixels + yoff;
-			jpeg_write_scanlines(&cinfo, &row, 1);
+// Applies --max-bytes to a named input and takes its format from the extension
+static enum convert_status input_check(const char *input_path, enum format *from_fmt)
+{
+	if (max_bytes != 0) {
+		struct stat st;
+		if (stat(input_path, &st) == 0 && S_ISREG(st.st_mode)) {
+			if (st.st_size < 0 || (uintmax_t)st.st_size > (uintmax_t)max_bytes)
+				return CONVERT_ERR_MAX_BYTES;
 		}
 	}
-
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-	fclose(f);
-	return true;
+	*from_fmt = detect_format(input_path);
+	return *from_fmt == FMT_UNKNOWN ? CONVERT_ERR_INPUT_FORMAT : CONVERT_OK;
 }
 
-// ============================================================================
-// WebP
-// ============================================================================
-
-#ifdef HAVE_WEBP
-static bool webp_read(const char *path, struct image *img)
+// Decodes input_path ("-" = stdin) in full and resizes it as opts asks
+static enum convert_status image_load(const char *input_path, struct image *img,
+									  const struct encode_opts *opts)
 {
-	size_t size;
-	uint8_t *data = read_file(path, &size);
-	if (!data) return false;
-
-	// Check if image has alpha
-	WebPBitstreamFeatures features;
-	if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) {
-		free(data);
-		return false;
-	}
-
-	if (features.width <= 0 || features.height <= 0) {
-		free(data);
-		return false;
-	}
-	if (!image_check_max_pixels(features.width, features.height)) {
-		free(data);
-		return false;
-	}
-	img->width = features.width;
-	img->height = features.height;
-
-	if (features.has_alpha) {
-		img->channels = 4;
-		img->pixels = WebPDecodeRGBA(data, size, &img->width, &img->height);
+	enum convert_status status;
+	if (path_is_stdio(input_path)) {
+		struct replay_stream rs;
+		enum format from_fmt;
+		status = stdin_open(&rs, &from_fmt);
+		if (status == CONVERT_OK)
+			status = stdin_decode(&rs, from_fmt, img, opts);
 	} else {
-		img->channels = 3;
-		img->pixels = WebPDecodeRGB(data, size, &img->width, &img->height);
-	}
-
-	free(data);
-
-	if (!img->pixels)
-		return false;
-
-	// WebP allocates with its own allocator, copy to our malloc'd buffer
-	size_t pixel_count;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->height, &pixel_count)) {
-		WebPFree(img->pixels);
-		return false;
-	}
-	size_t pixel_size;
-	if (!checked_mul_size(pixel_count, (size_t)img->channels, &pixel_size)) {
-		WebPFree(img->pixels);
-		return false;
-	}
-	uint8_t *copy = malloc(pixel_size);
-	if (!copy) {
-		WebPFree(img->pixels);
-		return false;
-	}
-	memcpy(copy, img->pixels, pixel_size);
-	WebPFree(img->pixels);
-	img->pixels = copy;
-
-	return true;
+		enum format from_fmt;
+		status = input_check(input_path, &from_fmt);
+		if (status != CONVERT_OK)
+			return status;
+		errno = 0;
+		enum stats_stage prev = stats_enter(STAGE_DECODE);
+		bool ok = format_read(from_fmt, input_path, img, opts);
+		stats_leave(prev);
+		if (!ok)
+			return errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
+		status = CONVERT_OK;
+	}
+	if (status == CONVERT_OK && !image_resize(img, opts)) {
+		image_free(img);
+		status = CONVERT_ERR_READ;
+	}
+	return status;
 }
 
-static bool webp_write(const char *path, struct image *img, int quality)
+// Full-frame tail of a conversion once the row streaming paths are ruled out
+static enum convert_status convert_full(const char *input_path, const char *output_path,
+										enum format to_fmt, const struct encode_opts *opts)
 {
-	uint8_t *output = NULL;
-	size_t output_size;
-
-	if (!image_validate_dims(img))
-		return false;
-	if (img->width > INT_MAX / img->channels)
-		return false;
-	int stride = img->width * img->channels;
-
-	if (img->channels == 4) {
-		output_size = WebPEncodeRGBA(img->pixels, img->width, img->height, stride, quality, &output);
-	} else {
-		output_size = WebPEncodeRGB(img->pixels, img->width, img->height, stride, quality, &output);
-	}
-
-	if (output_size == 0)
-		return false;
+	struct image img = {0};
+	enum convert_status status = image_load(input_path, &img, opts);
+	if (status != CONVERT_OK)
+		return status;
+	status = image_write_output(&img, output_path, to_fmt, opts);
+	image_free(&img);
+	return status;
+}
 
-	FILE *f = fopen(path, "wb");
-	if (!f) {
-		WebPFree(output);
-		return false;
+// Conversion from a pipe. The format comes from the magic bytes. PNG and
+// JPEG decode straight off stdin; everything else, and a stream the row
+// source turns down after its header, is read whole in growing chunks first.
+// So is an input that may skip RGB altogether (format_can_shortcut()).
+static enum convert_status convert_stdin(const char *output_path, enum format to_fmt,
+										 const struct encode_opts *opts)
+{
+	bool streams = format_has_row_sink(to_fmt) && !image_wants_resize(opts) && !encode_wants_search(opts);
+	if (!streams && !format_can_shortcut_to(to_fmt, opts))
+		return convert_full("-", output_path, to_fmt, opts);
+
+	struct replay_stream rs;
+	enum format from_fmt;
+	enum convert_status status = stdin_open(&rs, &from_fmt);
+	if (status != CONVERT_OK)
+		return status;
+
+	struct row_source *src = NULL;
+	if (format_can_shortcut(from_fmt, to_fmt, opts)) {
+		errno = 0;
+		enum stats_stage prev = stats_enter(STAGE_READ_IO);
+		bool ok = replay_stream_read_all(&rs);
+		stats_leave(prev);
+		if (ok && shortcut_output(from_fmt, rs.data, rs.size, output_path, to_fmt, opts, &status)) {
+			stdin_bytes = rs.total;
+			replay_stream_free(&rs);
+			return status;
+		}
+		// Not transcodable after all, or a read error stdin_decode() reports
+	} else if (streams) {
+		FILE *f = replay_stream_open(&rs);
+		if (f) {
+			enum stats_stage prev = stats_enter(STAGE_DECODE);
+			src = row_source_open_file(from_fmt, f);
+			stats_leave(prev);
+		}
 	}
+	if (!src) {
+		struct image img = {0};
+		status = stdin_decode(&rs, from_fmt, &img, opts);
+		if (status == CONVERT_OK && !image_resize(&img, opts)) {
+			image_free(&img);
+			status = CONVERT_ERR_READ;
+		}
+		if (status != CONVERT_OK)
+			return status;
+		status = image_write_output(&img, output_path, to_fmt, opts);
+		image_free(&img);
+		return status;
+	}
+
+	rs.recording = false;
+	status = stream_convert(src, output_path, to_fmt, opts);
+	if (rs.error != 0) {
+		// The decoder may have padded out a cut-off stream and succeeded
+		if (status == CONVERT_OK && !path_is_stdio(output_path))
+			unlink(output_path);
+		status = rs.error == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
+	}
+	stdin_bytes = rs.total;
+	replay_stream_free(&rs);
+	return status;
+}
 
-	bool ok = WRITE_FILE(output, output_size, f) == output_size;
-	fclose(f);
-	WebPFree(output);
+static enum convert_status convert_direct(const char *input_path, const char *output_path,
+										  enum format to_fmt, const struct encode_opts *opts)
+{
+	if (path_is_stdio(input_path))
+		return convert_stdin(output_path, to_fmt, opts);
 
-	return ok;
+	enum format from_fmt = detect_format(input_path);
+	if (format_can_shortcut(from_fmt, to_fmt, opts)) {
+		enum convert_status status = input_check(input_path, &from_fmt);
+		if (status != CONVERT_OK)
+			return status;
+		struct mapped_file mf;
+		errno = 0;
+		if (!input_map(input_path, MAP_FILE_SEQUENTIAL, &mf))
+			return errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
+		bool done = shortcut_output(from_fmt, mf.data, mf.size, output_path, to_fmt, opts, &status);
+		unmap_file(&mf);
+		if (done)
+			return status;
+	}
+
+	// Scanline formats on both ends: stream with bounded memory. Sources that
+	// cannot stream (interlaced PNG, tiled TIFF, ...) fall through to the
+	// full-frame path, as does anything being resized or quality-searched.
+	if (format_has_row_sink(to_fmt) && !image_wants_resize(opts) && !encode_wants_search(opts)) {
+		enum format from_fmt;
+		enum convert_status status = input_check(input_path, &from_fmt);
+		if (status != CONVERT_OK)
+			return status;
+		enum stats_stage prev = stats_enter(STAGE_DECODE);
+		struct row_source *src = row_source_open(from_fmt, input_path);
+		stats_leave(prev);
+		if (src)
+			return stream_convert(src, output_path, to_fmt, opts);
+	}
+	return convert_full(input_path, output_path, to_fmt, opts);
 }
-#endif
 
 // ============================================================================
-// BMP (no library needed)
+// Output cache (--cache-dir)
 // ============================================================================
 
-#pragma pack(push, 1)
-struct bmp_file_header {
-	uint16_t type;
-	uint32_t size;
-	uint16_t reserved1;
-	uint16_t reserved2;
-	uint32_t offset;
+// Outputs are kept in one flat directory under a 128-bit content key: XXH64
+// of the input bytes, and XXH64 (seeded with that) of everything else the
+// output depends on, i.e. the input size and format, the output format, the
+// encode and resize options, the codec versions built in and CACHE_VERSION.
+// A hit is copied out (reflink, copy_file_range) instead of converted. A miss
+// is converted into DIR/<key>.<ext>.tmp and renamed into place while holding
+// a flock on DIR/<key>.<ext>.lock, so workers and other processes after the
+// same entry wait for that one conversion rather than each running their own.
+// Entries' mtimes are their last use; when the directory grows past
+// --cache-size the least recently used are removed down to 90% of it.
+
+// Bump when an encoder change alters output for the same options
+#define CACHE_VERSION 1
+
+static const char *cache_dir;
+static uint64_t cache_size = 1ULL << 30;   // 0 = unbounded
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_used;     // as of the last scan, plus what we added since
+static bool cache_scanned;
+
+struct cache_key {
+	uint64_t input;
+	uint64_t params;
 };
 
-struct bmp_info_header {
-	uint32_t size;
-	int32_t width;
-	int32_t height;
-	uint16_t planes;
-	uint16_t bit_count;
-	uint32_t compression;
-	uint32_t image_size;
-	int32_t x_pels_per_meter;
-	int32_t y_pels_per_meter;
-	uint32_t clr_used;
-	uint32_t clr_important;
-};
-#pragma pack(pop)
-
-static bool bmp_read(const char *path, struct image *img)
+// Appends to desc at *len. Fails rather than truncate: a cut-off description
+// could give two different sets of options the same key.
+static bool cache_desc_add(char *desc, size_t cap, size_t *len, const char *fmt, ...)
 {
-	FILE *f = fopen(path, "rb");
-	if (!f) return false;
-
-	struct bmp_file_header fh;
-	struct bmp_info_header ih;
-
-	if (READ_FILE(&fh, sizeof(fh), f) != sizeof(fh) || READ_FILE(&ih, sizeof(ih), f) != sizeof(ih)) {
-		fclose(f);
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(desc + *len, cap - *len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= cap - *len)
 		return false;
-	}
-
-	if (fh.type != 0x4D42) {  // "BM"
-		fclose(f);
-		return false;
-	}
-
-	// Only support uncompressed 24-bit or 32-bit BMPs
-	if (ih.compression != 0 || (ih.bit_count != 24 && ih.bit_count != 32)) {
-		fclose(f);
-		return false;
-	}
-
-	if (ih.width <= 0 || ih.width > INT_MAX || ih.height == 0 || ih.height == INT32_MIN) {
-		fclose(f);
-		return false;
-	}
-
-	bool top_down = ih.height < 0;
-	img->width = ih.width;
-	img->height = top_down ? -ih.height : ih.height;
-	img->channels = (ih.bit_count == 32) ? 4 : 3;
-
-	if (!image_validate_dims(img)) {
-		fclose(f);
-		return false;
-	}
-	if (!image_check_max_pixels(img->width, img->height)) {
-		fclose(f);
-		return false;
-	}
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		fclose(f);
-		return false;
-	}
-	img->pixels = NULL;
-	if (!image_alloc_pixels(img, rowbytes)) {
-		fclose(f);
-		return false;
-	}
-
-	// BMP rows are padded to 4-byte boundaries
-	int bmp_channels = ih.bit_count / 8;
-	size_t raw_rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)bmp_channels, &raw_rowbytes)) {
-		free(img->pixels);
-		img->pixels = NULL;
-		fclose(f);
-		return false;
-	}
-	size_t tmp_rowbytes;
-	if (!checked_add_size(raw_rowbytes, 3, &tmp_rowbytes)) {
-		free(img->pixels);
-		img->pixels = NULL;
-		fclose(f);
-		return false;
-	}
-	size_t bmp_rowbytes = tmp_rowbytes & ~(size_t)3;
-	uint8_t *row = malloc(bmp_rowbytes);
-	if (!row) {
-		free(img->pixels);
-		img->pixels = NULL;
-		fclose(f);
-		return false;
-	}
-
-	if (fseek(f, fh.offset, SEEK_SET) != 0) {
-		free(row);
-		free(img->pixels);
-		img->pixels = NULL;
-		fclose(f);
-		return false;
-	}
-
-	for (int y = 0; y < img->height; y++) {
-		size_t dst_y = (size_t)(top_down ? y : (img->height - 1 - y));
-		if (READ_FILE(row, bmp_rowbytes, f) != bmp_rowbytes) {
-			free(row);
-			free(img->pixels);
-			fclose(f);
-			return false;
-		}
-
-		uint8_t *dst = img->pixels + dst_y * rowbytes;
-		for (int x = 0; x < img->width; x++) {
-			// BMP is BGR(A), convert to RGB(A)
-			dst[x * img->channels + 0] = row[x * bmp_channels + 2];
-			dst[x * img->channels + 1] = row[x * bmp_channels + 1];
-			dst[x * img->channels + 2] = row[x * bmp_channels + 0];
-			if (img->channels == 4)
-				dst[x * img->channels + 3] = row[x * bmp_channels + 3];
-		}
-	}
-
-	free(row);
-	fclose(f);
+	*len += (size_t)n;
 	return true;
 }
 
-static bool bmp_write(const char *path, struct image *img)
+// False if the options do not fit in a key, in which case the cache is skipped
+static bool cache_key_make(const uint8_t *data, size_t size, enum format from_fmt, enum format to_fmt,
+						   const struct encode_opts *opts, struct cache_key *key)
 {
-	FILE *f = fopen(path, "wb");
-	if (!f) return false;
-
-	if (!image_validate_dims(img)) {
-		fclose(f);
-		return false;
-	}
-
-	int bmp_channels = 3;  // Always write 24-bit BMP (no alpha)
-	size_t raw_rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)bmp_channels, &raw_rowbytes)) {
-		fclose(f);
-		return false;
-	}
-	size_t tmp_rowbytes;
-	if (!checked_add_size(raw_rowbytes, 3, &tmp_rowbytes)) {
-		fclose(f);
-		return false;
-	}
-	size_t bmp_rowbytes = tmp_rowbytes & ~(size_t)3;
-	if (bmp_rowbytes == 0) {
-		fclose(f);
-		return false;
-	}
-	size_t image_size;
-	if (!checked_mul_size(bmp_rowbytes, (size_t)img->height, &image_size)) {
-		fclose(f);
-		return false;
-	}
-	if (image_size > UINT32_MAX - (sizeof(struct bmp_file_header) + sizeof(struct bmp_info_header))) {
-		fclose(f);
-		return false;
-	}
-
-	struct bmp_file_header fh = {
-		.type = 0x4D42,
-		.size = (uint32_t)(sizeof(fh) + sizeof(struct bmp_info_header) + image_size),
-		.offset = sizeof(fh) + sizeof(struct bmp_info_header)
-	};
-
-	struct bmp_info_header ih = {
-		.size = sizeof(ih),
-		.width = img->width,
-		.height = img->height,
-		.planes = 1,
-		.bit_count = 24,
-		.image_size = (uint32_t)image_size
-	};
-
-	if (WRITE_FILE(&fh, sizeof(fh), f) != sizeof(fh) || WRITE_FILE(&ih, sizeof(ih), f) != sizeof(ih)) {
-		fclose(f);
-		return false;
-	}
-
-	uint8_t *row = calloc(1, bmp_rowbytes);
-	if (!row) {
-		fclose(f);
-		return false;
-	}
-
-	size_t src_rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &src_rowbytes)) {
-		free(row);
-		fclose(f);
+	key->input = xxh64(data, size, 0);
+	char desc[512];
+	size_t n = 0;
+	bool ok = cache_desc_add(desc, sizeof(desc), &n, "v%d %zu %s>%s q%d e%d %dx%d%s f%d m%d s%.17g ts%zu/%.17g y%d t%d/%d c%d j%d%d x%d p%d/%d/%d png%d jpeg%d",
+							 CACHE_VERSION, size, format_extension(from_fmt), format_extension(to_fmt),
+							 opts->quality, opts->effort, opts->resize_width, opts->resize_height,
+							 opts->fit ? "fit" : "", (int)opts->filter, opts->max_dim, opts->scale,
+							 opts->target_size, opts->target_ssim, (int)opts->chroma,
+							 (int)tiff_compression, tiff_tile, qoi_chunks, jpeg_parallel, jpeg_fast, jxl_transcode,
+							 png_level, png_strategy, png_parallel,
+							 PNG_LIBPNG_VER, JPEG_LIB_VERSION);
+#ifdef TIFFLIB_VERSION
+	ok = ok && cache_desc_add(desc, sizeof(desc), &n, " tiff%d", TIFFLIB_VERSION);
+#endif
+#ifdef HAVE_WEBP
+	ok = ok && cache_desc_add(desc, sizeof(desc), &n, " webp%d/%d", WebPGetDecoderVersion(), WebPGetEncoderVersion());
+#endif
+#ifdef AVIF_VERSION
+	ok = ok && cache_desc_add(desc, sizeof(desc), &n, " avif%d", AVIF_VERSION);
+#endif
+#ifdef HAVE_HEIF
+	ok = ok && cache_desc_add(desc, sizeof(desc), &n, " heif%u", (unsigned)heif_get_version_number());
+#endif
+#ifdef HAVE_JXL
+	ok = ok && cache_desc_add(desc, sizeof(desc), &n, " jxl%u/%u", (unsigned)JxlDecoderVersion(), (unsigned)JxlEncoderVersion());
+#endif
+	if (!ok)
 		return false;
-	}
-
-	for (int y = img->height - 1; y >= 0; y--) {
-		size_t yoff = (size_t)y * src_rowbytes;
-		uint8_t *src = img->pixels + yoff;
-		for (int x = 0; x < img->width; x++) {
-			// RGB(A) to BGR
-			row[x * 3 + 0] = src[x * img->channels + 2];
-			row[x * 3 + 1] = src[x * img->channels + 1];
-			row[x * 3 + 2] = src[x * img->channels + 0];
-		}
-		if (WRITE_FILE(row, bmp_rowbytes, f) != bmp_rowbytes) {
-			free(row);
-			fclose(f);
-			return false;
-		}
-	}
-
-	free(row);
-	fclose(f);
+	key->params = xxh64(desc, n, key->input);
 	return true;
 }
 
-// ============================================================================
-// QOI (no library needed)
-// ============================================================================
-
-static bool qoi_read(const char *path, struct image *img)
+// A hit skips the decode, and with it --max-pixels, so the header is checked
+// first and the input refused as a fresh conversion would refuse it. A header
+// the probe cannot parse is left to the decoder. (--max-bytes is enforced
+// when the input is read.)
+static bool cache_input_allowed(enum format from_fmt, const uint8_t *data, size_t size)
 {
-	FILE *f = fopen(path, "rb");
-	if (!f) return false;
-
-	uint8_t header[QOI_HEADER_SIZE];
-	if (!read_bytes(f, header, sizeof(header))) {
-		fclose(f);
-		return false;
-	}
-
-	if (qoi_read32be(header) != QOI_MAGIC) {
-		fclose(f);
-		return false;
-	}
+	if (max_pixels == 0)
+		return true;
+	struct image hdr = {0};
+	return format_probe(from_fmt, data, size, &hdr) || errno != EOVERFLOW;
+}
 
-	uint32_t width = qoi_read32be(header + 4);
-	uint32_t height = qoi_read32be(header + 8);
-	img->channels = header[12];
+static bool cache_entry_path(char *buf, size_t cap, const struct cache_key *key, enum format to_fmt,
+							 const char *suffix)
+{
+	int n = snprintf(buf, cap, "%s/%016" PRIx64 "%016" PRIx64 ".%s%s", cache_dir, key->input, key->params,
+					 format_extension(to_fmt), suffix);
+	return n > 0 && (size_t)n < cap;
+}
 
-	if (width == 0 || height == 0 || width > INT_MAX || height > INT_MAX) {
-		fclose(f);
-		return false;
-	}
+// <32 hex digits>.<ext>, leaving out .tmp and .lock files
+static bool cache_is_entry_name(const char *name)
+{
+	for (int i = 0; i < 32; i++)
+		if (!isxdigit((unsigned char)name[i]))
+			return false;
+	return name[32] == '.' && name[33] != '\0' && !strchr(name + 33, '.');
+}
 
-	if (img->channels != 3 && img->channels != 4) {
-		fclose(f);
-		return false;
-	}
+struct cache_file {
+	struct timespec used;
+	uint64_t size;
+	char *name;
+};
 
-	size_t pixel_count;
-	if (!checked_mul_size((size_t)width, (size_t)height, &pixel_count)) {
-		fclose(f);
-		return false;
-	}
-	size_t pixel_bytes;
-	if (!checked_mul_size(pixel_count, (size_t)img->channels, &pixel_bytes)) {
-		fclose(f);
-		return false;
-	}
+static int cache_file_cmp(const void *a, const void *b)
+{
+	const struct timespec *x = &((const struct cache_file *)a)->used;
+	const struct timespec *y = &((const struct cache_file *)b)->used;
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
 
-	img->width = (int)width;
-	img->height = (int)height;
-	if (!image_check_max_pixels(img->width, img->height)) {
-		fclose(f);
-		return false;
+// Totals the entries and, if that is over limit, removes the least recently
+// used down to target. Returns what is left.
+static uint64_t cache_trim(uint64_t limit, uint64_t target)
+{
+	DIR *dir = opendir(cache_dir);
+	if (!dir)
+		return 0;
+	struct cache_file *files = NULL;
+	size_t count = 0, cap = 0;
+	uint64_t total = 0;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+		if (!cache_is_entry_name(de->d_name) ||
+			fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		total += (uint64_t)st.st_size;
+		if (count == cap) {
+			size_t grown_cap = cap ? cap * 2 : 256;
+			struct cache_file *grown = realloc(files, grown_cap * sizeof(*files));
+			if (!grown)
+				break;
+			files = grown;
+			cap = grown_cap;
+		}
+		char *name = strdup(de->d_name);
+		if (!name)
+			break;
+		files[count++] = (struct cache_file){ st.st_mtim, (uint64_t)st.st_size, name };
 	}
 
-	img->pixels = malloc(pixel_bytes);
-	if (!img->pixels) {
-		fclose(f);
-		return false;
+	if (total > limit) {
+		qsort(files, count, sizeof(*files), cache_file_cmp);
+		for (size_t i = 0; i < count && total > target; i++) {
+			if (unlinkat(dirfd(dir), files[i].name, 0) == 0)
+				total -= files[i].size;
+		}
 	}
+	for (size_t i = 0; i < count; i++)
+		free(files[i].name);
+	free(files);
+	closedir(dir);
+	return total;
+}
 
-	uint8_t index[64][4] = {0};
-	uint8_t px[4] = {0, 0, 0, 255};
-	size_t px_pos = 0;
-	size_t px_end = pixel_count * (size_t)img->channels;
+// Counts a new entry against --cache-size. Other processes' entries are seen
+// at the next scan.
+static void cache_account(uint64_t added)
+{
+	if (cache_size == 0)
+		return;
+	pthread_mutex_lock(&cache_mutex);
+	cache_used += added;
+	if (!cache_scanned || cache_used > cache_size) {
+		cache_used = cache_trim(cache_size, cache_size - cache_size / 10);
+		cache_scanned = true;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
 
-	while (px_pos < px_end) {
-		uint8_t b1;
-		if (!read_byte(f, &b1)) {
-			free(img->pixels);
-			fclose(f);
-			return false;
-		}
+// Opens an entry and marks it used; -1 on a miss
+static int cache_open(const char *path, struct stat *st)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+		close(fd);
+		return -1;
+	}
+	futimens(fd, NULL);
+	return fd;
+}
 
-		if (b1 == QOI_OP_RGB) {
-			if (!read_bytes(f, px, 3)) {
-				free(img->pixels);
-				fclose(f);
-				return false;
-			}
-		} else if (b1 == QOI_OP_RGBA) {
-			if (!read_bytes(f, px, 4)) {
-				free(img->pixels);
-				fclose(f);
-				return false;
-			}
-		} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
-			memcpy(px, index[b1], 4);
-		} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
-			px[0] += ((b1 >> 4) & 0x03) - 2;
-			px[1] += ((b1 >> 2) & 0x03) - 2;
-			px[2] += (b1 & 0x03) - 2;
-		} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
-			uint8_t b2;
-			if (!read_byte(f, &b2)) {
-				free(img->pixels);
-				fclose(f);
-				return false;
-			}
-			int vg = (b1 & 0x3f) - 32;
-			px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
-			px[1] += vg;
-			px[2] += vg - 8 + (b2 & 0x0f);
-		} else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
-			int run = (b1 & 0x3f) + 1;
-			while (run-- > 0 && px_pos < px_end) {
-				memcpy(img->pixels + px_pos, px, (size_t)img->channels);
-				px_pos += (size_t)img->channels;
-			}
-			continue;
+// Takes the entry's lock, blocking while another worker or process converts
+// it. The holder removes the lock file when done, so a lock won on a file
+// that has since been unlinked is retried on the new one.
+static int cache_lock(const char *lock_path)
+{
+	for (;;) {
+		int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (fd < 0)
+			return -1;
+		int rc;
+		do {
+			rc = flock(fd, LOCK_EX);
+		} while (rc != 0 && errno == EINTR);
+		struct stat held, now;
+		if (rc != 0) {
+			close(fd);
+			return -1;
 		}
-
-		memcpy(index[qoi_hash(px[0], px[1], px[2], px[3])], px, 4);
-		memcpy(img->pixels + px_pos, px, (size_t)img->channels);
-		px_pos += (size_t)img->channels;
+		if (fstat(fd, &held) == 0 && stat(lock_path, &now) == 0 &&
+			held.st_dev == now.st_dev && held.st_ino == now.st_ino)
+			return fd;
+		close(fd);
 	}
-
-	fclose(f);
-	return true;
 }
 
-static bool qoi_write(const char *path, struct image *img)
+static void cache_unlock(const char *lock_path, int fd)
 {
-	if (!image_validate_dims(img))
-		return false;
-
-	size_t pixel_count;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->height, &pixel_count))
-		return false;
-
-	size_t per_pixel = (size_t)img->channels + 1;
-	size_t data_bytes;
-	if (!checked_mul_size(pixel_count, per_pixel, &data_bytes))
-		return false;
+	unlink(lock_path);
+	close(fd);
+}
 
-	size_t max_size;
-	if (!checked_add_size(QOI_HEADER_SIZE, data_bytes, &max_size))
-		return false;
-	if (!checked_add_size(max_size, QOI_END_MARKER_SIZE, &max_size))
-		return false;
+// Writes a cache miss to tmp_path
+typedef enum convert_status (*cache_fill_fn)(void *ctx, const char *tmp_path);
 
-	uint8_t *data = malloc(max_size);
-	if (!data) return false;
-
-	qoi_write32be(data, QOI_MAGIC);
-	qoi_write32be(data + 4, (uint32_t)img->width);
-	qoi_write32be(data + 8, (uint32_t)img->height);
-	data[12] = (uint8_t)img->channels;
-	data[13] = 1;  // colorspace: sRGB
-
-	uint8_t index[64][4] = {0};
-	uint8_t px[4] = {0, 0, 0, 255};
-	uint8_t px_prev[4] = {0, 0, 0, 255};
-	size_t p = QOI_HEADER_SIZE;
-	int run = 0;
-
-	for (size_t i = 0; i < pixel_count; i++) {
-		memcpy(px, img->pixels + i * (size_t)img->channels, (size_t)img->channels);
-		if (img->channels == 3) px[3] = 255;
-
-		if (memcmp(px, px_prev, 4) == 0) {
-			run++;
-				if (run == 62 || i == pixel_count - 1) {
-					data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
-					run = 0;
-				}
-			} else {
-				if (run > 0) {
-					data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
-					run = 0;
-				}
-
-			int idx = qoi_hash(px[0], px[1], px[2], px[3]);
-				if (memcmp(index[idx], px, 4) == 0) {
-					data[p++] = (uint8_t)(QOI_OP_INDEX | idx);
-				} else {
-				memcpy(index[idx], px, 4);
-
-				if (px[3] == px_prev[3]) {
-					int vr = px[0] - px_prev[0];
-					int vg = px[1] - px_prev[1];
-					int vb = px[2] - px_prev[2];
-
-					int vg_r = vr - vg;
-					int vg_b = vb - vg;
-
-						if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
-							data[p++] = (uint8_t)(QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
-						} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
-							data[p++] = (uint8_t)(QOI_OP_LUMA | (vg + 32));
-							data[p++] = (uint8_t)(((vg_r + 8) << 4) | (vg_b + 8));
-					} else {
-						data[p++] = QOI_OP_RGB;
-						data[p++] = px[0];
-						data[p++] = px[1];
-						data[p++] = px[2];
-					}
-				} else {
-					data[p++] = QOI_OP_RGBA;
-					data[p++] = px[0];
-					data[p++] = px[1];
-					data[p++] = px[2];
-					data[p++] = px[3];
-				}
-			}
+// Returns an open fd on the entry for key, running fill() first on a miss.
+// -1 if there is none after all, with *status the fill's result or, when the
+// cache itself could not be used, CONVERT_OK.
+static int cache_lookup(const struct cache_key *key, enum format to_fmt, cache_fill_fn fill, void *ctx,
+						struct stat *st, enum convert_status *status)
+{
+	char path[PATH_MAX], lock_path[PATH_MAX], tmp_path[PATH_MAX];
+	*status = CONVERT_OK;
+	if (!cache_entry_path(path, sizeof(path), key, to_fmt, "") ||
+		!cache_entry_path(lock_path, sizeof(lock_path), key, to_fmt, ".lock") ||
+		!cache_entry_path(tmp_path, sizeof(tmp_path), key, to_fmt, ".tmp"))
+		return -1;
+
+	int fd = cache_open(path, st);
+	if (fd >= 0)
+		return fd;
+
+	int lock = cache_lock(lock_path);
+	if (lock < 0)
+		return -1;
+	// Someone else may have converted it while we waited
+	fd = cache_open(path, st);
+	if (fd < 0) {
+		*status = fill(ctx, tmp_path);
+		if (*status == CONVERT_OK && rename(tmp_path, path) == 0) {
+			fd = cache_open(path, st);
+		} else {
+			unlink(tmp_path);
 		}
-		memcpy(px_prev, px, 4);
 	}
+	cache_unlock(lock_path, lock);
+	if (fd >= 0 && *status == CONVERT_OK)
+		cache_account((uint64_t)st->st_size);
+	return fd;
+}
 
-	// End marker
-	memset(data + p, 0, 7);
-	data[p + 7] = 1;
-	p += 8;
+struct cache_convert_ctx {
+	const char *input_path;
+	enum format to_fmt;
+	const struct encode_opts *opts;
+};
 
-	FILE *f = fopen(path, "wb");
-	if (!f) {
-		free(data);
-		return false;
-	}
+static enum convert_status cache_convert_fill(void *ctx, const char *tmp_path)
+{
+	struct cache_convert_ctx *c = ctx;
+	return convert_direct(c->input_path, tmp_path, c->to_fmt, c->opts);
+}
 
-	bool ok = WRITE_FILE(data, p, f) == p;
-	fclose(f);
-	free(data);
+static bool cache_copy_out(int fd, uint64_t size, const char *output_path)
+{
+	enum stats_stage prev = stats_enter(STAGE_WRITE_IO);
+	bool ok;
+	if (path_is_stdio(output_path)) {
+		ok = file_copy_fd(fd, STDOUT_FILENO, size);
+		stdout_bytes = ok ? size : 0;
+	} else {
+		int out = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		ok = out >= 0 && file_copy_fd(fd, out, size);
+		if (out >= 0 && close(out) != 0)
+			ok = false;
+		if (!ok && out >= 0)
+			unlink(output_path);
+	}
+	stats_leave(prev);
 	return ok;
 }
 
-// ============================================================================
-// AVIF (libavif)
-// ============================================================================
-
-#ifdef HAVE_AVIF
-static bool avif_read(const char *path, struct image *img)
+// convert_direct() by way of --cache-dir. stdin is not cached: it would have
+// to be read whole before anything could be decoded.
+static enum convert_status convert_file(const char *input_path, const char *output_path,
+										enum format to_fmt, const struct encode_opts *opts)
 {
-	size_t size;
-	uint8_t *data = read_file(path, &size);
-	if (!data) return false;
-
-	avifDecoder *decoder = avifDecoderCreate();
-	if (!decoder) {
-		free(data);
-		return false;
-	}
-
-	avifResult result = avifDecoderSetIOMemory(decoder, data, size);
-	if (result != AVIF_RESULT_OK) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-
-	result = avifDecoderParse(decoder);
-	if (result != AVIF_RESULT_OK) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-
-	result = avifDecoderNextImage(decoder);
-	if (result != AVIF_RESULT_OK) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-
-	avifImage *avif = decoder->image;
-	if (avif->width == 0 || avif->height == 0 || avif->width > INT_MAX || avif->height > INT_MAX) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-	img->width = (int)avif->width;
-	img->height = (int)avif->height;
-	img->channels = avif->alphaPlane ? 4 : 3;
-	if (!image_check_max_pixels(img->width, img->height)) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-	img->pixels = NULL;
-	if (!image_alloc_pixels(img, rowbytes)) {
-		avifDecoderDestroy(decoder);
-		free(data);
-		return false;
-	}
-
-	avifRGBImage rgb;
-	avifRGBImageSetDefaults(&rgb, avif);
-	rgb.format = img->channels == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
-	rgb.depth = 8;
-	rgb.pixels = img->pixels;
-	rgb.rowBytes = rowbytes;
-
-	result = avifImageYUVToRGB(avif, &rgb);
-	avifDecoderDestroy(decoder);
-	free(data);
-
-	if (result != AVIF_RESULT_OK) {
-		free(img->pixels);
-		img->pixels = NULL;
-		return false;
-	}
-
-	return true;
+	if (!cache_dir || path_is_stdio(input_path))
+		return convert_direct(input_path, output_path, to_fmt, opts);
+
+	enum format from_fmt;
+	enum convert_status status = input_check(input_path, &from_fmt);
+	if (status != CONVERT_OK)
+		return status;
+	struct mapped_file mf;
+	errno = 0;
+	if (!input_map(input_path, MAP_FILE_SEQUENTIAL, &mf))
+		return errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
+	struct cache_key key;
+	bool allowed = cache_input_allowed(from_fmt, mf.data, mf.size);
+	bool keyed = allowed && cache_key_make(mf.data, mf.size, from_fmt, to_fmt, opts, &key);
+	unmap_file(&mf);
+	if (!allowed)
+		return CONVERT_ERR_READ;
+	if (!keyed)
+		return convert_direct(input_path, output_path, to_fmt, opts);
+
+	struct cache_convert_ctx ctx = { input_path, to_fmt, opts };
+	struct stat st;
+	int fd = cache_lookup(&key, to_fmt, cache_convert_fill, &ctx, &st, &status);
+	if (fd < 0) {
+		// An unwritable cache should not fail the conversion
+		if (status == CONVERT_OK || status == CONVERT_ERR_WRITE)
+			status = convert_direct(input_path, output_path, to_fmt, opts);
+		return status;
+	}
+	bool ok = cache_copy_out(fd, (uint64_t)st.st_size, output_path);
+	close(fd);
+	return ok ? CONVERT_OK : CONVERT_ERR_WRITE;
 }
 
-static bool avif_write(const char *path, struct image *img, int quality)
+// convert_file() with per-stage timings and sizes collected into *st
+static enum convert_status convert_file_stats(const char *input_path, const char *output_path,
+											  enum format to_fmt, const struct encode_opts *opts,
+											  struct conv_stats *st)
 {
-	if (!image_validate_dims(img))
-		return false;
-	if (img->width > INT_MAX || img->height > INT_MAX)
-		return false;
-
-	avifImage *avif = avifImageCreate(img->width, img->height, 8, AVIF_PIXEL_FORMAT_YUV444);
-	if (!avif) return false;
-
-	avifRGBImage rgb;
-	avifRGBImageSetDefaults(&rgb, avif);
-	rgb.format = img->channels == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
-	rgb.depth = 8;
-	rgb.pixels = img->pixels;
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		avifImageDestroy(avif);
-		return false;
-	}
-	rgb.rowBytes = rowbytes;
-
-	avifResult result = avifImageRGBToYUV(avif, &rgb);
-	if (result != AVIF_RESULT_OK) {
-		avifImageDestroy(avif);
-		return false;
-	}
-
-	avifEncoder *encoder = avifEncoderCreate();
-	if (!encoder) {
-		avifImageDestroy(avif);
-		return false;
-	}
+	stats_begin(st);
+	enum convert_status status = convert_file(input_path, output_path, to_fmt, opts);
+	stats_end(st);
+
+	struct stat sb;
+	if (path_is_stdio(input_path))
+		st->bytes_in = stdin_bytes;
+	else if (stat(input_path, &sb) == 0)
+		st->bytes_in = (uint64_t)sb.st_size;
+	if (status == CONVERT_OK && path_is_stdio(output_path))
+		st->bytes_out = stdout_bytes;
+	else if (status == CONVERT_OK && stat(output_path, &sb) == 0)
+		st->bytes_out = (uint64_t)sb.st_size;
+	return status;
+}
 
-	encoder->quality = quality;
-	encoder->speed = AVIF_SPEED_DEFAULT;
+struct mem_cache_ctx {
+	enum format from_fmt;
+	const uint8_t *data;
+	size_t size;
+	enum format to_fmt;
+	const struct encode_opts *opts;
+	uint8_t *out;
+	size_t out_size;
+};
 
-	avifRWData output = AVIF_DATA_EMPTY;
-	result = avifEncoderWrite(encoder, avif, &output);
-	avifEncoderDestroy(encoder);
-	avifImageDestroy(avif);
+static enum convert_status convert_mem_fill(void *ctx, const char *tmp_path)
+{
+	struct mem_cache_ctx *c = ctx;
+	enum convert_status status = convert_mem(c->from_fmt, c->data, c->size, c->to_fmt, c->opts, &c->out, &c->out_size);
+	if (status != CONVERT_OK)
+		return status;
+	enum stats_stage prev = stats_enter(STAGE_WRITE_IO);
+	FILE *f = fopen(tmp_path, "wb");
+	bool ok = f && output_write(c->out, c->out_size, f) == c->out_size;
+	if (f && fclose(f) != 0)
+		ok = false;
+	stats_leave(prev);
+	// The caller uses c->out whether or not the cache took a copy
+	return ok ? CONVERT_OK : CONVERT_ERR_WRITE;
+}
 
-	if (result != AVIF_RESULT_OK) {
-		avifRWDataFree(&output);
-		return false;
-	}
+// convert_mem() by way of --cache-dir; a hit is mapped into *out
+static enum convert_status convert_mem_cached(enum format from_fmt, const uint8_t *data, size_t size,
+											  enum format to_fmt, const struct encode_opts *opts,
+											  struct mapped_file *out)
+{
+	if (from_fmt == FMT_UNKNOWN)
+		from_fmt = detect_format_data(data, size);
+	if (from_fmt == FMT_UNKNOWN)
+		return CONVERT_ERR_INPUT_FORMAT;
+
+	if (!cache_input_allowed(from_fmt, data, size))
+		return CONVERT_ERR_READ;
+	struct cache_key key;
+	struct mem_cache_ctx ctx = { from_fmt, data, size, to_fmt, opts, NULL, 0 };
+	struct stat st;
+	enum convert_status status = CONVERT_OK;
+	int fd = -1;
+	if (cache_key_make(data, size, from_fmt, to_fmt, opts, &key))
+		fd = cache_lookup(&key, to_fmt, convert_mem_fill, &ctx, &st, &status);
+	if (ctx.out) {
+		if (fd >= 0)
+			close(fd);
+		*out = (struct mapped_file){ .data = ctx.out, .size = ctx.out_size, .mapped = false };
+		return CONVERT_OK;
+	}
+	if (fd < 0) {
+		if (status != CONVERT_OK)
+			return status;
+		// The cache could not be used at all
+		uint8_t *buf = NULL;
+		size_t buf_size = 0;
+		status = convert_mem(from_fmt, data, size, to_fmt, opts, &buf, &buf_size);
+		*out = (struct mapped_file){ .data = buf, .size = buf_size, .mapped = false };
+		return status;
+	}
+	enum stats_stage prev = stats_enter(STAGE_READ_IO);
+	bool ok = map_file_fd(fd, 0, MAP_FILE_POPULATE, out);
+	stats_leave(prev);
+	close(fd);
+	return ok ? CONVERT_OK : CONVERT_ERR_READ;
+}
 
-	FILE *f = fopen(path, "wb");
-	if (!f) {
-		avifRWDataFree(&output);
-		return false;
+// Quoted and escaped; --stats-json writes to stderr, --info --json to stdout
+static void json_put_string(FILE *f, const char *s)
+{
+	fputc_unlocked('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			fputc_unlocked('\\', f);
+			fputc_unlocked(c, f);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc_unlocked(c, f);
+		}
 	}
-
-	bool ok = WRITE_FILE(output.data, output.size, f) == output.size;
-	fclose(f);
-	avifRWDataFree(&output);
-
-	return ok;
+	fputc_unlocked('"', f);
 }
-#endif
 
-// ============================================================================
-// HEIF (libheif)
-// ============================================================================
-
-#ifdef HAVE_HEIF
-static bool heif_read(const char *path, struct image *img)
+// One record on stderr, a block of text or a JSON line per --stats mode.
+// Peak RSS is for the whole process, so in batch mode it covers every file
+// converted so far.
+static void stats_print(const struct conv_stats *st, const char *input_path, const char *output_path,
+						const char *status)
 {
-	struct heif_context *ctx = heif_context_alloc();
-	if (!ctx) return false;
-
-	struct heif_error err = heif_context_read_from_file(ctx, path, NULL);
-	if (err.code != heif_error_Ok) {
-		heif_context_free(ctx);
-		return false;
-	}
+	struct rusage ru;
+	long peak_rss_kb = getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+
+	if (stats_mode == STATS_JSON) {
+		PUTS_ERR("{\"input\":");
+		json_put_string(stderr, input_path);
+		PUTS_ERR(",\"output\":");
+		json_put_string(stderr, output_path);
+		PUTS_ERR(",\"status\":");
+		json_put_string(stderr, status);
+		PRINTF_ERR(",\"total_ms\":%.3f", st->total_ns / 1e6);
+		for (int i = STAGE_READ_IO; i < STAGE_COUNT; i++)
+			PRINTF_ERR(",\"%s_ms\":%.3f", stats_stage_names[i], st->stage_ns[i] / 1e6);
+		PRINTF_ERR(",\"other_ms\":%.3f", st->stage_ns[STAGE_OTHER] / 1e6);
+		if (st->quality > 0)
+			PRINTF_ERR(",\"quality\":%d", st->quality);
+		PRINTF_ERR(",\"bytes_in\":%llu,\"bytes_out\":%llu,\"allocs\":%llu,\"alloc_bytes\":%llu,\"peak_rss_kb\":%ld}\n",
+				   (unsigned long long)st->bytes_in, (unsigned long long)st->bytes_out,
+				   (unsigned long long)st->allocs, (unsigned long long)st->alloc_bytes, peak_rss_kb);
+		return;
+	}
+
+	PUTS_ERR("stats: ");
+	PUTS_ERR(input_path);
+	PUTS_ERR(" -> ");
+	PUTS_ERR(output_path);
+	PUTS_ERR(" (");
+	PUTS_ERR(status);
+	PUTS_ERR(")\n");
+	double total = st->total_ns > 0 ? (double)st->total_ns : 1.0;
+	for (int i = STAGE_READ_IO; i <= STAGE_COUNT; i++) {
+		// "other" goes last so the stages read in pipeline order
+		int stage = i == STAGE_COUNT ? STAGE_OTHER : i;
+		PRINTF_ERR("  %-10s %10.3f ms  %5.1f%%\n", stats_stage_names[stage],
+				   st->stage_ns[stage] / 1e6, 100.0 * st->stage_ns[stage] / total);
+	}
+	PRINTF_ERR("  %-10s %10.3f ms\n", "total", st->total_ns / 1e6);
+	PRINTF_ERR("  bytes in %llu, out %llu; %llu allocations, %llu bytes; peak RSS %ld KiB\n",
+			   (unsigned long long)st->bytes_in, (unsigned long long)st->bytes_out,
+			   (unsigned long long)st->allocs, (unsigned long long)st->alloc_bytes, peak_rss_kb);
+	if (st->quality > 0)
+		PRINTF_ERR("  quality %d (searched)\n", st->quality);
+}
 
-	struct heif_image_handle *handle;
-	err = heif_context_get_primary_image_handle(ctx, &handle);
-	if (err.code != heif_error_Ok) {
-		heif_context_free(ctx);
-		return false;
+// Workers already use every core; split what is left between them
+static void share_codec_threads(int workers)
+{
+	if (codec_threads == 0) {
+		codec_threads = parallel_default_threads() / workers;
+		if (codec_threads < 1)
+			codec_threads = 1;
 	}
+}
 
-	bool has_alpha = heif_image_handle_has_alpha_channel(handle);
-	img->channels = has_alpha ? 4 : 3;
+// ============================================================================
+// Fan-out
+// ============================================================================
 
-	struct heif_image *heif_img;
-	err = heif_decode_image(handle, &heif_img,
-							heif_colorspace_RGB,
-							has_alpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB,
-							NULL);
-	heif_image_handle_release(handle);
+// Several -o targets for one input: the input is decoded (and resized) once,
+// then every target is encoded from that shared, read-only frame on a pool of
+// worker threads.
 
-	if (err.code != heif_error_Ok) {
-		heif_context_free(ctx);
-		return false;
-	}
+#define MAX_OUTPUTS 64
 
-	img->width = heif_image_get_width(heif_img, heif_channel_interleaved);
-	img->height = heif_image_get_height(heif_img, heif_channel_interleaved);
+// One -o target; -f and -q given after it apply to it alone
+struct output_target {
+	const char *path;
+	enum format fmt;    // FMT_UNKNOWN = the global -f, or else the extension
+	int quality;        // 0 = the global -q
+};
 
-	int stride;
-	const uint8_t *data = heif_image_get_plane_readonly(heif_img, heif_channel_interleaved, &stride);
+struct fanout {
+	const struct image *img;
+	const struct output_target *targets;
+	const struct encode_opts *opts;
+	enum convert_status *status;
+	struct conv_stats *stats;   // per target, when --stats is on
+};
 
-	if (!data || stride <= 0 || !image_validate_dims(img) || img->width > INT_MAX || img->height > INT_MAX) {
-		heif_image_release(heif_img);
-		heif_context_free(ctx);
-		return false;
-	}
-	if (!image_check_max_pixels(img->width, img->height)) {
-		heif_image_release(heif_img);
-		heif_context_free(ctx);
-		return false;
+static void fanout_encode_one(void *ctx, size_t i)
+{
+	struct fanout *fo = ctx;
+	const struct output_target *t = &fo->targets[i];
+	struct encode_opts opts = *fo->opts;
+	if (t->quality > 0)
+		opts.quality = t->quality;
+
+	if (fo->stats)
+		stats_begin(&fo->stats[i]);
+	fo->status[i] = image_write_output(fo->img, t->path, t->fmt, &opts);
+	if (fo->stats) {
+		struct conv_stats *st = &fo->stats[i];
+		stats_end(st);
+		struct stat sb;
+		if (fo->status[i] == CONVERT_OK && path_is_stdio(t->path))
+			st->bytes_out = stdout_bytes;
+		else if (fo->status[i] == CONVERT_OK && stat(t->path, &sb) == 0)
+			st->bytes_out = (uint64_t)sb.st_size;
 	}
+}
 
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		heif_image_release(heif_img);
-		heif_context_free(ctx);
-		return false;
-	}
-	img->pixels = NULL;
-	if (!image_alloc_pixels(img, rowbytes)) {
-		heif_image_release(heif_img);
-		heif_context_free(ctx);
-		return false;
+// Every target's fmt must be resolved. Returns the number of failed targets,
+// or -1 if the input could not be decoded (reported through *load_status).
+static int fanout_run(const char *input_path, const struct output_target *targets, size_t count,
+					  const struct encode_opts *opts, int jobs, enum convert_status *load_status)
+{
+	struct conv_stats load_stats;
+	struct image img = {0};
+	if (stats_mode != STATS_OFF)
+		stats_begin(&load_stats);
+	*load_status = image_load(input_path, &img, opts);
+	if (stats_mode != STATS_OFF) {
+		stats_end(&load_stats);
+		struct stat sb;
+		if (path_is_stdio(input_path))
+			load_stats.bytes_in = stdin_bytes;
+		else if (stat(input_path, &sb) == 0)
+			load_stats.bytes_in = (uint64_t)sb.st_size;
+		stats_print(&load_stats, input_path, "",
+					*load_status == CONVERT_OK ? "ok" : convert_status_reason(*load_status));
+	}
+	if (*load_status != CONVERT_OK)
+		return -1;
+
+	enum convert_status *status = calloc(count, sizeof(*status));
+	struct conv_stats *stats = stats_mode != STATS_OFF ? calloc(count, sizeof(*stats)) : NULL;
+	if (!status || (stats_mode != STATS_OFF && !stats)) {
+		free(status);
+		free(stats);
+		image_free(&img);
+		*load_status = CONVERT_ERR_READ;
+		return -1;
+	}
+
+	// The decode had every codec thread; the encoders split them
+	int workers = jobs > 0 ? jobs : parallel_default_threads();
+	if ((size_t)workers > count)
+		workers = (int)count;
+	int saved_threads = codec_threads;
+	share_codec_threads(workers);
+
+	struct fanout fo = { .img = &img, .targets = targets, .opts = opts, .status = status, .stats = stats };
+	parallel_for(count, workers, fanout_encode_one, &fo);
+	codec_threads = saved_threads;
+	image_free(&img);
+
+	int failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (stats)
+			stats_print(&stats[i], input_path, targets[i].path,
+						status[i] == CONVERT_OK ? "ok" : convert_status_reason(status[i]));
+		if (status[i] != CONVERT_OK) {
+			PRINTF_ERR("Error: failed to write %s\n", path_is_stdio(targets[i].path) ? "stdout" : targets[i].path);
+			failed++;
+		}
 	}
+	free(stats);
+	free(status);
+	return failed;
+}
 
-	for (int y = 0; y < img->height; y++) {
-		memcpy(img->pixels + y * rowbytes, data + y * stride, rowbytes);
-	}
+// ============================================================================
+// Memory budget (--mem-budget)
+// ============================================================================
 
-	heif_image_release(heif_img);
-	heif_context_free(ctx);
-	return true;
+// Batch and server jobs are admitted against --mem-budget on an estimate of
+// their peak memory taken from the input's header (format_memory_estimate()),
+// in arrival order, so a few very large images arriving together take turns
+// instead of all decoding at once, while small ones still run as many at a
+// time as there are workers. Unless --threads is given, a job's codec threads
+// follow its share of the budget: one estimated at a quarter of it gets a
+// quarter of the CPUs, so the large jobs that run few at a time still keep
+// every core busy. A quarter of the budget is left for the buffer pool's
+// per-thread caches.
+
+static uint64_t mem_budget;         // --mem-budget: bytes; 0 = no limit
+static struct mem_budget budget;
+static bool budget_threads;         // scale codec threads with each job's share
+
+static void budget_init(int workers)
+{
+	budget_threads = codec_threads == 0;
+	mem_budget_init(&budget, mem_budget - mem_budget / 4);
+	size_t cache = (size_t)(mem_budget / 4 / (uint64_t)workers);
+	if (cache < pool_cache_limit)
+		pool_cache_limit = cache;
 }
 
-static bool heif_write(const char *path, struct image *img, int quality)
+// An input that cannot be probed counts as its size; its conversion will
+// fail soon enough
+static uint64_t budget_estimate(enum format from_fmt, const uint8_t *data, size_t size,
+								enum format to_fmt, const struct encode_opts *opts)
 {
-	struct heif_context *ctx = heif_context_alloc();
-	if (!ctx) return false;
+	struct image hdr = {0};
+	if (from_fmt == FMT_UNKNOWN)
+		from_fmt = detect_format_data(data, size);
+	if (from_fmt == FMT_UNKNOWN || !format_probe(from_fmt, data, size, &hdr))
+		return size;
+	return format_memory_estimate(from_fmt, &hdr, size, to_fmt, opts);
+}
 
-	if (!image_validate_dims(img)) {
-		heif_context_free(ctx);
-		return false;
-	}
+static uint64_t budget_estimate_file(const char *path, enum format to_fmt, const struct encode_opts *opts)
+{
+	struct mapped_file mf;
+	if (!input_map(path, MAP_FILE_RANDOM, &mf))
+		return 0;
+	uint64_t need = budget_estimate(FMT_UNKNOWN, mf.data, mf.size, to_fmt, opts);
+	unmap_file(&mf);
+	return need;
+}
 
-	struct heif_encoder *encoder;
-	struct heif_error err = heif_context_get_encoder_for_format(ctx, heif_compression_HEVC, &encoder);
-	if (err.code != heif_error_Ok) {
-		heif_context_free(ctx);
-		return false;
+// Waits until a job needing `need` bytes fits and sets the calling thread's
+// codec threads for it; pass the result to budget_leave() when it is done
+static uint64_t budget_enter(uint64_t need)
+{
+	uint64_t held = mem_budget_acquire(&budget, need);
+	if (budget_threads && budget.limit > 0) {
+		uint64_t cpus = (uint64_t)parallel_default_threads();
+		uint64_t share = (held * cpus + budget.limit - 1) / budget.limit;
+		job_codec_threads = share < (uint64_t)codec_threads ? codec_threads : (int)share;
 	}
+	return held;
+}
 
-	heif_encoder_set_lossy_quality(encoder, quality);
+static void budget_leave(uint64_t held)
+{
+	job_codec_threads = 0;
+	mem_budget_release(&budget, held);
+}
 
-	struct heif_image *heif_img;
-	err = heif_image_create(img->width, img->height, heif_colorspace_RGB,
-							img->channels == 4 ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB,
-							&heif_img);
-	if (err.code != heif_error_Ok) {
-		heif_encoder_release(encoder);
-		heif_context_free(ctx);
-		return false;
-	}
+// ============================================================================
+// Batch mode
+// ============================================================================
 
-	err = heif_image_add_plane(heif_img, heif_channel_interleaved, img->width, img->height, 8);
-	if (err.code != heif_error_Ok) {
-		heif_image_release(heif_img);
-		heif_encoder_release(encoder);
-		heif_context_free(ctx);
-		return false;
-	}
+struct batch {
+	char **inputs;
+	size_t count;
+	size_t cap;
+	const char *output_dir;
+	enum format to_fmt;
+	struct encode_opts opts;
+	bool info;              // --info: stdin is allowed, nothing is written
+	atomic_size_t failed;
+	pthread_mutex_t report_lock;
+	bool *duplicate;        // per input: its output path is an earlier input's; NULL = none are
+
+	// --prefetch only
+	struct aio io;
+	struct batch_item *items;
+	pthread_mutex_t io_lock;
+	pthread_cond_t io_cond;     // an input loaded or a write finished
+	size_t writes_pending;
+};
 
-	int stride;
-	uint8_t *data = heif_image_get_plane(heif_img, heif_channel_interleaved, &stride);
-	if (!data || stride <= 0) {
-		heif_image_release(heif_img);
-		heif_encoder_release(encoder);
-		heif_context_free(ctx);
+static bool batch_add_input(struct batch *b, const char *path)
+{
+	if (path_is_stdio(path) && !b->info) {
+		PUTS_ERR("Error: stdin (-) cannot be used in batch mode\n");
 		return false;
 	}
-
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		heif_image_release(heif_img);
-		heif_encoder_release(encoder);
-		heif_context_free(ctx);
-		return false;
+	if (b->count == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 64;
+		char **inputs = realloc(b->inputs, cap * sizeof(*inputs));
+		if (!inputs) return false;
+		b->inputs = inputs;
+		b->cap = cap;
 	}
+	char *copy = strdup(path);
+	if (!copy) return false;
+	b->inputs[b->count++] = copy;
+	return true;
+}
 
-	for (int y = 0; y < img->height; y++) {
-		memcpy(data + y * stride, img->pixels + y * rowbytes, rowbytes);
+// One path per line; blank lines are skipped. "-" reads the list from stdin.
+static bool batch_read_list(struct batch *b, const char *list_path)
+{
+	FILE *f = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+	if (!f) return false;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+	bool ok = true;
+	while ((n = getline(&line, &line_cap, f)) != -1) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+		if (n == 0)
+			continue;
+		if (!batch_add_input(b, line)) {
+			ok = false;
+			break;
+		}
 	}
+	if (ferror(f))
+		ok = false;
 
-	err = heif_context_encode_image(ctx, heif_img, encoder, NULL, NULL);
-	heif_image_release(heif_img);
-	heif_encoder_release(encoder);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return ok;
+}
 
-	if (err.code != heif_error_Ok) {
-		heif_context_free(ctx);
-		return false;
-	}
+// DIR/<input basename without extension>.<output extension>
+static char *batch_output_path(const char *dir, const char *input_path, enum format fmt)
+{
+	const char *base = strrchr(input_path, '/');
+	base = base ? base + 1 : input_path;
+	const char *dot = strrchr(base, '.');
+	size_t stem = (dot && dot != base) ? (size_t)(dot - base) : strlen(base);
+	if (stem > INT_MAX)
+		return NULL;
+	const char *ext = format_extension(fmt);
+	size_t dirlen = strlen(dir);
+	bool slash = dirlen > 0 && dir[dirlen - 1] != '/';
+
+	size_t len = dirlen + slash + stem + 1 + strlen(ext) + 1;
+	char *out = malloc(len);
+	if (!out) return NULL;
+	snprintf(out, len, "%s%s%.*s.%s", dir, slash ? "/" : "", (int)stem, base, ext);
+	return out;
+}
 
-	err = heif_context_write_to_file(ctx, path);
-	heif_context_free(ctx);
+struct batch_output {
+	char *path;
+	size_t index;
+};
 
-	return err.code == heif_error_Ok;
+static int batch_output_cmp(const void *a, const void *b)
+{
+	const struct batch_output *x = a, *y = b;
+	int c = strcmp(x->path, y->path);
+	if (c != 0)
+		return c;
+	return (x->index > y->index) - (x->index < y->index);
 }
-#endif
 
-// ============================================================================
-// TIFF (libtiff)
-// ============================================================================
+// Inputs that map to the same output (a/x.png and b/x.png, or x.png and x.jpg)
+// would be written by two workers at once, and which one lands last is down
+// to timing. The first in input order keeps the name; the others are marked
+// in b->duplicate and fail. False if out of memory.
+static bool batch_find_duplicates(struct batch *b)
+{
+	struct batch_output *outputs = calloc(b->count ? b->count : 1, sizeof(*outputs));
+	if (!outputs)
+		return false;
+	bool ok = true;
+	size_t count = 0;
+	for (size_t i = 0; i < b->count; i++) {
+		char *path = batch_output_path(b->output_dir, b->inputs[i], b->to_fmt);
+		if (path)   // a path that cannot be made fails on its own later
+			outputs[count++] = (struct batch_output){ path, i };
+	}
+	qsort(outputs, count, sizeof(*outputs), batch_output_cmp);
+	for (size_t i = 1; i < count && ok; i++) {
+		if (strcmp(outputs[i].path, outputs[i - 1].path) != 0)
+			continue;
+		if (!b->duplicate)
+			b->duplicate = calloc(b->count, sizeof(*b->duplicate));
+		if (b->duplicate)
+			b->duplicate[outputs[i].index] = true;
+		else
+			ok = false;
+	}
+	for (size_t i = 0; i < count; i++)
+		free(outputs[i].path);
+	free(outputs);
+	return ok;
+}
 
-#ifdef HAVE_TIFF
-static bool tiff_read(const char *path, struct image *img)
+static bool batch_is_duplicate(const struct batch *b, size_t index)
 {
-	TIFF *tif = TIFFOpen(path, "r");
-	if (!tif) return false;
+	return b->duplicate && b->duplicate[index];
+}
 
-	uint32_t w, h;
-	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+// Stats (if any) go to stderr under the same lock so records never interleave
+static void batch_report(struct batch *b, const char *input_path, const char *output_path,
+						 enum convert_status status, const struct conv_stats *st)
+{
+	pthread_mutex_lock(&b->report_lock);
+	if (status == CONVERT_OK) {
+		PUTS("ok\t");
+		PUTS(input_path);
+		PUTC('\t');
+		PUTS(output_path);
+	} else {
+		PUTS("error\t");
+		PUTS(input_path);
+		PUTC('\t');
+		PUTS(convert_status_reason(status));
+	}
+	PUTC('\n');
+	if (st)
+		stats_print(st, input_path, output_path,
+					status == CONVERT_OK ? "ok" : convert_status_reason(status));
+	pthread_mutex_unlock(&b->report_lock);
+}
 
-	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX) {
-		TIFFClose(tif);
-		return false;
-	}
-	img->width = (int)w;
-	img->height = (int)h;
-	img->channels = 4;  // TIFFReadRGBAImage always outputs RGBA
-	if (!image_check_max_pixels(img->width, img->height)) {
-		TIFFClose(tif);
-		return false;
-	}
+static void batch_convert_one(void *ctx, size_t index)
+{
+	struct batch *b = ctx;
+	const char *input_path = b->inputs[index];
+
+	enum convert_status status = CONVERT_ERR_WRITE;
+	struct conv_stats st;
+	bool have_stats = false;
+	char *output_path = batch_output_path(b->output_dir, input_path, b->to_fmt);
+	if (output_path && batch_is_duplicate(b, index)) {
+		atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+		batch_report(b, input_path, output_path, CONVERT_ERR_DUPLICATE, NULL);
+		free(output_path);
+		return;
+	}
+	uint64_t held = mem_budget ? budget_enter(budget_estimate_file(input_path, b->to_fmt, &b->opts)) : 0;
+	if (output_path && stats_mode != STATS_OFF) {
+		status = convert_file_stats(input_path, output_path, b->to_fmt, &b->opts, &st);
+		have_stats = true;
+	} else if (output_path) {
+		status = convert_file(input_path, output_path, b->to_fmt, &b->opts);
+	}
+	if (mem_budget)
+		budget_leave(held);
+
+	if (status != CONVERT_OK)
+		atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+	batch_report(b, input_path, output_path ? output_path : "", status, have_stats ? &st : NULL);
+	free(output_path);
+}
 
-	size_t pixel_count;
-	if (!checked_mul_size((size_t)w, (size_t)h, &pixel_count) ||
-		pixel_count > SIZE_MAX / sizeof(uint32_t)) {
-		TIFFClose(tif);
-		return false;
-	}
-	uint32_t *raster = malloc(pixel_count * sizeof(uint32_t));
-	if (!raster) {
-		TIFFClose(tif);
-		return false;
-	}
+// --prefetch N takes file I/O off the workers: N inputs ahead of the one
+// being converted are read into memory in the background, conversions run on
+// those buffers (convert_mem(), so no codec touches a file), and each output
+// is handed back to the I/O stage to be written and closed while the worker
+// moves on, with at most N writes outstanding. On network filesystems, where
+// every open and read waits on a round trip, the workers no longer sit idle
+// on the latency. Row streaming is given up for it: every input is decoded
+// whole. --direct-io reads inputs of DIRECT_IO_MIN and up with O_DIRECT.
+#define DIRECT_IO_MIN ((size_t)64 << 20)
+
+static int prefetch = 0;            // --prefetch: inputs read ahead; 0 = workers do their own I/O
+static bool direct_io = false;      // --direct-io: O_DIRECT for large prefetched inputs
+
+struct batch_item {
+	struct batch *b;
+	const char *input_path;
+	char *output_path;
+	struct aio_file in;
+	struct aio_file out;
+	struct mapped_file result;  // the output: malloc'd, or a mapped cache entry
+	struct conv_stats st;
+	bool loaded;
+	bool duplicate;             // batch_is_duplicate(): never read, fails at once
+};
 
-	if (!TIFFReadRGBAImageOriented(tif, w, h, raster, ORIENTATION_TOPLEFT, 0)) {
-		free(raster);
-		TIFFClose(tif);
-		return false;
-	}
-	TIFFClose(tif);
+static void batch_read_done(struct aio_file *op)
+{
+	struct batch_item *it = op->ctx;
+	pthread_mutex_lock(&it->b->io_lock);
+	it->loaded = true;
+	pthread_cond_broadcast(&it->b->io_cond);
+	pthread_mutex_unlock(&it->b->io_lock);
+}
 
-	// Convert from ABGR (libtiff native) to RGBA
-	size_t pixel_bytes;
-	if (!checked_mul_size(pixel_count, 4, &pixel_bytes)) {
-		free(raster);
-		return false;
-	}
-	img->pixels = malloc(pixel_bytes);
-	if (!img->pixels) {
-		free(raster);
-		return false;
-	}
+static void batch_submit_read(struct batch *b, size_t index)
+{
+	struct batch_item *it = &b->items[index];
+	it->b = b;
+	it->input_path = b->inputs[index];
+	it->in = (struct aio_file){ .path = it->input_path, .done = batch_read_done, .ctx = it };
+	it->duplicate = batch_is_duplicate(b, index);
+	if (it->duplicate)
+		batch_read_done(&it->in);
+	else
+		aio_submit(&b->io, &it->in);
+}
 
-	for (size_t i = 0; i < pixel_count; i++) {
-		uint32_t p = raster[i];
-		img->pixels[i * 4 + 0] = TIFFGetR(p);
-		img->pixels[i * 4 + 1] = TIFFGetG(p);
-		img->pixels[i * 4 + 2] = TIFFGetB(p);
-		img->pixels[i * 4 + 3] = TIFFGetA(p);
-	}
+static void batch_item_finish(struct batch_item *it, enum convert_status status)
+{
+	struct batch *b = it->b;
+	if (status != CONVERT_OK)
+		atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+	batch_report(b, it->input_path, it->output_path ? it->output_path : "", status,
+				 stats_mode != STATS_OFF ? &it->st : NULL);
+	free(it->output_path);
+	it->output_path = NULL;
+}
 
-	free(raster);
-	return true;
+static void batch_write_done(struct aio_file *op)
+{
+	struct batch_item *it = op->ctx;
+	struct batch *b = it->b;
+	it->st.bytes_out = op->error == 0 ? it->result.size : 0;
+	unmap_file(&it->result);
+	batch_item_finish(it, op->error == 0 ? CONVERT_OK : CONVERT_ERR_WRITE);
+
+	pthread_mutex_lock(&b->io_lock);
+	b->writes_pending--;
+	pthread_cond_broadcast(&b->io_cond);
+	pthread_mutex_unlock(&b->io_lock);
 }
 
-static bool tiff_write(const char *path, struct image *img)
+static enum convert_status batch_convert_loaded(struct batch *b, struct batch_item *it)
 {
-	TIFF *tif = TIFFOpen(path, "w");
-	if (!tif) return false;
+	if (!it->output_path)
+		return CONVERT_ERR_WRITE;
+	if (it->duplicate)
+		return CONVERT_ERR_DUPLICATE;
+	if (it->in.error != 0)
+		return it->in.error == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
+	enum format from_fmt = detect_format(it->input_path);
+	if (from_fmt == FMT_UNKNOWN)
+		return CONVERT_ERR_INPUT_FORMAT;
+
+	uint64_t held = 0;
+	if (mem_budget)
+		held = budget_enter(budget_estimate(from_fmt, it->in.data, it->in.size, b->to_fmt, &b->opts));
+	enum convert_status status;
+	if (cache_dir) {
+		status = convert_mem_cached(from_fmt, it->in.data, it->in.size, b->to_fmt, &b->opts, &it->result);
+	} else {
+		uint8_t *buf = NULL;
+		size_t size = 0;
+		status = convert_mem(from_fmt, it->in.data, it->in.size, b->to_fmt, &b->opts, &buf, &size);
+		it->result = (struct mapped_file){ .data = buf, .size = size, .mapped = false };
+	}
+	if (mem_budget)
+		budget_leave(held);
+	return status;
+}
 
-	if (!image_validate_dims(img)) {
-		TIFFClose(tif);
-		return false;
-	}
+static void batch_convert_prefetched(void *ctx, size_t index)
+{
+	struct batch *b = ctx;
+	struct batch_item *it = &b->items[index];
+	// Items are handed out in order, so this keeps the window prefetch ahead
+	if (index + (size_t)prefetch < b->count)
+		batch_submit_read(b, index + (size_t)prefetch);
+
+	pthread_mutex_lock(&b->io_lock);
+	while (!it->loaded)
+		pthread_cond_wait(&b->io_cond, &b->io_lock);
+	pthread_mutex_unlock(&b->io_lock);
+
+	if (stats_mode != STATS_OFF)
+		stats_begin(&it->st);
+	it->output_path = batch_output_path(b->output_dir, it->input_path, b->to_fmt);
+	enum convert_status status = batch_convert_loaded(b, it);
+	if (stats_mode != STATS_OFF) {
+		stats_end(&it->st);
+		it->st.bytes_in = it->in.size;
+	}
+	free(it->in.data);
+	it->in.data = NULL;
+	if (status != CONVERT_OK) {
+		unmap_file(&it->result);
+		batch_item_finish(it, status);
+		return;
+	}
+
+	pthread_mutex_lock(&b->io_lock);
+	while (b->writes_pending >= (size_t)prefetch)
+		pthread_cond_wait(&b->io_cond, &b->io_lock);
+	b->writes_pending++;
+	pthread_mutex_unlock(&b->io_lock);
+	it->out = (struct aio_file){
+		.path = it->output_path,
+		.write = true,
+		.data = (uint8_t *)it->result.data,
+		.size = it->result.size,
+		.done = batch_write_done,
+		.ctx = it,
+	};
+	aio_submit(&b->io, &it->out);
+}
 
-	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, img->width);
-	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, img->height);
-	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, img->channels);
-	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
-	TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+// batch_run()'s workers with the I/O stage in front of and behind them
+static bool batch_run_prefetched(struct batch *b, int jobs)
+{
+	b->items = calloc(b->count, sizeof(*b->items));
+	if (!b->items || !aio_start(&b->io, (unsigned)prefetch, max_bytes, direct_io ? DIRECT_IO_MIN : 0)) {
+		free(b->items);
+		return false;
+	}
+	pthread_mutex_init(&b->io_lock, NULL);
+	pthread_cond_init(&b->io_cond, NULL);
+	for (size_t i = 0; i < b->count && i < (size_t)prefetch; i++)
+		batch_submit_read(b, i);
+	parallel_for(b->count, jobs, batch_convert_prefetched, b);
+	aio_stop(&b->io);     // waits for the writes still behind
+	pthread_cond_destroy(&b->io_cond);
+	pthread_mutex_destroy(&b->io_lock);
+	free(b->items);
+	return true;
+}
 
-	if (img->channels == 4) {
-		uint16_t extra = EXTRASAMPLE_ASSOCALPHA;
-		TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+static int batch_run(struct batch *b, int jobs)
+{
+	if (mkdir(b->output_dir, 0777) != 0 && errno != EEXIST) {
+		PRINTF_ERR("Error: cannot create output directory %s\n", b->output_dir);
+		return EXIT_FAILURE;
 	}
 
-	size_t rowbytes;
-	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
-		TIFFClose(tif);
-		return false;
+	if (!batch_find_duplicates(b)) {
+		PUTS_ERR("Error: out of memory\n");
+		return EXIT_FAILURE;
 	}
-	for (int y = 0; y < img->height; y++) {
-		if (TIFFWriteScanline(tif, img->pixels + y * rowbytes, y, 0) < 0) {
-			TIFFClose(tif);
-			return false;
+
+	atomic_init(&b->failed, 0);
+	pthread_mutex_init(&b->report_lock, NULL);
+	if (prefetch > 0) {
+		if (!batch_run_prefetched(b, jobs)) {
+			pthread_mutex_destroy(&b->report_lock);
+			free(b->duplicate);
+			PUTS_ERR("Error: cannot start the I/O threads\n");
+			return EXIT_FAILURE;
 		}
+	} else {
+		parallel_for(b->count, jobs, batch_convert_one, b);
 	}
+	pthread_mutex_destroy(&b->report_lock);
+	free(b->duplicate);
+	b->duplicate = NULL;
+	FLUSH();
 
-	TIFFClose(tif);
-	return true;
+	size_t failed = atomic_load(&b->failed);
+	if (failed > 0) {
+		PRINTF_ERR("Error: %zu of %zu files failed\n", failed, b->count);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
-#endif
 
 // ============================================================================
-// JPEG XL (libjxl)
+// Info mode
 // ============================================================================
 
-#ifdef HAVE_JXL
-static bool jxl_read(const char *path, struct image *img)
+// --info reads each input's header and nothing else: the format comes from the
+// magic bytes, the file is mapped without readahead and no pixel buffer is
+// ever allocated, so --max-pixels is checked against the header alone. Inputs
+// and workers are shared with batch mode; one line per input goes to stdout.
+static bool info_json;
+
+// NULL on success, else the reason for the report
+static const char *info_probe(const char *path, enum format *fmt, struct image *hdr)
 {
-	size_t size;
-	uint8_t *data = read_file(path, &size);
-	if (!data) return false;
+	struct mapped_file mf;
+	errno = 0;
+	bool mapped = path_is_stdio(path) ? map_file_read_all(STDIN_FILENO, max_bytes, &mf)
+									  : input_map(path, MAP_FILE_RANDOM, &mf);
+	if (!mapped)
+		return convert_status_reason(errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ);
+
+	const char *reason = NULL;
+	*fmt = detect_format_data(mf.data, mf.size);
+	if (*fmt == FMT_UNKNOWN)
+		reason = convert_status_reason(CONVERT_ERR_INPUT_FORMAT);
+	else if (!format_probe(*fmt, mf.data, mf.size, hdr))
+		reason = errno == EOVERFLOW ? "image exceeds --max-pixels limit" : "invalid or unsupported header";
+	unmap_file(&mf);
+	return reason;
+}
 
-	JxlDecoder *dec = JxlDecoderCreate(NULL);
-	if (!dec) {
-		free(data);
-		return false;
+static void info_report(struct batch *b, const char *input_path, enum format fmt,
+						const struct image *hdr, const char *reason)
+{
+	pthread_mutex_lock(&b->report_lock);
+	if (info_json) {
+		PUTS("{\"input\":");
+		json_put_string(stdout, input_path);
+		if (reason) {
+			PUTS(",\"status\":\"error\",\"reason\":");
+			json_put_string(stdout, reason);
+			PUTS("}\n");
+		} else {
+			PRINTF(",\"status\":\"ok\",\"format\":\"%s\",\"width\":%d,\"height\":%d,\"channels\":%d}\n",
+				   format_extension(fmt), hdr->width, hdr->height, hdr->channels);
+		}
+	} else if (reason) {
+		PUTS("error\t");
+		PUTS(input_path);
+		PUTC('\t');
+		PUTS(reason);
+		PUTC('\n');
+	} else {
+		PUTS("ok\t");
+		PUTS(input_path);
+		PRINTF("\t%s\t%dx%d\t%d\n", format_extension(fmt), hdr->width, hdr->height, hdr->channels);
 	}
+	pthread_mutex_unlock(&b->report_lock);
+}
 
-	void *runner = JxlResizableParallelRunnerCreate(NULL);
-	if (JxlDecoderSetParallelRunner(dec, JxlResizableParallelRunner, runner) != JXL_DEC_SUCCESS) {
-		JxlResizableParallelRunnerDestroy(runner);
-		JxlDecoderDestroy(dec);
-		free(data);
-		return false;
-	}
+static void info_one(void *ctx, size_t index)
+{
+	struct batch *b = ctx;
+	enum format fmt = FMT_UNKNOWN;
+	struct image hdr = {0};
+	const char *reason = info_probe(b->inputs[index], &fmt, &hdr);
+	if (reason)
+		atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+	info_report(b, b->inputs[index], fmt, &hdr, reason);
+}
 
-	if (JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
-		JxlResizableParallelRunnerDestroy(runner);
-		JxlDecoderDestroy(dec);
-		free(data);
-		return false;
+static int info_run(struct batch *b, int jobs)
+{
+	atomic_init(&b->failed, 0);
+	pthread_mutex_init(&b->report_lock, NULL);
+	parallel_for(b->count, jobs, info_one, b);
+	pthread_mutex_destroy(&b->report_lock);
+	FLUSH();
+
+	size_t failed = atomic_load(&b->failed);
+	if (failed > 0) {
+		PRINTF_ERR("Error: %zu of %zu files failed\n", failed, b->count);
+		return EXIT_FAILURE;
 	}
+	return EXIT_SUCCESS;
+}
 
-	JxlDecoderSetInput(dec, data, size);
-	JxlDecoderCloseInput(dec);
+// ============================================================================
+// Server mode
+// ============================================================================
 
-	JxlBasicInfo info;
-	JxlPixelFormat format = {0, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
-	bool success = false;
+// --serve keeps one process, its worker threads and the loaded codec libraries
+// alive across conversions. A connection carries any number of requests, one
+// at a time. A request is a line of space-separated key=value fields,
+//
+//     to=FORMAT (size=N | path=FILE) [from=FORMAT] [quality=N] [effort=N]
+//         [resize=WxH] [fit=0|1] [filter=NAME] [max_dim=N] [scale=F] [chroma=S]
+//
+// followed by N bytes of input when size= is given. The reply is "ok N\n" and
+// N bytes of output, or "error REASON\n". A request that cannot be framed
+// (bad header line, oversized or truncated payload) also closes the connection.
+
+#define SERVE_LINE_MAX 4096
+
+struct serve_conn {
+	int in_fd;
+	int out_fd;
+	uint8_t buf[SERVE_LINE_MAX];
+	size_t pos;     // buffered, unconsumed input is buf[pos, len)
+	size_t len;
+};
 
-	for (;;) {
-		JxlDecoderStatus status = JxlDecoderProcessInput(dec);
-
-			if (status == JXL_DEC_BASIC_INFO) {
-				if (JxlDecoderGetBasicInfo(dec, &info) != JXL_DEC_SUCCESS)
-					break;
-
-				if (info.xsize == 0 || info.ysize == 0 || info.xsize > INT_MAX || info.ysize > INT_MAX)
-					break;
-				img->width = (int)info.xsize;
-				img->height = (int)info.ysize;
-				img->channels = info.alpha_bits > 0 ? 4 : 3;
-				if (!image_check_max_pixels(img->width, img->height))
-					break;
-				format.num_channels = img->channels;
-
-				JxlResizableParallelRunnerSetThreads(runner,
-					JxlResizableParallelRunnerSuggestThreads(info.xsize, info.ysize));
-
-			} else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
-				size_t buffer_size;
-				if (JxlDecoderImageOutBufferSize(dec, &format, &buffer_size) != JXL_DEC_SUCCESS)
-					break;
-
-				if (!image_validate_dims(img))
-					break;
-				size_t pixel_count;
-				if (!checked_mul_size((size_t)img->width, (size_t)img->height, &pixel_count))
-					break;
-				size_t expected;
-				if (!checked_mul_size(pixel_count, (size_t)img->channels, &expected))
-					break;
-				if (buffer_size < expected)
-					break;
-
-				img->pixels = malloc(buffer_size);
-				if (!img->pixels)
-					break;
-
-				if (JxlDecoderSetImageOutBuffer(dec, &format, img->pixels, buffer_size) != JXL_DEC_SUCCESS) {
-					free(img->pixels);
-					img->pixels = NULL;
-					break;
-				}
-
-			} else if (status == JXL_DEC_FULL_IMAGE) {
-				success = true;
-			break;
+struct serve_request {
+	enum format to_fmt;
+	enum format from_fmt;   // FMT_UNKNOWN = sniff the input
+	struct encode_opts opts;
+	bool has_size;
+	size_t size;
+	const char *path;       // points into the request line
+};
 
-		} else if (status == JXL_DEC_SUCCESS) {
-			success = true;
-			break;
+static pthread_mutex_t serve_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		} else {
-			break;
-		}
+// Compacts the buffer and reads whatever is available after it
+static bool serve_fill(struct serve_conn *c)
+{
+	memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+	c->len -= c->pos;
+	c->pos = 0;
+	for (;;) {
+		ssize_t n = read(c->in_fd, c->buf + c->len, sizeof(c->buf) - c->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		c->len += (size_t)n;
+		return true;
 	}
+}
 
-		JxlResizableParallelRunnerDestroy(runner);
-		JxlDecoderDestroy(dec);
-		free(data);
-
-		if (!success && img->pixels) {
-			free(img->pixels);
-			img->pixels = NULL;
+// Next line without its "\n" (or "\r\n"), terminated in place. NULL at end of
+// input or when the line does not fit the buffer (*too_long is then set).
+static char *serve_read_line(struct serve_conn *c, bool *too_long)
+{
+	*too_long = false;
+	size_t scanned = 0;
+	for (;;) {
+		uint8_t *start = c->buf + c->pos;
+		uint8_t *nl = memchr(start + scanned, '\n', c->len - c->pos - scanned);
+		if (nl) {
+			*nl = '\0';
+			if (nl > start && nl[-1] == '\r')
+				nl[-1] = '\0';
+			c->pos = (size_t)(nl - c->buf) + 1;
+			return (char *)start;
 		}
-
-		return success;
-	}
-
-	static bool jxl_write(const char *path, struct image *img, int quality)
-	{
-		if (!image_validate_dims(img))
-			return false;
-
-		JxlEncoder *enc = JxlEncoderCreate(NULL);
-		if (!enc) return false;
-
-		void *runner = JxlResizableParallelRunnerCreate(NULL);
-		if (JxlEncoderSetParallelRunner(enc, JxlResizableParallelRunner, runner) != JXL_ENC_SUCCESS) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
-			return false;
+		scanned = c->len - c->pos;
+		if (scanned == sizeof(c->buf)) {
+			*too_long = true;
+			return NULL;
 		}
+		if (!serve_fill(c))
+			return NULL;
+	}
+}
 
-		JxlBasicInfo info;
-		JxlEncoderInitBasicInfo(&info);
-		info.xsize = img->width;
-		info.ysize = img->height;
-		info.bits_per_sample = 8;
-		info.num_color_channels = 3;
-		info.num_extra_channels = img->channels == 4 ? 1 : 0;
-		info.alpha_bits = img->channels == 4 ? 8 : 0;
-		info.uses_original_profile = JXL_FALSE;
-
-		if (JxlEncoderSetBasicInfo(enc, &info) != JXL_ENC_SUCCESS) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
+static bool serve_read_exact(struct serve_conn *c, uint8_t *dst, size_t n)
+{
+	size_t buffered = c->len - c->pos;
+	if (buffered > n)
+		buffered = n;
+	memcpy(dst, c->buf + c->pos, buffered);
+	c->pos += buffered;
+	size_t done = buffered;
+	while (done < n) {
+		ssize_t r = read(c->in_fd, dst + done, n - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
 			return false;
-		}
+		done += (size_t)r;
+	}
+	return true;
+}
 
-		JxlColorEncoding color;
-		JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
-		if (JxlEncoderSetColorEncoding(enc, &color) != JXL_ENC_SUCCESS) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
+static bool serve_write_all(int fd, const void *data, size_t n)
+{
+	const uint8_t *p = data;
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
 			return false;
-		}
-
-		JxlEncoderFrameSettings *settings = JxlEncoderFrameSettingsCreate(enc, NULL);
+		p += w;
+		n -= (size_t)w;
+	}
+	return true;
+}
 
-		// Convert quality 1-100 to distance (0 = lossless, 1 = visually lossless, 15 = max lossy)
-		float distance = quality >= 100 ? 0.0f : (100.0f - quality) / 6.5f;
-		if (distance > 15.0f) distance = 15.0f;
-		JxlEncoderSetFrameDistance(settings, distance);
+static bool serve_reply_error(struct serve_conn *c, const char *reason)
+{
+	char line[256];
+	int n = snprintf(line, sizeof(line), "error %s\n", reason);
+	if (n < 0)
+		return false;
+	if ((size_t)n >= sizeof(line)) {
+		n = sizeof(line) - 1;
+		line[n - 1] = '\n';
+	}
+	return serve_write_all(c->out_fd, line, (size_t)n);
+}
 
-		JxlPixelFormat format = {
-			.num_channels = img->channels,
-			.data_type = JXL_TYPE_UINT8,
-			.endianness = JXL_NATIVE_ENDIAN,
-			.align = 0
-		};
+static bool serve_parse_long(const char *s, long lo, long hi, long *out)
+{
+	char *end;
+	errno = 0;
+	long val = strtol(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || val < lo || val > hi)
+		return false;
+	*out = val;
+	return true;
+}
 
-		size_t pixel_count;
-		if (!checked_mul_size((size_t)img->width, (size_t)img->height, &pixel_count)) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
-			return false;
-		}
-		size_t pixel_size;
-		if (!checked_mul_size(pixel_count, (size_t)img->channels, &pixel_size)) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
-			return false;
-		}
-		if (JxlEncoderAddImageFrame(settings, &format, img->pixels, pixel_size) != JXL_ENC_SUCCESS) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
-			return false;
+// Fills req from a request line; returns NULL, or the reason to reply with
+static const char *serve_parse_request(char *line, struct serve_request *req)
+{
+	char *save;
+	for (char *tok = strtok_r(line, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+		char *val = strchr(tok, '=');
+		if (!val)
+			return "malformed request";
+		*val++ = '\0';
+
+		long n;
+		if (strcmp(tok, "to") == 0) {
+			req->to_fmt = format_from_name(val);
+			if (req->to_fmt == FMT_UNKNOWN)
+				return "unknown output format";
+		} else if (strcmp(tok, "from") == 0) {
+			req->from_fmt = format_from_name(val);
+			if (req->from_fmt == FMT_UNKNOWN)
+				return "unknown input format";
+		} else if (strcmp(tok, "quality") == 0) {
+			if (!serve_parse_long(val, 1, 100, &n))
+				return "invalid quality";
+			req->opts.quality = (int)n;
+		} else if (strcmp(tok, "effort") == 0) {
+			if (!serve_parse_long(val, 0, 10, &n))
+				return "invalid effort";
+			req->opts.effort = (int)n;
+		} else if (strcmp(tok, "resize") == 0) {
+			if (!parse_dims(val, &req->opts.resize_width, &req->opts.resize_height))
+				return "invalid resize";
+		} else if (strcmp(tok, "fit") == 0) {
+			if (!serve_parse_long(val, 0, 1, &n))
+				return "invalid fit";
+			req->opts.fit = n != 0;
+		} else if (strcmp(tok, "filter") == 0) {
+			if (!resample_filter_parse(val, &req->opts.filter))
+				return "unknown filter";
+		} else if (strcmp(tok, "max_dim") == 0) {
+			if (!serve_parse_long(val, 1, INT_MAX, &n))
+				return "invalid max_dim";
+			req->opts.max_dim = (int)n;
+		} else if (strcmp(tok, "scale") == 0) {
+			char *end;
+			errno = 0;
+			double f = strtod(val, &end);
+			if (errno != 0 || end == val || *end != '\0' || !(f > 0 && f <= 1))
+				return "invalid scale";
+			req->opts.scale = f;
+		} else if (strcmp(tok, "chroma") == 0) {
+			if (!chroma_parse(val, &req->opts.chroma))
+				return "invalid chroma";
+		} else if (strcmp(tok, "size") == 0) {
+			char *end;
+			errno = 0;
+			unsigned long long size = strtoull(val, &end, 10);
+			if (errno != 0 || end == val || *end != '\0' || val[0] == '-' || size > SIZE_MAX)
+				return "invalid size";
+			req->size = (size_t)size;
+			req->has_size = true;
+		} else if (strcmp(tok, "path") == 0) {
+			if (*val == '\0')
+				return "invalid path";
+			req->path = val;
+		} else {
+			return "unknown field";
 		}
+	}
 
-		JxlEncoderCloseInput(enc);
+	if (req->to_fmt == FMT_UNKNOWN)
+		return "output format required (to=)";
+	if (req->has_size == (req->path != NULL))
+		return "exactly one of size= and path= required";
+	return NULL;
+}
 
-		// Encode to buffer
-		size_t output_cap = 4096;
-		size_t output_size = 0;
-		uint8_t *output = malloc(output_cap);
-		if (!output) {
-			JxlResizableParallelRunnerDestroy(runner);
-			JxlEncoderDestroy(enc);
-			return false;
+// Runs one request; false if the connection has to be dropped
+static bool serve_request_run(struct serve_conn *c, const struct serve_request *req)
+{
+	struct conv_stats st;
+	if (stats_mode != STATS_OFF)
+		stats_begin(&st);
+
+	enum convert_status status = CONVERT_OK;
+	enum format from_fmt = req->from_fmt;
+	struct mapped_file mf = {0};
+	uint8_t *payload = NULL;
+	const uint8_t *data = NULL;
+	size_t size = 0;
+	bool framed = true;
+
+	if (req->path) {
+		if (from_fmt == FMT_UNKNOWN)
+			from_fmt = detect_format(req->path);
+		errno = 0;
+		if (input_map(req->path, MAP_FILE_POPULATE, &mf)) {
+			data = mf.data;
+			size = mf.size;
+		} else {
+			status = errno == EFBIG ? CONVERT_ERR_MAX_BYTES : CONVERT_ERR_READ;
 		}
-
-		for (;;) {
-			uint8_t *next_out = output + output_size;
-			size_t avail_out = output_cap - output_size;
-
-			JxlEncoderStatus status = JxlEncoderProcessOutput(enc, &next_out, &avail_out);
-			output_size = next_out - output;
-
-			if (status == JXL_ENC_SUCCESS) {
-				break;
-			} else if (status == JXL_ENC_NEED_MORE_OUTPUT) {
-				if (output_cap > SIZE_MAX / 2) {
-					free(output);
-					JxlResizableParallelRunnerDestroy(runner);
-					JxlEncoderDestroy(enc);
-					return false;
-				}
-				output_cap *= 2;
-				uint8_t *new_output = realloc(output, output_cap);
-				if (!new_output) {
-					free(output);
-					JxlResizableParallelRunnerDestroy(runner);
-					JxlEncoderDestroy(enc);
-					return false;
-				}
-				output = new_output;
-			} else {
-				free(output);
-				JxlResizableParallelRunnerDestroy(runner);
-				JxlEncoderDestroy(enc);
-				return false;
-			}
+	} else if (max_bytes != 0 && req->size > max_bytes) {
+		// Not worth reading just to throw away
+		status = CONVERT_ERR_MAX_BYTES;
+		framed = false;
+	} else {
+		enum stats_stage prev = stats_enter(STAGE_READ_IO);
+		payload = malloc(req->size ? req->size : 1);
+		if (payload && serve_read_exact(c, payload, req->size)) {
+			stats_alloc(req->size);
+			data = payload;
+			size = req->size;
+		} else {
+			status = CONVERT_ERR_READ;
+			framed = false;
 		}
+		stats_leave(prev);
+	}
+
+	bool admitted = status == CONVERT_OK && mem_budget;
+	uint64_t held = admitted ? budget_enter(budget_estimate(from_fmt, data, size, req->to_fmt, &req->opts)) : 0;
+	struct mapped_file out = {0};
+	if (status == CONVERT_OK && cache_dir) {
+		status = convert_mem_cached(from_fmt, data, size, req->to_fmt, &req->opts, &out);
+	} else if (status == CONVERT_OK) {
+		uint8_t *buf = NULL;
+		size_t buf_size = 0;
+		status = convert_mem(from_fmt, data, size, req->to_fmt, &req->opts, &buf, &buf_size);
+		out = (struct mapped_file){ .data = buf, .size = buf_size, .mapped = false };
+	}
+	if (admitted)
+		budget_leave(held);
+	size_t out_size = out.size;
+	unmap_file(&mf);
+	free(payload);
+
+	bool ok;
+	enum stats_stage prev = stats_enter(STAGE_WRITE_IO);
+	if (status == CONVERT_OK) {
+		char line[32];
+		int n = snprintf(line, sizeof(line), "ok %zu\n", out_size);
+		ok = serve_write_all(c->out_fd, line, (size_t)n) && serve_write_all(c->out_fd, out.data, out_size);
+	} else {
+		ok = serve_reply_error(c, convert_status_reason(status));
+	}
+	stats_leave(prev);
+	unmap_file(&out);
 
-		JxlResizableParallelRunnerDestroy(runner);
-		JxlEncoderDestroy(enc);
+	if (stats_mode != STATS_OFF) {
+		stats_end(&st);
+		st.bytes_in = size;
+		st.bytes_out = out_size;
+		pthread_mutex_lock(&serve_stats_lock);
+		stats_print(&st, req->path ? req->path : "-", "-",
+					status == CONVERT_OK ? "ok" : convert_status_reason(status));
+		pthread_mutex_unlock(&serve_stats_lock);
+	}
+	return ok && framed;
+}
 
-		FILE *f = fopen(path, "wb");
-		if (!f) {
-			free(output);
-			return false;
+static void serve_connection(struct serve_conn *c, const struct encode_opts *defaults)
+{
+	for (;;) {
+		bool too_long;
+		char *line = serve_read_line(c, &too_long);
+		if (!line) {
+			if (too_long)
+				serve_reply_error(c, "request line too long");
+			return;
 		}
+		if (*line == '\0')
+			continue;
 
-		bool ok = WRITE_FILE(output, output_size, f) == output_size;
-		fclose(f);
-		free(output);
-
-		return ok;
+		struct serve_request req = { .to_fmt = FMT_UNKNOWN, .from_fmt = FMT_UNKNOWN, .opts = *defaults };
+		const char *err = serve_parse_request(line, &req);
+		if (err) {
+			serve_reply_error(c, err);
+			return;
+		}
+		if (!serve_request_run(c, &req))
+			return;
 	}
-#endif
-
-// ============================================================================
-// Format detection
-// ============================================================================
+}
 
-enum format {
-	FMT_UNKNOWN,
-	FMT_PNG,
-	FMT_JPEG,
-	FMT_BMP,
-	FMT_QOI,
-#ifdef HAVE_TIFF
-	FMT_TIFF,
-#endif
-#ifdef HAVE_WEBP
-	FMT_WEBP,
-#endif
-#ifdef HAVE_AVIF
-	FMT_AVIF,
-#endif
-#ifdef HAVE_HEIF
-	FMT_HEIF,
-#endif
-#ifdef HAVE_JXL
-	FMT_JXL,
-#endif
+struct serve_ctx {
+	int listen_fd;
+	const struct encode_opts *opts;
 };
 
-static enum format format_from_name(const char *name)
-{
-	if (strcasecmp(name, "png") == 0)
-		return FMT_PNG;
-	if (strcasecmp(name, "jpg") == 0 || strcasecmp(name, "jpeg") == 0)
-		return FMT_JPEG;
-	if (strcasecmp(name, "bmp") == 0)
-		return FMT_BMP;
-	if (strcasecmp(name, "qoi") == 0)
-		return FMT_QOI;
-#ifdef HAVE_TIFF
-	if (strcasecmp(name, "tiff") == 0 || strcasecmp(name, "tif") == 0)
-		return FMT_TIFF;
-#endif
-#ifdef HAVE_WEBP
-	if (strcasecmp(name, "webp") == 0)
-		return FMT_WEBP;
-#endif
-#ifdef HAVE_AVIF
-	if (strcasecmp(name, "avif") == 0)
-		return FMT_AVIF;
-#endif
-#ifdef HAVE_HEIF
-	if (strcasecmp(name, "heif") == 0 || strcasecmp(name, "heic") == 0)
-		return FMT_HEIF;
-#endif
-#ifdef HAVE_JXL
-	if (strcasecmp(name, "jxl") == 0)
-		return FMT_JXL;
-#endif
-	return FMT_UNKNOWN;
+// Every worker blocks in accept() on the shared socket and serves the
+// connection it gets to the end
+static void *serve_worker(void *arg)
+{
+	struct serve_ctx *ctx = arg;
+	struct serve_conn *c = malloc(sizeof(*c));
+	if (!c)
+		return NULL;
+	for (;;) {
+		int fd = accept4(ctx->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EBADF || errno == EINVAL)
+				break;
+			continue;
+		}
+		*c = (struct serve_conn){ .in_fd = fd, .out_fd = fd };
+		serve_connection(c, ctx->opts);
+		close(fd);
+		// Idle until the next connection, which may be a long time coming
+		pool_trim();
+	}
+	free(c);
+	return NULL;
+}
+
+static int serve_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	// Replace a socket left behind by an earlier run, never anything else
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	// Owner-only: path= requests read files with the server's permissions
+	mode_t old_mask = umask(077);
+	int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_mask);
+	if (rc != 0 || listen(fd, SOMAXCONN) != 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	return fd;
 }
 
-static enum format detect_format(const char *path)
+// "-" serves a single connection over stdin/stdout
+static int serve_run(const char *path, int workers, const struct encode_opts *opts)
 {
-	const char *ext = strrchr(path, '.');
-	if (!ext) return FMT_UNKNOWN;
-	return format_from_name(ext + 1);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (strcmp(path, "-") == 0) {
+		struct serve_conn *c = calloc(1, sizeof(*c));
+		if (!c) return EXIT_FAILURE;
+		c->in_fd = STDIN_FILENO;
+		c->out_fd = STDOUT_FILENO;
+		serve_connection(c, opts);
+		free(c);
+		return EXIT_SUCCESS;
+	}
+
+	int fd = serve_listen(path);
+	if (fd < 0) {
+		PRINTF_ERR("Error: cannot listen on %s: %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// SIGINT/SIGTERM are taken synchronously below; workers never see them
+	sigset_t stop;
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+	struct serve_ctx ctx = { .listen_fd = fd, .opts = opts };
+	int started = 0;
+	for (int i = 0; i < workers; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, serve_worker, &ctx) != 0)
+			break;
+		pthread_detach(tid);
+		started++;
+	}
+	if (started == 0) {
+		PUTS_ERR("Error: cannot start server threads\n");
+		unlink(path);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	int sig;
+	sigwait(&stop, &sig);
+	// Connections still in flight are cut off when the process exits
+	unlink(path);
+	return EXIT_SUCCESS;
 }
 
 // ============================================================================
 // Main
 // ============================================================================
 
+// Long-only options
+enum {
+	OPT_QOI_CHUNKS = 256,
+	OPT_THREADS,
+	OPT_EFFORT,
+	OPT_SPEED,
+	OPT_STATS,
+	OPT_STATS_JSON,
+	OPT_SERVE,
+	OPT_HUGE_PAGES,
+	OPT_TIFF_COMPRESSION,
+	OPT_TIFF_TILE,
+	OPT_MAX_DIM,
+	OPT_SCALE,
+	OPT_RESIZE,
+	OPT_FIT,
+	OPT_FILTER,
+	OPT_JPEG_PARALLEL,
+	OPT_PNG_LEVEL,
+	OPT_PNG_STRATEGY,
+	OPT_PNG_PARALLEL,
+	OPT_FAST,
+	OPT_NO_TRANSCODE,
+	OPT_INFO,
+	OPT_JSON,
+	OPT_CACHE_DIR,
+	OPT_CACHE_SIZE,
+	OPT_MEM_BUDGET,
+	OPT_PREFETCH,
+	OPT_DIRECT_IO,
+	OPT_TARGET_SIZE,
+	OPT_TARGET_SSIM,
+	OPT_CHROMA,
+};
+
 int main(int argc, char **argv)
 {
 			struct option options[] = {
@@ -1738,24 +2240,70 @@ int main(int argc, char **argv)
 				{ "output", required_argument, 0, 'o' },
 				{ "max-pixels", required_argument, 0, 'm' },
 				{ "max-bytes", required_argument, 0, 'B' },
+				{ "output-dir", required_argument, 0, 'd' },
+				{ "from-list", required_argument, 0, 'l' },
+				{ "jobs", required_argument, 0, 'j' },
+				{ "qoi-chunks", required_argument, 0, OPT_QOI_CHUNKS },
+				{ "threads", required_argument, 0, OPT_THREADS },
+				{ "effort", required_argument, 0, OPT_EFFORT },
+				{ "speed", required_argument, 0, OPT_SPEED },
+				{ "stats", no_argument, 0, OPT_STATS },
+				{ "stats-json", no_argument, 0, OPT_STATS_JSON },
+				{ "serve", required_argument, 0, OPT_SERVE },
+				{ "huge-pages", no_argument, 0, OPT_HUGE_PAGES },
+				{ "tiff-compression", required_argument, 0, OPT_TIFF_COMPRESSION },
+				{ "tiff-tile", required_argument, 0, OPT_TIFF_TILE },
+				{ "max-dim", required_argument, 0, OPT_MAX_DIM },
+				{ "scale", required_argument, 0, OPT_SCALE },
+				{ "resize", required_argument, 0, OPT_RESIZE },
+				{ "fit", no_argument, 0, OPT_FIT },
+				{ "filter", required_argument, 0, OPT_FILTER },
+				{ "jpeg-parallel", no_argument, 0, OPT_JPEG_PARALLEL },
+				{ "png-level", required_argument, 0, OPT_PNG_LEVEL },
+				{ "png-strategy", required_argument, 0, OPT_PNG_STRATEGY },
+				{ "png-parallel", no_argument, 0, OPT_PNG_PARALLEL },
+				{ "fast", no_argument, 0, OPT_FAST },
+				{ "no-transcode", no_argument, 0, OPT_NO_TRANSCODE },
+				{ "info", no_argument, 0, OPT_INFO },
+				{ "json", no_argument, 0, OPT_JSON },
+				{ "cache-dir", required_argument, 0, OPT_CACHE_DIR },
+				{ "cache-size", required_argument, 0, OPT_CACHE_SIZE },
+				{ "mem-budget", required_argument, 0, OPT_MEM_BUDGET },
+				{ "prefetch", required_argument, 0, OPT_PREFETCH },
+				{ "direct-io", no_argument, 0, OPT_DIRECT_IO },
+				{ "target-size", required_argument, 0, OPT_TARGET_SIZE },
+				{ "target-ssim", required_argument, 0, OPT_TARGET_SSIM },
+				{ "chroma", required_argument, 0, OPT_CHROMA },
 				{ "help", no_argument, 0, 'h' },
 				{ 0 }
 			};
 
 	enum format to_fmt = FMT_UNKNOWN;
-	const char *output_path = NULL;
-	int quality = 85;
+	struct output_target targets[MAX_OUTPUTS];
+	size_t target_count = 0;
+	struct encode_opts opts = { .quality = 85, .effort = -1, .filter = RESAMPLE_LANCZOS };
+	const char *output_dir = NULL;
+	const char *list_path = NULL;
+	int jobs = 0;  // 0 = one per online CPU
+	const char *serve_path = NULL;
+	bool info = false;
 
 	int c;
-	while ((c = getopt_long(argc, argv, "f:q:o:m:B:h", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "f:q:o:m:B:d:l:j:h", options, NULL)) != -1) {
 		switch (c) {
-		case 'f':
-			to_fmt = format_from_name(optarg);
-			if (to_fmt == FMT_UNKNOWN) {
+		case 'f': {
+			enum format fmt = format_from_name(optarg);
+			if (fmt == FMT_UNKNOWN) {
 				PRINTF_ERR("Unknown format: %s\n", optarg);
 				return EXIT_FAILURE;
 			}
+			// After an -o it is that output's alone
+			if (target_count > 0)
+				targets[target_count - 1].fmt = fmt;
+			else
+				to_fmt = fmt;
 			break;
+		}
 		case 'q': {
 			char *end;
 			errno = 0;
@@ -1766,7 +2314,10 @@ int main(int argc, char **argv)
 			}
 			if (val < 1) val = 1;
 			if (val > 100) val = 100;
-			quality = (int)val;
+			if (target_count > 0)
+				targets[target_count - 1].quality = (int)val;
+			else
+				opts.quality = (int)val;
 			break;
 		}
 		case 'm': {
@@ -1791,21 +2342,325 @@ int main(int argc, char **argv)
 			max_bytes = (size_t)val;
 			break;
 		}
+		case 'j': {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 1024) {
+				PRINTF_ERR("Invalid jobs: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			jobs = (int)val;
+			break;
+		}
+		case OPT_QOI_CHUNKS: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 65536) {
+				PRINTF_ERR("Invalid qoi-chunks: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			qoi_chunks = (int)val;
+			break;
+		}
+		case OPT_THREADS: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 1024) {
+				PRINTF_ERR("Invalid threads: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			codec_threads = (int)val;
+			break;
+		}
+		case OPT_EFFORT:
+		case OPT_SPEED: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 10) {
+				PRINTF_ERR("Invalid %s: %s\n", c == OPT_EFFORT ? "effort" : "speed", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.effort = c == OPT_EFFORT ? (int)val : 10 - (int)val;
+			break;
+		}
+		case OPT_STATS:
+			stats_mode = STATS_TEXT;
+			break;
+		case OPT_STATS_JSON:
+			stats_mode = STATS_JSON;
+			break;
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+		case OPT_HUGE_PAGES:
+			pool_huge_pages = true;
+			break;
+		case OPT_TIFF_COMPRESSION:
+			if (strcasecmp(optarg, "lzw") == 0) {
+				tiff_compression = TIFF_COMPRESS_LZW;
+			} else if (strcasecmp(optarg, "deflate") == 0 || strcasecmp(optarg, "zip") == 0) {
+				tiff_compression = TIFF_COMPRESS_DEFLATE;
+			} else if (strcasecmp(optarg, "zstd") == 0) {
+				tiff_compression = TIFF_COMPRESS_ZSTD;
+			} else if (strcasecmp(optarg, "none") == 0) {
+				tiff_compression = TIFF_COMPRESS_NONE;
+			} else {
+				PRINTF_ERR("Invalid tiff-compression: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_TIFF_TILE: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			// TIFF requires tile dimensions to be multiples of 16
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 65536 || val % 16 != 0) {
+				PRINTF_ERR("Invalid tiff-tile (multiple of 16): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			tiff_tile = (int)val;
+			break;
+		}
+		case OPT_MAX_DIM: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > INT_MAX) {
+				PRINTF_ERR("Invalid max-dim: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.max_dim = (int)val;
+			break;
+		}
+		case OPT_SCALE: {
+			char *end;
+			errno = 0;
+			double val = strtod(optarg, &end);
+			if (errno != 0 || end == optarg || *end != '\0' || !(val > 0 && val <= 1)) {
+				PRINTF_ERR("Invalid scale (0 < F <= 1): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.scale = val;
+			break;
+		}
+		case OPT_RESIZE:
+			if (!parse_dims(optarg, &opts.resize_width, &opts.resize_height)) {
+				PRINTF_ERR("Invalid resize (WxH, Wx or xH): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_FIT:
+			opts.fit = true;
+			break;
+		case OPT_JPEG_PARALLEL:
+			jpeg_parallel = true;
+			break;
+		case OPT_PNG_LEVEL: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 9) {
+				PRINTF_ERR("Invalid png-level (0-9): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			png_level = (int)val;
+			break;
+		}
+		case OPT_PNG_STRATEGY:
+			if (strcasecmp(optarg, "default") == 0) {
+				png_strategy = Z_DEFAULT_STRATEGY;
+			} else if (strcasecmp(optarg, "filtered") == 0) {
+				png_strategy = Z_FILTERED;
+			} else if (strcasecmp(optarg, "rle") == 0) {
+				png_strategy = Z_RLE;
+			} else if (strcasecmp(optarg, "huffman") == 0) {
+				png_strategy = Z_HUFFMAN_ONLY;
+			} else {
+				PRINTF_ERR("Invalid png-strategy: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_PNG_PARALLEL:
+			png_parallel = true;
+			break;
+		case OPT_FAST:
+			jpeg_fast = true;
+			break;
+		case OPT_NO_TRANSCODE:
+			jxl_transcode = false;
+			break;
+		case OPT_INFO:
+			info = true;
+			break;
+		case OPT_JSON:
+			info_json = true;
+			break;
+		case OPT_TARGET_SIZE: {
+			char *end;
+			errno = 0;
+			unsigned long long val = strtoull(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || optarg[0] == '-' || val == 0 || val > SIZE_MAX) {
+				PRINTF_ERR("Invalid target-size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.target_size = (size_t)val;
+			break;
+		}
+		case OPT_TARGET_SSIM: {
+			char *end;
+			errno = 0;
+			double val = strtod(optarg, &end);
+			if (errno != 0 || end == optarg || *end != '\0' || !(val > 0 && val < 1)) {
+				PRINTF_ERR("Invalid target-ssim (0 < S < 1): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			opts.target_ssim = val;
+			break;
+		}
+		case OPT_CHROMA:
+			if (!chroma_parse(optarg, &opts.chroma)) {
+				PRINTF_ERR("Invalid chroma (420, 422 or 444): %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_CACHE_DIR:
+			cache_dir = optarg;
+			break;
+		case OPT_CACHE_SIZE: {
+			char *end;
+			errno = 0;
+			unsigned long long val = strtoull(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || optarg[0] == '-') {
+				PRINTF_ERR("Invalid cache-size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			cache_size = val;
+			break;
+		}
+		case OPT_MEM_BUDGET: {
+			char *end;
+			errno = 0;
+			unsigned long long val = strtoull(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || optarg[0] == '-') {
+				PRINTF_ERR("Invalid mem-budget: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			mem_budget = val;
+			break;
+		}
+		case OPT_PREFETCH: {
+			char *end;
+			errno = 0;
+			long val = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' || val < 0 || val > 1024) {
+				PRINTF_ERR("Invalid prefetch: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			prefetch = (int)val;
+			break;
+		}
+		case OPT_DIRECT_IO:
+			direct_io = true;
+			break;
+		case OPT_FILTER:
+			if (!resample_filter_parse(optarg, &opts.filter)) {
+				PRINTF_ERR("Invalid filter: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'o':
-			output_path = optarg;
+			if (target_count == MAX_OUTPUTS) {
+				PRINTF_ERR("Error: too many outputs (at most %d)\n", MAX_OUTPUTS);
+				return EXIT_FAILURE;
+			}
+			targets[target_count++] = (struct output_target){ .path = optarg };
+			break;
+		case 'd':
+			output_dir = optarg;
+			break;
+		case 'l':
+			list_path = optarg;
 			break;
 		case 'h':
 			PUTS(
-				"Usage: img-converter [OPTIONS] INPUT\n"
+				"Usage: img-converter [OPTIONS] INPUT -o OUTPUT [-f FORMAT] [-q N] [-o OUTPUT ...]\n"
+				"       img-converter [OPTIONS] -f FORMAT -d DIR INPUT...\n"
+				"       img-converter --info [--json] INPUT...\n"
 				"\n"
-				"Convert images between formats.\n"
+				"Convert images between formats. An INPUT of - reads stdin (format from\n"
+				"its magic bytes) and -o - writes stdout (needs -f).\n"
 				"\n"
 				"Options:\n"
 				"  -f, --format FORMAT   Output format\n"
 				"  -q, --quality N       Lossy quality 1-100 (default: 85)\n"
-				"  -o, --output FILE     Output file (required)\n"
+				"  -o, --output FILE     Output file (required; - = stdout). Repeat to write\n"
+				"                        several outputs from one decode; -f and -q after\n"
+				"                        an -o apply to that output only\n"
 				"  -m, --max-pixels N    Fail if width*height > N (0 = unlimited)\n"
 				"  -B, --max-bytes N     Fail if input file size > N (0 = unlimited)\n"
+				"  -d, --output-dir DIR  Batch mode: write DIR/<name>.<ext> for each input\n"
+				"  -l, --from-list FILE  Batch mode: read input paths from FILE (- = stdin)\n"
+				"  -j, --jobs N          Batch/server/multi-output mode: worker threads\n"
+				"                        (default: CPU count); --target-*: candidates per\n"
+				"                        round (default: up to 4)\n"
+				"      --qoi-chunks N    Write QOI as N independently coded stripes, encoded\n"
+				"                        and decoded in parallel (not standard QOI)\n"
+				"      --threads N       Threads per image inside codecs (default: CPU count,\n"
+				"                        or CPU count / jobs in batch mode; 0 = default)\n"
+				"      --effort N        Encoder effort 0-10, higher = slower and smaller\n"
+				"                        (default: each codec's own default)\n"
+				"      --speed N         Same as --effort 10-N\n"
+				"      --stats           Print per-stage timings and sizes to stderr\n"
+				"      --stats-json      Same as --stats, one JSON object per file\n"
+				"      --info            Print format, size and channels of each input from its\n"
+				"                        header alone, without decoding (honours -m, -B, -l, -j)\n"
+				"      --json            With --info, one JSON object per input\n"
+				"      --target-size N   Search for the highest quality whose output fits in\n"
+				"                        N bytes (lossy formats; -j candidates at a time)\n"
+				"      --target-ssim S   Search for the lowest quality whose output has an\n"
+				"                        SSIM of at least S to the input, e.g. 0.98\n"
+				"      --chroma S        Chroma subsampling of JPEG, AVIF and HEIC output: 420,\n"
+				"                        422 or 444 (default: the input's when converting\n"
+				"                        between JPEG, AVIF and HEIC without resizing or\n"
+				"                        --target-*, except JPEG to JPEG; else 420, or 444\n"
+				"                        for AVIF)\n"
+				"      --cache-dir DIR   Keep outputs in DIR keyed on the input's hash and the\n"
+				"                        options, and copy repeats from there\n"
+				"      --cache-size N    Evict least recently used entries past N bytes\n"
+				"                        (default: 1073741824; 0 = unlimited)\n"
+				"      --mem-budget N    Batch/server mode: admit jobs on their estimated peak\n"
+				"                        memory so running ones stay under N bytes, giving\n"
+				"                        large images more threads (default: 0 = no limit)\n"
+				"      --prefetch N      Batch mode: read N inputs ahead and write outputs\n"
+				"                        behind the workers (default: 0 = off)\n"
+				"      --direct-io       With --prefetch, read inputs of 64 MiB and up with\n"
+				"                        O_DIRECT\n"
+				"      --serve SOCKET    Serve conversion requests on a Unix socket\n"
+				"                        (- = one session on stdin/stdout); see README\n"
+				"      --huge-pages      Back large pixel buffers with transparent huge pages\n"
+				"      --tiff-compression C\n"
+				"                        TIFF output compression: lzw (default), deflate,\n"
+				"                        zstd or none\n"
+				"      --tiff-tile N     Write tiled TIFF with NxN tiles (N a multiple of 16;\n"
+				"                        default: 0 = strips)\n"
+				"      --jpeg-parallel   Encode large JPEGs as restart segments in parallel\n"
+				"      --png-level N     PNG zlib level 0-9 (default: from --effort, else 6)\n"
+				"      --png-strategy S  PNG zlib strategy: filtered (default), default, rle\n"
+				"                        or huffman\n"
+				"      --png-parallel    Deflate large PNGs as row bands in parallel\n"
+				"      --fast            Faster, slightly rougher JPEG decoding\n"
+				"      --no-transcode    Re-encode JPEG <-> JPEG XL from pixels (honouring -q)\n"
+				"                        instead of transcoding losslessly\n"
+				"      --resize WxH      Resize to WxH; Wx or xH keeps the aspect ratio\n"
+				"      --fit             With --resize WxH, keep the aspect ratio and fit\n"
+				"                        inside WxH\n"
+				"      --filter F        Resampling filter: lanczos (default), bicubic or box\n"
+				"      --max-dim N       Shrink to fit within NxN (0 = no limit)\n"
+				"      --scale F         Shrink by factor F, 0 < F <= 1\n"
 				"  -h, --help            Show this help\n"
 				"\n"
 				"Supported formats:\n"
@@ -1849,161 +2704,206 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (optind >= argc) {
-		PUTS_ERR("Error: no input file specified\n");
-		return EXIT_FAILURE;
-	}
-	if (optind + 1 < argc) {
-		PUTS_ERR("Error: too many input files\n");
+#ifdef HAVE_TIFF
+	if (tiff_compression == TIFF_COMPRESS_ZSTD && !TIFFIsCODECConfigured(COMPRESSION_ZSTD)) {
+		PUTS_ERR("Error: this libtiff was built without ZSTD support\n");
 		return EXIT_FAILURE;
 	}
+#endif
 
-	if (!output_path) {
-		PUTS_ERR("Error: output file required (-o)\n");
+	if (info_json && !info) {
+		PUTS_ERR("Error: --json needs --info\n");
 		return EXIT_FAILURE;
 	}
 
-	const char *input_path = argv[optind];
+	if (cache_dir) {
+		// Room for "/<32 hex digits>.<ext>.lock" on every entry path
+		if (strlen(cache_dir) > PATH_MAX - 64) {
+			PUTS_ERR("Error: --cache-dir path too long\n");
+			return EXIT_FAILURE;
+		}
+		if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+			PRINTF_ERR("Error: cannot create cache directory %s\n", cache_dir);
+			return EXIT_FAILURE;
+		}
+	}
 
-	if (max_bytes != 0) {
-		struct stat st;
-		if (stat(input_path, &st) == 0 && S_ISREG(st.st_mode)) {
-			if (st.st_size < 0 || (uintmax_t)st.st_size > (uintmax_t)max_bytes) {
-				PRINTF_ERR("Error: input file exceeds --max-bytes limit (%zu bytes)\n", max_bytes);
-				return EXIT_FAILURE;
-			}
+	if (info) {
+		if (target_count > 0 || output_dir || serve_path) {
+			PUTS_ERR("Error: --info takes input files only (no -o, -d or --serve)\n");
+			return EXIT_FAILURE;
+		}
+		struct batch b = { .info = true };
+		bool ok = true;
+		for (int i = optind; i < argc && ok; i++)
+			ok = batch_add_input(&b, argv[i]);
+		if (ok && list_path && !batch_read_list(&b, list_path)) {
+			PRINTF_ERR("Error: failed to read input list %s\n", list_path);
+			ok = false;
+		}
+		if (ok && b.count == 0) {
+			PUTS_ERR("Error: no input file specified\n");
+			ok = false;
 		}
+
+		int exit_code = ok ? info_run(&b, jobs > 0 ? jobs : parallel_default_threads()) : EXIT_FAILURE;
+		for (size_t i = 0; i < b.count; i++)
+			free(b.inputs[i]);
+		free(b.inputs);
+		return exit_code;
 	}
 
-	// Detect formats
-	enum format from_fmt = detect_format(input_path);
-	if (from_fmt == FMT_UNKNOWN) {
-		PUTS_ERR("Error: cannot detect input format\n");
-		return EXIT_FAILURE;
+	if (serve_path) {
+		if (optind < argc || target_count > 0 || output_dir || list_path) {
+			PUTS_ERR("Error: --serve takes no input or output files\n");
+			return EXIT_FAILURE;
+		}
+		int workers = jobs > 0 ? jobs : parallel_default_threads();
+		if (mem_budget)
+			budget_init(workers);
+		share_codec_threads(workers);
+		return serve_run(serve_path, workers, &opts);
 	}
 
-	if (to_fmt == FMT_UNKNOWN) {
-		to_fmt = detect_format(output_path);
+	bool batch_mode = output_dir || list_path || argc - optind > 1;
+
+	if (batch_mode) {
+		if (target_count > 0) {
+			PUTS_ERR("Error: -o cannot be used with multiple inputs, use --output-dir\n");
+			return EXIT_FAILURE;
+		}
+		if (!output_dir) {
+			PUTS_ERR("Error: output directory required for multiple inputs (--output-dir)\n");
+			return EXIT_FAILURE;
+		}
 		if (to_fmt == FMT_UNKNOWN) {
-			PUTS_ERR("Error: cannot detect output format, use -f\n");
+			PUTS_ERR("Error: output format required in batch mode (-f)\n");
+			return EXIT_FAILURE;
+		}
+		if (encode_wants_search(&opts) && !format_has_quality(to_fmt)) {
+			PUTS_ERR("Error: --target-size and --target-ssim need a lossy output format\n");
 			return EXIT_FAILURE;
 		}
+
+		int workers = jobs > 0 ? jobs : parallel_default_threads();
+		if (mem_budget)
+			budget_init(workers);
+		share_codec_threads(workers);
+
+		struct batch b = {
+			.output_dir = output_dir,
+			.to_fmt = to_fmt,
+			.opts = opts,
+		};
+		bool ok = true;
+		for (int i = optind; i < argc && ok; i++)
+			ok = batch_add_input(&b, argv[i]);
+		if (ok && list_path && !batch_read_list(&b, list_path)) {
+			PRINTF_ERR("Error: failed to read input list %s\n", list_path);
+			ok = false;
+		}
+		if (ok && b.count == 0) {
+			PUTS_ERR("Error: no input file specified\n");
+			ok = false;
+		}
+
+		int exit_code = ok ? batch_run(&b, workers) : EXIT_FAILURE;
+		for (size_t i = 0; i < b.count; i++)
+			free(b.inputs[i]);
+		free(b.inputs);
+		return exit_code;
 	}
 
-	// Read input
-	struct image img = {0};
-	int exit_code = EXIT_FAILURE;
-	bool ok = false;
-	bool have_pixels = false;
-	int read_errno = 0;
-	errno = 0;
+	if (optind >= argc) {
+		PUTS_ERR("Error: no input file specified\n");
+		return EXIT_FAILURE;
+	}
 
-	switch (from_fmt) {
-		case FMT_PNG:
-			ok = png_read(input_path, &img);
-			break;
-		case FMT_JPEG:
-			ok = jpeg_read(input_path, &img);
-			break;
-		case FMT_BMP:
-			ok = bmp_read(input_path, &img);
-			break;
-		case FMT_QOI:
-			ok = qoi_read(input_path, &img);
-			break;
-#ifdef HAVE_TIFF
-		case FMT_TIFF:
-			ok = tiff_read(input_path, &img);
-			break;
-#endif
-#ifdef HAVE_WEBP
-		case FMT_WEBP:
-			ok = webp_read(input_path, &img);
-			break;
-#endif
-#ifdef HAVE_AVIF
-		case FMT_AVIF:
-			ok = avif_read(input_path, &img);
-			break;
-#endif
-#ifdef HAVE_HEIF
-		case FMT_HEIF:
-			ok = heif_read(input_path, &img);
-			break;
-#endif
-#ifdef HAVE_JXL
-		case FMT_JXL:
-			ok = jxl_read(input_path, &img);
-			break;
-#endif
-		default:
-			break;
+	if (target_count == 0) {
+		PUTS_ERR("Error: output file required (-o)\n");
+		return EXIT_FAILURE;
 	}
-	read_errno = errno;
-	if (ok)
-		have_pixels = true;
 
-	if (!ok) {
-		if (read_errno == EFBIG) {
-			PRINTF_ERR("Error: input file exceeds --max-bytes limit (%zu bytes)\n", max_bytes);
-			goto cleanup;
+	const char *input_path = argv[optind];
+
+	size_t stdout_targets = 0;
+	for (size_t i = 0; i < target_count; i++) {
+		struct output_target *t = &targets[i];
+		if (path_is_stdio(t->path))
+			stdout_targets++;
+		if (t->fmt == FMT_UNKNOWN)
+			t->fmt = to_fmt;
+		if (t->fmt != FMT_UNKNOWN)
+			continue;
+		if (path_is_stdio(t->path)) {
+			PUTS_ERR("Error: output format required when writing to stdout (-f)\n");
+			return EXIT_FAILURE;
+		}
+		t->fmt = detect_format(t->path);
+		if (t->fmt == FMT_UNKNOWN) {
+			PRINTF_ERR("Error: cannot detect output format of %s, use -f\n", t->path);
+			return EXIT_FAILURE;
+		}
+	}
+	if (stdout_targets > 1) {
+		PUTS_ERR("Error: only one output can be stdout (-o -)\n");
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < target_count && encode_wants_search(&opts); i++) {
+		if (!format_has_quality(targets[i].fmt)) {
+			PRINTF_ERR("Error: --target-size and --target-ssim need a lossy output format, not %s\n",
+					   targets[i].path);
+			return EXIT_FAILURE;
 		}
-		PRINTF_ERR("Error: failed to read %s\n", input_path);
-		goto cleanup;
 	}
 
-	// Write output
-	switch (to_fmt) {
-		case FMT_PNG:
-			ok = png_write(output_path, &img);
-			break;
-		case FMT_JPEG:
-			ok = jpeg_write(output_path, &img, quality);
-			break;
-		case FMT_BMP:
-			ok = bmp_write(output_path, &img);
-			break;
-		case FMT_QOI:
-			ok = qoi_write(output_path, &img);
-			break;
-#ifdef HAVE_TIFF
-		case FMT_TIFF:
-			ok = tiff_write(output_path, &img);
+	enum convert_status status;
+	if (target_count > 1) {
+		int failed = fanout_run(input_path, targets, target_count, &opts, jobs, &status);
+		if (failed >= 0) {
+			if (failed > 0)
+				PRINTF_ERR("Error: %d of %zu outputs failed\n", failed, target_count);
+			return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	} else {
+		const char *output_path = targets[0].path;
+		if (targets[0].quality > 0)
+			opts.quality = targets[0].quality;
+		if (encode_wants_search(&opts)) {
+			search_probes = jobs > 0 ? jobs : parallel_default_threads() < 4 ? parallel_default_threads() : 4;
+			share_codec_threads(search_probes);
+		}
+		if (stats_mode != STATS_OFF) {
+			struct conv_stats st;
+			status = convert_file_stats(input_path, output_path, targets[0].fmt, &opts, &st);
+			stats_print(&st, input_path, output_path,
+						status == CONVERT_OK ? "ok" : convert_status_reason(status));
+		} else {
+			status = convert_file(input_path, output_path, targets[0].fmt, &opts);
+		}
+	}
+
+	switch (status) {
+		case CONVERT_OK:
+			return EXIT_SUCCESS;
+		case CONVERT_ERR_MAX_BYTES:
+			PRINTF_ERR("Error: input file exceeds --max-bytes limit (%zu bytes)\n", max_bytes);
 			break;
-#endif
-#ifdef HAVE_WEBP
-		case FMT_WEBP:
-			ok = webp_write(output_path, &img, quality);
+		case CONVERT_ERR_INPUT_FORMAT:
+			PUTS_ERR("Error: cannot detect input format\n");
 			break;
-#endif
-#ifdef HAVE_AVIF
-		case FMT_AVIF:
-			ok = avif_write(output_path, &img, quality);
+		case CONVERT_ERR_READ:
+			PRINTF_ERR("Error: failed to read %s\n", path_is_stdio(input_path) ? "stdin" : input_path);
 			break;
-#endif
-#ifdef HAVE_HEIF
-		case FMT_HEIF:
-			ok = heif_write(output_path, &img, quality);
+		case CONVERT_ERR_WRITE:
+			PRINTF_ERR("Error: failed to write %s\n",
+					   path_is_stdio(targets[0].path) ? "stdout" : targets[0].path);
 			break;
-#endif
-#ifdef HAVE_JXL
-		case FMT_JXL:
-			ok = jxl_write(output_path, &img, quality);
+		case CONVERT_ERR_TARGET:
+			PRINTF_ERR("Error: output is over --target-size (%zu bytes) even at quality 1\n", opts.target_size);
 			break;
-#endif
-		default:
+		case CONVERT_ERR_DUPLICATE:     // batch mode only
 			break;
 	}
-
-	if (!ok) {
-		PRINTF_ERR("Error: failed to write %s\n", output_path);
-		goto cleanup;
-	}
-
-	exit_code = EXIT_SUCCESS;
-
-cleanup:
-	if (have_pixels)
-		free(img.pixels);
-	return exit_code;
+	return EXIT_FAILURE;
 }
@@ -0,0 +1,6214 @@
+/*
+ * libimgconv - image codecs behind img-converter
+ * Supports: PNG, JPEG, BMP, QOI, plus optional TIFF, WebP, AVIF, HEIF, JXL
+ *
+ * Built on its own as libimgconv.a/.so, which exports only the imgconv_*
+ * API from imgconv.h: decoding, encoding and header probes. img-converter.c
+ * defines IMGCONV_CLI and includes this file whole, which adds what only the
+ * CLI uses: resizing, row streaming, the quality search, the JPEG XL and
+ * Y'CbCr shortcuts, memory estimates and per-conversion stats records.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <png.h>
+#include <zlib.h>
+#include <jpeglib.h>
+#ifdef HAVE_TIFF
+#include <tiffio.h>
+#endif
+#ifdef HAVE_WEBP
+#include <webp/decode.h>
+#include <webp/encode.h>
+#endif
+#ifdef HAVE_AVIF
+#include <avif/avif.h>
+#endif
+#ifdef HAVE_HEIF
+#include <libheif/heif.h>
+#endif
+#ifdef HAVE_JXL
+#include <jxl/decode.h>
+#include <jxl/encode.h>
+#include <jxl/resizable_parallel_runner.h>
+#endif
+
+#include "imgconv.h"
+
+#include "lib/stdio_helpers.h"
+#include "lib/checked_arith.h"
+#include "lib/parallel.h"
+#include "lib/pixel_kernels.h"
+#include "lib/mem_stream.h"
+#include "lib/buffer_pool.h"
+#include "lib/png_filter.h"
+#ifdef IMGCONV_CLI
+#include "lib/mapped_file.h"
+#include "lib/resample.h"
+#include "lib/ssim.h"
+#endif
+
+static size_t max_pixels = 100000000;  // 0 = unlimited
+#ifdef IMGCONV_CLI
+static size_t max_bytes = 268435456;   // 0 = unlimited
+#endif
+static int qoi_chunks = 0;              // QOI output stripes; 0 = standard QOI
+static int codec_threads = 0;           // threads per encode/decode; 0 = one per CPU
+static _Thread_local int job_codec_threads;     // this thread's job's own share; 0 = codec_threads
+
+enum tiff_compression {
+	TIFF_COMPRESS_LZW,
+	TIFF_COMPRESS_DEFLATE,
+	TIFF_COMPRESS_ZSTD,
+	TIFF_COMPRESS_NONE,
+};
+#if defined(HAVE_TIFF) || defined(IMGCONV_CLI)
+static enum tiff_compression tiff_compression = TIFF_COMPRESS_LZW;
+static int tiff_tile = 0;               // TIFF output tile size; 0 = strips
+#endif
+static bool jpeg_parallel = false;      // encode large JPEGs as parallel restart segments
+static bool jpeg_fast = false;          // --fast: fast IDCT and plain upsampling on JPEG decode
+#ifdef IMGCONV_CLI
+static bool jxl_transcode = true;       // JPEG <-> JPEG XL without decoding pixels
+#endif
+static int png_level = -1;              // PNG zlib level 0-9; -1 = from --effort
+static int png_strategy = -1;           // PNG zlib strategy (Z_*); -1 = Z_FILTERED, libpng's
+static bool png_parallel = false;       // deflate large PNGs as parallel row bands
+
+// QOI format implementation (inline, no library needed)
+#define QOI_OP_INDEX  0x00
+#define QOI_OP_DIFF   0x40
+#define QOI_OP_LUMA   0x80
+#define QOI_OP_RUN    0xc0
+#define QOI_OP_RGB    0xfe
+#define QOI_OP_RGBA   0xff
+#define QOI_MASK_2    0xc0
+#define QOI_MAGIC     0x716f6966  // "qoif"
+#define QOI_CHUNKED_MAGIC 0x716f6978  // "qoix", see qoi_parse_chunked()
+#define QOI_HEADER_SIZE 14
+#define QOI_END_MARKER_SIZE 8
+
+static inline uint32_t qoi_read32be(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void qoi_write32be(uint8_t *p, uint32_t v) {
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static inline uint64_t qoi_read64be(const uint8_t *p) {
+	return (uint64_t)qoi_read32be(p) << 32 | qoi_read32be(p + 4);
+}
+
+static inline void qoi_write64be(uint8_t *p, uint64_t v) {
+	qoi_write32be(p, (uint32_t)(v >> 32));
+	qoi_write32be(p + 4, (uint32_t)v);
+}
+
+static inline int qoi_hash(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+	return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+}
+
+// ============================================================================
+// Stage statistics (--stats)
+// ============================================================================
+
+// Wall time of a conversion is split into exclusive stages: entering a stage
+// charges the time since the last switch to the stage being left, so nested
+// stages (file I/O inside a decode) are not counted twice and the stages add
+// up to the total. I/O done inside libpng, libjpeg, libtiff and libheif is
+// part of their decode/encode stage.
+enum stats_stage {
+	STAGE_OTHER,        // format detection, setup, anything unclaimed
+	STAGE_READ_IO,      // mapping/reading the input
+	STAGE_DECODE,
+	STAGE_CONVERT,      // colour/layout conversion between a codec and RGB(A)
+	STAGE_RESIZE,
+	STAGE_ENCODE,
+	STAGE_WRITE_IO,     // writing encoded output
+	STAGE_COUNT,
+};
+
+#ifdef IMGCONV_CLI
+static const char *const stats_stage_names[STAGE_COUNT] = {
+	"other", "read_io", "decode", "convert", "resize", "encode", "write_io",
+};
+
+enum stats_mode { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+static enum stats_mode stats_mode = STATS_OFF;
+#endif
+
+struct conv_stats {
+	uint64_t stage_ns[STAGE_COUNT];
+	enum stats_stage stage;     // stage being timed
+	uint64_t since;             // when it was entered
+	uint64_t start;
+	uint64_t total_ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t allocs;            // pixel frames, strips and encode buffers
+	uint64_t alloc_bytes;
+	int quality;                // picked by --target-size/--target-ssim; 0 = none
+};
+
+// Set on the converting thread while a conversion with --stats runs
+static _Thread_local struct conv_stats *cur_stats;
+
+static uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Makes `stage` current and returns the previous one for stats_leave()
+static enum stats_stage stats_enter(enum stats_stage stage)
+{
+	struct conv_stats *st = cur_stats;
+	if (!st)
+		return STAGE_OTHER;
+	uint64_t now = stats_now_ns();
+	enum stats_stage prev = st->stage;
+	st->stage_ns[prev] += now - st->since;
+	st->since = now;
+	st->stage = stage;
+	return prev;
+}
+
+static void stats_leave(enum stats_stage prev)
+{
+	stats_enter(prev);
+}
+
+static void stats_alloc(size_t bytes)
+{
+	if (cur_stats) {
+		cur_stats->allocs++;
+		cur_stats->alloc_bytes += bytes;
+	}
+}
+
+#ifdef IMGCONV_CLI
+static void stats_begin(struct conv_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->start = st->since = stats_now_ns();
+	cur_stats = st;
+}
+
+static void stats_end(struct conv_stats *st)
+{
+	stats_enter(STAGE_OTHER);
+	st->total_ns = st->since - st->start;
+	cur_stats = NULL;
+}
+#endif
+
+// ============================================================================
+// Image data
+// ============================================================================
+
+// A decoder may hand over its own buffer instead of copying it into one from
+// the pool: rows then sit stride bytes apart and image_free() gives the
+// buffer back through release(owner).
+struct image {
+	uint8_t *pixels;    // RGB or RGBA
+	int width;
+	int height;
+	int channels;       // 3 = RGB, 4 = RGBA
+	size_t stride;      // bytes from one row to the next; 0 = width * channels
+	void (*release)(void *owner);   // NULL = pixels came from image_alloc_pixels()
+	void *owner;
+	int target_width;   // output size a shrink-on-read decoder worked out from the
+	int target_height;  // full-size header; 0 = derive it from width x height
+};
+
+static bool image_validate_dims(const struct image *img)
+{
+	return img->width > 0 && img->height > 0 && (img->channels == 3 || img->channels == 4);
+}
+
+// Fails with errno = EOVERFLOW so callers can tell the limit from a bad file
+static bool image_check_max_pixels(int width, int height)
+{
+	size_t pixel_count;
+	if (!checked_mul_size((size_t)width, (size_t)height, &pixel_count) ||
+		(max_pixels != 0 && pixel_count > max_pixels)) {
+		errno = EOVERFLOW;
+		return false;
+	}
+	return true;
+}
+
+// Chroma subsampling of a Y'CbCr encode (--chroma)
+enum chroma_subsampling {
+	CHROMA_DEFAULT,     // each codec's own: 4:2:0 for JPEG and HEIC, 4:4:4 for AVIF
+	CHROMA_420,
+	CHROMA_422,
+	CHROMA_444,
+};
+
+// Per-output encoder settings
+struct encode_opts {
+	int quality;    // 1-100, lossy formats only
+	int effort;     // 0-10, higher = slower and smaller; -1 = each codec's default
+	enum chroma_subsampling chroma;
+#ifdef IMGCONV_CLI
+	int resize_width;   // --resize; 0 = follow the other dimension's ratio
+	int resize_height;
+	bool fit;       // --resize keeps the aspect ratio and fits inside the box
+	enum resample_filter filter;
+	int max_dim;    // shrink to fit within max_dim x max_dim; 0 = no limit
+	double scale;   // shrink by this factor, in (0, 1); 0 = full size
+	size_t target_size;     // search quality for the best output under this many bytes; 0 = off
+	double target_ssim;     // search quality for the smallest output this similar; 0 = off
+#endif
+};
+
+// What --threads (or a batch job's share of the CPUs) asks for; 0 = the default
+static int codec_thread_setting(void)
+{
+	return job_codec_threads > 0 ? job_codec_threads : codec_threads;
+}
+
+static int codec_thread_count(void)
+{
+	return codec_thread_setting() > 0 ? codec_thread_setting() : parallel_default_threads();
+}
+
+static bool image_alloc_pixels(struct image *img, size_t rowbytes)
+{
+	if (!image_validate_dims(img) || rowbytes == 0)
+		return false;
+	if (!image_check_max_pixels(img->width, img->height))
+		return false;
+	size_t total;
+	if (!checked_mul_size(rowbytes, (size_t)img->height, &total))
+		return false;
+	img->pixels = pool_alloc(total);
+	if (!img->pixels)
+		return false;
+	stats_alloc(total);
+	return true;
+}
+
+static size_t image_stride(const struct image *img)
+{
+	return img->stride ? img->stride : (size_t)img->width * (size_t)img->channels;
+}
+
+static bool image_is_packed(const struct image *img)
+{
+	return image_stride(img) == (size_t)img->width * (size_t)img->channels;
+}
+
+// Hands the pixel buffer back to the pool, or to the decoder that owns it
+static void image_free(struct image *img)
+{
+	if (img->release)
+		img->release(img->owner);
+	else
+		pool_free(img->pixels);
+	img->pixels = NULL;
+	img->stride = 0;
+	img->release = NULL;
+	img->owner = NULL;
+}
+
+// Copies a decoder-owned or strided frame into a packed pool buffer, for the
+// few consumers that need one
+static bool image_pack(struct image *img)
+{
+	if (!img->release && image_is_packed(img))
+		return true;
+	struct image out = { .width = img->width, .height = img->height, .channels = img->channels,
+						 .target_width = img->target_width, .target_height = img->target_height };
+	size_t rowbytes = (size_t)out.width * (size_t)out.channels;
+	if (!image_alloc_pixels(&out, rowbytes))
+		return false;
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	size_t stride = image_stride(img);
+	for (int y = 0; y < img->height; y++)
+		memcpy(out.pixels + (size_t)y * rowbytes, img->pixels + (size_t)y * stride, rowbytes);
+	stats_leave(prev);
+	image_free(img);
+	*img = out;
+	return true;
+}
+
+#ifdef IMGCONV_CLI
+// Output size for a width x height input under opts (NULL = unchanged); false
+// if that is the input size. --resize is applied first, then --max-dim and
+// --scale, which only ever shrink.
+static bool image_target_size(const struct encode_opts *opts, int width, int height,
+							  int *out_width, int *out_height)
+{
+	if (!opts)
+		return false;
+	double tw = width, th = height;
+	if (opts->resize_width > 0 || opts->resize_height > 0) {
+		double fx = (double)opts->resize_width / width, fy = (double)opts->resize_height / height;
+		if (opts->resize_width == 0)
+			fx = fy;
+		else if (opts->resize_height == 0)
+			fy = fx;
+		else if (opts->fit)
+			fx = fy = fx < fy ? fx : fy;
+		tw *= fx;
+		th *= fy;
+	}
+
+	double f = opts->scale > 0 && opts->scale < 1 ? opts->scale : 1;
+	double longest = tw > th ? tw : th;
+	if (opts->max_dim > 0 && longest > opts->max_dim && opts->max_dim / longest < f)
+		f = opts->max_dim / longest;
+	tw = tw * f + 0.5;
+	th = th * f + 0.5;
+	*out_width = tw < 1 ? 1 : tw > INT_MAX ? INT_MAX : (int)tw;
+	*out_height = th < 1 ? 1 : th > INT_MAX ? INT_MAX : (int)th;
+	return *out_width != width || *out_height != height;
+}
+
+// Output size for img under opts. A decoder that already shrank the image
+// records the size from the original header, since --scale is relative and
+// must not be applied to the reduced size a second time.
+static bool image_output_size(const struct image *img, const struct encode_opts *opts,
+							  int *out_width, int *out_height)
+{
+	if (img->target_width > 0 && img->target_height > 0) {
+		*out_width = img->target_width;
+		*out_height = img->target_height;
+		return *out_width != img->width || *out_height != img->height;
+	}
+	return image_target_size(opts, img->width, img->height, out_width, out_height);
+}
+
+static bool image_wants_resize(const struct encode_opts *opts)
+{
+	return opts && (opts->resize_width > 0 || opts->resize_height > 0 || opts->max_dim > 0 ||
+					(opts->scale > 0 && opts->scale < 1));
+}
+
+// Resamples img to the size opts asks for. Decoders that can (JPEG, WebP)
+// already stop near that size when shrinking, which leaves little to do.
+static bool image_resize(struct image *img, const struct encode_opts *opts)
+{
+	struct image out = { .channels = img->channels };
+	if (!image_output_size(img, opts, &out.width, &out.height))
+		return true;
+	if (!image_alloc_pixels(&out, (size_t)out.width * (size_t)out.channels))
+		return false;
+
+	enum stats_stage prev = stats_enter(STAGE_RESIZE);
+	bool ok = resample(img->pixels, img->width, img->height, image_stride(img), out.pixels, out.width,
+					   out.height, img->channels, opts->filter, codec_thread_count());
+	stats_leave(prev);
+	if (!ok) {
+		image_free(&out);
+		return false;
+	}
+	image_free(img);
+	*img = out;
+	return true;
+}
+#endif
+
+static int chroma_shift_x(enum chroma_subsampling chroma)
+{
+	return chroma == CHROMA_444 ? 0 : 1;
+}
+
+static int chroma_shift_y(enum chroma_subsampling chroma)
+{
+	return chroma == CHROMA_420 ? 1 : 0;
+}
+
+#ifdef IMGCONV_CLI
+// Planar Y'CbCr, for conversions between JPEG, AVIF and HEIC that never go
+// through RGB (format_convert_yuv_mem()). Always 8-bit, full-range BT.601 as
+// in JFIF. Each plane is padded, with copies of its edge samples, to a
+// multiple of 16 luma rows and columns, which covers any JPEG iMCU.
+struct yuv_image {
+	uint8_t *planes[3];     // Y, Cb, Cr
+	size_t strides[3];
+	int width;
+	int height;
+	enum chroma_subsampling chroma;     // never CHROMA_DEFAULT
+};
+
+// Size of plane p without the padding
+static void yuv_plane_size(const struct yuv_image *yuv, int p, int *width, int *height)
+{
+	int sx = p ? chroma_shift_x(yuv->chroma) : 0;
+	int sy = p ? chroma_shift_y(yuv->chroma) : 0;
+	*width = (yuv->width + (1 << sx) - 1) >> sx;
+	*height = (yuv->height + (1 << sy) - 1) >> sy;
+}
+
+static size_t yuv_plane_rows(const struct yuv_image *yuv, int p)
+{
+	size_t rows = ((size_t)yuv->height + 15) & ~(size_t)15;
+	return p ? rows >> chroma_shift_y(yuv->chroma) : rows;
+}
+
+static void yuv_image_free(struct yuv_image *yuv)
+{
+	for (int p = 0; p < 3; p++) {
+		pool_free(yuv->planes[p]);
+		yuv->planes[p] = NULL;
+	}
+}
+
+// Allocates the planes for yuv->width x yuv->height in yuv->chroma
+static bool yuv_image_alloc(struct yuv_image *yuv)
+{
+	if (yuv->width <= 0 || yuv->height <= 0 || yuv->width > INT_MAX - 15 || yuv->height > INT_MAX - 15 ||
+		yuv->chroma == CHROMA_DEFAULT || !image_check_max_pixels(yuv->width, yuv->height))
+		return false;
+	size_t width = ((size_t)yuv->width + 15) & ~(size_t)15;
+	for (int p = 0; p < 3; p++) {
+		yuv->strides[p] = p ? width >> chroma_shift_x(yuv->chroma) : width;
+		size_t bytes;
+		if (!checked_mul_size(yuv->strides[p], yuv_plane_rows(yuv, p), &bytes) ||
+			!(yuv->planes[p] = pool_alloc(bytes))) {
+			yuv_image_free(yuv);
+			return false;
+		}
+		stats_alloc(bytes);
+	}
+	return true;
+}
+
+// Fills the padding of each plane from its last column and row
+static void yuv_image_pad(struct yuv_image *yuv)
+{
+	for (int p = 0; p < 3; p++) {
+		int w, h;
+		yuv_plane_size(yuv, p, &w, &h);
+		size_t stride = yuv->strides[p];
+		uint8_t *plane = yuv->planes[p];
+		for (int y = 0; y < h; y++) {
+			uint8_t *row = plane + (size_t)y * stride;
+			memset(row + w, row[w - 1], stride - (size_t)w);
+		}
+		for (size_t y = (size_t)h; y < yuv_plane_rows(yuv, p); y++)
+			memcpy(plane + y * stride, plane + (size_t)(h - 1) * stride, stride);
+	}
+}
+
+#if defined(HAVE_AVIF) || defined(HAVE_HEIF)
+// Copies plane p in from a decoder's, stretching limited-range ("studio
+// swing", 16-235 luma and 16-240 chroma) samples to full range if asked
+static void yuv_plane_import(struct yuv_image *yuv, int p, const uint8_t *src, size_t src_stride,
+							 bool limited)
+{
+	uint8_t lut[256];
+	if (limited) {
+		for (int v = 0; v < 256; v++) {
+			int full = p ? ((v - 128) * 255 + (v >= 128 ? 112 : -112)) / 224 + 128
+						 : ((v - 16) * 255 + 109) / 219;
+			lut[v] = (uint8_t)(full < 0 ? 0 : full > 255 ? 255 : full);
+		}
+	}
+	int w, h;
+	yuv_plane_size(yuv, p, &w, &h);
+	for (int y = 0; y < h; y++) {
+		const uint8_t *in = src + (size_t)y * src_stride;
+		uint8_t *out = yuv->planes[p] + (size_t)y * yuv->strides[p];
+		if (limited) {
+			for (int x = 0; x < w; x++)
+				out[x] = lut[in[x]];
+		} else {
+			memcpy(out, in, (size_t)w);
+		}
+	}
+}
+
+// Copies plane p out to an encoder's
+static void yuv_plane_export(const struct yuv_image *yuv, int p, uint8_t *dst, size_t dst_stride)
+{
+	int w, h;
+	yuv_plane_size(yuv, p, &w, &h);
+	for (int y = 0; y < h; y++)
+		memcpy(dst + (size_t)y * dst_stride, yuv->planes[p] + (size_t)y * yuv->strides[p], (size_t)w);
+}
+#endif
+
+// Maps an input file under the --max-bytes limit, timed as read I/O
+static bool input_map(const char *path, int flags, struct mapped_file *mf)
+{
+	enum stats_stage prev = stats_enter(STAGE_READ_IO);
+	bool ok = map_file(path, max_bytes, flags, mf);
+	stats_leave(prev);
+	return ok;
+}
+#endif
+
+// WRITE_FILE for encoded output, timed as write I/O
+static size_t output_write(const void *buf, size_t len, FILE *f)
+{
+	enum stats_stage prev = stats_enter(STAGE_WRITE_IO);
+	size_t n = WRITE_FILE(buf, len, f);
+	stats_leave(prev);
+	return n;
+}
+
+// ============================================================================
+// Row streaming
+// ============================================================================
+
+// Scanline-oriented formats (PNG, JPEG, BMP, QOI, TIFF) expose their decoders
+// and encoders as row sources and sinks so that a conversion between two of
+// them only ever holds a strip of STREAM_STRIP_ROWS rows in memory. Rows are
+// tightly packed RGB or RGBA, top to bottom.
+
+#define STREAM_STRIP_ROWS 16
+
+struct row_source {
+	int width;
+	int height;
+	int channels;
+	bool (*read)(struct row_source *src, uint8_t *rows, int count);
+	void (*close)(struct row_source *src);
+};
+
+// close() finishes the file and frees the sink; it returns false if the output
+// is incomplete, including after an earlier failed write(). abort() frees the
+// sink without finishing the file, for when the rows stop coming.
+struct row_sink {
+	bool (*write)(struct row_sink *dst, const uint8_t *rows, int count);
+	bool (*close)(struct row_sink *dst);
+	void (*abort)(struct row_sink *dst);
+};
+
+#ifdef IMGCONV_CLI
+static size_t row_source_rowbytes(const struct row_source *src)
+{
+	return (size_t)src->width * (size_t)src->channels;
+}
+#endif
+
+// Full-frame writers are a single pass over a sink, a row at a time if the
+// frame is strided
+static bool image_write_rows(struct row_sink *dst, const struct image *img)
+{
+	if (!dst) return false;
+	bool ok = true;
+	if (image_is_packed(img)) {
+		ok = dst->write(dst, img->pixels, img->height);
+	} else {
+		size_t stride = image_stride(img);
+		for (int y = 0; y < img->height && ok; y++)
+			ok = dst->write(dst, img->pixels + (size_t)y * stride, 1);
+	}
+	return dst->close(dst) && ok;
+}
+
+// ============================================================================
+// PNG
+// ============================================================================
+
+// Reads the header and configures libpng to deliver 8-bit RGB or RGBA rows.
+// Must be called with png_jmpbuf(png) set.
+static bool png_read_setup(png_structp png, png_infop info, struct image *img)
+{
+	png_read_info(png, info);
+
+	png_uint_32 w = png_get_image_width(png, info);
+	png_uint_32 h = png_get_image_height(png, info);
+	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX)
+		return false;
+	img->width = (int)w;
+	img->height = (int)h;
+	png_byte color_type = png_get_color_type(png, info);
+	png_byte bit_depth = png_get_bit_depth(png, info);
+
+	// Convert to 8-bit RGBA
+	if (bit_depth == 16)
+		png_set_strip_16(png);
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png);
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+	if (png_get_valid(png, info, PNG_INFO_tRNS))
+		png_set_tRNS_to_alpha(png);
+	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png);
+
+	png_read_update_info(png, info);
+
+	img->channels = (png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA) ? 4 : 3;
+	return image_check_max_pixels(img->width, img->height);
+}
+
+// png_set_read_fn() callback over an in-memory file
+struct png_mem_reader {
+	const uint8_t *pos;
+	const uint8_t *end;
+};
+
+static void png_mem_read(png_structp png, png_bytep out, png_size_t len)
+{
+	struct png_mem_reader *r = png_get_io_ptr(png);
+	if ((size_t)(r->end - r->pos) < len)
+		png_error(png, "unexpected end of file");
+	memcpy(out, r->pos, len);
+	r->pos += len;
+}
+
+// Header probe: IHDR, plus a walk over the chunk headers up to the first IDAT
+// for a tRNS, which the decoder turns into alpha. No pixel data is touched.
+static bool png_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	if (size < 33 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0 ||
+		qoi_read32be(data + 8) != 13 || memcmp(data + 12, "IHDR", 4) != 0)
+		return false;
+	uint32_t w = qoi_read32be(data + 16);
+	uint32_t h = qoi_read32be(data + 20);
+	uint8_t color_type = data[25];
+	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX)
+		return false;
+	img->width = (int)w;
+	img->height = (int)h;
+
+	bool alpha = color_type & PNG_COLOR_MASK_ALPHA;
+	for (size_t pos = 33; !alpha && size - pos >= 8;) {
+		uint32_t len = qoi_read32be(data + pos);
+		if (memcmp(data + pos + 4, "IDAT", 4) == 0)
+			break;
+		if (memcmp(data + pos + 4, "tRNS", 4) == 0)
+			alpha = true;
+		if (len > size - pos - 8 || size - pos - 8 - len < 4)
+			break;
+		pos += 8 + (size_t)len + 4;     // length, type, data, CRC
+	}
+	img->channels = alpha ? 4 : 3;
+	return image_check_max_pixels(img->width, img->height);
+}
+
+static bool png_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return false;
+
+	png_infop info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return false;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	struct png_mem_reader reader = { data, data + size };
+	png_set_read_fn(png, &reader, png_mem_read);
+	if (!png_read_setup(png, info, img)) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	size_t rowbytes = png_get_rowbytes(png, info);
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes)) {
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+
+	size_t rows_bytes;
+	if (!checked_mul_size((size_t)img->height, sizeof(png_bytep), &rows_bytes)) {
+		image_free(img);
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+	png_bytep *rows = malloc(rows_bytes);
+	if (!rows) {
+		image_free(img);
+		png_destroy_read_struct(&png, &info, NULL);
+		return false;
+	}
+	for (int y = 0; y < img->height; y++) {
+		size_t yoff = (size_t)y * rowbytes;
+		rows[y] = img->pixels + yoff;
+	}
+
+	png_read_image(png, rows);
+	free(rows);
+
+	png_destroy_read_struct(&png, &info, NULL);
+	return true;
+}
+
+#ifdef IMGCONV_CLI
+struct png_source {
+	struct row_source base;
+	FILE *f;
+	png_structp png;
+	png_infop info;
+};
+
+static bool png_source_read(struct row_source *src, uint8_t *rows, int count)
+{
+	struct png_source *s = (struct png_source *)src;
+	size_t rowbytes = row_source_rowbytes(src);
+
+	if (setjmp(png_jmpbuf(s->png)))
+		return false;
+	for (int i = 0; i < count; i++)
+		png_read_row(s->png, rows + (size_t)i * rowbytes, NULL);
+	return true;
+}
+
+static void png_source_close(struct row_source *src)
+{
+	struct png_source *s = (struct png_source *)src;
+	png_destroy_read_struct(&s->png, &s->info, NULL);
+	fclose(s->f);
+	free(s);
+}
+
+// Interlaced images need every pass before any row is final, so they are not
+// streamable; the caller falls back to png_decode(). Takes ownership of f,
+// which is closed on failure too.
+static struct row_source *png_source_open_file(FILE *f)
+{
+	struct png_source *s = calloc(1, sizeof(*s));
+	if (!s) {
+		fclose(f);
+		return NULL;
+	}
+	s->f = f;
+
+	s->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!s->png) {
+		fclose(s->f);
+		free(s);
+		return NULL;
+	}
+
+	s->info = png_create_info_struct(s->png);
+	if (!s->info) {
+		png_destroy_read_struct(&s->png, NULL, NULL);
+		fclose(s->f);
+		free(s);
+		return NULL;
+	}
+
+	if (setjmp(png_jmpbuf(s->png))) {
+		png_source_close(&s->base);
+		return NULL;
+	}
+
+	png_init_io(s->png, s->f);
+	struct image hdr = {0};
+	if (!png_read_setup(s->png, s->info, &hdr) ||
+		png_get_interlace_type(s->png, s->info) != PNG_INTERLACE_NONE ||
+		png_get_rowbytes(s->png, s->info) != (size_t)hdr.width * (size_t)hdr.channels) {
+		png_source_close(&s->base);
+		return NULL;
+	}
+
+	s->base.width = hdr.width;
+	s->base.height = hdr.height;
+	s->base.channels = hdr.channels;
+	s->base.read = png_source_read;
+	s->base.close = png_source_close;
+	return &s->base;
+}
+
+static struct row_source *png_source_open(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	return f ? png_source_open_file(f) : NULL;
+}
+#endif
+
+// zlib settings for PNG output: --effort picks the level and how many row
+// filters are tried (None and Sub are cheap, Paeth costs the most), and
+// --png-level and --png-strategy override it
+struct png_codec {
+	int level;
+	int strategy;
+	unsigned filters;   // PNG_ROW_MASK() set
+};
+
+static struct png_codec png_codec_for(const struct encode_opts *opts)
+{
+	struct png_codec c = { .level = 6, .strategy = Z_FILTERED, .filters = PNG_ROW_MASK_ALL };
+	if (opts && opts->effort >= 0) {
+		c.level = 1 + opts->effort * 8 / 10;
+		if (opts->effort <= 2)
+			c.filters = PNG_ROW_MASK(PNG_ROW_NONE) | PNG_ROW_MASK(PNG_ROW_SUB);
+		else if (opts->effort <= 5)
+			c.filters = PNG_ROW_MASK(PNG_ROW_NONE) | PNG_ROW_MASK(PNG_ROW_SUB) | PNG_ROW_MASK(PNG_ROW_UP);
+	}
+	if (png_level >= 0)
+		c.level = png_level;
+	if (png_strategy >= 0)
+		c.strategy = png_strategy;
+	return c;
+}
+
+// --png-parallel filters and deflates bands of rows on several threads, as
+// pigz does: each segment of a band is a raw deflate stream primed with the
+// 32 KiB before it and ended with a sync flush, which leaves it byte-aligned,
+// so the segments read back as one zlib stream. Each segment becomes one IDAT
+// chunk, the first with the zlib header in front and the last with the
+// Adler-32 (combined from the segments') behind. The sink writes the PNG
+// chunks itself rather than through libpng.
+#define PNG_SEGMENT_BYTES  ((size_t)1 << 20)
+#define PNG_WINDOW_BYTES   ((size_t)32 << 10)
+
+struct png_sink {
+	struct row_sink base;
+	FILE *f;
+	png_structp png;
+	png_infop info;
+	size_t rowbytes;
+	bool failed;
+
+	// Parallel mode only
+	bool parallel;
+	struct png_codec codec;
+	int height;
+	int channels;
+	size_t slots;
+	int seg_rows;       // rows per segment
+	uint8_t *buf;       // one band of slots segments
+	uint8_t *filtered;  // the band's filtered rows, each led by its filter type
+	uint8_t *prev_row;  // last row of the previous band
+	uint8_t *dict;      // last PNG_WINDOW_BYTES of the stream so far
+	size_t dict_len;
+	uLong adler;
+	int band_rows;
+	int band_y;         // first row of the band being gathered
+	int fill;           // rows gathered for it
+};
+
+struct png_segment_job {
+	const struct png_sink *s;
+	const uint8_t *src;     // first row of the band
+	int rows;               // rows in the band
+	bool last;              // the band ends the image
+	uint8_t **out;          // per segment: 2 bytes of room, deflate data, 4 bytes of room
+	size_t *out_size;       // deflate data only
+	uLong *adler;
+	atomic_bool failed;
+};
+
+static size_t png_filtered_rowbytes(const struct png_sink *s)
+{
+	return s->rowbytes + 1;
+}
+
+static void png_filter_segment(void *ctx, size_t seg)
+{
+	struct png_segment_job *job = ctx;
+	const struct png_sink *s = job->s;
+	int y0 = (int)seg * s->seg_rows;
+	int rows = job->rows - y0 < s->seg_rows ? job->rows - y0 : s->seg_rows;
+	uint8_t *scratch = pool_alloc(s->rowbytes);
+	if (!scratch) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	for (int y = y0; y < y0 + rows; y++) {
+		const uint8_t *row = job->src + (size_t)y * s->rowbytes;
+		const uint8_t *prev = y > 0 ? row - s->rowbytes : s->band_y > 0 ? s->prev_row : NULL;
+		png_row_filter(row, prev, s->rowbytes, s->channels, s->codec.filters,
+					   s->filtered + (size_t)y * png_filtered_rowbytes(s), scratch);
+	}
+	pool_free(scratch);
+}
+
+static void png_deflate_segment(void *ctx, size_t seg)
+{
+	struct png_segment_job *job = ctx;
+	const struct png_sink *s = job->s;
+	size_t frow = png_filtered_rowbytes(s);
+	int y0 = (int)seg * s->seg_rows;
+	int rows = job->rows - y0 < s->seg_rows ? job->rows - y0 : s->seg_rows;
+	size_t segments = (size_t)((job->rows + s->seg_rows - 1) / s->seg_rows);
+	const uint8_t *in = s->filtered + (size_t)y0 * frow;
+	size_t len = (size_t)rows * frow;
+	bool finish = job->last && seg == segments - 1;
+
+	z_stream z = { 0 };
+	if (deflateInit2(&z, s->codec.level, Z_DEFLATED, -15, 8, s->codec.strategy) != Z_OK) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	// The window the segment would have seen in a serial stream
+	const uint8_t *dict = seg > 0 ? in - PNG_WINDOW_BYTES : s->dict + PNG_WINDOW_BYTES - s->dict_len;
+	size_t dict_len = seg > 0 ? PNG_WINDOW_BYTES : s->dict_len;
+	size_t cap = deflateBound(&z, len) + 16;    // + room for the sync flush
+	uint8_t *out = malloc(2 + cap + 4);
+	bool ok = out && (dict_len == 0 || deflateSetDictionary(&z, dict, (uInt)dict_len) == Z_OK);
+	if (ok) {
+		z.next_in = (Bytef *)in;
+		z.avail_in = (uInt)len;
+		z.next_out = out + 2;
+		z.avail_out = (uInt)cap;
+		int ret = deflate(&z, finish ? Z_FINISH : Z_SYNC_FLUSH);
+		ok = (finish ? ret == Z_STREAM_END : ret == Z_OK) && z.avail_in == 0 && z.avail_out > 0;
+	}
+	if (ok) {
+		job->out[seg] = out;
+		job->out_size[seg] = cap - z.avail_out;
+		job->adler[seg] = adler32(adler32(0, NULL, 0), in, (uInt)len);
+	} else {
+		free(out);
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+	}
+	deflateEnd(&z);
+}
+
+// Writes one PNG chunk: length, type, data and the CRC of type and data
+static bool png_out_chunk(FILE *f, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t head[8], crc[4];
+	qoi_write32be(head, (uint32_t)len);
+	memcpy(head + 4, type, 4);
+	uLong c = crc32(crc32(0, NULL, 0), head + 4, 4);
+	if (len > 0)
+		c = crc32(c, data, (uInt)len);
+	qoi_write32be(crc, (uint32_t)c);
+	return output_write(head, sizeof(head), f) == sizeof(head) &&
+		   (len == 0 || output_write(data, len, f) == len) &&
+		   output_write(crc, sizeof(crc), f) == sizeof(crc);
+}
+
+static bool png_sink_band(struct png_sink *s, const uint8_t *src, int rows)
+{
+	size_t frow = png_filtered_rowbytes(s);
+	size_t segments = (size_t)((rows + s->seg_rows - 1) / s->seg_rows);
+	struct png_segment_job job = { .s = s, .src = src, .rows = rows, .last = s->band_y + rows == s->height };
+	atomic_init(&job.failed, false);
+	job.out = calloc(segments, sizeof(*job.out));
+	job.out_size = calloc(segments, sizeof(*job.out_size));
+	job.adler = calloc(segments, sizeof(*job.adler));
+	bool ok = job.out && job.out_size && job.adler;
+	if (ok) {
+		parallel_for(segments, (int)s->slots, png_filter_segment, &job);
+		ok = !atomic_load(&job.failed);
+	}
+	if (ok) {
+		parallel_for(segments, (int)s->slots, png_deflate_segment, &job);
+		ok = !atomic_load(&job.failed);
+	}
+
+	for (size_t i = 0; ok && i < segments; i++) {
+		uint8_t *data = job.out[i] + 2;
+		size_t size = job.out_size[i];
+		int rows_in = rows - (int)i * s->seg_rows < s->seg_rows ? rows - (int)i * s->seg_rows : s->seg_rows;
+		s->adler = adler32_combine(s->adler, job.adler[i], (z_off_t)((size_t)rows_in * frow));
+		if (s->band_y == 0 && i == 0) {
+			// zlib header: 32 KiB window, FLEVEL as zlib itself would set it
+			int flevel = s->codec.strategy >= Z_HUFFMAN_ONLY || s->codec.level < 2 ? 0 :
+						 s->codec.level < 6 ? 1 : s->codec.level == 6 ? 2 : 3;
+			unsigned header = 0x7800u | (unsigned)flevel << 6;
+			header += 31 - header % 31;
+			data -= 2;
+			data[0] = (uint8_t)(header >> 8);
+			data[1] = (uint8_t)header;
+			size += 2;
+		}
+		if (job.last && i == segments - 1) {
+			qoi_write32be(data + size, (uint32_t)s->adler);
+			size += 4;
+		}
+		ok = png_out_chunk(s->f, "IDAT", data, size);
+	}
+
+	if (ok) {
+		// The next band's window and the row above its first row. Only the
+		// image's last band can be shorter than a window.
+		size_t band_bytes = (size_t)rows * frow;
+		s->dict_len = band_bytes < PNG_WINDOW_BYTES ? band_bytes : PNG_WINDOW_BYTES;
+		memcpy(s->dict + PNG_WINDOW_BYTES - s->dict_len, s->filtered + band_bytes - s->dict_len, s->dict_len);
+		memcpy(s->prev_row, src + (size_t)(rows - 1) * s->rowbytes, s->rowbytes);
+	}
+
+	if (job.out) {
+		for (size_t i = 0; i < segments; i++)
+			free(job.out[i]);
+	}
+	free(job.out);
+	free(job.out_size);
+	free(job.adler);
+	return ok;
+}
+
+// Rows are gathered into bands of slots segments as in the JPEG sink; a band
+// that arrives in one write is filtered from the caller's rows without the copy
+static bool png_sink_write_parallel(struct png_sink *s, const uint8_t *rows, int count)
+{
+	if (count > s->height - s->band_y - s->fill) {
+		s->failed = true;
+		return false;
+	}
+
+	int left = count;
+	while (left > 0) {
+		int want = s->height - s->band_y < s->band_rows ? s->height - s->band_y : s->band_rows;
+		const uint8_t *band = NULL;
+		if (s->fill == 0 && left >= want) {
+			band = rows;
+			rows += (size_t)want * s->rowbytes;
+			left -= want;
+		} else {
+			int n = want - s->fill < left ? want - s->fill : left;
+			memcpy(s->buf + (size_t)s->fill * s->rowbytes, rows, (size_t)n * s->rowbytes);
+			rows += (size_t)n * s->rowbytes;
+			left -= n;
+			s->fill += n;
+			if (s->fill == want)
+				band = s->buf;
+		}
+		if (!band)
+			continue;
+		if (!png_sink_band(s, band, want)) {
+			s->failed = true;
+			return false;
+		}
+		s->band_y += want;
+		s->fill = 0;
+	}
+	return true;
+}
+
+static bool png_sink_write(struct row_sink *dst, const uint8_t *rows, int count)
+{
+	struct png_sink *s = (struct png_sink *)dst;
+	if (s->failed)
+		return false;
+	if (s->parallel)
+		return png_sink_write_parallel(s, rows, count);
+
+	if (setjmp(png_jmpbuf(s->png))) {
+		s->failed = true;
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+		png_write_row(s->png, rows + (size_t)i * s->rowbytes);
+	return true;
+}
+
+static void png_sink_free(struct png_sink *s)
+{
+	png_destroy_write_struct(&s->png, &s->info);
+	pool_free(s->buf);
+	pool_free(s->filtered);
+	pool_free(s->prev_row);
+	pool_free(s->dict);
+	free(s);
+}
+
+static bool png_sink_close(struct row_sink *dst)
+{
+	struct png_sink *s = (struct png_sink *)dst;
+	if (s->parallel) {
+		if (!s->failed && (s->band_y != s->height || !png_out_chunk(s->f, "IEND", NULL, 0)))
+			s->failed = true;
+	} else if (!s->failed) {
+		if (setjmp(png_jmpbuf(s->png)))
+			s->failed = true;
+		else
+			png_write_end(s->png, NULL);
+	}
+	if (fflush(s->f) != 0)
+		s->failed = true;
+	bool ok = !s->failed;
+	png_sink_free(s);
+	return ok;
+}
+
+static void png_sink_abort(struct row_sink *dst)
+{
+	png_sink_free((struct png_sink *)dst);
+}
+
+// Sets up parallel mode if it is on and worth it (at least two segments), and
+// writes the signature and IHDR
+static bool png_sink_init_parallel(struct png_sink *s, int width)
+{
+	s->slots = (size_t)codec_thread_count();
+	size_t frow = png_filtered_rowbytes(s);
+	if (!png_parallel || s->slots < 2 || frow > PNG_SEGMENT_BYTES)
+		return true;
+	// Whole segments are at least a window long, so each primes the next
+	s->seg_rows = (int)((PNG_SEGMENT_BYTES + frow - 1) / frow);
+	if (s->height < 2 * s->seg_rows)
+		return true;
+
+	if (s->slots > (size_t)((s->height + s->seg_rows - 1) / s->seg_rows))
+		s->slots = (size_t)((s->height + s->seg_rows - 1) / s->seg_rows);
+	s->band_rows = (int)s->slots * s->seg_rows;
+	size_t band_bytes = (size_t)s->band_rows * s->rowbytes;
+	size_t filtered_bytes = (size_t)s->band_rows * frow;
+	s->buf = pool_alloc(band_bytes);
+	s->filtered = pool_alloc(filtered_bytes);
+	s->prev_row = pool_alloc(s->rowbytes);
+	s->dict = pool_alloc(PNG_WINDOW_BYTES);
+	if (!s->buf || !s->filtered || !s->prev_row || !s->dict)
+		return false;
+	stats_alloc(band_bytes + filtered_bytes);
+	s->adler = adler32(0, NULL, 0);
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	uint8_t ihdr[13];
+	qoi_write32be(ihdr, (uint32_t)width);
+	qoi_write32be(ihdr + 4, (uint32_t)s->height);
+	ihdr[8] = 8;
+	ihdr[9] = s->channels == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	if (output_write(signature, sizeof(signature), s->f) != sizeof(signature) ||
+		!png_out_chunk(s->f, "IHDR", ihdr, sizeof(ihdr)))
+		return false;
+	s->parallel = true;
+	return true;
+}
+
+static struct row_sink *png_sink_open(FILE *f, int width, int height, int channels,
+									  const struct encode_opts *opts)
+{
+	struct image hdr = { .width = width, .height = height, .channels = channels };
+	if (!image_validate_dims(&hdr))
+		return NULL;
+
+	struct png_sink *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+
+	if (!checked_mul_size((size_t)width, (size_t)channels, &s->rowbytes)) {
+		free(s);
+		return NULL;
+	}
+
+	s->f = f;
+	s->height = height;
+	s->channels = channels;
+	s->codec = png_codec_for(opts);
+	if (!png_sink_init_parallel(s, width)) {
+		png_sink_free(s);
+		return NULL;
+	}
+
+	if (!s->parallel) {
+		s->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (!s->png) {
+			png_sink_free(s);
+			return NULL;
+		}
+
+		s->info = png_create_info_struct(s->png);
+		if (!s->info) {
+			png_sink_free(s);
+			return NULL;
+		}
+
+		if (setjmp(png_jmpbuf(s->png))) {
+			png_sink_free(s);
+			return NULL;
+		}
+
+		png_init_io(s->png, s->f);
+		png_set_compression_level(s->png, s->codec.level);
+		png_set_compression_strategy(s->png, s->codec.strategy);
+		// libpng's filter flags are PNG_FILTER_NONE (0x08) and up
+		png_set_filter(s->png, PNG_FILTER_TYPE_BASE, (int)(s->codec.filters << 3));
+
+		int color_type = (channels == 4) ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+		png_set_IHDR(s->png, s->info, (png_uint_32)width, (png_uint_32)height, 8, color_type,
+					 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_write_info(s->png, s->info);
+	}
+
+	s->base.write = png_sink_write;
+	s->base.close = png_sink_close;
+	s->base.abort = png_sink_abort;
+	return &s->base;
+}
+
+static bool png_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	return image_write_rows(png_sink_open(f, img->width, img->height, img->channels, opts), img);
+}
+
+// ============================================================================
+// JPEG
+// ============================================================================
+
+// libjpeg's default error_exit calls exit(), which would take down every other
+// conversion in batch mode; jump back to the caller instead.
+struct jpeg_error_ctx {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error_ctx *ctx = (struct jpeg_error_ctx *)cinfo->err;
+	longjmp(ctx->jmp, 1);
+}
+
+// Rows handed to libjpeg per call. At least rec_outbuf_height (at most 2 with
+// merged upsampling), so it can write a whole row group straight into our
+// rows instead of through its spare row buffer, and fewer calls.
+#define JPEG_BATCH_ROWS 16
+
+// libjpeg-turbo converts straight from RGBX (skipping the alpha byte) in its
+// SIMD colour converter; plain libjpeg gets alpha-stripped RGB rows
+#ifdef JCS_EXTENSIONS
+#define JPEG_STRIP_ALPHA 0
+#else
+#define JPEG_STRIP_ALPHA 1
+#endif
+
+static void jpeg_set_decode_params(struct jpeg_decompress_struct *cinfo)
+{
+	cinfo->out_color_space = JCS_RGB;
+	if (jpeg_fast) {
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->do_fancy_upsampling = FALSE;
+	}
+}
+
+// Reads up to count rows into consecutive rows of rowbytes; 0 on a stall
+static JDIMENSION jpeg_read_rows(struct jpeg_decompress_struct *cinfo, uint8_t *rows, size_t rowbytes, int count)
+{
+	JSAMPROW ptrs[JPEG_BATCH_ROWS];
+	int n = count < JPEG_BATCH_ROWS ? count : JPEG_BATCH_ROWS;
+	for (int i = 0; i < n; i++)
+		ptrs[i] = rows + (size_t)i * rowbytes;
+	return jpeg_read_scanlines(cinfo, ptrs, (JDIMENSION)n);
+}
+
+#ifdef IMGCONV_CLI
+// Picks the largest 1/2^n DCT-domain downscale (n <= 3) that keeps the image
+// at least as large as the target size, so the resampler only has to finish
+// the job from at most twice the final size. Records that target size on img
+// for image_resize().
+static unsigned jpeg_scale_denom(const struct jpeg_decompress_struct *cinfo, const struct encode_opts *opts,
+								 struct image *img)
+{
+	int tw, th;
+	if (cinfo->image_width > (JDIMENSION)INT_MAX || cinfo->image_height > (JDIMENSION)INT_MAX ||
+		!image_target_size(opts, (int)cinfo->image_width, (int)cinfo->image_height, &tw, &th))
+		return 1;
+	img->target_width = tw;
+	img->target_height = th;
+	unsigned denom = 8;
+	while (denom > 1 && ((cinfo->image_width + denom - 1) / denom < (JDIMENSION)tw ||
+						 (cinfo->image_height + denom - 1) / denom < (JDIMENSION)th))
+		denom /= 2;
+	return denom;
+}
+#endif
+
+// Header probe: walks the marker segments to the first frame header (SOFn)
+static bool jpeg_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+		return false;
+	size_t pos = 2;
+	while (pos + 4 <= size) {
+		if (data[pos] != 0xFF)
+			return false;
+		uint8_t marker = data[pos + 1];
+		if (marker == 0xFF) {       // fill byte
+			pos++;
+			continue;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			pos += 2;               // standalone: TEM, RSTn
+			continue;
+		}
+		if (marker == 0xD9 || marker == 0xDA)
+			return false;           // EOI or SOS before any frame header
+		size_t len = (size_t)data[pos + 2] << 8 | data[pos + 3];
+		if (len < 2 || len > size - pos - 2)
+			return false;
+		bool sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+		if (sof) {
+			if (len < 8)
+				return false;
+			const uint8_t *f = data + pos + 4;
+			img->height = f[1] << 8 | f[2];
+			img->width = f[3] << 8 | f[4];
+			img->channels = 3;  // JPEG doesn't support alpha
+			if (img->width == 0 || img->height == 0)
+				return false;   // height from a DNL marker is not supported
+			return image_check_max_pixels(img->width, img->height);
+		}
+		pos += 2 + len;
+	}
+	return false;
+}
+
+static bool jpeg_decode(const uint8_t *data, size_t size, struct image *img, const struct encode_opts *opts)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	img->pixels = NULL;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		image_free(img);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, data, (unsigned long)size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	jpeg_set_decode_params(&cinfo);
+	cinfo.scale_num = 1;
+#ifdef IMGCONV_CLI
+	cinfo.scale_denom = jpeg_scale_denom(&cinfo, opts, img);
+#else
+	(void)opts;
+#endif
+	jpeg_start_decompress(&cinfo);
+
+	if (cinfo.output_width > (JDIMENSION)INT_MAX || cinfo.output_height > (JDIMENSION)INT_MAX) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	img->width = (int)cinfo.output_width;
+	img->height = (int)cinfo.output_height;
+	img->channels = 3;  // JPEG doesn't support alpha
+
+	if (!image_validate_dims(img)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	if (!image_check_max_pixels(img->width, img->height)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	size_t rowbytes;
+	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JDIMENSION y = cinfo.output_scanline;
+		if (jpeg_read_rows(&cinfo, img->pixels + y * rowbytes, rowbytes, (int)(cinfo.output_height - y)) == 0)
+			break;
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+}
+
+#ifdef IMGCONV_CLI
+struct jpeg_source {
+	struct row_source base;
+	FILE *f;
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+};
+
+static bool jpeg_source_read(struct row_source *src, uint8_t *rows, int count)
+{
+	struct jpeg_source *s = (struct jpeg_source *)src;
+	size_t rowbytes = row_source_rowbytes(src);
+
+	if (setjmp(s->jerr.jmp))
+		return false;
+	int done = 0;
+	while (done < count) {
+		JDIMENSION n = jpeg_read_rows(&s->cinfo, rows + (size_t)done * rowbytes, rowbytes, count - done);
+		if (n == 0)
+			return false;
+		done += (int)n;
+	}
+	return true;
+}
+
+static void jpeg_source_close(struct row_source *src)
+{
+	struct jpeg_source *s = (struct jpeg_source *)src;
+	jpeg_destroy_decompress(&s->cinfo);
+	fclose(s->f);
+	free(s);
+}
+
+// Takes ownership of f, which is closed on failure too
+static struct row_source *jpeg_source_open_file(FILE *f)
+{
+	struct jpeg_source *s = calloc(1, sizeof(*s));
+	if (!s) {
+		fclose(f);
+		return NULL;
+	}
+	s->f = f;
+
+	s->cinfo.err = jpeg_std_error(&s->jerr.pub);
+	s->jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(s->jerr.jmp)) {
+		jpeg_source_close(&s->base);
+		return NULL;
+	}
+	jpeg_create_decompress(&s->cinfo);
+	jpeg_stdio_src(&s->cinfo, s->f);
+	jpeg_read_header(&s->cinfo, TRUE);
+
+	jpeg_set_decode_params(&s->cinfo);
+	jpeg_start_decompress(&s->cinfo);
+
+	if (s->cinfo.output_width == 0 || s->cinfo.output_height == 0 ||
+		s->cinfo.output_width > (JDIMENSION)INT_MAX || s->cinfo.output_height > (JDIMENSION)INT_MAX ||
+		!image_check_max_pixels((int)s->cinfo.output_width, (int)s->cinfo.output_height)) {
+		jpeg_source_close(&s->base);
+		return NULL;
+	}
+
+	s->base.width = (int)s->cinfo.output_width;
+	s->base.height = (int)s->cinfo.output_height;
+	s->base.channels = 3;  // JPEG doesn't support alpha
+	s->base.read = jpeg_source_read;
+	s->base.close = jpeg_source_close;
+	return &s->base;
+}
+
+static struct row_source *jpeg_source_open(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	return f ? jpeg_source_open_file(f) : NULL;
+}
+#endif
+
+// Compression parameters shared by the serial sink and the parallel segments
+static void jpeg_set_params(struct jpeg_compress_struct *cinfo, int width, int height, int channels,
+							const struct encode_opts *opts)
+{
+	cinfo->image_width = (JDIMENSION)width;
+	cinfo->image_height = (JDIMENSION)height;
+	if (channels == 4 && !JPEG_STRIP_ALPHA) {
+#ifdef JCS_EXTENSIONS
+		cinfo->input_components = 4;
+		cinfo->in_color_space = JCS_EXT_RGBX;
+#endif
+	} else {
+		cinfo->input_components = 3;
+		cinfo->in_color_space = JCS_RGB;
+	}
+
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, opts->quality, TRUE);
+	if (opts->chroma != CHROMA_DEFAULT) {
+		// Cb and Cr stay 1x1; luma sampling sets the ratio
+		cinfo->comp_info[0].h_samp_factor = 1 << chroma_shift_x(opts->chroma);
+		cinfo->comp_info[0].v_samp_factor = 1 << chroma_shift_y(opts->chroma);
+	}
+	if (opts->effort >= 0) {
+		// Low effort: fast integer DCT. Higher: optimized Huffman tables,
+		// then progressive scans (both buffer the coefficients in libjpeg).
+		cinfo->dct_method = opts->effort <= 2 ? JDCT_IFAST : JDCT_ISLOW;
+		cinfo->optimize_coding = opts->effort >= 5;
+		if (opts->effort >= 9)
+			jpeg_simple_progression(cinfo);
+	}
+}
+
+// Feeds count rows of width x channels to the compressor, JPEG_BATCH_ROWS
+// per call. rgb_row is one RGB row, needed only for 4 channels when
+// JPEG_STRIP_ALPHA is set.
+static void jpeg_write_rows(struct jpeg_compress_struct *cinfo, const uint8_t *rows, int count, int width,
+							int channels, uint8_t *rgb_row)
+{
+	size_t rowbytes = (size_t)width * (size_t)channels;
+	if (channels == 4 && JPEG_STRIP_ALPHA) {
+		for (int y = 0; y < count; y++) {
+			enum stats_stage prev = stats_enter(STAGE_CONVERT);
+			px_rgba_to_rgb(rgb_row, rows + (size_t)y * rowbytes, (size_t)width);
+			stats_leave(prev);
+			JSAMPROW row = rgb_row;
+			jpeg_write_scanlines(cinfo, &row, 1);
+		}
+		return;
+	}
+
+	JSAMPROW ptrs[JPEG_BATCH_ROWS];
+	int done = 0;
+	while (done < count) {
+		int n = count - done < JPEG_BATCH_ROWS ? count - done : JPEG_BATCH_ROWS;
+		for (int i = 0; i < n; i++)
+			ptrs[i] = (JSAMPROW)(rows + (size_t)(done + i) * rowbytes);
+		JDIMENSION wrote = jpeg_write_scanlines(cinfo, ptrs, (JDIMENSION)n);
+		if (wrote == 0)
+			break;  // suspended; only possible with a suspending destination
+		done += (int)wrote;
+	}
+}
+
+// --jpeg-parallel cuts the image into segments of whole MCU rows, each
+// compressed by its own libjpeg instance with a restart marker after every
+// MCU row. Restart markers reset the entropy coder and the DC predictors, so
+// the segments' scan data can be joined with one more marker in between: the
+// result is the single baseline JPEG a serial encoder with the same restart
+// interval would produce. Segments span a multiple of 8 MCU rows, so each
+// one's own RST0-RST7 numbering already matches its place in the file.
+// Needs the standard Huffman tables, so --effort 5 and up stays serial.
+#define JPEG_SEGMENT_PIXELS  ((size_t)1 << 20)
+
+struct jpeg_sink {
+	struct row_sink base;
+	FILE *f;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+	int width;
+	int height;
+	int channels;
+	uint8_t *rgb_row;  // alpha-stripped row for 4-channel input (JPEG_STRIP_ALPHA)
+	bool failed;
+
+	// Parallel mode only
+	bool parallel;
+	struct encode_opts opts;
+	size_t slots;
+	int mcu_rows;       // rows per MCU row
+	int seg_rows;       // rows per segment
+	uint8_t *buf;       // one band of slots segments
+	int band_rows;
+	int band_y;         // first row of the band being gathered
+	int fill;           // rows gathered for it
+};
+
+struct jpeg_segment_job {
+	const struct jpeg_sink *s;
+	const uint8_t *src;     // first row of the band
+	int rows;               // rows in the band
+	uint8_t **out;          // per segment, from jpeg_mem_dest()
+	unsigned long *out_size;
+	atomic_bool failed;
+};
+
+static void jpeg_encode_segment(void *ctx, size_t seg)
+{
+	struct jpeg_segment_job *job = ctx;
+	const struct jpeg_sink *s = job->s;
+	int y0 = (int)seg * s->seg_rows;
+	int rows = job->rows - y0 < s->seg_rows ? job->rows - y0 : s->seg_rows;
+	size_t rowbytes = (size_t)s->width * (size_t)s->channels;
+	bool strip = s->channels == 4 && JPEG_STRIP_ALPHA;
+	uint8_t *rgb_row = strip ? pool_alloc((size_t)s->width * 3) : NULL;
+	if (strip && !rgb_row) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_compress(&cinfo);
+		pool_free(rgb_row);
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &job->out[seg], &job->out_size[seg]);
+	jpeg_set_params(&cinfo, s->width, rows, s->channels, &s->opts);
+	cinfo.restart_in_rows = 1;
+	jpeg_start_compress(&cinfo, TRUE);
+	jpeg_write_rows(&cinfo, job->src + (size_t)y0 * rowbytes, rows, s->width, s->channels, rgb_row);
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	pool_free(rgb_row);
+}
+
+// Finds the frame header and the scan data in one segment's JPEG; the scan
+// data runs from *scan to the EOI marker
+static bool jpeg_segment_split(const uint8_t *data, size_t size, size_t *sof, size_t *scan)
+{
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8 || data[size - 2] != 0xFF || data[size - 1] != 0xD9)
+		return false;
+	*sof = 0;
+	size_t pos = 2;
+	while (pos + 4 <= size - 2) {
+		if (data[pos] != 0xFF)
+			return false;
+		uint8_t marker = data[pos + 1];
+		size_t len = (size_t)data[pos + 2] << 8 | data[pos + 3];
+		if (len < 2 || len > size - 2 - pos - 2)
+			return false;
+		if (marker == 0xC0 && len >= 8)
+			*sof = pos;
+		pos += 2 + len;
+		if (marker == 0xDA) {
+			*scan = pos;
+			return *sof != 0;
+		}
+	}
+	return false;
+}
+
+static bool jpeg_sink_band(struct jpeg_sink *s, const uint8_t *src, int rows)
+{
+	size_t segments = (size_t)((rows + s->seg_rows - 1) / s->seg_rows);
+	struct jpeg_segment_job job = { .s = s, .src = src, .rows = rows };
+	atomic_init(&job.failed, false);
+	job.out = calloc(segments, sizeof(*job.out));
+	job.out_size = calloc(segments, sizeof(*job.out_size));
+	bool ok = job.out && job.out_size;
+	if (ok) {
+		parallel_for(segments, (int)s->slots, jpeg_encode_segment, &job);
+		ok = !atomic_load(&job.failed);
+	}
+
+	for (size_t i = 0; ok && i < segments; i++) {
+		uint8_t *data = job.out[i];
+		size_t size = job.out_size[i], sof, scan;
+		if (!jpeg_segment_split(data, size, &sof, &scan)) {
+			ok = false;
+			break;
+		}
+		int y = s->band_y + (int)i * s->seg_rows;
+		if (y == 0) {
+			// The first segment's headers serve for the whole image
+			data[sof + 5] = (uint8_t)(s->height >> 8);
+			data[sof + 6] = (uint8_t)s->height;
+			ok = output_write(data, scan, s->f) == scan;
+		} else {
+			uint8_t rst[2] = { 0xFF, (uint8_t)(0xD0 + (y / s->mcu_rows + 7) % 8) };
+			ok = output_write(rst, sizeof(rst), s->f) == sizeof(rst);
+		}
+		size_t len = size - 2 - scan;
+		ok = ok && output_write(data + scan, len, s->f) == len;
+	}
+
+	if (job.out) {
+		for (size_t i = 0; i < segments; i++)
+			free(job.out[i]);
+	}
+	free(job.out);
+	free(job.out_size);
+	return ok;
+}
+
+// Rows are gathered into bands of slots segments, as in the TIFF sink; a band
+// that arrives in one write is encoded from the caller's rows without the copy
+static bool jpeg_sink_write_parallel(struct jpeg_sink *s, const uint8_t *rows, int count)
+{
+	size_t rowbytes = (size_t)s->width * (size_t)s->channels;
+	if (count > s->height - s->band_y - s->fill) {
+		s->failed = true;
+		return false;
+	}
+
+	int left = count;
+	while (left > 0) {
+		int want = s->height - s->band_y < s->band_rows ? s->height - s->band_y : s->band_rows;
+		const uint8_t *band = NULL;
+		if (s->fill == 0 && left >= want) {
+			band = rows;
+			rows += (size_t)want * rowbytes;
+			left -= want;
+		} else {
+			int n = want - s->fill < left ? want - s->fill : left;
+			memcpy(s->buf + (size_t)s->fill * rowbytes, rows, (size_t)n * rowbytes);
+			rows += (size_t)n * rowbytes;
+			left -= n;
+			s->fill += n;
+			if (s->fill == want)
+				band = s->buf;
+		}
+		if (!band)
+			continue;
+		if (!jpeg_sink_band(s, band, want)) {
+			s->failed = true;
+			return false;
+		}
+		s->band_y += want;
+		s->fill = 0;
+	}
+	return true;
+}
+
+static bool jpeg_sink_write(struct row_sink *dst, const uint8_t *rows, int count)
+{
+	struct jpeg_sink *s = (struct jpeg_sink *)dst;
+	if (s->failed)
+		return false;
+	if (s->parallel)
+		return jpeg_sink_write_parallel(s, rows, count);
+
+	if (setjmp(s->jerr.jmp)) {
+		s->failed = true;
+		return false;
+	}
+
+	jpeg_write_rows(&s->cinfo, rows, count, s->width, s->channels, s->rgb_row);
+	return true;
+}
+
+static void jpeg_sink_free(struct jpeg_sink *s)
+{
+	jpeg_destroy_compress(&s->cinfo);
+	pool_free(s->rgb_row);
+	pool_free(s->buf);
+	free(s);
+}
+
+static bool jpeg_sink_close(struct row_sink *dst)
+{
+	struct jpeg_sink *s = (struct jpeg_sink *)dst;
+	if (s->parallel) {
+		static const uint8_t eoi[2] = { 0xFF, 0xD9 };
+		if (!s->failed && (s->band_y != s->height || output_write(eoi, sizeof(eoi), s->f) != sizeof(eoi)))
+			s->failed = true;
+	} else if (!s->failed) {
+		if (setjmp(s->jerr.jmp))
+			s->failed = true;
+		else
+			jpeg_finish_compress(&s->cinfo);
+	}
+	if (fflush(s->f) != 0)
+		s->failed = true;
+	bool ok = !s->failed;
+	jpeg_sink_free(s);
+	return ok;
+}
+
+static void jpeg_sink_abort(struct row_sink *dst)
+{
+	jpeg_sink_free((struct jpeg_sink *)dst);
+}
+
+// Sets up parallel mode if it is on and worth it: at least two segments and
+// a serial encode would not need optimized tables or progressive scans
+static bool jpeg_sink_init_parallel(struct jpeg_sink *s, const struct encode_opts *opts)
+{
+	s->slots = (size_t)codec_thread_count();
+	if (!jpeg_parallel || s->slots < 2 || opts->effort >= 5 || s->width > JPEG_MAX_DIMENSION ||
+		s->height > JPEG_MAX_DIMENSION)
+		return true;
+
+	int max_v = 1;
+	for (int i = 0; i < s->cinfo.num_components; i++) {
+		if (s->cinfo.comp_info[i].v_samp_factor > max_v)
+			max_v = s->cinfo.comp_info[i].v_samp_factor;
+	}
+	s->mcu_rows = max_v * DCTSIZE;
+	int step = s->mcu_rows * 8;
+	size_t steps = JPEG_SEGMENT_PIXELS / ((size_t)s->width * (size_t)step) + 1;
+	if (steps > (size_t)(s->height / step))
+		steps = (size_t)(s->height / step);
+	s->seg_rows = (int)steps * step;
+	if (s->seg_rows == 0 || s->height < 2 * s->seg_rows)
+		return true;
+
+	if (s->slots > (size_t)((s->height + s->seg_rows - 1) / s->seg_rows))
+		s->slots = (size_t)((s->height + s->seg_rows - 1) / s->seg_rows);
+	s->band_rows = (int)s->slots * s->seg_rows;
+	size_t band_bytes = (size_t)s->band_rows * (size_t)s->width * (size_t)s->channels;
+	s->buf = pool_alloc(band_bytes);
+	if (!s->buf)
+		return false;
+	stats_alloc(band_bytes);
+	s->opts = *opts;
+	s->parallel = true;
+	return true;
+}
+
+static struct row_sink *jpeg_sink_open(FILE *f, int width, int height, int channels,
+									   const struct encode_opts *opts)
+{
+	struct image hdr = { .width = width, .height = height, .channels = channels };
+	if (!image_validate_dims(&hdr))
+		return NULL;
+	size_t src_rowbytes;
+	if (!checked_mul_size((size_t)width, (size_t)channels, &src_rowbytes))
+		return NULL;
+
+	struct jpeg_sink *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->width = width;
+	s->height = height;
+	s->channels = channels;
+
+	if (channels == 4 && JPEG_STRIP_ALPHA) {
+		size_t rgb_rowbytes;
+		if (!checked_mul_size((size_t)width, 3, &rgb_rowbytes)) {
+			free(s);
+			return NULL;
+		}
+		s->rgb_row = pool_alloc(rgb_rowbytes);
+		if (!s->rgb_row) {
+			free(s);
+			return NULL;
+		}
+	}
+
+	s->f = f;
+
+	s->cinfo.err = jpeg_std_error(&s->jerr.pub);
+	s->jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(s->jerr.jmp)) {
+		jpeg_sink_free(s);
+		return NULL;
+	}
+	jpeg_create_compress(&s->cinfo);
+	jpeg_set_params(&s->cinfo, width, height, channels, opts);
+	if (!jpeg_sink_init_parallel(s, opts)) {
+		jpeg_sink_free(s);
+		return NULL;
+	}
+	if (!s->parallel) {
+		jpeg_stdio_dest(&s->cinfo, s->f);
+		jpeg_start_compress(&s->cinfo, TRUE);
+	}
+
+	s->base.write = jpeg_sink_write;
+	s->base.close = jpeg_sink_close;
+	s->base.abort = jpeg_sink_abort;
+	return &s->base;
+}
+
+static bool jpeg_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	return image_write_rows(jpeg_sink_open(f, img->width, img->height, img->channels, opts), img);
+}
+
+#ifdef IMGCONV_CLI
+// Subsampling of a YCbCr JPEG that raw data I/O can take as is: Cb and Cr at
+// 1x1 and luma at 2x2, 2x1 or 1x1. CHROMA_DEFAULT for anything else (4:4:0,
+// 4:1:1, grey, CMYK, RGB).
+static enum chroma_subsampling jpeg_chroma(const struct jpeg_decompress_struct *cinfo)
+{
+	if (cinfo->num_components != 3 || cinfo->jpeg_color_space != JCS_YCbCr)
+		return CHROMA_DEFAULT;
+	const jpeg_component_info *c = cinfo->comp_info;
+	for (int i = 1; i < 3; i++) {
+		if (c[i].h_samp_factor != 1 || c[i].v_samp_factor != 1)
+			return CHROMA_DEFAULT;
+	}
+	if (c[0].h_samp_factor == 2 && c[0].v_samp_factor == 2)
+		return CHROMA_420;
+	if (c[0].h_samp_factor == 2 && c[0].v_samp_factor == 1)
+		return CHROMA_422;
+	if (c[0].h_samp_factor == 1 && c[0].v_samp_factor == 1)
+		return CHROMA_444;
+	return CHROMA_DEFAULT;
+}
+
+// Row pointers into each plane for the iMCU row holding luma row y
+static void jpeg_raw_rows(const jpeg_component_info *comp, const struct yuv_image *yuv, int max_v, int y,
+						  JSAMPROW rows[3][2 * DCTSIZE])
+{
+	for (int p = 0; p < 3; p++) {
+		int v = comp[p].v_samp_factor;
+		size_t y0 = (size_t)(y / (max_v * DCTSIZE)) * (size_t)(v * DCTSIZE);
+		for (int i = 0; i < v * DCTSIZE; i++)
+			rows[p][i] = yuv->planes[p] + (y0 + (size_t)i) * yuv->strides[p];
+	}
+}
+
+// Decodes the Y'CbCr planes as stored, skipping colour conversion and chroma
+// upsampling (raw_data_out). Fails for JPEGs jpeg_chroma() turns down, or
+// whose subsampling is not `want` (unless that is CHROMA_DEFAULT).
+static bool jpeg_decode_yuv(const uint8_t *data, size_t size, struct yuv_image *yuv,
+							enum chroma_subsampling want)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	*yuv = (struct yuv_image){0};
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		yuv_image_free(yuv);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, data, (unsigned long)size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	yuv->chroma = jpeg_chroma(&cinfo);
+	if (yuv->chroma == CHROMA_DEFAULT || (want != CHROMA_DEFAULT && want != yuv->chroma) ||
+		cinfo.image_width > (JDIMENSION)INT_MAX || cinfo.image_height > (JDIMENSION)INT_MAX) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	cinfo.raw_data_out = TRUE;
+	cinfo.out_color_space = JCS_YCbCr;
+	if (jpeg_fast)
+		cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+
+	yuv->width = (int)cinfo.output_width;
+	yuv->height = (int)cinfo.output_height;
+	if (!yuv_image_alloc(yuv)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	JSAMPROW rows[3][2 * DCTSIZE];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	int imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+	while (cinfo.output_scanline < cinfo.output_height) {
+		jpeg_raw_rows(cinfo.comp_info, yuv, cinfo.max_v_samp_factor, (int)cinfo.output_scanline, rows);
+		if (jpeg_read_raw_data(&cinfo, planes, (JDIMENSION)imcu_rows) == 0)
+			break;
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	yuv_image_pad(yuv);
+	return true;
+}
+
+// Compresses the planes as they are (raw_data_in), keeping their subsampling
+static bool jpeg_encode_yuv(FILE *f, const struct yuv_image *yuv, const struct encode_opts *opts)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_ctx jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_compress(&cinfo);
+		return false;
+	}
+	jpeg_create_compress(&cinfo);
+	struct encode_opts o = *opts;
+	o.chroma = yuv->chroma;
+	jpeg_set_params(&cinfo, yuv->width, yuv->height, 3, &o);
+	cinfo.in_color_space = JCS_YCbCr;
+	cinfo.raw_data_in = TRUE;
+	jpeg_stdio_dest(&cinfo, f);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	JSAMPROW rows[3][2 * DCTSIZE];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	int imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+	while (cinfo.next_scanline < cinfo.image_height) {
+		jpeg_raw_rows(cinfo.comp_info, yuv, cinfo.max_v_samp_factor, (int)cinfo.next_scanline, rows);
+		if (jpeg_write_raw_data(&cinfo, planes, (JDIMENSION)imcu_rows) == 0) {
+			jpeg_destroy_compress(&cinfo);
+			return false;
+		}
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return true;
+}
+#endif
+
+// ============================================================================
+// WebP
+// ============================================================================
+
+#ifdef HAVE_WEBP
+// Decodes straight into a pool buffer (libwebp's own would need a copy to
+// join the pool), through its scaler if width x height is not the image size
+static bool webp_decode_into(const uint8_t *data, size_t size, struct image *img, int width, int height)
+{
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config))
+		return false;
+	config.options.use_scaling = width != img->width || height != img->height;
+	img->width = width;
+	img->height = height;
+	size_t rowbytes = (size_t)width * (size_t)img->channels;
+	if (!image_alloc_pixels(img, rowbytes))
+		return false;
+
+	config.options.scaled_width = width;
+	config.options.scaled_height = height;
+	config.options.use_threads = codec_thread_count() > 1;
+	config.output.colorspace = img->channels == 4 ? MODE_RGBA : MODE_RGB;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = img->pixels;
+	config.output.u.RGBA.stride = (int)rowbytes;
+	config.output.u.RGBA.size = rowbytes * (size_t)height;
+	if (WebPDecode(data, size, &config) != VP8_STATUS_OK) {
+		image_free(img);
+		return false;
+	}
+	return true;
+}
+
+static bool webp_decode(const uint8_t *data, size_t size, struct image *img, const struct encode_opts *opts)
+{
+	// Check if image has alpha
+	WebPBitstreamFeatures features;
+	if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) {
+		return false;
+	}
+
+	if (features.width <= 0 || features.height <= 0) {
+		return false;
+	}
+	if (!image_check_max_pixels(features.width, features.height)) {
+		return false;
+	}
+	img->width = features.width;
+	img->height = features.height;
+	img->channels = features.has_alpha ? 4 : 3;
+
+#ifdef IMGCONV_CLI
+	// libwebp's scaler averages like the box filter: it does the whole shrink
+	// for that, and otherwise gets within twice the target for the resampler
+	// to finish
+	int tw, th;
+	if (image_target_size(opts, img->width, img->height, &tw, &th) && tw <= img->width &&
+		th <= img->height) {
+		img->target_width = tw;
+		img->target_height = th;
+		if (opts->filter != RESAMPLE_BOX) {
+			tw = tw <= img->width / 2 ? tw * 2 : img->width;
+			th = th <= img->height / 2 ? th * 2 : img->height;
+		}
+		if (tw < img->width || th < img->height)
+			return webp_decode_into(data, size, img, tw, th);
+	}
+#else
+	(void)opts;
+#endif
+
+	return webp_decode_into(data, size, img, img->width, img->height);
+}
+
+static bool webp_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	WebPBitstreamFeatures features;
+	if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK ||
+		features.width <= 0 || features.height <= 0)
+		return false;
+	img->width = features.width;
+	img->height = features.height;
+	img->channels = features.has_alpha ? 4 : 3;
+	return image_check_max_pixels(img->width, img->height);
+}
+
+// Imports img into a YUVA picture that encodes only read, so several of them
+// (concurrent ones included) can share one colour conversion
+static bool webp_prepare(struct image *img, WebPPicture *pic)
+{
+	if (!image_validate_dims(img))
+		return false;
+	if (img->width > INT_MAX / img->channels || image_stride(img) > INT_MAX)
+		return false;
+	int stride = (int)image_stride(img);
+
+	if (!WebPPictureInit(pic))
+		return false;
+	pic->use_argb = 0;
+	pic->width = img->width;
+	pic->height = img->height;
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	int imported = img->channels == 4 ? WebPPictureImportRGBA(pic, img->pixels, stride)
+									  : WebPPictureImportRGB(pic, img->pixels, stride);
+	// WebPEncode() would flatten the colour under transparent areas in place;
+	// done once here, and the encodes then run with config.exact set
+	if (imported)
+		WebPCleanupTransparentArea(pic);
+	stats_leave(prev);
+	if (!imported) {
+		WebPPictureFree(pic);
+		return false;
+	}
+	return true;
+}
+
+static bool webp_encode_prepared(FILE *f, const WebPPicture *prep, const struct encode_opts *opts)
+{
+	WebPConfig config;
+	if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, (float)opts->quality))
+		return false;
+	if (opts->effort >= 0)
+		config.method = (opts->effort * 6 + 5) / 10;    // 0-10 -> 0-6
+	config.thread_level = codec_thread_count() > 1;
+	config.exact = 1;
+	if (!WebPValidateConfig(&config))
+		return false;
+
+	// A view shares the planes but not the writer and error fields
+	WebPPicture pic;
+	if (!WebPPictureView(prep, 0, 0, prep->width, prep->height, &pic))
+		return false;
+	WebPMemoryWriter writer;
+	WebPMemoryWriterInit(&writer);
+	pic.writer = WebPMemoryWrite;
+	pic.custom_ptr = &writer;
+	int encoded = WebPEncode(&config, &pic);
+	WebPPictureFree(&pic);
+	if (!encoded) {
+		WebPMemoryWriterClear(&writer);
+		return false;
+	}
+
+	bool ok = output_write(writer.mem, writer.size, f) == writer.size;
+	WebPMemoryWriterClear(&writer);
+
+	return ok;
+}
+
+static bool webp_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	WebPPicture pic;
+	if (!webp_prepare(img, &pic))
+		return false;
+	bool ok = webp_encode_prepared(f, &pic, opts);
+	WebPPictureFree(&pic);
+	return ok;
+}
+#endif
+
+// ============================================================================
+// BMP (no library needed)
+// ============================================================================
+
+#pragma pack(push, 1)
+struct bmp_file_header {
+	uint16_t type;
+	uint32_t size;
+	uint16_t reserved1;
+	uint16_t reserved2;
+	uint32_t offset;
+};
+
+struct bmp_info_header {
+	uint32_t size;
+	int32_t width;
+	int32_t height;
+	uint16_t planes;
+	uint16_t bit_count;
+	uint32_t compression;
+	uint32_t image_size;
+	int32_t x_pels_per_meter;
+	int32_t y_pels_per_meter;
+	uint32_t clr_used;
+	uint32_t clr_important;
+};
+#pragma pack(pop)
+
+// Pixel data layout, as parsed from the headers
+struct bmp_layout {
+	size_t offset;          // first row in file order
+	size_t bmp_rowbytes;    // padded row size in the file
+	bool top_down;
+};
+
+#define BMP_HEADER_SIZE (sizeof(struct bmp_file_header) + sizeof(struct bmp_info_header))
+
+// `data` holds at least the first BMP_HEADER_SIZE bytes of a file of file_size bytes
+static bool bmp_parse_header(const uint8_t *data, size_t file_size, struct image *img, struct bmp_layout *layout)
+{
+	struct bmp_file_header fh;
+	struct bmp_info_header ih;
+
+	if (file_size < BMP_HEADER_SIZE)
+		return false;
+	memcpy(&fh, data, sizeof(fh));
+	memcpy(&ih, data + sizeof(fh), sizeof(ih));
+
+	if (fh.type != 0x4D42)  // "BM"
+		return false;
+
+	// Only support uncompressed 24-bit or 32-bit BMPs
+	if (ih.compression != 0 || (ih.bit_count != 24 && ih.bit_count != 32))
+		return false;
+
+	if (ih.width <= 0 || ih.width > INT_MAX || ih.height == 0 || ih.height == INT32_MIN)
+		return false;
+
+	layout->top_down = ih.height < 0;
+	img->width = ih.width;
+	img->height = layout->top_down ? -ih.height : ih.height;
+	img->channels = (ih.bit_count == 32) ? 4 : 3;
+
+	if (!image_validate_dims(img))
+		return false;
+	if (!image_check_max_pixels(img->width, img->height))
+		return false;
+
+	// BMP rows are padded to 4-byte boundaries
+	size_t raw_rowbytes;
+	if (!checked_mul_size((size_t)img->width, (size_t)(ih.bit_count / 8), &raw_rowbytes))
+		return false;
+	size_t tmp_rowbytes;
+	if (!checked_add_size(raw_rowbytes, 3, &tmp_rowbytes))
+		return false;
+	layout->bmp_rowbytes = tmp_rowbytes & ~(size_t)3;
+
+	// Every row, padding included, must be inside the file
+	size_t pixel_bytes, end;
+	if (!checked_mul_size(layout->bmp_rowbytes, (size_t)img->height, &pixel_bytes) ||
+		!checked_add_size(fh.offset, pixel_bytes, &end) || end > file_size)
+		return false;
+	layout->offset = fh.offset;
+	return true;
+}
+
+// File offset of row y of the image, counting from the top
+static size_t bmp_row_offset(const struct bmp_layout *layout, int height, int y)
+{
+	size_t file_y = (size_t)(layout->top_down ? y : (height - 1 - y));
+	return layout->offset + file_y * layout->bmp_rowbytes;
+}
+
+// BMP is BGR(A), convert to RGB(A); BMP and image channel counts always match
+static void bmp_unpack_row(uint8_t *dst, const uint8_t *row, int width, int channels)
+{
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	if (channels == 4)
+		px_rgba_swap_rb(dst, row, (size_t)width);
+	else
+		px_rgb_swap_rb(dst, row, (size_t)width);
+	stats_leave(prev);
+}
+
+// RGB(A) to BGR
+static void bmp_pack_row(uint8_t *row, const uint8_t *src, int width, int channels)
+{
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	if (channels == 4)
+		px_rgba_to_bgr(row, src, (size_t)width);
+	else
+		px_rgb_swap_rb(row, src, (size_t)width);
+	stats_leave(prev);
+}
+
+static bool bmp_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	struct bmp_layout layout;
+	if (!bmp_parse_header(data, size, img, &layout)) {
+		return false;
+	}
+
+	size_t rowbytes;
+	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
+		return false;
+	}
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes)) {
+		return false;
+	}
+
+	for (int y = 0; y < img->height; y++) {
+		const uint8_t *row = data + bmp_row_offset(&layout, img->height, y);
+		bmp_unpack_row(img->pixels + (size_t)y * rowbytes, row, img->width, img->channels);
+	}
+
+	return true;
+}
+
+static bool bmp_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	struct bmp_layout layout;
+	return bmp_parse_header(data, size, img, &layout);
+}
+
+#ifdef IMGCONV_CLI
+// Bottom-up files are walked back to front with one pread() per row, which
+// keeps the resident set to a single row (a mapping would fault neighbouring,
+// already consumed pages back in).
+struct bmp_source {
+	struct row_source base;
+	int fd;
+	struct bmp_layout layout;
+	uint8_t *row;
+	int y;
+};
+
+static bool bmp_source_read(struct row_source *src, uint8_t *rows, int count)
+{
+	struct bmp_source *s = (struct bmp_source *)src;
+	size_t rowbytes = row_source_rowbytes(src);
+
+	for (int i = 0; i < count; i++, s->y++) {
+		off_t off = (off_t)bmp_row_offset(&s->layout, src->height, s->y);
+		enum stats_stage prev = stats_enter(STAGE_READ_IO);
+		size_t done = 0;
+		while (done < s->layout.bmp_rowbytes) {
+			ssize_t n = pread(s->fd, s->row + done, s->layout.bmp_rowbytes - done, off + (off_t)done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				stats_leave(prev);
+				return false;
+			}
+			done += (size_t)n;
+		}
+		stats_leave(prev);
+		bmp_unpack_row(rows + (size_t)i * rowbytes, s->row, src->width, src->channels);
+	}
+	return true;
+}
+
+static void bmp_source_close(struct row_source *src)
+{
+	struct bmp_source *s = (struct bmp_source *)src;
+	close(s->fd);
+	pool_free(s->row);
+	free(s);
+}
+
+static struct row_source *bmp_source_open(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	uint8_t header[BMP_HEADER_SIZE];
+	struct stat st;
+	struct image hdr = {0};
+	struct bmp_layout layout;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+		pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+		!bmp_parse_header(header, (size_t)st.st_size, &hdr, &layout)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct bmp_source *s = calloc(1, sizeof(*s));
+	if (!s) {
+		close(fd);
+		return NULL;
+	}
+	s->row = pool_alloc(layout.bmp_rowbytes);
+	if (!s->row) {
+		free(s);
+		close(fd);
+		return NULL;
+	}
+	s->fd = fd;
+	s->layout = layout;
+
+	s->base.width = hdr.width;
+	s->base.height = hdr.height;
+	s->base.channels = hdr.channels;
+	s->base.read = bmp_source_read;
+	s->base.close = bmp_source_close;
+	return &s->base;
+}
+#endif
+
+// Always writes a bottom-up 24-bit BMP, seeking to each row's slot so rows can
+// arrive top to bottom.
+struct bmp_sink {
+	struct row_sink base;
+	FILE *f;
+	uint8_t *row;
+	size_t bmp_rowbytes;
+	int width;
+	int height;
+	int channels;
+	int y;
+	bool failed;
+};
+
+static bool bmp_sink_write(struct row_sink *dst, const uint8_t *rows, int count)
+{
+	struct bmp_sink *s = (struct bmp_sink *)dst;
+	if (s->failed)
+		return false;
+
+	size_t src_rowbytes = (size_t)s->width * (size_t)s->channels;
+	for (int i = 0; i < count; i++, s->y++) {
+		size_t file_y = (size_t)(s->height - 1 - s->y);
+		off_t off = (off_t)BMP_HEADER_SIZE + (off_t)(file_y * s->bmp_rowbytes);
+		bmp_pack_row(s->row, rows + (size_t)i * src_rowbytes, s->width, s->channels);
+		if (fseeko(s->f, off, SEEK_SET) != 0 ||
+			output_write(s->row, s->bmp_rowbytes, s->f) != s->bmp_rowbytes) {
+			s->failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool bmp_sink_close(struct row_sink *dst)
+{
+	struct bmp_sink *s = (struct bmp_sink *)dst;
+	if (fflush(s->f) != 0 || s->y != s->height)
+		s->failed = true;
+	bool ok = !s->failed;
+	pool_free(s->row);
+	free(s);
+	return ok;
+}
+
+static void bmp_sink_abort(struct row_sink *dst)
+{
+	struct bmp_sink *s = (struct bmp_sink *)dst;
+	pool_free(s->row);
+	free(s);
+}
+
+static struct row_sink *bmp_sink_open(FILE *f, int width, int height, int channels)
+{
+	struct image hdr = { .width = width, .height = height, .channels = channels };
+	if (!image_validate_dims(&hdr))
+		return NULL;
+
+	int bmp_channels = 3;  // Always write 24-bit BMP (no alpha)
+	size_t raw_rowbytes;
+	if (!checked_mul_size((size_t)width, (size_t)bmp_channels, &raw_rowbytes))
+		return NULL;
+	size_t tmp_rowbytes;
+	if (!checked_add_size(raw_rowbytes, 3, &tmp_rowbytes))
+		return NULL;
+	size_t bmp_rowbytes = tmp_rowbytes & ~(size_t)3;
+	if (bmp_rowbytes == 0)
+		return NULL;
+	size_t image_size;
+	if (!checked_mul_size(bmp_rowbytes, (size_t)height, &image_size))
+		return NULL;
+	if (image_size > UINT32_MAX - (sizeof(struct bmp_file_header) + sizeof(struct bmp_info_header)))
+		return NULL;
+
+	struct bmp_sink *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->bmp_rowbytes = bmp_rowbytes;
+	s->width = width;
+	s->height = height;
+	s->channels = channels;
+
+	s->row = pool_alloc(bmp_rowbytes);
+	if (!s->row) {
+		free(s);
+		return NULL;
+	}
+	memset(s->row, 0, bmp_rowbytes);  // row padding stays zero
+
+	s->f = f;
+
+	struct bmp_file_header fh = {
+		.type = 0x4D42,
+		.size = (uint32_t)(sizeof(fh) + sizeof(struct bmp_info_header) + image_size),
+		.offset = sizeof(fh) + sizeof(struct bmp_info_header)
+	};
+
+	struct bmp_info_header ih = {
+		.size = sizeof(ih),
+		.width = width,
+		.height = height,
+		.planes = 1,
+		.bit_count = 24,
+		.image_size = (uint32_t)image_size
+	};
+
+	if (output_write(&fh, sizeof(fh), s->f) != sizeof(fh) || output_write(&ih, sizeof(ih), s->f) != sizeof(ih)) {
+		pool_free(s->row);
+		free(s);
+		return NULL;
+	}
+
+	s->base.write = bmp_sink_write;
+	s->base.close = bmp_sink_close;
+	s->base.abort = bmp_sink_abort;
+	return &s->base;
+}
+
+static bool bmp_encode(FILE *f, struct image *img)
+{
+	return image_write_rows(bmp_sink_open(f, img->width, img->height, img->channels), img);
+}
+
+// ============================================================================
+// QOI (no library needed)
+// ============================================================================
+
+// Everything after the magic, shared by plain and chunked QOI
+static bool qoi_parse_dims(const uint8_t *header, struct image *img)
+{
+	uint32_t width = qoi_read32be(header + 4);
+	uint32_t height = qoi_read32be(header + 8);
+	img->channels = header[12];
+
+	if (width == 0 || height == 0 || width > INT_MAX || height > INT_MAX)
+		return false;
+
+	if (img->channels != 3 && img->channels != 4)
+		return false;
+
+	size_t pixel_count;
+	if (!checked_mul_size((size_t)width, (size_t)height, &pixel_count))
+		return false;
+	size_t pixel_bytes;
+	if (!checked_mul_size(pixel_count, (size_t)img->channels, &pixel_bytes))
+		return false;
+
+	img->width = (int)width;
+	img->height = (int)height;
+	return image_check_max_pixels(img->width, img->height);
+}
+
+static bool qoi_parse_header(const uint8_t *header, struct image *img)
+{
+	return qoi_read32be(header) == QOI_MAGIC && qoi_parse_dims(header, img);
+}
+
+// Pixels are handled as 32-bit words with R in the low byte and A in the high
+// byte, whatever the host byte order; qoi_px_store() converts to memory order.
+static inline uint32_t qoi_px_pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+	return (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16 | (uint32_t)a << 24;
+}
+
+static inline uint32_t qoi_px_load(const uint8_t *p) {
+	return qoi_px_pack(p[0], p[1], p[2], p[3]);
+}
+
+static inline void qoi_px_store(uint8_t *p, uint32_t px) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	px = __builtin_bswap32(px);
+#endif
+	memcpy(p, &px, 4);
+}
+
+// qoi_hash() on a packed pixel: spreading the channels into 16-bit lanes lets a
+// single multiply sum r*3 + g*5 + b*7 + a*11 into the top byte
+static inline int qoi_hash_px(uint32_t px) {
+	uint64_t v = (px & 0x00ff00ffu) | ((uint64_t)(px & 0xff00ff00u) << 24);
+	return (int)((v * 0x0300070005000b00ull) >> 56) & 63;
+}
+
+// Per-byte add modulo 256 with no carries between channels
+static inline uint32_t qoi_px_add(uint32_t a, uint32_t b) {
+	return ((a & 0x7f7f7f7fu) + (b & 0x7f7f7f7fu)) ^ ((a ^ b) & 0x80808080u);
+}
+
+// Channel deltas for QOI_OP_DIFF (indexed by the low 6 bits of the opcode) and
+// QOI_OP_LUMA (green part by the opcode, red/blue part by the second byte),
+// pre-packed so applying an op is one qoi_px_add()
+static uint32_t qoi_diff_delta[64];
+static uint32_t qoi_luma_delta_g[64];
+static uint32_t qoi_luma_delta_rb[256];
+
+__attribute__((constructor))
+static void qoi_init_tables(void)
+{
+	for (int i = 0; i < 64; i++) {
+		qoi_diff_delta[i] = qoi_px_pack((uint8_t)(((i >> 4) & 3) - 2),
+										(uint8_t)(((i >> 2) & 3) - 2),
+										(uint8_t)((i & 3) - 2), 0);
+		uint8_t vg = (uint8_t)(i - 32);
+		qoi_luma_delta_g[i] = qoi_px_pack(vg, vg, vg, 0);
+	}
+	for (int i = 0; i < 256; i++)
+		qoi_luma_delta_rb[i] = qoi_px_pack((uint8_t)((i >> 4) - 8), 0, (uint8_t)((i & 15) - 8), 0);
+}
+
+// Decoder state carried between calls, so an image can be decoded in strips
+struct qoi_dec {
+	uint32_t index[64];
+	uint32_t px;
+	int run;    // pixels left in the current QOI_OP_RUN
+};
+
+static void qoi_dec_init(struct qoi_dec *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->px = qoi_px_pack(0, 0, 0, 255);
+}
+
+// Longest opcode (QOI_OP_RGBA) in bytes. While at least this much input is
+// left no opcode can overrun, so the main loop checks the input once per op.
+#define QOI_MAX_OP_SIZE 5
+
+static inline __attribute__((always_inline))
+void qoi_emit(uint8_t *out, uint32_t px, int channels, bool last)
+{
+	// Storing the full word is a single move; past the last 3-channel pixel
+	// there is no spare byte for it, so that one gets an exact copy
+	if (channels == 4 || !last) {
+		qoi_px_store(out, px);
+	} else {
+		uint8_t tmp[4];
+		qoi_px_store(tmp, px);
+		memcpy(out, tmp, 3);
+	}
+}
+
+// Body of qoi_decode_pixels(); `channels` is a constant at both call sites so
+// each gets its own loop with the pixel stride and stores folded in
+static inline __attribute__((always_inline))
+bool qoi_decode_impl(struct qoi_dec *st, const uint8_t **pos, const uint8_t *end,
+					 uint8_t *out, size_t count, const int channels)
+{
+	const uint8_t *p = *pos;
+	uint32_t *index = st->index;
+	uint32_t px = st->px;
+	bool ok = true;
+
+	if (count == 0)
+		return true;
+	uint8_t *out_last = out + (count - 1) * (size_t)channels;
+	uint8_t *out_end = out + count * (size_t)channels;
+
+	// A run carried over from the previous call
+	while (st->run > 0 && out < out_end) {
+		qoi_emit(out, px, channels, out == out_last);
+		out += channels;
+		st->run--;
+	}
+
+	while (out < out_end) {
+		if (end - p < QOI_MAX_OP_SIZE) {
+			// Close to the end of the buffer (a valid stream still has its
+			// 8-byte end marker here): check each op's exact length
+			if (p >= end) { ok = false; break; }
+			int need = *p == QOI_OP_RGBA ? 5 : *p == QOI_OP_RGB ? 4 :
+					   (*p & QOI_MASK_2) == QOI_OP_LUMA ? 2 : 1;
+			if (end - p < need) { ok = false; break; }
+		}
+
+		uint8_t b1 = *p++;
+		switch (b1 >> 6) {
+		case QOI_OP_INDEX >> 6:
+			px = index[b1];
+			break;
+		case QOI_OP_DIFF >> 6:
+			px = qoi_px_add(px, qoi_diff_delta[b1 & 0x3f]);
+			break;
+		case QOI_OP_LUMA >> 6:
+			px = qoi_px_add(px, qoi_px_add(qoi_luma_delta_g[b1 & 0x3f], qoi_luma_delta_rb[*p++]));
+			break;
+		default:
+			if (b1 == QOI_OP_RGB) {
+				px = (px & 0xff000000u) | qoi_px_pack(p[0], p[1], p[2], 0);
+				p += 3;
+			} else if (b1 == QOI_OP_RGBA) {
+				px = qoi_px_load(p);
+				p += 4;
+			} else {
+				size_t run = (size_t)(b1 & 0x3f) + 1;
+				size_t left = (size_t)(out_end - out) / (size_t)channels;
+				size_t n = run < left ? run : left;
+				for (size_t i = 0; i < n; i++) {
+					qoi_emit(out, px, channels, out == out_last);
+					out += channels;
+				}
+				st->run = (int)(run - n);
+				continue;
+			}
+			break;
+		}
+
+		index[qoi_hash_px(px)] = px;
+		qoi_emit(out, px, channels, out == out_last);
+		out += channels;
+	}
+
+	st->px = px;
+	*pos = p;
+	return ok;
+}
+
+// Decodes `count` pixels starting at *pos, advancing *pos past the opcodes used
+static bool qoi_decode_pixels(struct qoi_dec *st, const uint8_t **pos, const uint8_t *end,
+							  uint8_t *out, size_t count, int channels)
+{
+	if (channels == 4)
+		return qoi_decode_impl(st, pos, end, out, count, 4);
+	return qoi_decode_impl(st, pos, end, out, count, 3);
+}
+
+// Chunked QOI (--qoi-chunks): the image cut into horizontal stripes, each an
+// independent QOI op stream starting from fresh encoder state, so stripes can
+// be encoded and decoded on separate threads. Not readable by other QOI tools.
+//
+//   0    "qoix"
+//   4    width, height, channels, colorspace as in a QOI header
+//   14   u32 rows per stripe (the last stripe may be shorter)
+//   18   u32 stripe count
+//   22   u64 per stripe: offset of the end of its data from the start of the
+//        file; stripe 0 starts right after this table, each other one where
+//        the previous one ends
+//   ...  stripe data, then the QOI end marker
+
+#define QOI_CHUNKED_HEADER_SIZE 22
+
+struct qoi_chunked_layout {
+	int stripe_rows;
+	int stripe_count;
+	const uint8_t *table;   // stripe_count big-endian end offsets
+	const uint8_t *data;    // start of stripe 0
+};
+
+static bool qoi_parse_chunked(const uint8_t *data, size_t size, struct image *img,
+							  struct qoi_chunked_layout *layout)
+{
+	if (size < QOI_CHUNKED_HEADER_SIZE || qoi_read32be(data) != QOI_CHUNKED_MAGIC ||
+		!qoi_parse_dims(data, img))
+		return false;
+
+	uint32_t stripe_rows = qoi_read32be(data + 14);
+	uint32_t stripe_count = qoi_read32be(data + 18);
+	if (stripe_rows == 0 || stripe_rows > (uint32_t)img->height ||
+		stripe_count != ((uint32_t)img->height - 1) / stripe_rows + 1)
+		return false;
+
+	if (stripe_count > (size - QOI_CHUNKED_HEADER_SIZE) / 8)
+		return false;
+	size_t table_end = QOI_CHUNKED_HEADER_SIZE + (size_t)stripe_count * 8;
+	if (table_end > size - QOI_END_MARKER_SIZE)
+		return false;
+
+	// Ends must be in order and leave room for the end marker
+	uint64_t prev = table_end;
+	for (uint32_t i = 0; i < stripe_count; i++) {
+		uint64_t end = qoi_read64be(data + QOI_CHUNKED_HEADER_SIZE + i * 8);
+		if (end < prev || end > size - QOI_END_MARKER_SIZE)
+			return false;
+		prev = end;
+	}
+
+	layout->stripe_rows = (int)stripe_rows;
+	layout->stripe_count = (int)stripe_count;
+	layout->table = data + QOI_CHUNKED_HEADER_SIZE;
+	layout->data = data + table_end;
+	return true;
+}
+
+struct qoi_chunked_dec_job {
+	const uint8_t *file;
+	const struct qoi_chunked_layout *layout;
+	struct image *img;
+	atomic_bool failed;
+};
+
+static void qoi_decode_stripe(void *ctx, size_t i)
+{
+	struct qoi_chunked_dec_job *job = ctx;
+	const struct qoi_chunked_layout *layout = job->layout;
+	struct image *img = job->img;
+
+	const uint8_t *pos = i == 0 ? layout->data : job->file + qoi_read64be(layout->table + (i - 1) * 8);
+	const uint8_t *end = job->file + qoi_read64be(layout->table + i * 8);
+	int y = (int)i * layout->stripe_rows;
+	int rows = img->height - y < layout->stripe_rows ? img->height - y : layout->stripe_rows;
+	size_t rowbytes = (size_t)img->width * (size_t)img->channels;
+
+	struct qoi_dec st;
+	qoi_dec_init(&st);
+	if (!qoi_decode_pixels(&st, &pos, end, img->pixels + (size_t)y * rowbytes,
+						   (size_t)img->width * (size_t)rows, img->channels))
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+}
+
+static bool qoi_decode_chunked(const uint8_t *data, size_t size, struct image *img)
+{
+	struct qoi_chunked_layout layout;
+	if (!qoi_parse_chunked(data, size, img, &layout))
+		return false;
+
+	size_t rowbytes = (size_t)img->width * (size_t)img->channels;
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes))
+		return false;
+
+	struct qoi_chunked_dec_job job = { .file = data, .layout = &layout, .img = img };
+	atomic_init(&job.failed, false);
+	parallel_for((size_t)layout.stripe_count, codec_thread_count(), qoi_decode_stripe, &job);
+	if (atomic_load(&job.failed)) {
+		image_free(img);
+		return false;
+	}
+	return true;
+}
+
+static bool qoi_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	if (size >= 4 && qoi_read32be(data) == QOI_CHUNKED_MAGIC)
+		return qoi_decode_chunked(data, size, img);
+
+	if (size < QOI_HEADER_SIZE || !qoi_parse_header(data, img)) {
+		return false;
+	}
+
+	size_t rowbytes = (size_t)img->width * (size_t)img->channels;
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes)) {
+		return false;
+	}
+
+	struct qoi_dec st;
+	qoi_dec_init(&st);
+	const uint8_t *pos = data + QOI_HEADER_SIZE;
+	size_t pixel_count = (size_t)img->width * (size_t)img->height;
+	if (!qoi_decode_pixels(&st, &pos, data + size, img->pixels, pixel_count, img->channels)) {
+		image_free(img);
+		return false;
+	}
+
+	return true;
+}
+
+static bool qoi_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	return size >= QOI_HEADER_SIZE && (qoi_read32be(data) == QOI_MAGIC || qoi_read32be(data) == QOI_CHUNKED_MAGIC) &&
+		   qoi_parse_dims(data, img);
+}
+
+#ifdef IMGCONV_CLI
+struct qoi_source {
+	struct row_source base;
+	struct mapped_file mf;
+	const uint8_t *pos;
+	struct qoi_dec st;
+};
+
+static bool qoi_source_read(struct row_source *src, uint8_t *rows, int count)
+{
+	struct qoi_source *s = (struct qoi_source *)src;
+	size_t pixel_count = (size_t)src->width * (size_t)count;
+	const uint8_t *start = s->pos;
+	if (!qoi_decode_pixels(&s->st, &s->pos, s->mf.data + s->mf.size, rows, pixel_count, src->channels))
+		return false;
+	map_file_discard(&s->mf, start, s->pos);
+	return true;
+}
+
+static void qoi_source_close(struct row_source *src)
+{
+	struct qoi_source *s = (struct qoi_source *)src;
+	unmap_file(&s->mf);
+	free(s);
+}
+
+static struct row_source *qoi_source_open(const char *path)
+{
+	struct qoi_source *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+
+	if (!input_map(path, MAP_FILE_SEQUENTIAL, &s->mf)) {
+		free(s);
+		return NULL;
+	}
+
+	struct image hdr = {0};
+	if (s->mf.size < QOI_HEADER_SIZE || !qoi_parse_header(s->mf.data, &hdr)) {
+		unmap_file(&s->mf);
+		free(s);
+		return NULL;
+	}
+	s->pos = s->mf.data + QOI_HEADER_SIZE;
+	qoi_dec_init(&s->st);
+
+	s->base.width = hdr.width;
+	s->base.height = hdr.height;
+	s->base.channels = hdr.channels;
+	s->base.read = qoi_source_read;
+	s->base.close = qoi_source_close;
+	return &s->base;
+}
+#endif
+
+// Encoder state carried between calls, so an image can be encoded in strips
+struct qoi_enc {
+	uint32_t index[64];
+	uint32_t px_prev;   // packed as in qoi_px_pack()
+	int run;
+	size_t remaining;   // pixels still to come; the final pixel flushes the run
+};
+
+static void qoi_enc_init(struct qoi_enc *st, size_t pixel_count)
+{
+	memset(st, 0, sizeof(*st));
+	st->px_prev = qoi_px_pack(0, 0, 0, 255);
+	st->remaining = pixel_count;
+}
+
+// Worst case output for `count` pixels: every pixel as a full QOI_OP_RGB(A),
+// plus one byte for a run carried in from the previous call
+static size_t qoi_encode_bound(size_t count, int channels)
+{
+	return count * ((size_t)channels + 1) + 1;
+}
+
+// Body of qoi_encode_pixels(), specialised on `channels` like qoi_decode_impl()
+static inline __attribute__((always_inline))
+size_t qoi_encode_impl(struct qoi_enc *st, const uint8_t *pixels, size_t count,
+					   const int channels, uint8_t *data)
+{
+	uint32_t *index = st->index;
+	uint32_t px_prev = st->px_prev;
+	size_t p = 0;
+	size_t run = (size_t)st->run;
+	size_t remaining = st->remaining;
+
+	for (size_t i = 0; i < count; ) {
+		const uint8_t *src = pixels + i * (size_t)channels;
+		uint32_t px = channels == 4 ? qoi_px_load(src) : qoi_px_pack(src[0], src[1], src[2], 255);
+
+		if (px == px_prev) {
+			// Take the whole run in one scan, then emit it in ops of up to 62
+			size_t n = 1 + px_run_length(src + channels, count - i - 1, channels, src);
+			i += n;
+			remaining -= n;
+			run += n;
+			for (; run >= 62; run -= 62)
+				data[p++] = (uint8_t)(QOI_OP_RUN | 61);
+			if (remaining == 0 && run > 0) {
+				data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+
+		if (run > 0) {
+			data[p++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+			run = 0;
+		}
+
+		int idx = qoi_hash_px(px);
+		if (index[idx] == px) {
+			data[p++] = (uint8_t)(QOI_OP_INDEX | idx);
+		} else {
+			index[idx] = px;
+
+			if ((px ^ px_prev) >> 24 == 0) {
+				int vr = (int)(px & 0xff) - (int)(px_prev & 0xff);
+				int vg = (int)(px >> 8 & 0xff) - (int)(px_prev >> 8 & 0xff);
+				int vb = (int)(px >> 16 & 0xff) - (int)(px_prev >> 16 & 0xff);
+
+				int vg_r = vr - vg;
+				int vg_b = vb - vg;
+
+				if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+					data[p++] = (uint8_t)(QOI_OP_DIFF | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+				} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+					data[p++] = (uint8_t)(QOI_OP_LUMA | (vg + 32));
+					data[p++] = (uint8_t)(((vg_r + 8) << 4) | (vg_b + 8));
+				} else {
+					data[p++] = QOI_OP_RGB;
+					data[p++] = src[0];
+					data[p++] = src[1];
+					data[p++] = src[2];
+				}
+			} else {
+				data[p++] = QOI_OP_RGBA;
+				qoi_px_store(data + p, px);
+				p += 4;
+			}
+		}
+		px_prev = px;
+		i++;
+		remaining--;
+	}
+
+	st->px_prev = px_prev;
+	st->run = (int)run;
+	st->remaining = remaining;
+	return p;
+}
+
+static size_t qoi_encode_pixels(struct qoi_enc *st, const uint8_t *pixels, size_t count, int channels,
+								uint8_t *data)
+{
+	if (channels == 4)
+		return qoi_encode_impl(st, pixels, count, 4, data);
+	return qoi_encode_impl(st, pixels, count, 3, data);
+}
+
+// Pixels are encoded QOI_SINK_CHUNK at a time into a bounded buffer
+#define QOI_SINK_CHUNK 16384
+
+struct qoi_sink {
+	struct row_sink base;
+	FILE *f;
+	struct qoi_enc st;
+	uint8_t *buf;
+	int width;
+	int channels;
+	bool failed;
+};
+
+static bool qoi_sink_write(struct row_sink *dst, const uint8_t *rows, int count)
+{
+	struct qoi_sink *s = (struct qoi_sink *)dst;
+	if (s->failed)
+		return false;
+
+	size_t pixel_count = (size_t)s->width * (size_t)count;
+	if (pixel_count > s->st.remaining) {
+		s->failed = true;
+		return false;
+	}
+	for (size_t i = 0; i < pixel_count; i += QOI_SINK_CHUNK) {
+		size_t n = pixel_count - i < QOI_SINK_CHUNK ? pixel_count - i : QOI_SINK_CHUNK;
+		size_t len = qoi_encode_pixels(&s->st, rows + i * (size_t)s->channels, n, s->channels, s->buf);
+		if (output_write(s->buf, len, s->f) != len) {
+			s->failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool qoi_sink_close(struct row_sink *dst)
+{
+	struct qoi_sink *s = (struct qoi_sink *)dst;
+
+	// End marker
+	uint8_t end[QOI_END_MARKER_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+	if (!s->failed && (s->st.remaining != 0 || output_write(end, sizeof(end), s->f) != sizeof(end)))
+		s->failed = true;
+	if (fflush(s->f) != 0)
+		s->failed = true;
+	bool ok = !s->failed;
+	pool_free(s->buf);
+	free(s);
+	return ok;
+}
+
+static void qoi_sink_abort(struct row_sink *dst)
+{
+	struct qoi_sink *s = (struct qoi_sink *)dst;
+	pool_free(s->buf);
+	free(s);
+}
+
+static struct row_sink *qoi_sink_open(FILE *f, int width, int height, int channels)
+{
+	struct image hdr = { .width = width, .height = height, .channels = channels };
+	if (!image_validate_dims(&hdr))
+		return NULL;
+
+	size_t pixel_count;
+	if (!checked_mul_size((size_t)width, (size_t)height, &pixel_count))
+		return NULL;
+
+	struct qoi_sink *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->width = width;
+	s->channels = channels;
+	qoi_enc_init(&s->st, pixel_count);
+
+	s->buf = pool_alloc(qoi_encode_bound(QOI_SINK_CHUNK, channels));
+	if (!s->buf) {
+		free(s);
+		return NULL;
+	}
+
+	s->f = f;
+
+	uint8_t header[QOI_HEADER_SIZE];
+	qoi_write32be(header, QOI_MAGIC);
+	qoi_write32be(header + 4, (uint32_t)width);
+	qoi_write32be(header + 8, (uint32_t)height);
+	header[12] = (uint8_t)channels;
+	header[13] = 1;  // colorspace: sRGB
+	if (output_write(header, sizeof(header), s->f) != sizeof(header)) {
+		pool_free(s->buf);
+		free(s);
+		return NULL;
+	}
+
+	s->base.write = qoi_sink_write;
+	s->base.close = qoi_sink_close;
+	s->base.abort = qoi_sink_abort;
+	return &s->base;
+}
+
+// Stripes are encoded in parallel into their own buffers, then written out in
+// order behind the header and offset table
+struct qoi_chunked_enc_job {
+	const struct image *img;
+	int stripe_rows;
+	uint8_t **bufs;
+	size_t *lens;
+	atomic_bool failed;
+};
+
+static void qoi_encode_stripe(void *ctx, size_t i)
+{
+	struct qoi_chunked_enc_job *job = ctx;
+	const struct image *img = job->img;
+	int y = (int)i * job->stripe_rows;
+	int rows = img->height - y < job->stripe_rows ? img->height - y : job->stripe_rows;
+	size_t rowbytes = (size_t)img->width * (size_t)img->channels;
+	size_t count = (size_t)img->width * (size_t)rows;
+
+	uint8_t *buf = pool_alloc(qoi_encode_bound(count, img->channels));
+	if (!buf) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	struct qoi_enc st;
+	qoi_enc_init(&st, count);
+	size_t len = 0;
+	if (image_is_packed(img)) {
+		len = qoi_encode_pixels(&st, img->pixels + (size_t)y * rowbytes, count, img->channels, buf);
+	} else {
+		// The encoder state carries across calls, so row by row codes the same
+		size_t stride = image_stride(img);
+		for (int r = 0; r < rows; r++)
+			len += qoi_encode_pixels(&st, img->pixels + (size_t)(y + r) * stride, (size_t)img->width,
+									 img->channels, buf + len);
+	}
+
+	// Keep only the encoded bytes; the worst-case buffer goes back to this
+	// thread's pool for its next stripe
+	uint8_t *out = pool_alloc(len);
+	if (out)
+		memcpy(out, buf, len);
+	pool_free(buf);
+	if (!out) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	job->bufs[i] = out;
+	job->lens[i] = len;
+}
+
+static bool qoi_encode_chunked(FILE *f, struct image *img, int chunks)
+{
+	struct image hdr = { .width = img->width, .height = img->height, .channels = img->channels };
+	if (!image_validate_dims(&hdr))
+		return false;
+
+	if (chunks > img->height)
+		chunks = img->height;
+	int stripe_rows = (img->height - 1) / chunks + 1;
+	int stripe_count = (img->height - 1) / stripe_rows + 1;
+
+	struct qoi_chunked_enc_job job = { .img = img, .stripe_rows = stripe_rows };
+	atomic_init(&job.failed, false);
+	job.bufs = calloc((size_t)stripe_count, sizeof(*job.bufs));
+	job.lens = calloc((size_t)stripe_count, sizeof(*job.lens));
+	size_t table_size = (size_t)stripe_count * 8;
+	uint8_t *header = malloc(QOI_CHUNKED_HEADER_SIZE + table_size);
+	bool ok = job.bufs && job.lens && header;
+
+	if (ok) {
+		parallel_for((size_t)stripe_count, codec_thread_count(), qoi_encode_stripe, &job);
+		ok = !atomic_load(&job.failed);
+	}
+
+	if (ok) {
+		qoi_write32be(header, QOI_CHUNKED_MAGIC);
+		qoi_write32be(header + 4, (uint32_t)img->width);
+		qoi_write32be(header + 8, (uint32_t)img->height);
+		header[12] = (uint8_t)img->channels;
+		header[13] = 1;  // colorspace: sRGB
+		qoi_write32be(header + 14, (uint32_t)stripe_rows);
+		qoi_write32be(header + 18, (uint32_t)stripe_count);
+		uint64_t end = QOI_CHUNKED_HEADER_SIZE + table_size;
+		for (int i = 0; i < stripe_count; i++) {
+			end += job.lens[i];
+			qoi_write64be(header + QOI_CHUNKED_HEADER_SIZE + (size_t)i * 8, end);
+		}
+
+		ok = output_write(header, QOI_CHUNKED_HEADER_SIZE + table_size, f) == QOI_CHUNKED_HEADER_SIZE + table_size;
+	}
+	for (int i = 0; ok && i < stripe_count; i++)
+		ok = output_write(job.bufs[i], job.lens[i], f) == job.lens[i];
+	if (ok) {
+		uint8_t end_marker[QOI_END_MARKER_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+		ok = output_write(end_marker, sizeof(end_marker), f) == sizeof(end_marker);
+	}
+
+	if (job.bufs) {
+		for (int i = 0; i < stripe_count; i++)
+			pool_free(job.bufs[i]);
+	}
+	free(job.bufs);
+	free(job.lens);
+	free(header);
+	return ok;
+}
+
+static bool qoi_encode(FILE *f, struct image *img)
+{
+	if (qoi_chunks > 1)
+		return qoi_encode_chunked(f, img, qoi_chunks);
+	return image_write_rows(qoi_sink_open(f, img->width, img->height, img->channels), img);
+}
+
+// ============================================================================
+// AVIF (libavif)
+// ============================================================================
+
+#ifdef HAVE_AVIF
+static bool avif_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	avifDecoder *decoder = avifDecoderCreate();
+	if (!decoder) {
+		return false;
+	}
+	decoder->maxThreads = codec_thread_count();
+
+	avifResult result = avifDecoderSetIOMemory(decoder, data, size);
+	if (result != AVIF_RESULT_OK) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	result = avifDecoderParse(decoder);
+	if (result != AVIF_RESULT_OK) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	result = avifDecoderNextImage(decoder);
+	if (result != AVIF_RESULT_OK) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	avifImage *avif = decoder->image;
+	if (avif->width == 0 || avif->height == 0 || avif->width > INT_MAX || avif->height > INT_MAX) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+	img->width = (int)avif->width;
+	img->height = (int)avif->height;
+	img->channels = avif->alphaPlane ? 4 : 3;
+	if (!image_check_max_pixels(img->width, img->height)) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	size_t rowbytes;
+	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes)) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+	img->pixels = NULL;
+	if (!image_alloc_pixels(img, rowbytes)) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	avifRGBImage rgb;
+	avifRGBImageSetDefaults(&rgb, avif);
+	rgb.format = img->channels == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
+	rgb.depth = 8;
+	rgb.pixels = img->pixels;
+	rgb.rowBytes = rowbytes;
+	rgb.maxThreads = codec_thread_count();
+
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	result = avifImageYUVToRGB(avif, &rgb);
+	stats_leave(prev);
+	avifDecoderDestroy(decoder);
+
+	if (result != AVIF_RESULT_OK) {
+		image_free(img);
+		return false;
+	}
+
+	return true;
+}
+
+// Parsing reads the container boxes only; no AV1 data is decoded
+static bool avif_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	avifDecoder *decoder = avifDecoderCreate();
+	if (!decoder)
+		return false;
+	bool ok = avifDecoderSetIOMemory(decoder, data, size) == AVIF_RESULT_OK &&
+			  avifDecoderParse(decoder) == AVIF_RESULT_OK &&
+			  decoder->image->width > 0 && decoder->image->height > 0 &&
+			  decoder->image->width <= INT_MAX && decoder->image->height <= INT_MAX;
+	if (ok) {
+		img->width = (int)decoder->image->width;
+		img->height = (int)decoder->image->height;
+		img->channels = decoder->alphaPresent ? 4 : 3;
+		ok = image_check_max_pixels(img->width, img->height);
+	}
+	int saved = errno;
+	avifDecoderDestroy(decoder);
+	errno = saved;
+	return ok;
+}
+
+static avifPixelFormat avif_pixel_format(enum chroma_subsampling chroma)
+{
+	return chroma == CHROMA_420 ? AVIF_PIXEL_FORMAT_YUV420 :
+		   chroma == CHROMA_422 ? AVIF_PIXEL_FORMAT_YUV422 : AVIF_PIXEL_FORMAT_YUV444;
+}
+
+// The YUV frame avifImageRGBToYUV() makes; encodes only read it
+static avifImage *avif_prepare(struct image *img, enum chroma_subsampling chroma)
+{
+	if (!image_validate_dims(img))
+		return NULL;
+	if (img->width > INT_MAX || img->height > INT_MAX || image_stride(img) > UINT32_MAX)
+		return NULL;
+
+	avifImage *avif = avifImageCreate(img->width, img->height, 8, avif_pixel_format(chroma));
+	if (!avif) return NULL;
+
+	avifRGBImage rgb;
+	avifRGBImageSetDefaults(&rgb, avif);
+	rgb.format = img->channels == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
+	rgb.depth = 8;
+	rgb.pixels = img->pixels;
+	rgb.rowBytes = (uint32_t)image_stride(img);
+	rgb.maxThreads = codec_thread_count();
+
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	avifResult result = avifImageRGBToYUV(avif, &rgb);
+	stats_leave(prev);
+	if (result != AVIF_RESULT_OK) {
+		avifImageDestroy(avif);
+		return NULL;
+	}
+	return avif;
+}
+
+static bool avif_encode_prepared(FILE *f, const avifImage *avif, const struct encode_opts *opts)
+{
+	avifEncoder *encoder = avifEncoderCreate();
+	if (!encoder)
+		return false;
+
+	encoder->quality = opts->quality;
+	encoder->speed = opts->effort >= 0 ? AVIF_SPEED_FASTEST - opts->effort : AVIF_SPEED_DEFAULT;
+	encoder->maxThreads = codec_thread_count();
+
+	avifRWData output = AVIF_DATA_EMPTY;
+	avifResult result = avifEncoderWrite(encoder, avif, &output);
+	avifEncoderDestroy(encoder);
+
+	if (result != AVIF_RESULT_OK) {
+		avifRWDataFree(&output);
+		return false;
+	}
+
+	bool ok = output_write(output.data, output.size, f) == output.size;
+	avifRWDataFree(&output);
+
+	return ok;
+}
+
+static bool avif_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	avifImage *avif = avif_prepare(img, opts->chroma);
+	if (!avif)
+		return false;
+	bool ok = avif_encode_prepared(f, avif, opts);
+	avifImageDestroy(avif);
+	return ok;
+}
+
+#ifdef IMGCONV_CLI
+// Decodes to the AV1 frame's own planes: 8-bit, no alpha, BT.601 matrix (a
+// limited-range frame is stretched to full range), else fails
+static bool avif_decode_yuv(const uint8_t *data, size_t size, struct yuv_image *yuv,
+							enum chroma_subsampling want)
+{
+	*yuv = (struct yuv_image){0};
+	avifDecoder *decoder = avifDecoderCreate();
+	if (!decoder)
+		return false;
+	decoder->maxThreads = codec_thread_count();
+	if (avifDecoderSetIOMemory(decoder, data, size) != AVIF_RESULT_OK ||
+		avifDecoderParse(decoder) != AVIF_RESULT_OK || decoder->alphaPresent ||
+		avifDecoderNextImage(decoder) != AVIF_RESULT_OK) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	const avifImage *avif = decoder->image;
+	yuv->chroma = avif->yuvFormat == AVIF_PIXEL_FORMAT_YUV420 ? CHROMA_420 :
+				  avif->yuvFormat == AVIF_PIXEL_FORMAT_YUV422 ? CHROMA_422 :
+				  avif->yuvFormat == AVIF_PIXEL_FORMAT_YUV444 ? CHROMA_444 : CHROMA_DEFAULT;
+	bool usable = avif->depth == 8 && !avif->alphaPlane && yuv->chroma != CHROMA_DEFAULT &&
+				  (want == CHROMA_DEFAULT || want == yuv->chroma) &&
+				  (avif->matrixCoefficients == AVIF_MATRIX_COEFFICIENTS_BT601 ||
+				   avif->matrixCoefficients == AVIF_MATRIX_COEFFICIENTS_BT470BG) &&
+				  avif->width <= INT_MAX && avif->height <= INT_MAX;
+	if (usable) {
+		yuv->width = (int)avif->width;
+		yuv->height = (int)avif->height;
+		usable = yuv_image_alloc(yuv);
+	}
+	if (!usable) {
+		avifDecoderDestroy(decoder);
+		return false;
+	}
+
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	for (int p = 0; p < 3; p++)
+		yuv_plane_import(yuv, p, avif->yuvPlanes[p], avif->yuvRowBytes[p], avif->yuvRange == AVIF_RANGE_LIMITED);
+	yuv_image_pad(yuv);
+	stats_leave(prev);
+	avifDecoderDestroy(decoder);
+	return true;
+}
+
+static bool avif_encode_yuv(FILE *f, const struct yuv_image *yuv, const struct encode_opts *opts)
+{
+	avifImage *avif = avifImageCreate((uint32_t)yuv->width, (uint32_t)yuv->height, 8, avif_pixel_format(yuv->chroma));
+	if (!avif)
+		return false;
+	avif->yuvRange = AVIF_RANGE_FULL;
+	avif->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_BT601;
+	if (avifImageAllocatePlanes(avif, AVIF_PLANES_YUV) != AVIF_RESULT_OK) {
+		avifImageDestroy(avif);
+		return false;
+	}
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	for (int p = 0; p < 3; p++)
+		yuv_plane_export(yuv, p, avif->yuvPlanes[p], avif->yuvRowBytes[p]);
+	stats_leave(prev);
+	bool ok = avif_encode_prepared(f, avif, opts);
+	avifImageDestroy(avif);
+	return ok;
+}
+#endif
+#endif
+
+// ============================================================================
+// HEIF (libheif)
+// ============================================================================
+
+#ifdef HAVE_HEIF
+static bool heif_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	struct heif_context *ctx = heif_context_alloc();
+	if (!ctx) return false;
+	struct heif_image_handle *handle;
+	if (heif_context_read_from_memory_without_copy(ctx, data, size, NULL).code != heif_error_Ok ||
+		heif_context_get_primary_image_handle(ctx, &handle).code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+	img->width = heif_image_handle_get_width(handle);
+	img->height = heif_image_handle_get_height(handle);
+	img->channels = heif_image_handle_has_alpha_channel(handle) ? 4 : 3;
+	heif_image_handle_release(handle);
+	heif_context_free(ctx);
+	return img->width > 0 && img->height > 0 && image_check_max_pixels(img->width, img->height);
+}
+
+static void heif_image_release_owner(void *owner)
+{
+	heif_image_release(owner);
+}
+
+static bool heif_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	struct heif_context *ctx = heif_context_alloc();
+	if (!ctx) return false;
+
+	heif_context_set_max_decoding_threads(ctx, codec_thread_count());
+
+	struct heif_error err = heif_context_read_from_memory_without_copy(ctx, data, size, NULL);
+	if (err.code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+
+	struct heif_image_handle *handle;
+	err = heif_context_get_primary_image_handle(ctx, &handle);
+	if (err.code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+
+	bool has_alpha = heif_image_handle_has_alpha_channel(handle);
+	img->channels = has_alpha ? 4 : 3;
+
+	struct heif_image *heif_img;
+	err = heif_decode_image(handle, &heif_img,
+							heif_colorspace_RGB,
+							has_alpha ? heif_chroma_interleaved_RGBA : heif_chroma_interleaved_RGB,
+							NULL);
+	heif_image_handle_release(handle);
+
+	if (err.code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+
+	img->width = heif_image_get_width(heif_img, heif_channel_interleaved);
+	img->height = heif_image_get_height(heif_img, heif_channel_interleaved);
+
+	int stride;
+	const uint8_t *plane = heif_image_get_plane_readonly(heif_img, heif_channel_interleaved, &stride);
+
+	if (!plane || stride <= 0 || !image_validate_dims(img) || img->width > INT_MAX || img->height > INT_MAX) {
+		heif_image_release(heif_img);
+		heif_context_free(ctx);
+		return false;
+	}
+	if (!image_check_max_pixels(img->width, img->height)) {
+		heif_image_release(heif_img);
+		heif_context_free(ctx);
+		return false;
+	}
+
+	if ((size_t)stride < (size_t)img->width * (size_t)img->channels) {
+		heif_image_release(heif_img);
+		heif_context_free(ctx);
+		return false;
+	}
+
+	// The decoded image outlives its context; its interleaved plane becomes
+	// the frame as is, and nothing downstream writes to it
+	heif_context_free(ctx);
+	img->pixels = (uint8_t *)plane;
+	img->stride = (size_t)stride;
+	img->release = heif_image_release_owner;
+	img->owner = heif_img;
+	return true;
+}
+
+// x265 presets, fastest first, indexed by effort 0-10
+static const char *const heif_x265_presets[] = {
+	"ultrafast", "superfast", "veryfast", "faster", "fast", "medium",
+	"medium", "slow", "slower", "veryslow", "placebo",
+};
+
+// x265 "chroma" values by enum chroma_subsampling
+static const char *const heif_chroma_names[] = { NULL, "420", "422", "444" };
+
+static struct heif_error heif_write_stream(struct heif_context *ctx, const void *data, size_t size,
+										   void *userdata)
+{
+	(void)ctx;
+	struct heif_error err = { heif_error_Ok, 0, "" };
+	if (output_write(data, size, userdata) != size) {
+		err.code = heif_error_Encoding_error;
+		err.message = "write failed";
+	}
+	return err;
+}
+
+// img copied into an interleaved heif_image that encodes only read
+static struct heif_image *heif_prepare(struct image *img)
+{
+	if (!image_validate_dims(img))
+		return NULL;
+	size_t rowbytes;
+	if (!checked_mul_size((size_t)img->width, (size_t)img->channels, &rowbytes))
+		return NULL;
+
+	struct heif_image *heif_img;
+	struct heif_error err = heif_image_create(img->width, img->height, heif_colorspace_RGB,
+											  img->channels == 4 ? heif_chroma_interleaved_RGBA
+																 : heif_chroma_interleaved_RGB,
+											  &heif_img);
+	if (err.code != heif_error_Ok)
+		return NULL;
+
+	err = heif_image_add_plane(heif_img, heif_channel_interleaved, img->width, img->height, 8);
+	if (err.code != heif_error_Ok) {
+		heif_image_release(heif_img);
+		return NULL;
+	}
+
+	int stride;
+	uint8_t *data = heif_image_get_plane(heif_img, heif_channel_interleaved, &stride);
+	if (!data || stride <= 0) {
+		heif_image_release(heif_img);
+		return NULL;
+	}
+
+	size_t src_stride = image_stride(img);
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	for (int y = 0; y < img->height; y++) {
+		memcpy(data + y * stride, img->pixels + y * src_stride, rowbytes);
+	}
+	stats_leave(prev);
+	return heif_img;
+}
+
+static bool heif_encode_prepared(FILE *f, const struct heif_image *heif_img, const struct encode_opts *opts)
+{
+	struct heif_context *ctx = heif_context_alloc();
+	if (!ctx) return false;
+
+	struct heif_encoder *encoder;
+	struct heif_error err = heif_context_get_encoder_for_format(ctx, heif_compression_HEVC, &encoder);
+	if (err.code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+
+	heif_encoder_set_lossy_quality(encoder, opts->quality);
+	// Parameter names are plugin-specific; ones the encoder lacks are ignored
+	heif_encoder_set_parameter_integer(encoder, "threads", codec_thread_count());
+	if (opts->effort >= 0)
+		heif_encoder_set_parameter_string(encoder, "preset", heif_x265_presets[opts->effort]);
+	if (opts->chroma != CHROMA_DEFAULT)
+		heif_encoder_set_parameter_string(encoder, "chroma", heif_chroma_names[opts->chroma]);
+
+	err = heif_context_encode_image(ctx, heif_img, encoder, NULL, NULL);
+	heif_encoder_release(encoder);
+
+	if (err.code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+
+	struct heif_writer writer = { .writer_api_version = 1, .write = heif_write_stream };
+	err = heif_context_write(ctx, &writer, f);
+	heif_context_free(ctx);
+
+	return err.code == heif_error_Ok;
+}
+
+static bool heif_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	struct heif_image *heif_img = heif_prepare(img);
+	if (!heif_img)
+		return false;
+	bool ok = heif_encode_prepared(f, heif_img, opts);
+	heif_image_release(heif_img);
+	return ok;
+}
+
+#ifdef IMGCONV_CLI
+static const enum heif_channel heif_yuv_channels[3] = { heif_channel_Y, heif_channel_Cb, heif_channel_Cr };
+
+// Decodes to the HEVC frame's own planes: 8-bit, no alpha, the BT.601 matrix
+// or no nclx profile (a limited-range frame is stretched to full range), else
+// fails
+static bool heif_decode_yuv(const uint8_t *data, size_t size, struct yuv_image *yuv,
+							enum chroma_subsampling want)
+{
+	*yuv = (struct yuv_image){0};
+	struct heif_context *ctx = heif_context_alloc();
+	if (!ctx) return false;
+	heif_context_set_max_decoding_threads(ctx, codec_thread_count());
+
+	struct heif_image_handle *handle;
+	if (heif_context_read_from_memory_without_copy(ctx, data, size, NULL).code != heif_error_Ok ||
+		heif_context_get_primary_image_handle(ctx, &handle).code != heif_error_Ok) {
+		heif_context_free(ctx);
+		return false;
+	}
+	if (heif_image_handle_has_alpha_channel(handle) ||
+		!image_check_max_pixels(heif_image_handle_get_width(handle), heif_image_handle_get_height(handle))) {
+		heif_image_handle_release(handle);
+		heif_context_free(ctx);
+		return false;
+	}
+
+	// The colr box's profile. libheif writes none for the defaults and decodes
+	// a file without one as full-range BT.601, the JFIF convention.
+	struct heif_color_profile_nclx *nclx = NULL;
+	if (heif_image_handle_get_nclx_color_profile(handle, &nclx).code != heif_error_Ok)
+		nclx = NULL;
+
+	// undefined/undefined: the decoder's own colourspace and chroma, no
+	// conversion (libheif 1.15 returns RGB here, which falls back below)
+	struct heif_image *heif_img;
+	struct heif_error err = heif_decode_image(handle, &heif_img, heif_colorspace_undefined,
+											  heif_chroma_undefined, NULL);
+	heif_image_handle_release(handle);
+	if (err.code != heif_error_Ok) {
+		heif_nclx_color_profile_free(nclx);
+		heif_context_free(ctx);
+		return false;
+	}
+
+	enum heif_chroma chroma = heif_image_get_chroma_format(heif_img);
+	yuv->chroma = chroma == heif_chroma_420 ? CHROMA_420 : chroma == heif_chroma_422 ? CHROMA_422 :
+				  chroma == heif_chroma_444 ? CHROMA_444 : CHROMA_DEFAULT;
+	bool usable = heif_image_get_colorspace(heif_img) == heif_colorspace_YCbCr &&
+				  yuv->chroma != CHROMA_DEFAULT && (want == CHROMA_DEFAULT || want == yuv->chroma) &&
+				  heif_image_get_bits_per_pixel_range(heif_img, heif_channel_Y) == 8 &&
+				  (!nclx || nclx->matrix_coefficients == heif_matrix_coefficients_ITU_R_BT_601_6 ||
+				   nclx->matrix_coefficients == heif_matrix_coefficients_ITU_R_BT_470_6_System_B_G);
+	bool limited = usable && nclx && !nclx->full_range_flag;
+	heif_nclx_color_profile_free(nclx);
+
+	const uint8_t *planes[3] = {0};
+	int strides[3] = {0};
+	for (int p = 0; usable && p < 3; p++) {
+		planes[p] = heif_image_get_plane_readonly(heif_img, heif_yuv_channels[p], &strides[p]);
+		usable = planes[p] && strides[p] > 0;
+	}
+	if (usable) {
+		yuv->width = heif_image_get_width(heif_img, heif_channel_Y);
+		yuv->height = heif_image_get_height(heif_img, heif_channel_Y);
+		usable = yuv_image_alloc(yuv);
+	}
+	if (usable) {
+		enum stats_stage prev = stats_enter(STAGE_CONVERT);
+		for (int p = 0; p < 3; p++)
+			yuv_plane_import(yuv, p, planes[p], (size_t)strides[p], limited);
+		yuv_image_pad(yuv);
+		stats_leave(prev);
+	}
+	heif_image_release(heif_img);
+	heif_context_free(ctx);
+	return usable;
+}
+
+static bool heif_encode_yuv(FILE *f, const struct yuv_image *yuv, const struct encode_opts *opts)
+{
+	enum heif_chroma chroma = yuv->chroma == CHROMA_420 ? heif_chroma_420 :
+							  yuv->chroma == CHROMA_422 ? heif_chroma_422 : heif_chroma_444;
+	struct heif_image *heif_img;
+	if (heif_image_create(yuv->width, yuv->height, heif_colorspace_YCbCr, chroma, &heif_img).code != heif_error_Ok)
+		return false;
+
+	bool ok = true;
+	for (int p = 0; ok && p < 3; p++) {
+		int w, h, stride;
+		yuv_plane_size(yuv, p, &w, &h);
+		ok = heif_image_add_plane(heif_img, heif_yuv_channels[p], w, h, 8).code == heif_error_Ok;
+		uint8_t *plane = ok ? heif_image_get_plane(heif_img, heif_yuv_channels[p], &stride) : NULL;
+		ok = plane && stride > 0;
+		if (ok) {
+			enum stats_stage prev = stats_enter(STAGE_CONVERT);
+			yuv_plane_export(yuv, p, plane, (size_t)stride);
+			stats_leave(prev);
+		}
+	}
+
+	// Tells libheif the planes are already JFIF Y'CbCr, so it leaves them be
+	struct heif_color_profile_nclx *nclx = ok ? heif_nclx_color_profile_alloc() : NULL;
+	if (nclx) {
+		nclx->color_primaries = heif_color_primaries_ITU_R_BT_709_5;
+		nclx->transfer_characteristics = heif_transfer_characteristic_IEC_61966_2_1;
+		nclx->matrix_coefficients = heif_matrix_coefficients_ITU_R_BT_601_6;
+		nclx->full_range_flag = 1;
+		ok = heif_image_set_nclx_color_profile(heif_img, nclx).code == heif_error_Ok;
+		heif_nclx_color_profile_free(nclx);
+	} else {
+		ok = false;
+	}
+
+	if (ok) {
+		struct encode_opts o = *opts;
+		o.chroma = yuv->chroma;
+		ok = heif_encode_prepared(f, heif_img, &o);
+	}
+	heif_image_release(heif_img);
+	return ok;
+}
+#endif
+#endif
+
+// ============================================================================
+// TIFF (libtiff)
+// ============================================================================
+
+#ifdef HAVE_TIFF
+// Read-only libtiff I/O over an in-memory file. The map callback hands libtiff
+// the buffer itself, so strips are decoded straight from it.
+struct tiff_mem {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+};
+
+static tmsize_t tiff_mem_read(thandle_t h, void *buf, tmsize_t size)
+{
+	struct tiff_mem *m = h;
+	size_t n = m->size - m->pos;
+	if (size < 0)
+		return -1;
+	if ((size_t)size < n)
+		n = (size_t)size;
+	memcpy(buf, m->data + m->pos, n);
+	m->pos += n;
+	return (tmsize_t)n;
+}
+
+static tmsize_t tiff_mem_write(thandle_t h, void *buf, tmsize_t size)
+{
+	(void)h;
+	(void)buf;
+	(void)size;
+	return -1;
+}
+
+static toff_t tiff_mem_seek(thandle_t h, toff_t off, int whence)
+{
+	struct tiff_mem *m = h;
+	uint64_t base = whence == SEEK_CUR ? m->pos : whence == SEEK_END ? m->size : 0;
+	if (off > UINT64_MAX - base || base + off > m->size)
+		return (toff_t)-1;
+	m->pos = (size_t)(base + off);
+	return (toff_t)m->pos;
+}
+
+static int tiff_mem_close(thandle_t h)
+{
+	(void)h;
+	return 0;
+}
+
+static toff_t tiff_mem_size(thandle_t h)
+{
+	return (toff_t)((struct tiff_mem *)h)->size;
+}
+
+static int tiff_mem_map(thandle_t h, void **base, toff_t *size)
+{
+	struct tiff_mem *m = h;
+	*base = (void *)m->data;
+	*size = (toff_t)m->size;
+	return 1;
+}
+
+static void tiff_no_unmap(thandle_t h, void *base, toff_t size)
+{
+	(void)h;
+	(void)base;
+	(void)size;
+}
+
+static TIFF *tiff_open_mem(struct tiff_mem *m)
+{
+	return TIFFClientOpen("input", "r", m, tiff_mem_read, tiff_mem_write, tiff_mem_seek,
+						  tiff_mem_close, tiff_mem_size, tiff_mem_map, tiff_no_unmap);
+}
+
+// Plain 8-bit, contiguous RGB(A) stored top-left first: decoded strips and
+// tiles already hold our pixel layout. Anything else needs libtiff's RGBA
+// image interface.
+static bool tiff_is_plain_rgb(TIFF *tif, uint16_t *channels)
+{
+	uint16_t bps = 0, spp = 0, planar = 0, photometric = 0, orientation = ORIENTATION_TOPLEFT;
+	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+	TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+	TIFFGetField(tif, TIFFTAG_ORIENTATION, &orientation);
+	*channels = spp;
+	return bps == 8 && (spp == 3 || spp == 4) && planar == PLANARCONFIG_CONTIG &&
+		   photometric == PHOTOMETRIC_RGB && orientation == ORIENTATION_TOPLEFT;
+}
+
+// How a plain RGB(A) image is cut into strips or tiles ("units"); a strip is
+// a unit as wide as the image. Units are numbered row-major, as libtiff does
+// for contiguous data, and work is done in bands of whole unit rows.
+struct tiff_layout {
+	uint32_t width;
+	uint32_t height;
+	size_t channels;
+	size_t rowbytes;
+	bool tiled;
+	uint32_t unit_w;
+	uint32_t unit_h;
+	size_t unit_rowbytes;
+	size_t unit_bytes;
+	uint32_t across;        // units per unit row
+};
+
+static bool tiff_layout_init(struct tiff_layout *l, uint32_t width, uint32_t height, size_t channels,
+							 bool tiled, uint32_t unit_w, uint32_t unit_h)
+{
+	if (!tiled) {
+		unit_w = width;
+		if (unit_h > height)
+			unit_h = height;
+	}
+	if (width == 0 || height == 0 || unit_w == 0 || unit_h == 0)
+		return false;
+	l->width = width;
+	l->height = height;
+	l->channels = channels;
+	l->tiled = tiled;
+	l->unit_w = unit_w;
+	l->unit_h = unit_h;
+	l->across = (width - 1) / unit_w + 1;
+	return checked_mul_size((size_t)width, channels, &l->rowbytes) &&
+		   checked_mul_size((size_t)unit_w, channels, &l->unit_rowbytes) &&
+		   checked_mul_size(l->unit_rowbytes, (size_t)unit_h, &l->unit_bytes);
+}
+
+// Layout of an input, checked against libtiff's own idea of the unit size
+static bool tiff_layout_read(TIFF *tif, uint32_t width, uint32_t height, size_t channels,
+							 struct tiff_layout *l)
+{
+	if (TIFFIsTiled(tif)) {
+		uint32_t tw = 0, th = 0;
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+		return tiff_layout_init(l, width, height, channels, true, tw, th) &&
+			   TIFFTileSize(tif) > 0 && (uint64_t)TIFFTileSize(tif) == (uint64_t)l->unit_bytes;
+	}
+	uint32_t strip_rows = 0;
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &strip_rows);
+	if (strip_rows == 0 || strip_rows > height)
+		strip_rows = height;
+	return tiff_layout_init(l, width, height, channels, false, 0, strip_rows) &&
+		   (uint64_t)TIFFScanlineSize64(tif) == (uint64_t)l->rowbytes;
+}
+
+// Rows per band: one unit row when working alone, otherwise enough unit rows
+// to give every thread about two units
+static uint32_t tiff_band_rows(const struct tiff_layout *l, size_t threads)
+{
+	size_t unit_rows = threads > 1 ? (2 * threads - 1) / l->across + 1 : 1;
+	uint64_t rows = (uint64_t)unit_rows * l->unit_h;
+	return rows < l->height ? (uint32_t)rows : l->height;
+}
+
+static size_t tiff_band_units(const struct tiff_layout *l, uint32_t rows)
+{
+	return (size_t)((rows - 1) / l->unit_h + 1) * l->across;
+}
+
+// Units [first, first + count) split into contiguous slices, one per slot
+static size_t tiff_slice_begin(size_t first, size_t count, size_t slots, size_t slot)
+{
+	return first + count * slot / slots;
+}
+
+// Extra handles over the same input, one per decoding thread beyond the
+// first: a TIFF carries its decoder state and cannot be shared. Returns how
+// many of the `want` handles are usable; tifs[0] is the caller's own.
+static size_t tiff_readers_open(TIFF *first, const struct tiff_mem *src, size_t want,
+								TIFF **tifs, struct tiff_mem *mems)
+{
+	tifs[0] = first;
+	size_t count = 1;
+	while (count < want) {
+		mems[count] = (struct tiff_mem){ .data = src->data, .size = src->size };
+		tifs[count] = tiff_open_mem(&mems[count]);
+		if (!tifs[count])
+			break;  // decode with the handles we have
+		count++;
+	}
+	return count;
+}
+
+static void tiff_readers_close(TIFF **tifs, size_t count)
+{
+	for (size_t i = 1; i < count; i++)
+		TIFFClose(tifs[i]);
+}
+
+struct tiff_read_job {
+	TIFF **tifs;
+	const struct tiff_layout *layout;
+	uint8_t *dst;           // row y0
+	uint32_t y0;
+	size_t first;
+	size_t count;
+	size_t slots;
+	atomic_bool failed;
+};
+
+// Strips decode straight into place; tiles go through a scratch tile
+static void tiff_read_slot(void *ctx, size_t slot)
+{
+	struct tiff_read_job *job = ctx;
+	const struct tiff_layout *l = job->layout;
+	TIFF *tif = job->tifs[slot];
+	size_t begin = tiff_slice_begin(job->first, job->count, job->slots, slot);
+	size_t end = tiff_slice_begin(job->first, job->count, job->slots, slot + 1);
+
+	uint8_t *tile = NULL;
+	if (l->tiled && begin < end && !(tile = pool_alloc(l->unit_bytes))) {
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+		return;
+	}
+	for (size_t u = begin; u < end; u++) {
+		uint32_t ux = (uint32_t)(u % l->across) * l->unit_w;
+		uint32_t uy = (uint32_t)(u / l->across) * l->unit_h;
+		uint32_t rows = l->height - uy < l->unit_h ? l->height - uy : l->unit_h;
+		uint8_t *dst = job->dst + (size_t)(uy - job->y0) * l->rowbytes;
+
+		if (!l->tiled) {
+			tmsize_t bytes = (tmsize_t)((size_t)rows * l->rowbytes);
+			if (TIFFReadEncodedStrip(tif, (uint32_t)u, dst, bytes) != bytes) {
+				atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+				break;
+			}
+			continue;
+		}
+		if (TIFFReadEncodedTile(tif, (uint32_t)u, tile, (tmsize_t)l->unit_bytes) < 0) {
+			atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+			break;
+		}
+		size_t cols = l->width - ux < l->unit_w ? l->width - ux : l->unit_w;
+		dst += (size_t)ux * l->channels;
+		for (uint32_t r = 0; r < rows; r++)
+			memcpy(dst + (size_t)r * l->rowbytes, tile + (size_t)r * l->unit_rowbytes, cols * l->channels);
+	}
+	pool_free(tile);
+}
+
+// Decodes rows [y0, y0 + rows) into dst, y0 being on a unit row boundary
+static bool tiff_read_band(TIFF **tifs, size_t slots, const struct tiff_layout *l,
+						   uint32_t y0, uint32_t rows, uint8_t *dst)
+{
+	struct tiff_read_job job = {
+		.tifs = tifs,
+		.layout = l,
+		.dst = dst,
+		.y0 = y0,
+		.first = (size_t)(y0 / l->unit_h) * l->across,
+		.count = tiff_band_units(l, rows),
+	};
+	job.slots = slots < job.count ? slots : job.count;
+	atomic_init(&job.failed, false);
+	parallel_for(job.slots, (int)job.slots, tiff_read_slot, &job);
+	return !atomic_load(&job.failed);
+}
+
+// Any other layout: libtiff converts to packed ABGR, which is then reordered
+// into a 4-channel frame
+static bool tiff_read_rgba(TIFF *tif, struct image *img)
+{
+	uint32_t w = (uint32_t)img->width, h = (uint32_t)img->height;
+	size_t pixel_count;
+	if (!checked_mul_size((size_t)w, (size_t)h, &pixel_count) ||
+		pixel_count > SIZE_MAX / sizeof(uint32_t))
+		return false;
+	uint32_t *raster = pool_alloc(pixel_count * sizeof(uint32_t));
+	if (!raster)
+		return false;
+	stats_alloc(pixel_count * sizeof(uint32_t));
+
+	if (!TIFFReadRGBAImageOriented(tif, w, h, raster, ORIENTATION_TOPLEFT, 0) ||
+		!image_alloc_pixels(img, (size_t)w * 4)) {
+		pool_free(raster);
+		return false;
+	}
+
+	enum stats_stage prev = stats_enter(STAGE_CONVERT);
+	px_abgr32_to_rgba(img->pixels, raster, pixel_count);
+	stats_leave(prev);
+
+	pool_free(raster);
+	return true;
+}
+
+// Plain images are decoded as a single band: every thread takes a slice of
+// the strips or tiles with its own handle, straight into img->pixels
+static bool tiff_read_plain(TIFF *tif, const struct tiff_mem *mem, struct image *img)
+{
+	struct tiff_layout l;
+	if (!tiff_layout_read(tif, (uint32_t)img->width, (uint32_t)img->height, (size_t)img->channels, &l) ||
+		!image_alloc_pixels(img, l.rowbytes))
+		return false;
+
+	size_t units = tiff_band_units(&l, l.height);
+	size_t want = (size_t)codec_thread_count();
+	if (want > units)
+		want = units;
+	TIFF **tifs = calloc(want, sizeof(*tifs));
+	struct tiff_mem *mems = calloc(want, sizeof(*mems));
+	bool ok = tifs && mems;
+	if (ok) {
+		size_t slots = tiff_readers_open(tif, mem, want, tifs, mems);
+		ok = tiff_read_band(tifs, slots, &l, 0, l.height, img->pixels);
+		tiff_readers_close(tifs, slots);
+	}
+	free(tifs);
+	free(mems);
+	return ok;
+}
+
+static bool tiff_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	struct tiff_mem mem = { .data = data, .size = size };
+	TIFF *tif = tiff_open_mem(&mem);
+	if (!tif) return false;
+
+	uint32_t w = 0, h = 0;
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+
+	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX) {
+		TIFFClose(tif);
+		return false;
+	}
+	img->width = (int)w;
+	img->height = (int)h;
+	img->pixels = NULL;
+	if (!image_check_max_pixels(img->width, img->height)) {
+		TIFFClose(tif);
+		return false;
+	}
+
+	uint16_t channels;
+	bool ok;
+	if (tiff_is_plain_rgb(tif, &channels)) {
+		img->channels = channels;
+		ok = tiff_read_plain(tif, &mem, img);
+	} else {
+		img->channels = 4;
+		ok = tiff_read_rgba(tif, img);
+	}
+	TIFFClose(tif);
+
+	if (!ok)
+		image_free(img);
+	return ok;
+}
+
+// Reads the first directory only
+static bool tiff_probe(const uint8_t *data, size_t size, struct image *img)
+{
+	struct tiff_mem mem = { .data = data, .size = size };
+	TIFF *tif = tiff_open_mem(&mem);
+	if (!tif) return false;
+
+	uint32_t w = 0, h = 0;
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+	uint16_t channels;
+	img->channels = tiff_is_plain_rgb(tif, &channels) ? channels : 4;
+	TIFFClose(tif);
+	if (w == 0 || h == 0 || w > INT_MAX || h > INT_MAX)
+		return false;
+	img->width = (int)w;
+	img->height = (int)h;
+	return image_check_max_pixels(img->width, img->height);
+}
+
+#ifdef IMGCONV_CLI
+// Plain RGB(A), stripped or tiled, streams a band of unit rows at a time,
+// each band decoded in parallel; anything else is decoded in full by
+// tiff_decode().
+struct tiff_source {
+	struct row_source base;
+	struct mapped_file mf;
+	struct tiff_mem mem;
+	struct tiff_layout layout;
+	TIFF **tifs;
+	struct tiff_mem *mems;
+	size_t slots;
+	uint8_t *band;
+	uint32_t band_rows;
+	uint32_t band_y;        // first row held in band
+	uint32_t band_fill;     // rows held
+	uint32_t y;             // next row to hand out
+};
+
+static bool tiff_source_read(struct row_source *src, uint8_t *rows, int count)
+{
+	struct tiff_source *s = (struct tiff_source *)src;
+	const struct tiff_layout *l = &s->layout;
+
+	while (count > 0) {
+		if (s->y == s->band_y + s->band_fill) {
+			if (s->y >= l->height)
+				return false;
+			s->band_y = s->y;
+			s->band_fill = l->height - s->y < s->band_rows ? l->height - s->y : s->band_rows;
+			if (!tiff_read_band(s->tifs, s->slots, l, s->band_y, s->band_fill, s->band))
+				return false;
+		}
+		uint32_t avail = s->band_y + s->band_fill - s->y;
+		uint32_t n = (uint32_t)count < avail ? (uint32_t)count : avail;
+		memcpy(rows, s->band + (size_t)(s->y - s->band_y) * l->rowbytes, (size_t)n * l->rowbytes);
+		rows += (size_t)n * l->rowbytes;
+		count -= (int)n;
+		s->y += n;
+	}
+	return true;
+}
+
+static void tiff_source_close(struct row_source *src)
+{
+	struct tiff_source *s = (struct tiff_source *)src;
+	tiff_readers_close(s->tifs, s->slots);
+	TIFFClose(s->tifs[0]);
+	unmap_file(&s->mf);
+	pool_free(s->band);
+	free(s->tifs);
+	free(s->mems);
+	free(s);
+}
+
+static struct row_source *tiff_source_open(const char *path)
+{
+	struct tiff_source *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+
+	if (!input_map(path, MAP_FILE_SEQUENTIAL, &s->mf)) {
+		free(s);
+		return NULL;
+	}
+	s->mem = (struct tiff_mem){ .data = s->mf.data, .size = s->mf.size };
+	TIFF *tif = tiff_open_mem(&s->mem);
+	if (!tif) {
+		unmap_file(&s->mf);
+		free(s);
+		return NULL;
+	}
+
+	uint32_t w = 0, h = 0;
+	uint16_t spp;
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+
+	if (!tiff_is_plain_rgb(tif, &spp) ||
+		w == 0 || h == 0 || w > INT_MAX || h > INT_MAX ||
+		!image_check_max_pixels((int)w, (int)h) ||
+		!tiff_layout_read(tif, w, h, spp, &s->layout)) {
+		TIFFClose(tif);
+		unmap_file(&s->mf);
+		free(s);
+		return NULL;
+	}
+
+	size_t want = (size_t)codec_thread_count();
+	s->band_rows = tiff_band_rows(&s->layout, want);
+	size_t band_bytes = (size_t)s->band_rows * s->layout.rowbytes;
+	s->tifs = calloc(want, sizeof(*s->tifs));
+	s->mems = calloc(want, sizeof(*s->mems));
+	s->band = pool_alloc(band_bytes);
+	if (!s->tifs || !s->mems || !s->band) {
+		TIFFClose(tif);
+		unmap_file(&s->mf);
+		pool_free(s->band);
+		free(s->tifs);
+		free(s->mems);
+		free(s);
+		return NULL;
+	}
+	stats_alloc(band_bytes);
+	s->slots = tiff_readers_open(tif, &s->mem, want, s->tifs, s->mems);
+
+	s->base.width = (int)w;
+	s->base.height = (int)h;
+	s->base.channels = spp;
+	s->base.read = tiff_source_read;
+	s->base.close = tiff_source_close;
+	return &s->base;
+}
+#endif
+
+// libtiff I/O over a caller-owned stdio stream. Closing the TIFF only flushes;
+// the stream stays open for whoever opened it.
+static tmsize_t tiff_stdio_read(thandle_t h, void *buf, tmsize_t size)
+{
+	return (tmsize_t)READ_FILE(buf, (size_t)size, (FILE *)h);
+}
+
+static tmsize_t tiff_stdio_write(thandle_t h, void *buf, tmsize_t size)
+{
+	return (tmsize_t)output_write(buf, (size_t)size, (FILE *)h);
+}
+
+static toff_t tiff_stdio_seek(thandle_t h, toff_t off, int whence)
+{
+	FILE *f = h;
+	if (off > (toff_t)INT64_MAX || fseeko(f, (off_t)off, whence) != 0)
+		return (toff_t)-1;
+	return (toff_t)ftello(f);
+}
+
+static int tiff_stdio_close(thandle_t h)
+{
+	return FLUSH_FILE((FILE *)h);
+}
+
+static toff_t tiff_stdio_size(thandle_t h)
+{
+	FILE *f = h;
+	off_t pos = ftello(f);
+	if (pos < 0 || fseeko(f, 0, SEEK_END) != 0)
+		return 0;
+	off_t end = ftello(f);
+	fseeko(f, pos, SEEK_SET);
+	return end < 0 ? 0 : (toff_t)end;
+}
+
+static int tiff_no_map(thandle_t h, void **base, toff_t *size)
+{
+	(void)h;
+	(void)base;
+	(void)size;
+	return 0;
+}
+
+static TIFF *tiff_open_stdio(FILE *f)
+{
+	return TIFFClientOpen("output", "w", f, tiff_stdio_read, tiff_stdio_write, tiff_stdio_seek,
+						  tiff_stdio_close, tiff_stdio_size, tiff_no_map, tiff_no_unmap);
+}
+
+// Output strips hold about TIFF_STRIP_BYTES unless --tiff-tile asks for tiles
+#define TIFF_STRIP_BYTES ((size_t)256 << 10)
+
+struct tiff_codec {
+	uint16_t compression;
+	uint16_t predictor;
+	int level;              // ZIPQUALITY or ZSTD_LEVEL; 0 = libtiff default
+};
+
+// --tiff-compression, with --effort mapped onto the Deflate or ZSTD level
+static struct tiff_codec tiff_codec_for(const struct encode_opts *opts)
+{
+	struct tiff_codec c = { .compression = COMPRESSION_LZW, .predictor = PREDICTOR_HORIZONTAL };
+	switch (tiff_compression) {
+		case TIFF_COMPRESS_NONE:
+			c.compression = COMPRESSION_NONE;
+			c.predictor = PREDICTOR_NONE;
+			break;
+		case TIFF_COMPRESS_DEFLATE:
+			c.compression = COMPRESSION_ADOBE_DEFLATE;
+			if (opts->effort >= 0)
+				c.level = 1 + opts->effort * 8 / 10;
+			break;
+		case TIFF_COMPRESS_ZSTD:
+			c.compression = COMPRESSION_ZSTD;
+			if (opts->effort >= 0)
+				c.level = 1 + opts->effort * 18 / 10;
+			break;
+		case TIFF_COMPRESS_LZW:
+			break;
+	}
+	return c;
+}
+
+static void tiff_set_tags(TIFF *tif, const struct tiff_layout *l, uint32_t height, const struct tiff_codec *c)
+{
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, l->width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (int)l->channels);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, c->compression);
+	if (c->predictor != PREDICTOR_NONE)
+		TIFFSetField(tif, TIFFTAG_PREDICTOR, c->predictor);
+	if (c->level > 0)
+		TIFFSetField(tif, c->compression == COMPRESSION_ZSTD ? TIFFTAG_ZSTD_LEVEL : TIFFTAG_ZIPQUALITY, c->level);
+	if (l->tiled) {
+		TIFFSetField(tif, TIFFTAG_TILEWIDTH, l->unit_w);
+		TIFFSetField(tif, TIFFTAG_TILELENGTH, l->unit_h);
+	} else {
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, l->unit_h);
+	}
+
+	if (l->channels == 4) {
+		uint16_t extra = EXTRASAMPLE_ASSOCALPHA;
+		TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+	}
+}
+
+// Compresses unit u of a band starting at row y0 (held at src) as unit
+// `index` of tif. The predictor differences its input in place, so strips
+// are copied to scratch first unless stored raw; tiles are always assembled
+// there, zero-padded past the image edge.
+static bool tiff_write_unit(TIFF *tif, const struct tiff_layout *l, const struct tiff_codec *c,
+							const uint8_t *src, uint32_t y0, size_t u, uint32_t index, uint8_t *scratch)
+{
+	uint32_t ux = (uint32_t)(u % l->across) * l->unit_w;
+	uint32_t uy = (uint32_t)(u / l->across) * l->unit_h;
+	uint32_t rows = l->height - uy < l->unit_h ? l->height - uy : l->unit_h;
+	src += (size_t)(uy - y0) * l->rowbytes;
+
+	if (!l->tiled) {
+		tmsize_t bytes = (tmsize_t)((size_t)rows * l->rowbytes);
+		void *data = (void *)src;  // libtiff takes a non-const buffer
+		if (c->predictor != PREDICTOR_NONE) {
+			memcpy(scratch, src, (size_t)bytes);
+			data = scratch;
+		}
+		return TIFFWriteEncodedStrip(tif, index, data, bytes) == bytes;
+	}
+
+	size_t cols = l->width - ux < l->unit_w ? l->width - ux : l->unit_w;
+	if (rows < l->unit_h || cols < l->unit_w)
+		memset(scratch, 0, l->unit_bytes);
+	src += (size_t)ux * l->channels;
+	for (uint32_t r = 0; r < rows; r++)
+		memcpy(scratch + (size_t)r * l->unit_rowbytes, src + (size_t)r * l->rowbytes, cols * l->channels);
+	return TIFFWriteEncodedTile(tif, index, scratch, (tmsize_t)l->unit_bytes) == (tmsize_t)l->unit_bytes;
+}
+
+// Each thread compresses its slice of a band's units with libtiff's own codec
+// into a private in-memory TIFF shaped like the band; the output handle then
+// takes the compressed units in order with TIFFWriteRaw*().
+struct tiff_write_job {
+	const struct tiff_layout *layout;
+	const struct tiff_codec *codec;
+	const uint8_t *src;     // row y0
+	uint32_t y0;
+	uint32_t rows;
+	size_t first;
+	size_t count;
+	size_t slots;
+	struct mem_stream *out;     // per slot
+	uint64_t *offsets;          // per unit, into its slot's stream
+	uint64_t *lengths;
+	atomic_bool failed;
+};
+
+static void tiff_write_slot(void *ctx, size_t slot)
+{
+	struct tiff_write_job *job = ctx;
+	const struct tiff_layout *l = job->layout;
+	size_t begin = tiff_slice_begin(job->first, job->count, job->slots, slot);
+	size_t end = tiff_slice_begin(job->first, job->count, job->slots, slot + 1);
+
+	FILE *f = mem_stream_open(&job->out[slot]);
+	TIFF *tif = f ? tiff_open_stdio(f) : NULL;
+	uint8_t *scratch = pool_alloc(l->unit_bytes);
+	bool ok = tif && scratch;
+	if (ok)
+		tiff_set_tags(tif, l, job->rows, job->codec);
+	for (size_t u = begin; ok && u < end; u++)
+		ok = tiff_write_unit(tif, l, job->codec, job->src, job->y0, u, (uint32_t)(u - job->first), scratch);
+	if (ok) {
+		uint64_t *offsets = NULL, *lengths = NULL;
+		ok = TIFFGetField(tif, l->tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS, &offsets) &&
+			 TIFFGetField(tif, l->tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS, &lengths);
+		for (size_t u = begin; ok && u < end; u++) {
+			job->offsets[u - job->first] = offsets[u - job->first];
+			job->lengths[u - job->first] = lengths[u - job->first];
+		}
+	}
+	if (tif)
+		TIFFCleanup(tif);  // the scratch file needs no directory
+	if (f && fclose(f) != 0)
+		ok = false;
+	pool_free(scratch);
+	if (!ok)
+		atomic_store_explicit(&job->failed, true, memory_order_relaxed);
+}
+
+// Rows arrive in any batch size and are gathered into bands of whole unit
+// rows; a band that arrives in one write is compressed from the caller's
+// rows without the copy.
+struct tiff_sink {
+	struct row_sink base;
+	TIFF *tif;
+	struct tiff_layout layout;
+	struct tiff_codec codec;
+	size_t slots;
+	uint8_t *scratch;       // one unit, for the single-threaded path
+	uint8_t *buf;           // one band
+	uint32_t band_rows;
+	uint32_t band_y;        // first row of the band being gathered
+	uint32_t fill;          // rows gathered for it
+	bool failed;
+};
+
+static bool tiff_sink_band(struct tiff_sink *s, const uint8_t *src, uint32_t rows)
+{
+	const struct tiff_layout *l = &s->layout;
+	size_t first = (size_t)(s->band_y / l->unit_h) * l->across;
+	size_t count = tiff_band_units(l, rows);
+	size_t slots = s->slots < count ? s->slots : count;
+
+	if (slots == 1) {
+		for (size_t u = first; u < first + count; u++) {
+			if (!tiff_write_unit(s->tif, l, &s->codec, src, s->band_y, u, (uint32_t)u, s->scratch))
+				return false;
+		}
+		return true;
+	}
+
+	struct tiff_write_job job = {
+		.layout = l,
+		.codec = &s->codec,
+		.src = src,
+		.y0 = s->band_y,
+		.rows = rows,
+		.first = first,
+		.count = count,
+		.slots = slots,
+	};
+	atomic_init(&job.failed, false);
+	job.out = calloc(slots, sizeof(*job.out));
+	job.offsets = calloc(count, sizeof(*job.offsets));
+	job.lengths = calloc(count, sizeof(*job.lengths));
+	bool ok = job.out && job.offsets && job.lengths;
+	if (ok) {
+		parallel_for(slots, (int)slots, tiff_write_slot, &job);
+		ok = !atomic_load(&job.failed);
+	}
+
+	for (size_t slot = 0; ok && slot < slots; slot++) {
+		size_t end = tiff_slice_begin(first, count, slots, slot + 1);
+		for (size_t u = tiff_slice_begin(first, count, slots, slot); ok && u < end; u++) {
+			uint64_t off = job.offsets[u - first], len = job.lengths[u - first];
+			if (off > job.out[slot].size || len > job.out[slot].size - off) {
+				ok = false;
+				break;
+			}
+			void *data = job.out[slot].data + off;
+			tmsize_t n = l->tiled ? TIFFWriteRawTile(s->tif, (uint32_t)u, data, (tmsize_t)len)
+								  : TIFFWriteRawStrip(s->tif, (uint32_t)u, data, (tmsize_t)len);
+			ok = n == (tmsize_t)len;
+		}
+	}
+
+	if (job.out) {
+		for (size_t slot = 0; slot < slots; slot++)
+			free(job.out[slot].data);
+	}
+	free(job.out);
+	free(job.offsets);
+	free(job.lengths);
+	return ok;
+}
+
+static bool tiff_sink_write(struct row_sink *dst, const uint8_t *rows, int count)
+{
+	struct tiff_sink *s = (struct tiff_sink *)dst;
+	const struct tiff_layout *l = &s->layout;
+	if (s->failed)
+		return false;
+	if ((uint32_t)count > l->height - s->band_y - s->fill) {
+		s->failed = true;
+		return false;
+	}
+
+	uint32_t left = (uint32_t)count;
+	while (left > 0) {
+		uint32_t want = l->height - s->band_y < s->band_rows ? l->height - s->band_y : s->band_rows;
+		const uint8_t *band = NULL;
+		if (s->fill == 0 && left >= want) {
+			band = rows;
+			rows += (size_t)want * l->rowbytes;
+			left -= want;
+		} else {
+			uint32_t n = want - s->fill < left ? want - s->fill : left;
+			memcpy(s->buf + (size_t)s->fill * l->rowbytes, rows, (size_t)n * l->rowbytes);
+			rows += (size_t)n * l->rowbytes;
+			left -= n;
+			s->fill += n;
+			if (s->fill == want)
+				band = s->buf;
+		}
+		if (!band)
+			continue;
+		if (!tiff_sink_band(s, band, want)) {
+			s->failed = true;
+			return false;
+		}
+		s->band_y += want;
+		s->fill = 0;
+	}
+	return true;
+}
+
+static void tiff_sink_free(struct tiff_sink *s)
+{
+	pool_free(s->scratch);
+	pool_free(s->buf);
+	free(s);
+}
+
+static bool tiff_sink_close(struct row_sink *dst)
+{
+	struct tiff_sink *s = (struct tiff_sink *)dst;
+	if (s->band_y != s->layout.height)
+		s->failed = true;
+	TIFFClose(s->tif);
+	bool ok = !s->failed;
+	tiff_sink_free(s);
+	return ok;
+}
+
+static void tiff_sink_abort(struct row_sink *dst)
+{
+	struct tiff_sink *s = (struct tiff_sink *)dst;
+	TIFFClose(s->tif);
+	tiff_sink_free(s);
+}
+
+static struct row_sink *tiff_sink_open(FILE *f, int width, int height, int channels,
+									   const struct encode_opts *opts)
+{
+	struct image hdr = { .width = width, .height = height, .channels = channels };
+	if (!image_validate_dims(&hdr))
+		return NULL;
+
+	struct tiff_sink *s = calloc(1, sizeof(*s));
+	if (!s) return NULL;
+	s->codec = tiff_codec_for(opts);
+
+	bool ok;
+	if (tiff_tile > 0) {
+		ok = tiff_layout_init(&s->layout, (uint32_t)width, (uint32_t)height, (size_t)channels,
+							  true, (uint32_t)tiff_tile, (uint32_t)tiff_tile);
+	} else {
+		size_t rowbytes;
+		ok = checked_mul_size((size_t)width, (size_t)channels, &rowbytes);
+		size_t strip_rows = ok ? TIFF_STRIP_BYTES / rowbytes : 0;
+		ok = ok && tiff_layout_init(&s->layout, (uint32_t)width, (uint32_t)height, (size_t)channels,
+									false, 0, strip_rows > 1 ? (uint32_t)strip_rows : 1);
+	}
+	if (!ok) {
+		free(s);
+		return NULL;
+	}
+
+	s->slots = (size_t)codec_thread_count();
+	s->band_rows = tiff_band_rows(&s->layout, s->slots);
+	size_t band_bytes;
+	if (!checked_mul_size((size_t)s->band_rows, s->layout.rowbytes, &band_bytes)) {
+		free(s);
+		return NULL;
+	}
+	s->buf = pool_alloc(band_bytes);
+	s->scratch = pool_alloc(s->layout.unit_bytes);
+	if (!s->buf || !s->scratch) {
+		tiff_sink_free(s);
+		return NULL;
+	}
+	stats_alloc(band_bytes);
+
+	s->tif = tiff_open_stdio(f);
+	if (!s->tif) {
+		tiff_sink_free(s);
+		return NULL;
+	}
+	tiff_set_tags(s->tif, &s->layout, s->layout.height, &s->codec);
+
+	s->base.write = tiff_sink_write;
+	s->base.close = tiff_sink_close;
+	s->base.abort = tiff_sink_abort;
+	return &s->base;
+}
+
+static bool tiff_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	return image_write_rows(tiff_sink_open(f, img->width, img->height, img->channels, opts), img);
+}
+#endif
+
+// ============================================================================
+// JPEG XL (libjxl)
+// ============================================================================
+
+#ifdef HAVE_JXL
+static bool jxl_decode(const uint8_t *data, size_t size, struct image *img)
+{
+	JxlDecoder *dec = JxlDecoderCreate(NULL);
+	if (!dec) {
+		return false;
+	}
+
+	void *runner = JxlResizableParallelRunnerCreate(NULL);
+	if (JxlDecoderSetParallelRunner(dec, JxlResizableParallelRunner, runner) != JXL_DEC_SUCCESS) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlDecoderDestroy(dec);
+		return false;
+	}
+
+	if (JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlDecoderDestroy(dec);
+		return false;
+	}
+
+	JxlDecoderSetInput(dec, data, size);
+	JxlDecoderCloseInput(dec);
+
+	JxlBasicInfo info;
+	JxlPixelFormat format = {0, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+	bool success = false;
+
+	for (;;) {
+		JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+
+			if (status == JXL_DEC_BASIC_INFO) {
+				if (JxlDecoderGetBasicInfo(dec, &info) != JXL_DEC_SUCCESS)
+					break;
+
+				if (info.xsize == 0 || info.ysize == 0 || info.xsize > INT_MAX || info.ysize > INT_MAX)
+					break;
+				img->width = (int)info.xsize;
+				img->height = (int)info.ysize;
+				img->channels = info.alpha_bits > 0 ? 4 : 3;
+				if (!image_check_max_pixels(img->width, img->height))
+					break;
+				format.num_channels = img->channels;
+
+				JxlResizableParallelRunnerSetThreads(runner, codec_thread_setting() > 0 ?
+					(size_t)codec_thread_setting() : JxlResizableParallelRunnerSuggestThreads(info.xsize, info.ysize));
+
+			} else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+				size_t buffer_size;
+				if (JxlDecoderImageOutBufferSize(dec, &format, &buffer_size) != JXL_DEC_SUCCESS)
+					break;
+
+				if (!image_validate_dims(img))
+					break;
+				size_t pixel_count;
+				if (!checked_mul_size((size_t)img->width, (size_t)img->height, &pixel_count))
+					break;
+				size_t expected;
+				if (!checked_mul_size(pixel_count, (size_t)img->channels, &expected))
+					break;
+				if (buffer_size < expected)
+					break;
+
+				img->pixels = pool_alloc(buffer_size);
+				if (!img->pixels)
+					break;
+				stats_alloc(buffer_size);
+
+				if (JxlDecoderSetImageOutBuffer(dec, &format, img->pixels, buffer_size) != JXL_DEC_SUCCESS) {
+					image_free(img);
+					break;
+				}
+
+			} else if (status == JXL_DEC_FULL_IMAGE) {
+				success = true;
+			break;
+
+		} else if (status == JXL_DEC_SUCCESS) {
+			success = true;
+			break;
+
+		} else {
+			break;
+		}
+	}
+
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlDecoderDestroy(dec);
+
+		if (!success && img->pixels) {
+			image_free(img);
+		}
+
+		return success;
+	}
+
+	// Stops at the basic info box, before any frame data
+	static bool jxl_probe(const uint8_t *data, size_t size, struct image *img)
+	{
+		JxlDecoder *dec = JxlDecoderCreate(NULL);
+		if (!dec) {
+			return false;
+		}
+		if (JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO) != JXL_DEC_SUCCESS) {
+			JxlDecoderDestroy(dec);
+			return false;
+		}
+		JxlDecoderSetInput(dec, data, size);
+		JxlDecoderCloseInput(dec);
+
+		JxlBasicInfo info;
+		bool ok = JxlDecoderProcessInput(dec) == JXL_DEC_BASIC_INFO &&
+				  JxlDecoderGetBasicInfo(dec, &info) == JXL_DEC_SUCCESS &&
+				  info.xsize > 0 && info.ysize > 0 && info.xsize <= INT_MAX && info.ysize <= INT_MAX;
+		JxlDecoderDestroy(dec);
+		if (!ok) {
+			return false;
+		}
+		img->width = (int)info.xsize;
+		img->height = (int)info.ysize;
+		img->channels = info.alpha_bits > 0 ? 4 : 3;
+		return image_check_max_pixels(img->width, img->height);
+	}
+
+	// Runs an encoder whose input is closed and writes what it makes to f
+	static bool jxl_encode_output(JxlEncoder *enc, FILE *f)
+	{
+		size_t output_cap = 4096;
+		size_t output_size = 0;
+		uint8_t *output = malloc(output_cap);
+		if (!output)
+			return false;
+
+		for (;;) {
+			uint8_t *next_out = output + output_size;
+			size_t avail_out = output_cap - output_size;
+
+			JxlEncoderStatus status = JxlEncoderProcessOutput(enc, &next_out, &avail_out);
+			output_size = next_out - output;
+
+			if (status == JXL_ENC_SUCCESS) {
+				break;
+			} else if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+				if (output_cap > SIZE_MAX / 2) {
+					free(output);
+					return false;
+				}
+				output_cap *= 2;
+				uint8_t *new_output = realloc(output, output_cap);
+				if (!new_output) {
+					free(output);
+					return false;
+				}
+				output = new_output;
+			} else {
+				free(output);
+				return false;
+			}
+		}
+
+		bool ok = output_write(output, output_size, f) == output_size;
+		free(output);
+		return ok;
+	}
+
+	static bool jxl_encode(FILE *f, struct image *img, const struct encode_opts *opts)
+	{
+		if (!image_validate_dims(img))
+			return false;
+
+		JxlEncoder *enc = JxlEncoderCreate(NULL);
+		if (!enc) return false;
+
+		void *runner = JxlResizableParallelRunnerCreate(NULL);
+		if (JxlEncoderSetParallelRunner(enc, JxlResizableParallelRunner, runner) != JXL_ENC_SUCCESS) {
+			JxlResizableParallelRunnerDestroy(runner);
+			JxlEncoderDestroy(enc);
+			return false;
+		}
+		JxlResizableParallelRunnerSetThreads(runner, codec_thread_setting() > 0 ?
+			(size_t)codec_thread_setting() : JxlResizableParallelRunnerSuggestThreads((uint64_t)img->width, (uint64_t)img->height));
+
+		JxlBasicInfo info;
+		JxlEncoderInitBasicInfo(&info);
+		info.xsize = img->width;
+		info.ysize = img->height;
+		info.bits_per_sample = 8;
+		info.num_color_channels = 3;
+		info.num_extra_channels = img->channels == 4 ? 1 : 0;
+		info.alpha_bits = img->channels == 4 ? 8 : 0;
+		info.uses_original_profile = JXL_FALSE;
+
+		if (JxlEncoderSetBasicInfo(enc, &info) != JXL_ENC_SUCCESS) {
+			JxlResizableParallelRunnerDestroy(runner);
+			JxlEncoderDestroy(enc);
+			return false;
+		}
+
+		JxlColorEncoding color;
+		JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+		if (JxlEncoderSetColorEncoding(enc, &color) != JXL_ENC_SUCCESS) {
+			JxlResizableParallelRunnerDestroy(runner);
+			JxlEncoderDestroy(enc);
+			return false;
+		}
+
+		JxlEncoderFrameSettings *settings = JxlEncoderFrameSettingsCreate(enc, NULL);
+
+		// Convert quality 1-100 to distance (0 = lossless, 1 = visually lossless, 15 = max lossy)
+		float distance = opts->quality >= 100 ? 0.0f : (100.0f - opts->quality) / 6.5f;
+		if (distance > 15.0f) distance = 15.0f;
+		JxlEncoderSetFrameDistance(settings, distance);
+
+		// libjxl effort runs 1-9 (default 7)
+		if (opts->effort >= 0) {
+			int effort = opts->effort < 1 ? 1 : opts->effort > 9 ? 9 : opts->effort;
+			JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT, effort);
+		}
+
+		// Rows are padded up to a multiple of align, so a stride at least a
+		// row long describes itself. The last row needs no padding.
+		size_t stride = image_stride(img);
+		JxlPixelFormat format = {
+			.num_channels = img->channels,
+			.data_type = JXL_TYPE_UINT8,
+			.endianness = JXL_NATIVE_ENDIAN,
+			.align = image_is_packed(img) ? 0 : stride
+		};
+
+		size_t pixel_size;
+		if (!checked_mul_size(stride, (size_t)img->height - 1, &pixel_size) ||
+			!checked_add_size(pixel_size, (size_t)img->width * (size_t)img->channels, &pixel_size)) {
+			JxlResizableParallelRunnerDestroy(runner);
+			JxlEncoderDestroy(enc);
+			return false;
+		}
+		if (JxlEncoderAddImageFrame(settings, &format, img->pixels, pixel_size) != JXL_ENC_SUCCESS) {
+			JxlResizableParallelRunnerDestroy(runner);
+			JxlEncoderDestroy(enc);
+			return false;
+		}
+
+		JxlEncoderCloseInput(enc);
+
+		bool ok = jxl_encode_output(enc, f);
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlEncoderDestroy(enc);
+		return ok;
+	}
+
+#ifdef IMGCONV_CLI
+// ============================================================================
+// Lossless JPEG <-> JPEG XL
+// ============================================================================
+
+// libjxl can take a JPEG's DCT coefficients as they are and keep what it
+// needs to put the original file back together ("jbrd" box), so a JPEG
+// goes to JPEG XL about 20% smaller with no pixel decode and no loss, and
+// comes back byte for byte.
+
+static bool jxl_encode_jpeg(FILE *f, const uint8_t *data, size_t size, const struct encode_opts *opts)
+{
+	struct image dims = {0};
+	if (!jpeg_probe(data, size, &dims))
+		return false;
+
+	JxlEncoder *enc = JxlEncoderCreate(NULL);
+	if (!enc) return false;
+
+	void *runner = JxlResizableParallelRunnerCreate(NULL);
+	if (!runner) {
+		JxlEncoderDestroy(enc);
+		return false;
+	}
+	if (JxlEncoderSetParallelRunner(enc, JxlResizableParallelRunner, runner) != JXL_ENC_SUCCESS) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlEncoderDestroy(enc);
+		return false;
+	}
+	JxlResizableParallelRunnerSetThreads(runner, codec_thread_setting() > 0 ?
+		(size_t)codec_thread_setting() : JxlResizableParallelRunnerSuggestThreads((uint64_t)dims.width, (uint64_t)dims.height));
+
+	if (JxlEncoderUseContainer(enc, JXL_TRUE) != JXL_ENC_SUCCESS ||
+		JxlEncoderStoreJPEGMetadata(enc, JXL_TRUE) != JXL_ENC_SUCCESS) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlEncoderDestroy(enc);
+		return false;
+	}
+
+	// Quality has no say here: the coefficients go in unchanged
+	JxlEncoderFrameSettings *settings = JxlEncoderFrameSettingsCreate(enc, NULL);
+	if (!settings) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlEncoderDestroy(enc);
+		return false;
+	}
+	if (opts->effort >= 0) {
+		int effort = opts->effort < 1 ? 1 : opts->effort > 9 ? 9 : opts->effort;
+		JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT, effort);
+	}
+
+	// Fails on JPEGs libjxl cannot carry over (arithmetic coding, some
+	// unusual sampling); the caller then converts through pixels
+	if (JxlEncoderAddJPEGFrame(settings, data, size) != JXL_ENC_SUCCESS) {
+		JxlResizableParallelRunnerDestroy(runner);
+		JxlEncoderDestroy(enc);
+		return false;
+	}
+	JxlEncoderCloseInput(enc);
+
+	bool ok = jxl_encode_output(enc, f);
+	JxlResizableParallelRunnerDestroy(runner);
+	JxlEncoderDestroy(enc);
+	return ok;
+}
+
+// Whether a JPEG XL file carries JPEG reconstruction data: a "jbrd" box,
+// which only exists in the ISOBMFF container (a bare codestream has none)
+static bool jxl_has_jpeg_reconstruction(const uint8_t *data, size_t size)
+{
+	static const uint8_t container[12] = {
+		0x00, 0x00, 0x00, 0x0c, 'J', 'X', 'L', ' ', 0x0d, 0x0a, 0x87, 0x0a
+	};
+	if (size < sizeof(container) || memcmp(data, container, sizeof(container)) != 0)
+		return false;
+
+	size_t pos = 0;
+	while (size - pos >= 8) {
+		uint64_t box_size = qoi_read32be(data + pos);
+		const uint8_t *type = data + pos + 4;
+		size_t header = 8;
+		if (box_size == 1) {
+			if (size - pos < 16)
+				return false;
+			box_size = qoi_read64be(data + pos + 8);
+			header = 16;
+		} else if (box_size == 0) {
+			box_size = size - pos;  // runs to the end of the file
+		}
+		if (memcmp(type, "jbrd", 4) == 0)
+			return true;
+		if (box_size < header || box_size > size - pos)
+			return false;
+		pos += (size_t)box_size;
+	}
+	return false;
+}
+
+// Puts back the JPEG a file from jxl_encode_jpeg() was made from. Fails,
+// writing nothing, when the file has no reconstruction data.
+static bool jxl_decode_jpeg(FILE *f, const uint8_t *data, size_t size)
+{
+	if (!jxl_has_jpeg_reconstruction(data, size))
+		return false;
+
+	JxlDecoder *dec = JxlDecoderCreate(NULL);
+	if (!dec) {
+		return false;
+	}
+	if (JxlDecoderSubscribeEvents(dec, JXL_DEC_BASIC_INFO | JXL_DEC_JPEG_RECONSTRUCTION |
+								  JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
+		JxlDecoderDestroy(dec);
+		return false;
+	}
+	JxlDecoderSetInput(dec, data, size);
+	JxlDecoderCloseInput(dec);
+
+	// The JPEG usually comes out 20-30% bigger than its JPEG XL
+	size_t jpeg_cap = size + size / 2 + 4096;
+	size_t jpeg_size = 0;
+	uint8_t *jpeg = NULL;
+	bool reconstructing = false;
+	bool success = false;
+
+	for (;;) {
+		JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+
+		if (status == JXL_DEC_BASIC_INFO) {
+			JxlBasicInfo info;
+			if (JxlDecoderGetBasicInfo(dec, &info) != JXL_DEC_SUCCESS ||
+				info.xsize == 0 || info.ysize == 0 || info.xsize > INT_MAX || info.ysize > INT_MAX ||
+				!image_check_max_pixels((int)info.xsize, (int)info.ysize))
+				break;
+
+		} else if (status == JXL_DEC_JPEG_RECONSTRUCTION) {
+			if (max_bytes > 0 && jpeg_cap > max_bytes)
+				jpeg_cap = max_bytes;
+			jpeg = malloc(jpeg_cap);
+			if (!jpeg || JxlDecoderSetJPEGBuffer(dec, jpeg, jpeg_cap) != JXL_DEC_SUCCESS)
+				break;
+			reconstructing = true;
+
+		} else if (status == JXL_DEC_JPEG_NEED_MORE_OUTPUT) {
+			jpeg_size = jpeg_cap - JxlDecoderReleaseJPEGBuffer(dec);
+			if (jpeg_cap > SIZE_MAX / 2 || (max_bytes > 0 && jpeg_cap >= max_bytes)) {
+				errno = EFBIG;
+				break;
+			}
+			size_t new_cap = jpeg_cap * 2;
+			if (max_bytes > 0 && new_cap > max_bytes)
+				new_cap = max_bytes;
+			uint8_t *new_jpeg = realloc(jpeg, new_cap);
+			if (!new_jpeg)
+				break;
+			jpeg = new_jpeg;
+			jpeg_cap = new_cap;
+			if (JxlDecoderSetJPEGBuffer(dec, jpeg + jpeg_size, jpeg_cap - jpeg_size) != JXL_DEC_SUCCESS)
+				break;
+
+		} else if (status == JXL_DEC_FULL_IMAGE || status == JXL_DEC_SUCCESS) {
+			if (reconstructing) {
+				jpeg_size = jpeg_cap - JxlDecoderReleaseJPEGBuffer(dec);
+				success = true;
+			}
+			break;
+
+		} else {
+			// JXL_DEC_NEED_IMAGE_OUT_BUFFER included: pixels only, no JPEG
+			break;
+		}
+	}
+
+	JxlDecoderDestroy(dec);
+
+	bool ok = success && output_write(jpeg, jpeg_size, f) == jpeg_size;
+	free(jpeg);
+	return ok;
+}
+#endif
+#endif
+
+// ============================================================================
+// Format detection
+// ============================================================================
+
+enum format {
+	FMT_UNKNOWN,
+	FMT_PNG,
+	FMT_JPEG,
+	FMT_BMP,
+	FMT_QOI,
+#ifdef HAVE_TIFF
+	FMT_TIFF,
+#endif
+#ifdef HAVE_WEBP
+	FMT_WEBP,
+#endif
+#ifdef HAVE_AVIF
+	FMT_AVIF,
+#endif
+#ifdef HAVE_HEIF
+	FMT_HEIF,
+#endif
+#ifdef HAVE_JXL
+	FMT_JXL,
+#endif
+	FMT_COUNT,  // one past the last compiled-in format
+};
+
+static enum format format_from_name(const char *name)
+{
+	if (strcasecmp(name, "png") == 0)
+		return FMT_PNG;
+	if (strcasecmp(name, "jpg") == 0 || strcasecmp(name, "jpeg") == 0)
+		return FMT_JPEG;
+	if (strcasecmp(name, "bmp") == 0)
+		return FMT_BMP;
+	if (strcasecmp(name, "qoi") == 0)
+		return FMT_QOI;
+#ifdef HAVE_TIFF
+	if (strcasecmp(name, "tiff") == 0 || strcasecmp(name, "tif") == 0)
+		return FMT_TIFF;
+#endif
+#ifdef HAVE_WEBP
+	if (strcasecmp(name, "webp") == 0)
+		return FMT_WEBP;
+#endif
+#ifdef HAVE_AVIF
+	if (strcasecmp(name, "avif") == 0)
+		return FMT_AVIF;
+#endif
+#ifdef HAVE_HEIF
+	if (strcasecmp(name, "heif") == 0 || strcasecmp(name, "heic") == 0)
+		return FMT_HEIF;
+#endif
+#ifdef HAVE_JXL
+	if (strcasecmp(name, "jxl") == 0)
+		return FMT_JXL;
+#endif
+	return FMT_UNKNOWN;
+}
+
+#ifdef IMGCONV_CLI
+static enum format detect_format(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	if (!ext) return FMT_UNKNOWN;
+	return format_from_name(ext + 1);
+}
+#endif
+
+// Magic-byte sniffing for inputs that arrive without a file name. Only
+// compiled-in formats are reported.
+static enum format detect_format_data(const uint8_t *data, size_t size)
+{
+	if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+		return FMT_PNG;
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+		return FMT_JPEG;
+	if (size >= 2 && data[0] == 'B' && data[1] == 'M')
+		return FMT_BMP;
+	if (size >= 4 && (memcmp(data, "qoif", 4) == 0 || memcmp(data, "qoix", 4) == 0))
+		return FMT_QOI;
+#ifdef HAVE_TIFF
+	if (size >= 4 && (memcmp(data, "II*\0", 4) == 0 || memcmp(data, "MM\0*", 4) == 0))
+		return FMT_TIFF;
+#endif
+#ifdef HAVE_WEBP
+	if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0)
+		return FMT_WEBP;
+#endif
+#if defined(HAVE_AVIF) || defined(HAVE_HEIF)
+	// ISOBMFF: the major brand of the leading ftyp box tells AVIF from HEIC
+	if (size >= 12 && memcmp(data + 4, "ftyp", 4) == 0) {
+		const uint8_t *brand = data + 8;
+#ifdef HAVE_AVIF
+		if (memcmp(brand, "avif", 4) == 0 || memcmp(brand, "avis", 4) == 0)
+			return FMT_AVIF;
+#endif
+#ifdef HAVE_HEIF
+		static const char heif_brands[][4] = { "heic", "heix", "hevc", "hevx", "heim", "heis", "mif1", "msf1" };
+		for (size_t i = 0; i < sizeof(heif_brands) / sizeof(heif_brands[0]); i++) {
+			if (memcmp(brand, heif_brands[i], 4) == 0)
+				return FMT_HEIF;
+		}
+#endif
+	}
+#endif
+#ifdef HAVE_JXL
+	if (size >= 2 && data[0] == 0xFF && data[1] == 0x0A)
+		return FMT_JXL;  // bare codestream
+	if (size >= 12 && memcmp(data, "\0\0\0\x0cJXL \r\n\x87\n", 12) == 0)
+		return FMT_JXL;  // container
+#endif
+	return FMT_UNKNOWN;
+}
+
+#ifdef IMGCONV_CLI
+static const char *format_extension(enum format fmt)
+{
+	switch (fmt) {
+		case FMT_PNG: return "png";
+		case FMT_JPEG: return "jpg";
+		case FMT_BMP: return "bmp";
+		case FMT_QOI: return "qoi";
+#ifdef HAVE_TIFF
+		case FMT_TIFF: return "tiff";
+#endif
+#ifdef HAVE_WEBP
+		case FMT_WEBP: return "webp";
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF: return "avif";
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: return "heic";
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL: return "jxl";
+#endif
+		default: return NULL;
+	}
+}
+#endif
+
+// ============================================================================
+// Codec dispatch
+// ============================================================================
+
+#ifdef IMGCONV_CLI
+static struct row_source *row_source_open(enum format fmt, const char *path)
+{
+	switch (fmt) {
+		case FMT_PNG: return png_source_open(path);
+		case FMT_JPEG: return jpeg_source_open(path);
+		case FMT_BMP: return bmp_source_open(path);
+		case FMT_QOI: return qoi_source_open(path);
+#ifdef HAVE_TIFF
+		case FMT_TIFF: return tiff_source_open(path);
+#endif
+		default: return NULL;
+	}
+}
+
+// Row source over an already open stream, for input that has no path (a
+// pipe). Only the formats whose decoders read sequentially can stream this
+// way; the rest return NULL. Takes ownership of f either way.
+static struct row_source *row_source_open_file(enum format fmt, FILE *f)
+{
+	switch (fmt) {
+		case FMT_PNG: return png_source_open_file(f);
+		case FMT_JPEG: return jpeg_source_open_file(f);
+		default:
+			fclose(f);
+			return NULL;
+	}
+}
+#endif
+
+#ifdef IMGCONV_CLI
+static struct row_sink *row_sink_open(enum format fmt, FILE *f, int width, int height,
+									  int channels, const struct encode_opts *opts)
+{
+	switch (fmt) {
+		case FMT_PNG: return png_sink_open(f, width, height, channels, opts);
+		case FMT_JPEG: return jpeg_sink_open(f, width, height, channels, opts);
+		case FMT_BMP: return bmp_sink_open(f, width, height, channels);
+		case FMT_QOI: return qoi_sink_open(f, width, height, channels);
+#ifdef HAVE_TIFF
+		case FMT_TIFF: return tiff_sink_open(f, width, height, channels, opts);
+#endif
+		default: return NULL;
+	}
+}
+
+static bool format_has_row_sink(enum format fmt)
+{
+	switch (fmt) {
+		case FMT_PNG:
+		case FMT_JPEG:
+		case FMT_BMP:
+#ifdef HAVE_TIFF
+		case FMT_TIFF:
+#endif
+			return true;
+		case FMT_QOI:
+			// Chunked QOI encodes its stripes in parallel from a full frame
+			return qoi_chunks <= 1;
+		default:
+			return false;
+	}
+}
+
+// Encoders that seek back in their output (BMP writes rows bottom-up, libtiff
+// patches its directory) and so cannot write straight into a pipe
+static bool format_needs_seekable_output(enum format fmt)
+{
+	switch (fmt) {
+		case FMT_BMP:
+#ifdef HAVE_TIFF
+		case FMT_TIFF:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+#endif
+
+// Full-frame decode of an in-memory file, which must be in format fmt
+// opts (may be NULL) lets decoders that support it decode at reduced size;
+// the result can still be larger than the shrink target
+static bool format_decode(enum format fmt, const uint8_t *data, size_t size, struct image *img,
+						  const struct encode_opts *opts)
+{
+	bool ok = false;
+	switch (fmt) {
+		case FMT_PNG:
+			ok = png_decode(data, size, img);
+			break;
+		case FMT_JPEG:
+			ok = jpeg_decode(data, size, img, opts);
+			break;
+		case FMT_BMP:
+			ok = bmp_decode(data, size, img);
+			break;
+		case FMT_QOI:
+			ok = qoi_decode(data, size, img);
+			break;
+#ifdef HAVE_TIFF
+		case FMT_TIFF:
+			ok = tiff_decode(data, size, img);
+			break;
+#endif
+#ifdef HAVE_WEBP
+		case FMT_WEBP:
+			ok = webp_decode(data, size, img, opts);
+			break;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+			ok = avif_decode(data, size, img);
+			break;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+			ok = heif_decode(data, size, img);
+			break;
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL:
+			ok = jxl_decode(data, size, img);
+			break;
+#endif
+		default:
+			break;
+	}
+	return ok;
+}
+
+// Reads only the header of an in-memory file in format fmt: width, height
+// and the channel count a decode would produce, with pixels left NULL. Fails
+// with errno = EOVERFLOW if the image is over --max-pixels.
+static bool format_probe(enum format fmt, const uint8_t *data, size_t size, struct image *img)
+{
+	errno = 0;
+	switch (fmt) {
+		case FMT_PNG: return png_probe(data, size, img);
+		case FMT_JPEG: return jpeg_probe(data, size, img);
+		case FMT_BMP: return bmp_probe(data, size, img);
+		case FMT_QOI: return qoi_probe(data, size, img);
+#ifdef HAVE_TIFF
+		case FMT_TIFF: return tiff_probe(data, size, img);
+#endif
+#ifdef HAVE_WEBP
+		case FMT_WEBP: return webp_probe(data, size, img);
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF: return avif_probe(data, size, img);
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: return heif_probe(data, size, img);
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL: return jxl_probe(data, size, img);
+#endif
+		default: return false;
+	}
+}
+
+#ifdef IMGCONV_CLI
+// Full-frame decode of `path`, which must be in format fmt. Fails with
+// errno = EFBIG if the file is over --max-bytes.
+static bool format_read(enum format fmt, const char *path, struct image *img,
+						const struct encode_opts *opts)
+{
+	struct mapped_file mf;
+	if (!input_map(path, MAP_FILE_POPULATE, &mf))
+		return false;
+	bool ok = format_decode(fmt, mf.data, mf.size, img, opts);
+	unmap_file(&mf);
+	return ok;
+}
+#endif
+
+// Full-frame encode of img to f in format fmt; f stays open
+static bool format_encode(enum format fmt, FILE *f, struct image *img, const struct encode_opts *opts)
+{
+	bool ok;
+	switch (fmt) {
+		case FMT_PNG:
+			ok = png_encode(f, img, opts);
+			break;
+		case FMT_JPEG:
+			ok = jpeg_encode(f, img, opts);
+			break;
+		case FMT_BMP:
+			ok = bmp_encode(f, img);
+			break;
+		case FMT_QOI:
+			ok = qoi_encode(f, img);
+			break;
+#ifdef HAVE_TIFF
+		case FMT_TIFF:
+			ok = tiff_encode(f, img, opts);
+			break;
+#endif
+#ifdef HAVE_WEBP
+		case FMT_WEBP:
+			ok = webp_encode(f, img, opts);
+			break;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+			ok = avif_encode(f, img, opts);
+			break;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+			ok = heif_encode(f, img, opts);
+			break;
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL:
+			ok = jxl_encode(f, img, opts);
+			break;
+#endif
+		default:
+			ok = false;
+			break;
+	}
+	return ok;
+}
+
+// Full-frame encode into a malloc'd buffer returned through *out/*out_size
+static bool format_encode_mem(enum format fmt, struct image *img, const struct encode_opts *opts,
+							  uint8_t **out, size_t *out_size)
+{
+	struct mem_stream ms = {0};
+	FILE *f = mem_stream_open(&ms);
+	if (!f) return false;
+	bool ok = format_encode(fmt, f, img, opts);
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok) {
+		free(ms.data);
+		return false;
+	}
+	*out = ms.data;
+	*out_size = ms.size;
+	return true;
+}
+
+#ifdef IMGCONV_CLI
+// ============================================================================
+// Quality search (--target-size, --target-ssim)
+// ============================================================================
+
+// An encoder input converted once for many encodes at different qualities:
+// the YUV frame for AVIF (avifImageRGBToYUV) and WebP, the filled heif_image
+// for HEIF. JPEG and JPEG XL encode from the RGB frame itself.
+struct encode_prep {
+	enum format fmt;
+	struct image *img;
+	void *data;
+};
+
+static bool encode_wants_search(const struct encode_opts *opts)
+{
+	return opts && (opts->target_size > 0 || opts->target_ssim > 0);
+}
+
+// Formats that take -q (the rest are lossless)
+static bool format_has_quality(enum format fmt)
+{
+	switch (fmt) {
+		case FMT_JPEG:
+#ifdef HAVE_WEBP
+		case FMT_WEBP:
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool encode_prepare(enum format fmt, struct image *img, const struct encode_opts *opts,
+						   struct encode_prep *prep)
+{
+	(void)opts;     // used by AVIF only
+	*prep = (struct encode_prep){ .fmt = fmt, .img = img };
+	switch (fmt) {
+#ifdef HAVE_WEBP
+		case FMT_WEBP:
+			prep->data = malloc(sizeof(WebPPicture));
+			if (prep->data && !webp_prepare(img, prep->data)) {
+				free(prep->data);
+				prep->data = NULL;
+			}
+			return prep->data != NULL;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+			prep->data = avif_prepare(img, opts->chroma);
+			return prep->data != NULL;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+			prep->data = heif_prepare(img);
+			return prep->data != NULL;
+#endif
+		default:
+			return true;
+	}
+}
+
+// Safe to call from several threads at once on the same prep
+static bool encode_prepared(const struct encode_prep *prep, FILE *f, const struct encode_opts *opts)
+{
+	switch (prep->fmt) {
+#ifdef HAVE_WEBP
+		case FMT_WEBP: return webp_encode_prepared(f, prep->data, opts);
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF: return avif_encode_prepared(f, prep->data, opts);
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: return heif_encode_prepared(f, prep->data, opts);
+#endif
+		default: return format_encode(prep->fmt, f, prep->img, opts);
+	}
+}
+
+static void encode_prep_free(struct encode_prep *prep)
+{
+	switch (prep->fmt) {
+#ifdef HAVE_WEBP
+		case FMT_WEBP:
+			if (prep->data)
+				WebPPictureFree(prep->data);
+			free(prep->data);
+			break;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+			if (prep->data)
+				avifImageDestroy(prep->data);
+			break;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+			if (prep->data)
+				heif_image_release(prep->data);
+			break;
+#endif
+		default:
+			break;
+	}
+	prep->data = NULL;
+}
+
+#define SEARCH_MAX_PROBES 8
+
+// One slot per quality 1-100, filled as the search probes it
+struct quality_probe {
+	uint8_t *out;
+	size_t size;
+	double ssim;
+	bool encoded;
+	bool measured;
+	bool failed;
+};
+
+struct quality_search {
+	const struct encode_prep *prep;
+	const struct encode_opts *opts;
+	const uint8_t *ref_luma;    // img's luma when measuring SSIM
+	bool measure;
+	int probes;
+	int quality[SEARCH_MAX_PROBES];     // this round's
+	struct quality_probe q[101];
+};
+
+static bool quality_probe_measure(struct quality_search *s, struct quality_probe *p)
+{
+	struct image dec = {0};
+	bool ok = format_decode(s->prep->fmt, p->out, p->size, &dec, NULL) &&
+			  dec.width == s->prep->img->width && dec.height == s->prep->img->height;
+	uint8_t *luma = ok ? malloc((size_t)dec.width * (size_t)dec.height) : NULL;
+	if (luma) {
+		ssim_luma(dec.pixels, dec.width, dec.height, dec.channels, image_stride(&dec), luma);
+		p->ssim = ssim_plane(s->ref_luma, luma, dec.width, dec.height);
+		free(luma);
+	}
+	image_free(&dec);
+	return luma != NULL;
+}
+
+static void quality_search_probe(void *ctx, size_t i)
+{
+	struct quality_search *s = ctx;
+	int quality = s->quality[i];
+	struct quality_probe *p = &s->q[quality];
+	if (!p->encoded) {
+		struct encode_opts opts = *s->opts;
+		opts.quality = quality;
+		struct mem_stream ms = {0};
+		FILE *f = mem_stream_open(&ms);
+		bool ok = f && encode_prepared(s->prep, f, &opts);
+		if (f && fclose(f) != 0)
+			ok = false;
+		if (!ok) {
+			free(ms.data);
+			p->failed = true;
+			return;
+		}
+		p->out = ms.data;
+		p->size = ms.size;
+		p->encoded = true;
+	}
+	if (s->measure && !p->measured) {
+		p->measured = quality_probe_measure(s, p);
+		p->failed = !p->measured;
+	}
+}
+
+// Smallest quality in [lo, hi] for which pred() holds, hi + 1 if none, -1 on
+// an encode failure; pred() must be false up to some quality and true from
+// there on. Each round probes up to s->probes qualities spread evenly over
+// what is left, in parallel, and keeps the gap where pred() turns true.
+static int quality_search_first(struct quality_search *s, int lo, int hi,
+								bool (*pred)(const struct quality_search *s, int quality))
+{
+	while (lo <= hi) {
+		int width = hi - lo + 1;
+		int n = width < s->probes ? width : s->probes;
+		for (int i = 0; i < n; i++)
+			s->quality[i] = lo + (i + 1) * width / (n + 1);
+		parallel_for((size_t)n, n, quality_search_probe, s);
+
+		int k = 0;
+		for (int i = 0; i < n; i++)
+			if (s->q[s->quality[i]].failed)
+				return -1;
+		while (k < n && !pred(s, s->quality[k]))
+			k++;
+		if (k < n)
+			hi = s->quality[k] - 1;
+		if (k > 0)
+			lo = s->quality[k - 1] + 1;
+	}
+	return lo;
+}
+
+static bool quality_over_size(const struct quality_search *s, int quality)
+{
+	return s->q[quality].size > s->opts->target_size;
+}
+
+static bool quality_reaches_ssim(const struct quality_search *s, int quality)
+{
+	return s->q[quality].ssim >= s->opts->target_ssim;
+}
+
+// Encodes img as fmt at the quality that opts->target_size and/or
+// opts->target_ssim pick: the highest whose output fits in target_size bytes,
+// the lowest whose decoded output has an SSIM to img of at least target_ssim,
+// or with both, the lowest reaching the SSIM within the size bound (the bound
+// alone if the SSIM is out of reach). The colour conversion is done once and
+// up to `probes` candidates are encoded at a time, in memory; the winner ends
+// up in *out. Fails with errno = ERANGE if even quality 1 is too large.
+static bool format_encode_search(enum format fmt, struct image *img, const struct encode_opts *opts,
+								 int probes, uint8_t **out, size_t *out_size, int *quality)
+{
+	errno = 0;
+	if (!format_has_quality(fmt) || !image_validate_dims(img))
+		return false;
+	struct encode_prep prep;
+	if (!encode_prepare(fmt, img, opts, &prep))
+		return false;
+
+	struct quality_search *s = calloc(1, sizeof(*s));
+	uint8_t *ref_luma = NULL;
+	bool ok = s != NULL;
+	if (ok && opts->target_ssim > 0) {
+		ref_luma = malloc((size_t)img->width * (size_t)img->height);
+		if (ref_luma)
+			ssim_luma(img->pixels, img->width, img->height, img->channels, image_stride(img), ref_luma);
+		ok = ref_luma != NULL;
+	}
+
+	int best = -1;
+	bool too_large = false;
+	if (ok) {
+		s->prep = &prep;
+		s->opts = opts;
+		s->ref_luma = ref_luma;
+		s->probes = probes < 1 ? 1 : probes > SEARCH_MAX_PROBES ? SEARCH_MAX_PROBES : probes;
+
+		int hi = 100;
+		if (opts->target_size > 0) {
+			int first_over = quality_search_first(s, 1, 100, quality_over_size);
+			too_large = first_over == 1;
+			hi = first_over - 1;
+		}
+		best = hi;
+		if (hi >= 1 && opts->target_ssim > 0) {
+			s->measure = true;
+			int first_similar = quality_search_first(s, 1, hi, quality_reaches_ssim);
+			best = first_similar < 0 ? -1 : first_similar <= hi ? first_similar : hi;
+		}
+		if (best >= 1 && !s->q[best].encoded) {
+			// The SSIM was never reached and the top of the range was not probed
+			s->quality[0] = best;
+			s->measure = false;
+			quality_search_probe(s, 0);
+			if (!s->q[best].encoded)
+				best = -1;
+		}
+	}
+
+	if (best >= 1) {
+		*out = s->q[best].out;
+		*out_size = s->q[best].size;
+		*quality = best;
+		s->q[best].out = NULL;
+	}
+	for (int i = 0; s && i <= 100; i++)
+		free(s->q[i].out);
+	free(s);
+	free(ref_luma);
+	encode_prep_free(&prep);
+	errno = too_large ? ERANGE : 0;
+	return best >= 1;
+}
+
+// ============================================================================
+// Bitstream transcodes (JPEG <-> JPEG XL)
+// ============================================================================
+
+// Whether converting from -> to may skip the pixels (see jxl_encode_jpeg()).
+// Not when the pixels are wanted for a resize or a quality search.
+static bool format_can_transcode(enum format from, enum format to, const struct encode_opts *opts)
+{
+	if (!jxl_transcode || image_wants_resize(opts) || encode_wants_search(opts))
+		return false;
+#ifdef HAVE_JXL
+	return (from == FMT_JPEG && to == FMT_JXL) || (from == FMT_JXL && to == FMT_JPEG);
+#else
+	(void)from;
+	(void)to;
+	return false;
+#endif
+}
+
+// The transcode itself, into a malloc'd buffer. Fails, leaving the caller to
+// convert through pixels, for a JPEG libjxl cannot carry over or a JPEG XL
+// that was not made from a JPEG.
+static bool format_transcode_mem(enum format from, enum format to, const uint8_t *data, size_t size,
+								 const struct encode_opts *opts, uint8_t **out, size_t *out_size)
+{
+	if (!format_can_transcode(from, to, opts))
+		return false;
+	struct mem_stream ms = {0};
+	FILE *f = mem_stream_open(&ms);
+	if (!f) return false;
+	bool ok = false;
+#ifdef HAVE_JXL
+	ok = from == FMT_JPEG ? jxl_encode_jpeg(f, data, size, opts) : jxl_decode_jpeg(f, data, size);
+#else
+	(void)data;
+	(void)size;
+#endif
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok) {
+		free(ms.data);
+		return false;
+	}
+	*out = ms.data;
+	*out_size = ms.size;
+	return true;
+}
+
+// ============================================================================
+// Planar Y'CbCr conversions (JPEG, AVIF, HEIC)
+// ============================================================================
+
+// JPEG, AVIF and HEIC all store Y'CbCr, and usually 4:2:0. Decoding to RGB
+// and encoding back converts the colour twice and upsamples the chroma to
+// 4:4:4 in between (which AVIF then also encodes), so between these formats
+// the planes are handed over instead: a JPEG's via raw_data_out / raw_data_in,
+// an AV1 or HEVC frame's as decoded. The subsampling stays that of the input;
+// a --chroma that differs, like anything needing pixels, goes through RGB.
+
+static bool format_has_yuv_decode(enum format fmt)
+{
+	switch (fmt) {
+		case FMT_JPEG:
+#ifdef HAVE_AVIF
+		case FMT_AVIF:
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool format_can_convert_yuv(enum format from, enum format to, const struct encode_opts *opts)
+{
+	if (image_wants_resize(opts) || encode_wants_search(opts) || !format_has_yuv_decode(from))
+		return false;
+	// JPEG to JPEG already streams with bounded memory; --jpeg-parallel wants RGB rows
+	if (to == FMT_JPEG)
+		return from != FMT_JPEG && !jpeg_parallel;
+	return format_has_yuv_decode(to);
+}
+
+static bool format_convert_yuv_mem(enum format from, enum format to, const uint8_t *data, size_t size,
+								   const struct encode_opts *opts, uint8_t **out, size_t *out_size)
+{
+	if (!format_can_convert_yuv(from, to, opts))
+		return false;
+
+	struct yuv_image yuv = {0};
+	bool ok = false;
+	enum stats_stage prev = stats_enter(STAGE_DECODE);
+	switch (from) {
+		case FMT_JPEG: ok = jpeg_decode_yuv(data, size, &yuv, opts->chroma); break;
+#ifdef HAVE_AVIF
+		case FMT_AVIF: ok = avif_decode_yuv(data, size, &yuv, opts->chroma); break;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: ok = heif_decode_yuv(data, size, &yuv, opts->chroma); break;
+#endif
+		default: break;
+	}
+	stats_leave(prev);
+	if (!ok)
+		return false;
+
+	struct mem_stream ms = {0};
+	FILE *f = mem_stream_open(&ms);
+	ok = false;
+	if (f) {
+		prev = stats_enter(STAGE_ENCODE);
+		switch (to) {
+			case FMT_JPEG: ok = jpeg_encode_yuv(f, &yuv, opts); break;
+#ifdef HAVE_AVIF
+			case FMT_AVIF: ok = avif_encode_yuv(f, &yuv, opts); break;
+#endif
+#ifdef HAVE_HEIF
+			case FMT_HEIF: ok = heif_encode_yuv(f, &yuv, opts); break;
+#endif
+			default: break;
+		}
+		stats_leave(prev);
+		if (fclose(f) != 0)
+			ok = false;
+	}
+	yuv_image_free(&yuv);
+	if (!ok) {
+		free(ms.data);
+		return false;
+	}
+	*out = ms.data;
+	*out_size = ms.size;
+	return true;
+}
+
+// ============================================================================
+// Shortcut conversions
+// ============================================================================
+
+// Conversions that may skip RGB: a bitstream transcode, else planar Y'CbCr
+static bool format_can_shortcut(enum format from, enum format to, const struct encode_opts *opts)
+{
+	return format_can_transcode(from, to, opts) || format_can_convert_yuv(from, to, opts);
+}
+
+// Whether some input could take a shortcut to `to`, before the input is seen
+static bool format_can_shortcut_to(enum format to, const struct encode_opts *opts)
+{
+	static const enum format from[] = {
+		FMT_JPEG,
+#ifdef HAVE_AVIF
+		FMT_AVIF,
+#endif
+#ifdef HAVE_HEIF
+		FMT_HEIF,
+#endif
+#ifdef HAVE_JXL
+		FMT_JXL,
+#endif
+	};
+	for (size_t i = 0; i < sizeof(from) / sizeof(from[0]); i++) {
+		if (format_can_shortcut(from[i], to, opts))
+			return true;
+	}
+	return false;
+}
+
+// The shortcut into a malloc'd buffer; false, with nothing to clean up, if
+// there is none for this pair or this file and it has to go through RGB
+static bool format_shortcut_mem(enum format from, enum format to, const uint8_t *data, size_t size,
+								const struct encode_opts *opts, uint8_t **out, size_t *out_size)
+{
+	return format_transcode_mem(from, to, data, size, opts, out, out_size) ||
+		   format_convert_yuv_mem(from, to, data, size, opts, out, out_size);
+}
+
+// ============================================================================
+// Memory estimates
+// ============================================================================
+
+// Bytes per pixel, beyond the RGB(A) frame itself, that a codec holds at its
+// peak. Rough figures that err high: the TIFF RGBA raster, Y'CbCr planes up to
+// 4:4:4 for AVIF and HEIC plus the AV1/HEVC encoders' source and reference
+// frames, WebP's ARGB picture and its Y'CbCr copy, libjxl's float planes.
+// The scanline codecs and TIFF output keep a band of rows at most.
+static unsigned format_decode_overhead(enum format fmt)
+{
+	switch (fmt) {
+#ifdef HAVE_TIFF
+		case FMT_TIFF: return 4;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF: return 3;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: return 3;
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL: return 12;
+#endif
+		default: return 0;
+	}
+}
+
+static unsigned format_encode_overhead(enum format fmt, int channels)
+{
+	switch (fmt) {
+		case FMT_QOI: return (unsigned)channels + 1;    // the output, held whole
+#ifdef HAVE_WEBP
+		case FMT_WEBP: return 6;
+#endif
+#ifdef HAVE_AVIF
+		case FMT_AVIF: return 9;
+#endif
+#ifdef HAVE_HEIF
+		case FMT_HEIF: return 9;
+#endif
+#ifdef HAVE_JXL
+		case FMT_JXL: return 16;
+#endif
+		default: return 0;
+	}
+}
+
+#define ESTIMATE_BASE_BYTES  ((uint64_t)4 << 20)   // codec state, row buffers, stacks
+
+// Estimated peak memory of converting the image hdr describes (from
+// format_probe()), input_size bytes of fmt, to to_fmt under opts: the input,
+// the decoded frame and any resized one, the codecs' own buffers and, for a
+// quality search, one probe's decode
+static uint64_t format_memory_estimate(enum format fmt, const struct image *hdr, size_t input_size,
+									   enum format to_fmt, const struct encode_opts *opts)
+{
+	uint64_t pixels = (uint64_t)hdr->width * (uint64_t)hdr->height;
+	uint64_t channels = (uint64_t)hdr->channels;
+	uint64_t total = ESTIMATE_BASE_BYTES + input_size + pixels * (channels + format_decode_overhead(fmt));
+
+	int out_width = hdr->width, out_height = hdr->height;
+	if (image_target_size(opts, hdr->width, hdr->height, &out_width, &out_height)) {
+		// The horizontal pass's intermediate and the result
+		total += ((uint64_t)out_width * (uint64_t)hdr->height + (uint64_t)out_width * (uint64_t)out_height) *
+				 channels;
+	}
+	uint64_t out_pixels = (uint64_t)out_width * (uint64_t)out_height;
+	total += out_pixels * format_encode_overhead(to_fmt, hdr->channels);
+	if (encode_wants_search(opts))
+		total += out_pixels * (channels + 1);
+	return total;
+}
+#endif
+
+// ============================================================================
+// Public API (imgconv.h)
+// ============================================================================
+
+#define IMGCONV_EXPORT __attribute__((visibility("default")))
+
+static const struct {
+	enum imgconv_format id;
+	enum format fmt;
+} imgconv_formats[] = {
+	{ IMGCONV_PNG, FMT_PNG },
+	{ IMGCONV_JPEG, FMT_JPEG },
+	{ IMGCONV_BMP, FMT_BMP },
+	{ IMGCONV_QOI, FMT_QOI },
+#ifdef HAVE_TIFF
+	{ IMGCONV_TIFF, FMT_TIFF },
+#endif
+#ifdef HAVE_WEBP
+	{ IMGCONV_WEBP, FMT_WEBP },
+#endif
+#ifdef HAVE_AVIF
+	{ IMGCONV_AVIF, FMT_AVIF },
+#endif
+#ifdef HAVE_HEIF
+	{ IMGCONV_HEIF, FMT_HEIF },
+#endif
+#ifdef HAVE_JXL
+	{ IMGCONV_JXL, FMT_JXL },
+#endif
+};
+
+#define IMGCONV_FORMAT_COUNT (sizeof(imgconv_formats) / sizeof(imgconv_formats[0]))
+
+static enum format imgconv_to_format(enum imgconv_format id)
+{
+	for (size_t i = 0; i < IMGCONV_FORMAT_COUNT; i++) {
+		if (imgconv_formats[i].id == id)
+			return imgconv_formats[i].fmt;
+	}
+	return FMT_UNKNOWN;
+}
+
+static enum imgconv_format imgconv_from_format(enum format fmt)
+{
+	for (size_t i = 0; i < IMGCONV_FORMAT_COUNT; i++) {
+		if (imgconv_formats[i].fmt == fmt)
+			return imgconv_formats[i].id;
+	}
+	return IMGCONV_UNKNOWN;
+}
+
+IMGCONV_EXPORT enum imgconv_format imgconv_format_from_name(const char *name)
+{
+	return imgconv_from_format(format_from_name(name));
+}
+
+IMGCONV_EXPORT enum imgconv_format imgconv_detect(const void *data, size_t size)
+{
+	return imgconv_from_format(detect_format_data(data, size));
+}
+
+IMGCONV_EXPORT bool imgconv_decode(const void *data, size_t size, struct imgconv_image *img)
+{
+	*img = (struct imgconv_image){0};
+	enum format fmt = detect_format_data(data, size);
+	struct image out = {0};
+	if (fmt == FMT_UNKNOWN || !format_decode(fmt, data, size, &out, NULL))
+		return false;
+	// imgconv_image is always packed and owned by the pool
+	if (!image_pack(&out)) {
+		image_free(&out);
+		return false;
+	}
+	img->pixels = out.pixels;
+	img->width = out.width;
+	img->height = out.height;
+	img->channels = out.channels;
+	return true;
+}
+
+IMGCONV_EXPORT enum imgconv_format imgconv_probe(const void *data, size_t size, struct imgconv_image *img)
+{
+	*img = (struct imgconv_image){0};
+	enum format fmt = detect_format_data(data, size);
+	struct image hdr = {0};
+	if (fmt == FMT_UNKNOWN || !format_probe(fmt, data, size, &hdr))
+		return IMGCONV_UNKNOWN;
+	img->width = hdr.width;
+	img->height = hdr.height;
+	img->channels = hdr.channels;
+	return imgconv_from_format(fmt);
+}
+
+IMGCONV_EXPORT bool imgconv_encode(const struct imgconv_image *img, enum imgconv_format fmt,
+								   const struct imgconv_opts *opts, void **out, size_t *out_size)
+{
+	enum format to_fmt = imgconv_to_format(fmt);
+	if (to_fmt == FMT_UNKNOWN || !img->pixels)
+		return false;
+	struct encode_opts eo = { .quality = 85, .effort = -1 };
+	if (opts) {
+		if (opts->quality < 1 || opts->quality > 100 || opts->effort < -1 || opts->effort > 10)
+			return false;
+		eo.quality = opts->quality;
+		eo.effort = opts->effort;
+	}
+	// Encoders only read the pixels
+	struct image in = { .pixels = img->pixels, .width = img->width, .height = img->height,
+						.channels = img->channels };
+	if (!image_validate_dims(&in))
+		return false;
+	uint8_t *buf;
+	if (!format_encode_mem(to_fmt, &in, &eo, &buf, out_size))
+		return false;
+	*out = buf;
+	return true;
+}
+
+IMGCONV_EXPORT void imgconv_image_free(struct imgconv_image *img)
+{
+	pool_free(img->pixels);
+	img->pixels = NULL;
+}
+
+IMGCONV_EXPORT void imgconv_free(void *buf)
+{
+	free(buf);
+}
+
+IMGCONV_EXPORT void imgconv_release_cache(void)
+{
+	pool_trim();
+}
+
+IMGCONV_EXPORT void imgconv_set_threads(int threads)
+{
+	codec_threads = threads < 0 ? 0 : threads > 1024 ? 1024 : threads;
+}
+
+IMGCONV_EXPORT void imgconv_set_max_pixels(size_t max)
+{
+	max_pixels = max;
+}
@@ -0,0 +1,86 @@
+#ifndef IMGCONV_H
+#define IMGCONV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libimgconv: img-converter's codecs on in-memory buffers.
+//
+// Images are 8-bit RGB or RGBA, rows top to bottom with no padding. Decoded
+// pixels belong to the library's buffer pool and go back through
+// imgconv_image_free(); encoded output is malloc'd and released with
+// imgconv_free(). Any number of threads may decode and encode at once; the
+// settings functions are meant to be called once, before that starts.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stable IDs, whether or not the format was compiled in
+enum imgconv_format {
+	IMGCONV_UNKNOWN = 0,
+	IMGCONV_PNG = 1,
+	IMGCONV_JPEG = 2,
+	IMGCONV_BMP = 3,
+	IMGCONV_QOI = 4,
+	IMGCONV_TIFF = 5,
+	IMGCONV_WEBP = 6,
+	IMGCONV_AVIF = 7,
+	IMGCONV_HEIF = 8,
+	IMGCONV_JXL = 9,
+};
+
+struct imgconv_image {
+	uint8_t *pixels;
+	int width;
+	int height;
+	int channels;       // 3 = RGB, 4 = RGBA
+};
+
+struct imgconv_opts {
+	int quality;        // 1-100, lossy formats only
+	int effort;         // 0-10, higher = slower and smaller; -1 = each codec's default
+};
+
+#define IMGCONV_OPTS_DEFAULT { 85, -1 }
+
+// "png", "jpg", "webp", ... as accepted by img-converter -f; IMGCONV_UNKNOWN
+// if unknown or not compiled in
+enum imgconv_format imgconv_format_from_name(const char *name);
+
+// Sniffs the format from the first bytes of an encoded image
+enum imgconv_format imgconv_detect(const void *data, size_t size);
+
+// Decodes an encoded image, in whatever supported format it is. On failure
+// img is left empty.
+bool imgconv_decode(const void *data, size_t size, struct imgconv_image *img);
+
+// Reads only the header of an encoded image: width, height and the channels
+// imgconv_decode() would produce, with pixels left NULL. Honours the
+// max-pixels limit. Returns the format, or IMGCONV_UNKNOWN on failure.
+enum imgconv_format imgconv_probe(const void *data, size_t size, struct imgconv_image *img);
+
+// Encodes img as fmt (opts may be NULL for the defaults) into a new buffer
+bool imgconv_encode(const struct imgconv_image *img, enum imgconv_format fmt,
+					const struct imgconv_opts *opts, void **out, size_t *out_size);
+
+void imgconv_image_free(struct imgconv_image *img);
+void imgconv_free(void *buf);
+
+// Frees the buffers the calling thread keeps for reuse by later decodes (up to
+// 256 MiB per thread), for a thread about to go idle. They are also freed
+// when the thread exits.
+void imgconv_release_cache(void);
+
+// Threads each decode or encode may use; 0 = one per CPU (the default)
+void imgconv_set_threads(int threads);
+
+// Decodes fail if width * height exceeds max; 0 = unlimited (default: 100000000)
+void imgconv_set_max_pixels(size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // IMGCONV_H
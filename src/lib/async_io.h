@@ -0,0 +1,486 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+// Whole-file reads and writes done off the calling threads, for batch mode's
+// prefetch and write-behind. A caller queues an aio_file with aio_submit()
+// and its done() callback runs on an I/O thread once the file has been read
+// into a malloc'd buffer, or written out and closed. With liburing
+// (HAVE_URING) one thread keeps up to `depth` files in flight on an io_uring,
+// statx, open, reads and close all asynchronous; without it, or where the
+// kernel refuses a ring, `depth` threads each take one file at a time with
+// plain blocking calls. Either way the latency of a slow (network) filesystem
+// overlaps with other files and with the callers' work.
+//
+// Reads of files of at least direct_min bytes use O_DIRECT, which skips the
+// page cache for inputs read once; it falls back to buffered reads wherever
+// the filesystem turns it down. Needs Linux.
+
+#define AIO_CHUNK        ((size_t)8 << 20)  // largest single read or write
+#define AIO_DIRECT_ALIGN ((size_t)4096)
+
+struct aio_file {
+	// Set by the caller
+	const char *path;
+	bool write;             // write data/size to path; else read path into data/size
+	uint8_t *data;          // read: malloc'd on success, the caller's to free()
+	size_t size;
+	void (*done)(struct aio_file *op);
+	void *ctx;
+
+	int error;              // result: 0 or an errno, EFBIG for over max_size
+
+	// Engine state
+	struct aio_file *next;
+	int fd;
+	size_t pos;
+	size_t cap;
+	int stage;
+	bool direct;
+#ifdef HAVE_URING
+	struct statx stx;
+#endif
+};
+
+struct aio {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct aio_file *head;  // queued, not yet started
+	struct aio_file *tail;
+	bool stopping;
+	size_t max_size;        // reads of larger files fail with EFBIG; 0 = unlimited
+	size_t direct_min;      // O_DIRECT reads from this size up; 0 = never
+	unsigned depth;
+	pthread_t *threads;
+	unsigned thread_count;
+#ifdef HAVE_URING
+	bool uring;
+	struct io_uring ring;
+	int wake_fd;            // aio_submit() and aio_stop() poke the ring thread here
+	uint64_t wake_buf;
+#endif
+};
+
+static struct aio_file *aio_pop(struct aio *io)
+{
+	struct aio_file *op = io->head;
+	if (op) {
+		io->head = op->next;
+		if (!io->head)
+			io->tail = NULL;
+	}
+	return op;
+}
+
+// ----------------------------------------------------------------------------
+// Reading, shared by both engines: a buffer sized from the stat (plus one
+// byte, so that EOF shows without a grow), filled until a read returns 0
+// ----------------------------------------------------------------------------
+
+static int aio_read_prepare(const struct aio *io, struct aio_file *op, const struct stat *st)
+{
+	size_t expect = S_ISREG(st->st_mode) && st->st_size > 0 ? (size_t)st->st_size : 0;
+	if (io->max_size != 0 && expect > io->max_size)
+		return EFBIG;
+	op->direct = io->direct_min != 0 && S_ISREG(st->st_mode) && expect >= io->direct_min;
+	op->pos = 0;
+	op->cap = expect < 65536 ? 65536 : expect + 1;
+	if (op->direct) {
+		op->cap = (op->cap + AIO_DIRECT_ALIGN - 1) & ~(AIO_DIRECT_ALIGN - 1);
+		void *buf;
+		op->data = posix_memalign(&buf, AIO_DIRECT_ALIGN, op->cap) == 0 ? buf : NULL;
+	} else {
+		op->data = malloc(op->cap);
+	}
+	return op->data ? 0 : ENOMEM;
+}
+
+static size_t aio_read_len(const struct aio_file *op)
+{
+	size_t left = op->cap - op->pos;
+	return left < AIO_CHUNK ? left : AIO_CHUNK;
+}
+
+static void aio_read_no_direct(struct aio_file *op)
+{
+	int fl = fcntl(op->fd, F_GETFL);
+	if (fl >= 0)
+		fcntl(op->fd, F_SETFL, fl & ~O_DIRECT);
+	op->direct = false;
+}
+
+// Takes one read's result: 1 = read more, 0 = done, else an errno
+static int aio_read_advance(const struct aio *io, struct aio_file *op, ssize_t n)
+{
+	if (n < 0)
+		return (int)-n;
+	if (n == 0) {
+		op->size = op->pos;
+		return 0;
+	}
+	op->pos += (size_t)n;
+	if (io->max_size != 0 && op->pos > io->max_size)
+		return EFBIG;
+	if (op->pos == op->cap) {
+		// Larger than its stat said
+		if (op->cap > SIZE_MAX / 2)
+			return EFBIG;
+		if (op->direct)
+			aio_read_no_direct(op);
+		uint8_t *grown = realloc(op->data, op->cap * 2);
+		if (!grown)
+			return ENOMEM;
+		op->data = grown;
+		op->cap *= 2;
+	} else if (op->direct && op->pos % AIO_DIRECT_ALIGN != 0) {
+		// A short read before the end; the next would be misaligned
+		aio_read_no_direct(op);
+	}
+	return 1;
+}
+
+static void aio_read_fail(struct aio_file *op, int error)
+{
+	free(op->data);
+	op->data = NULL;
+	op->size = 0;
+	op->error = error;
+}
+
+// ----------------------------------------------------------------------------
+// Blocking engine
+// ----------------------------------------------------------------------------
+
+static int aio_read_blocking(const struct aio *io, struct aio_file *op)
+{
+	struct stat st;
+	if (stat(op->path, &st) != 0)
+		return errno;
+	int err = aio_read_prepare(io, op, &st);
+	if (err != 0)
+		return err;
+	op->fd = open(op->path, O_RDONLY | O_CLOEXEC | (op->direct ? O_DIRECT : 0));
+	if (op->fd < 0 && op->direct) {
+		op->direct = false;
+		op->fd = open(op->path, O_RDONLY | O_CLOEXEC);
+	}
+	if (op->fd < 0)
+		return errno;
+	do {
+		ssize_t n = read(op->fd, op->data + op->pos, aio_read_len(op));
+		if (n < 0 && errno == EINTR) {
+			err = 1;
+		} else if (n < 0 && errno == EINVAL && op->direct) {
+			aio_read_no_direct(op);
+			err = 1;
+		} else {
+			err = aio_read_advance(io, op, n < 0 ? -errno : n);
+		}
+	} while (err == 1);
+	close(op->fd);
+	return err;
+}
+
+static int aio_write_blocking(struct aio_file *op)
+{
+	int fd = open(op->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return errno;
+	int err = 0;
+	for (size_t done = 0; done < op->size && err == 0; ) {
+		size_t len = op->size - done < AIO_CHUNK ? op->size - done : AIO_CHUNK;
+		ssize_t n = write(fd, op->data + done, len);
+		if (n > 0)
+			done += (size_t)n;
+		else if (n == 0)
+			err = EIO;
+		else if (errno != EINTR)
+			err = errno;
+	}
+	if (close(fd) != 0 && err == 0)
+		err = errno;
+	if (err != 0)
+		unlink(op->path);
+	return err;
+}
+
+static void *aio_blocking_thread(void *arg)
+{
+	struct aio *io = arg;
+	pthread_mutex_lock(&io->lock);
+	for (;;) {
+		struct aio_file *op = aio_pop(io);
+		if (!op) {
+			if (io->stopping)
+				break;
+			pthread_cond_wait(&io->cond, &io->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&io->lock);
+		if (op->write) {
+			op->error = aio_write_blocking(op);
+		} else {
+			int err = aio_read_blocking(io, op);
+			if (err != 0)
+				aio_read_fail(op, err);
+		}
+		op->done(op);
+		pthread_mutex_lock(&io->lock);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// io_uring engine
+// ----------------------------------------------------------------------------
+
+#ifdef HAVE_URING
+
+enum { AIO_STATX, AIO_OPEN, AIO_TRANSFER, AIO_CLOSE };
+
+static void aio_uring_arm_wake(struct aio *io)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+	io_uring_prep_read(sqe, io->wake_fd, &io->wake_buf, sizeof(io->wake_buf), 0);
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+// Queues op's next operation, per op->stage
+static void aio_uring_prep(struct aio *io, struct aio_file *op)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+	switch (op->stage) {
+		case AIO_STATX:
+			io_uring_prep_statx(sqe, AT_FDCWD, op->path, 0, STATX_TYPE | STATX_SIZE, &op->stx);
+			break;
+		case AIO_OPEN:
+			if (op->write)
+				io_uring_prep_openat(sqe, AT_FDCWD, op->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			else
+				io_uring_prep_openat(sqe, AT_FDCWD, op->path, O_RDONLY | O_CLOEXEC | (op->direct ? O_DIRECT : 0), 0);
+			break;
+		case AIO_TRANSFER:
+			if (op->write) {
+				size_t len = op->size - op->pos < AIO_CHUNK ? op->size - op->pos : AIO_CHUNK;
+				io_uring_prep_write(sqe, op->fd, op->data + op->pos, (unsigned)len, (uint64_t)op->pos);
+			} else {
+				io_uring_prep_read(sqe, op->fd, op->data + op->pos, (unsigned)aio_read_len(op), (uint64_t)op->pos);
+			}
+			break;
+		case AIO_CLOSE:
+			io_uring_prep_close(sqe, op->fd);
+			break;
+	}
+	io_uring_sqe_set_data(sqe, op);
+}
+
+// Moves op on after a completion with result res; true once it is finished
+static bool aio_uring_step(struct aio *io, struct aio_file *op, int res)
+{
+	switch (op->stage) {
+		case AIO_STATX:
+			if (res < 0) {
+				op->error = -res;
+				return true;
+			} else {
+				struct stat st = { .st_mode = op->stx.stx_mode, .st_size = (off_t)op->stx.stx_size };
+				op->error = aio_read_prepare(io, op, &st);
+				if (op->error != 0)
+					return true;
+				op->stage = AIO_OPEN;
+			}
+			break;
+		case AIO_OPEN:
+			if (res == -EINVAL && op->direct) {
+				op->direct = false;     // resubmitted without O_DIRECT
+			} else if (res < 0) {
+				op->error = -res;
+				return true;
+			} else {
+				op->fd = res;
+				op->pos = 0;
+				op->stage = op->write && op->size == 0 ? AIO_CLOSE : AIO_TRANSFER;
+			}
+			break;
+		case AIO_TRANSFER:
+			if (op->write) {
+				if (res > 0)
+					op->pos += (size_t)res;
+				else if (res != -EINTR && res != -EAGAIN)
+					op->error = res < 0 ? -res : EIO;
+				if (op->error != 0 || op->pos == op->size)
+					op->stage = AIO_CLOSE;
+			} else if (res == -EINVAL && op->direct) {
+				aio_read_no_direct(op);
+			} else if (res != -EINTR && res != -EAGAIN) {
+				int err = aio_read_advance(io, op, res);
+				if (err != 1) {
+					op->error = err;
+					op->stage = AIO_CLOSE;
+				}
+			}
+			break;
+		case AIO_CLOSE:
+			if (res < 0 && op->write && op->error == 0)
+				op->error = -res;
+			return true;
+	}
+	aio_uring_prep(io, op);
+	return false;
+}
+
+static void aio_uring_finish(struct aio_file *op)
+{
+	if (op->write) {
+		if (op->error != 0)
+			unlink(op->path);
+	} else if (op->error != 0) {
+		aio_read_fail(op, op->error);
+	}
+	op->done(op);
+}
+
+static void *aio_uring_thread(void *arg)
+{
+	struct aio *io = arg;
+	unsigned inflight = 0;
+	aio_uring_arm_wake(io);
+	for (;;) {
+		pthread_mutex_lock(&io->lock);
+		while (inflight < io->depth) {
+			struct aio_file *op = aio_pop(io);
+			if (!op)
+				break;
+			op->stage = op->write ? AIO_OPEN : AIO_STATX;
+			aio_uring_prep(io, op);
+			inflight++;
+		}
+		bool stop = io->stopping && inflight == 0 && !io->head;
+		pthread_mutex_unlock(&io->lock);
+		if (stop)
+			break;
+
+		struct io_uring_cqe *cqe;
+		int rc = io_uring_submit_and_wait(&io->ring, 1);
+		if (rc < 0 && rc != -EINTR)
+			break;
+		unsigned head, seen = 0;
+		io_uring_for_each_cqe(&io->ring, head, cqe) {
+			struct aio_file *op = io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			seen++;
+			if (!op) {
+				aio_uring_arm_wake(io);
+			} else if (aio_uring_step(io, op, res)) {
+				inflight--;
+				aio_uring_finish(op);
+			}
+		}
+		io_uring_cq_advance(&io->ring, seen);
+	}
+	return NULL;
+}
+
+#endif  // HAVE_URING
+
+// ----------------------------------------------------------------------------
+
+// Starts the engine with up to depth files in flight
+static bool aio_start(struct aio *io, unsigned depth, size_t max_size, size_t direct_min)
+{
+	*io = (struct aio){ .max_size = max_size, .direct_min = direct_min, .depth = depth ? depth : 1 };
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->cond, NULL);
+	unsigned want = io->depth;
+#ifdef HAVE_URING
+	// Each file has one operation outstanding at a time, plus the wake read
+	io->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (io->wake_fd >= 0 && io_uring_queue_init(io->depth + 1, &io->ring, 0) == 0) {
+		io->uring = true;
+		want = 1;
+	} else if (io->wake_fd >= 0) {
+		close(io->wake_fd);
+	}
+#endif
+	io->threads = calloc(want, sizeof(*io->threads));
+	if (!io->threads)
+		return false;
+	for (unsigned i = 0; i < want; i++) {
+		void *(*fn)(void *) = aio_blocking_thread;
+#ifdef HAVE_URING
+		if (io->uring)
+			fn = aio_uring_thread;
+#endif
+		if (pthread_create(&io->threads[i], NULL, fn, io) != 0)
+			break;
+		io->thread_count++;
+	}
+	return io->thread_count > 0;
+}
+
+static void aio_wake(struct aio *io)
+{
+	pthread_cond_signal(&io->cond);
+#ifdef HAVE_URING
+	if (io->uring) {
+		uint64_t one = 1;
+		if (write(io->wake_fd, &one, sizeof(one)) < 0) {
+			// Already pending; the ring thread will look at the queue anyway
+		}
+	}
+#endif
+}
+
+static void aio_submit(struct aio *io, struct aio_file *op)
+{
+	op->next = NULL;
+	op->error = 0;
+	if (!op->write)
+		op->data = NULL;
+	pthread_mutex_lock(&io->lock);
+	if (io->tail)
+		io->tail->next = op;
+	else
+		io->head = op;
+	io->tail = op;
+	aio_wake(io);
+	pthread_mutex_unlock(&io->lock);
+}
+
+// Finishes everything queued, then stops the threads
+static void aio_stop(struct aio *io)
+{
+	pthread_mutex_lock(&io->lock);
+	io->stopping = true;
+	pthread_cond_broadcast(&io->cond);
+	aio_wake(io);
+	pthread_mutex_unlock(&io->lock);
+	for (unsigned i = 0; i < io->thread_count; i++)
+		pthread_join(io->threads[i], NULL);
+	free(io->threads);
+#ifdef HAVE_URING
+	if (io->uring) {
+		io_uring_queue_exit(&io->ring);
+		close(io->wake_fd);
+	}
+#endif
+	pthread_cond_destroy(&io->cond);
+	pthread_mutex_destroy(&io->lock);
+}
+
+#endif  // ASYNC_IO_H
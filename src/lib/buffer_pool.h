@@ -0,0 +1,208 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size-classed buffer pool for pixel planes and codec scratch buffers. A freed
+// block goes onto the freeing thread's free list and is handed back out to the
+// next request of the same class, so a batch or server run over similarly
+// sized frames reuses pages that are already faulted in instead of paying an
+// mmap/munmap pair and a page fault per 4 KiB on every image.
+//
+// Classes are quarter steps between powers of two, so a block is at most 25%
+// larger than asked for (never touched pages cost nothing). Blocks of
+// POOL_MAP_MIN and up are mmap'd directly; with pool_huge_pages set, the ones
+// spanning at least a huge page are 2 MiB aligned and advised for transparent
+// huge pages. Any thread may free any block. Each thread caches at most
+// pool_cache_limit bytes, and a thread's cache is released when it exits or
+// calls pool_trim().
+// Pool memory is not zeroed.
+
+#define POOL_MIN_SHIFT  12                          // smallest class: 4 KiB
+#define POOL_MAX_SHIFT  48
+#define POOL_CLASSES    (1 + 4 * (POOL_MAX_SHIFT - POOL_MIN_SHIFT))
+#define POOL_HEADER     64                          // keeps blocks cache-line aligned
+#define POOL_MAP_MIN    ((size_t)256 << 10)
+#define POOL_HUGE_PAGE  ((size_t)2 << 20)
+
+static bool pool_huge_pages = false;
+static size_t pool_cache_limit = (size_t)256 << 20;    // per thread
+
+struct pool_block {
+	struct pool_block *next;    // free list link while cached
+	void *base;                 // start of the mapping or malloc'd region
+	size_t map_len;             // 0 = malloc'd
+	size_t size;                // usable bytes (the class size)
+	unsigned cls;
+};
+
+_Static_assert(sizeof(struct pool_block) <= POOL_HEADER, "pool header too large");
+
+struct pool_cache {
+	struct pool_block *free[POOL_CLASSES];
+	size_t bytes;
+	bool registered;
+};
+
+static _Thread_local struct pool_cache pool_cache;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static size_t pool_class_size(unsigned cls)
+{
+	if (cls == 0)
+		return (size_t)1 << POOL_MIN_SHIFT;
+	unsigned k = POOL_MIN_SHIFT + (cls - 1) / 4;
+	size_t q = (cls - 1) % 4 + 1;
+	return ((size_t)1 << k) + q * ((size_t)1 << (k - 2));
+}
+
+// Smallest class holding size bytes; false if beyond the largest class
+static bool pool_class_of(size_t size, unsigned *cls)
+{
+	if (size <= (size_t)1 << POOL_MIN_SHIFT) {
+		*cls = 0;
+		return true;
+	}
+	unsigned k = (unsigned)(63 - __builtin_clzll((unsigned long long)(size - 1)));
+	if (k >= POOL_MAX_SHIFT)
+		return false;
+	size_t step = (size_t)1 << (k - 2);
+	size_t q = (size - ((size_t)1 << k) + step - 1) / step;
+	*cls = (k - POOL_MIN_SHIFT) * 4 + (unsigned)q;
+	return true;
+}
+
+static void pool_release(struct pool_block *b)
+{
+	if (b->map_len)
+		munmap(b->base, b->map_len);
+	else
+		free(b->base);
+}
+
+static void pool_drain(struct pool_cache *c)
+{
+	for (unsigned i = 0; i < POOL_CLASSES; i++) {
+		while (c->free[i]) {
+			struct pool_block *b = c->free[i];
+			c->free[i] = b->next;
+			pool_release(b);
+		}
+	}
+	c->bytes = 0;
+}
+
+static void pool_thread_exit(void *arg)
+{
+	pool_drain(arg);
+}
+
+static void pool_key_init(void)
+{
+	pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+// Maps a fresh block; page-granular, optionally huge-page aligned
+static struct pool_block *pool_map(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t align = page;
+	if (pool_huge_pages && size >= POOL_HUGE_PAGE)
+		align = POOL_HUGE_PAGE;
+	if (size > SIZE_MAX - POOL_HEADER - 2 * align)
+		return NULL;
+	size_t len = (size + POOL_HEADER + align - 1) & ~(align - 1);
+	size_t map_len = align > page ? len + align : len;
+
+	uint8_t *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	uint8_t *base = map;
+	if (align > page) {
+		// Trim the slack so the block starts and ends on huge-page boundaries
+		base = (uint8_t *)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+		if (base > map)
+			munmap(map, (size_t)(base - map));
+		size_t tail = map_len - (size_t)(base - map) - len;
+		if (tail)
+			munmap(base + len, tail);
+#ifdef MADV_HUGEPAGE
+		madvise(base, len, MADV_HUGEPAGE);
+#endif
+	}
+
+	struct pool_block *b = (struct pool_block *)base;
+	b->base = base;
+	b->map_len = len;
+	return b;
+}
+
+static void *pool_alloc(size_t size)
+{
+	unsigned cls;
+	if (!pool_class_of(size, &cls))
+		return NULL;
+
+	struct pool_cache *c = &pool_cache;
+	struct pool_block *b = c->free[cls];
+	if (b) {
+		c->free[cls] = b->next;
+		c->bytes -= b->size;
+		return (uint8_t *)b + POOL_HEADER;
+	}
+
+	size_t class_size = pool_class_size(cls);
+	if (class_size >= POOL_MAP_MIN) {
+		b = pool_map(class_size);
+	} else {
+		void *base;
+		if (posix_memalign(&base, POOL_HEADER, POOL_HEADER + class_size) != 0)
+			return NULL;
+		b = base;
+		b->base = base;
+		b->map_len = 0;
+	}
+	if (!b)
+		return NULL;
+	b->size = class_size;
+	b->cls = cls;
+	return (uint8_t *)b + POOL_HEADER;
+}
+
+static void pool_free(void *ptr)
+{
+	if (!ptr)
+		return;
+	struct pool_block *b = (struct pool_block *)((uint8_t *)ptr - POOL_HEADER);
+	struct pool_cache *c = &pool_cache;
+	if (b->size > pool_cache_limit - c->bytes) {
+		pool_release(b);
+		return;
+	}
+	if (!c->registered) {
+		pthread_once(&pool_key_once, pool_key_init);
+		if (pthread_setspecific(pool_key, c) != 0) {
+			pool_release(b);
+			return;
+		}
+		c->registered = true;
+	}
+	b->next = c->free[b->cls];
+	c->free[b->cls] = b;
+	c->bytes += b->size;
+}
+
+// Releases everything the calling thread has cached
+static void pool_trim(void)
+{
+	pool_drain(&pool_cache);
+}
+
+#endif  // BUFFER_POOL_H
@@ -0,0 +1,73 @@
+#ifndef FILE_COPY_H
+#define FILE_COPY_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>   // FICLONE
+#endif
+
+// Copies the first size bytes of in_fd to the current position of out_fd,
+// cheapest way first: into an empty regular file, a reflink sharing the
+// extents (Btrfs, XFS, bcachefs); then copy_file_range() (in-kernel, and
+// server-side on NFS); then sendfile(), which also takes a pipe or socket;
+// then plain pread()/write(). in_fd's own position is left alone. Needs Linux.
+
+enum file_copy_method { FILE_COPY_RANGE, FILE_COPY_SENDFILE, FILE_COPY_RW };
+
+static bool file_copy_fd(int in_fd, int out_fd, uint64_t size)
+{
+#ifdef FICLONE
+	struct stat st;
+	if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0 &&
+		ioctl(out_fd, FICLONE, in_fd) == 0) {
+		// A clone takes all of in_fd; callers pass its whole size
+		return lseek(out_fd, 0, SEEK_END) == (off_t)size;
+	}
+#endif
+
+	enum file_copy_method method = FILE_COPY_RANGE;
+	off_t in_off = 0;
+	char buf[65536];
+	while ((uint64_t)in_off < size) {
+		size_t want = (size_t)(size - (uint64_t)in_off);
+		ssize_t n;
+		if (method == FILE_COPY_RANGE) {
+			n = copy_file_range(in_fd, &in_off, out_fd, NULL, want, 0);
+		} else if (method == FILE_COPY_SENDFILE) {
+			n = sendfile(out_fd, in_fd, &in_off, want);
+		} else {
+			n = pread(in_fd, buf, want < sizeof(buf) ? want : sizeof(buf), in_off);
+			for (ssize_t done = 0; n > 0 && done < n; ) {
+				ssize_t w = write(out_fd, buf + done, (size_t)(n - done));
+				if (w < 0 && errno == EINTR)
+					continue;
+				if (w <= 0)
+					return false;
+				done += w;
+			}
+			if (n > 0)
+				in_off += n;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && in_off == 0 && method != FILE_COPY_RW &&
+			(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+			// Not supported between these two files; try the next way
+			method++;
+			continue;
+		}
+		if (n <= 0)
+			return false;   // error, or in_fd is shorter than size
+	}
+	return true;
+}
+
+#endif  // FILE_COPY_H
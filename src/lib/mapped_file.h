@@ -0,0 +1,148 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a whole input file. Regular files are mmap'd, so decoders
+// get a zero-copy span straight out of the page cache; anything that cannot be
+// mapped (pipes, sockets, character devices) is read into a malloc'd buffer.
+
+struct mapped_file {
+	const uint8_t *data;
+	size_t size;
+	bool mapped;    // munmap() rather than free()
+};
+
+enum {
+	MAP_FILE_SEQUENTIAL = 0,    // madvise(MADV_SEQUENTIAL) only
+	MAP_FILE_POPULATE = 1,      // also prefault the whole file up front
+	MAP_FILE_RANDOM = 2,        // MADV_RANDOM instead: header reads, no readahead
+};
+
+static bool map_file_read_all(int fd, size_t max_size, struct mapped_file *mf)
+{
+	size_t cap = 65536;
+	size_t size = 0;
+	uint8_t *buf = malloc(cap);
+	if (!buf) return false;
+
+	for (;;) {
+		if (size == cap) {
+			if (cap > SIZE_MAX / 2) {
+				free(buf);
+				errno = EFBIG;
+				return false;
+			}
+			uint8_t *grown = realloc(buf, cap * 2);
+			if (!grown) {
+				free(buf);
+				return false;
+			}
+			buf = grown;
+			cap *= 2;
+		}
+		ssize_t n = read(fd, buf + size, cap - size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return false;
+		}
+		if (n == 0)
+			break;
+		size += (size_t)n;
+		if (max_size != 0 && size > max_size) {
+			free(buf);
+			errno = EFBIG;
+			return false;
+		}
+	}
+
+	mf->data = buf;
+	mf->size = size;
+	mf->mapped = false;
+	return true;
+}
+
+// Maps an open file, which stays the caller's to close. Fails with errno =
+// EFBIG if the file is larger than max_size (0 = unlimited).
+static bool map_file_fd(int fd, size_t max_size, int flags, struct mapped_file *mf)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return map_file_read_all(fd, max_size, mf);
+
+	if (st.st_size < 0 || (uintmax_t)st.st_size > SIZE_MAX ||
+		(max_size != 0 && (uintmax_t)st.st_size > max_size)) {
+		errno = EFBIG;
+		return false;
+	}
+	size_t size = (size_t)st.st_size;
+
+	int mmap_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if (flags & MAP_FILE_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+#endif
+	void *data = mmap(NULL, size, PROT_READ, mmap_flags, fd, 0);
+	if (data == MAP_FAILED) {
+		// e.g. procfs or FUSE files that report a size but refuse mmap
+		return map_file_read_all(fd, max_size, mf);
+	}
+	madvise(data, size, (flags & MAP_FILE_RANDOM) ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+	mf->data = data;
+	mf->size = size;
+	mf->mapped = true;
+	return true;
+}
+
+// Fails with errno = EFBIG if the file is larger than max_size (0 = unlimited)
+static bool map_file(const char *path, size_t max_size, int flags, struct mapped_file *mf)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	bool ok = map_file_fd(fd, max_size, flags, mf);
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return ok;
+}
+
+// Drops the pages covering [from, to) from the process; a streaming reader
+// calls this on data it has consumed so RSS stays bounded. The mapping is
+// private and never written, so a page that also holds unread bytes is simply
+// faulted back in from the file. No-op for buffered (non-mapped) input.
+static void map_file_discard(const struct mapped_file *mf, const uint8_t *from, const uint8_t *to)
+{
+	if (!mf->mapped || to <= from)
+		return;
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)from & ~(page - 1);
+	uintptr_t end = (uintptr_t)to & ~(page - 1);
+	if (end > start)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+static void unmap_file(struct mapped_file *mf)
+{
+	if (mf->mapped)
+		munmap((void *)mf->data, mf->size);
+	else
+		free((void *)mf->data);
+	mf->data = NULL;
+	mf->size = 0;
+}
+
+#endif  // MAPPED_FILE_H
@@ -0,0 +1,57 @@
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Admission gate for jobs with a known (estimated) memory need: a job waits
+// until what is already admitted plus its own need fits under the limit.
+// Jobs are let in strictly in arrival order, so a large job is not starved by
+// a stream of small ones behind it; one larger than the whole limit waits for
+// everything before it to finish and then runs alone.
+
+struct mem_budget {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t limit;
+	uint64_t used;
+	uint64_t next_ticket;   // handed to the next arrival
+	uint64_t serving;       // the ticket allowed to enter next
+};
+
+static void mem_budget_init(struct mem_budget *b, uint64_t limit)
+{
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	b->limit = limit;
+	b->used = 0;
+	b->next_ticket = 0;
+	b->serving = 0;
+}
+
+// Blocks until need fits; returns the amount held, to be given back with
+// mem_budget_release(). Needs above the limit are held as the limit.
+static uint64_t mem_budget_acquire(struct mem_budget *b, uint64_t need)
+{
+	if (need > b->limit)
+		need = b->limit;
+	pthread_mutex_lock(&b->lock);
+	uint64_t ticket = b->next_ticket++;
+	while (ticket != b->serving || b->used + need > b->limit)
+		pthread_cond_wait(&b->cond, &b->lock);
+	b->used += need;
+	b->serving++;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	return need;
+}
+
+static void mem_budget_release(struct mem_budget *b, uint64_t held)
+{
+	pthread_mutex_lock(&b->lock);
+	b->used -= held;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+#endif  // MEM_BUDGET_H
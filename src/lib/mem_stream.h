@@ -0,0 +1,92 @@
+#ifndef MEM_STREAM_H
+#define MEM_STREAM_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Growable in-memory file behind a stdio FILE, for encoders that write to a
+// stream. Unlike open_memstream(), seeking back and rewriting (BMP rows,
+// libtiff's header patch) keeps the full length: size is the furthest byte
+// ever written, not the final position. Needs glibc's fopencookie().
+
+struct mem_stream {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+	size_t pos;
+};
+
+static ssize_t mem_stream_read(void *cookie, char *buf, size_t len)
+{
+	struct mem_stream *ms = cookie;
+	size_t avail = ms->pos < ms->size ? ms->size - ms->pos : 0;
+	if (len > avail)
+		len = avail;
+	memcpy(buf, ms->data + ms->pos, len);
+	ms->pos += len;
+	return (ssize_t)len;
+}
+
+static ssize_t mem_stream_write(void *cookie, const char *buf, size_t len)
+{
+	struct mem_stream *ms = cookie;
+	if (len > SIZE_MAX - ms->pos) {
+		errno = EFBIG;
+		return -1;
+	}
+	size_t end = ms->pos + len;
+	if (end > ms->cap) {
+		size_t cap = ms->cap ? ms->cap : 65536;
+		while (cap < end) {
+			if (cap > SIZE_MAX / 2) {
+				cap = end;
+				break;
+			}
+			cap *= 2;
+		}
+		uint8_t *grown = realloc(ms->data, cap);
+		if (!grown)
+			return -1;
+		ms->data = grown;
+		ms->cap = cap;
+	}
+	if (ms->pos > ms->size)
+		memset(ms->data + ms->size, 0, ms->pos - ms->size);  // hole left by a seek
+	memcpy(ms->data + ms->pos, buf, len);
+	ms->pos = end;
+	if (end > ms->size)
+		ms->size = end;
+	return (ssize_t)len;
+}
+
+static int mem_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct mem_stream *ms = cookie;
+	int64_t base = whence == SEEK_CUR ? (int64_t)ms->pos : whence == SEEK_END ? (int64_t)ms->size : 0;
+	if (*offset < -base || (*offset > 0 && base > INT64_MAX - *offset)) {
+		errno = EINVAL;
+		return -1;
+	}
+	ms->pos = (size_t)(base + *offset);
+	*offset = (off64_t)ms->pos;
+	return 0;
+}
+
+// Opens a read/write stream over ms, which must be zeroed. After fclose()
+// the contents are ms->data[0, ms->size), to be released with free().
+static FILE *mem_stream_open(struct mem_stream *ms)
+{
+	cookie_io_functions_t io = {
+		.read = mem_stream_read,
+		.write = mem_stream_write,
+		.seek = mem_stream_seek,
+		.close = NULL,
+	};
+	return fopencookie(ms, "w+", io);
+}
+
+#endif  // MEM_STREAM_H
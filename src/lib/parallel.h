@@ -0,0 +1,66 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Work-sharing loop: calls fn(ctx, i) for every i in [0, count) using up to
+// `threads` threads (the caller's thread included). Items are handed out one
+// at a time from a shared counter, so uneven item costs balance themselves.
+
+typedef void (*parallel_fn)(void *ctx, size_t index);
+
+struct parallel_job {
+	parallel_fn fn;
+	void *ctx;
+	size_t count;
+	atomic_size_t next;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_job *job = arg;
+	for (;;) {
+		size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+		if (i >= job->count)
+			break;
+		job->fn(job->ctx, i);
+	}
+	return NULL;
+}
+
+static inline int parallel_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) return 1;
+	if (n > 1024) return 1024;
+	return (int)n;
+}
+
+static inline void parallel_for(size_t count, int threads, parallel_fn fn, void *ctx)
+{
+	struct parallel_job job = { .fn = fn, .ctx = ctx, .count = count };
+	atomic_init(&job.next, 0);
+
+	if (threads < 1)
+		threads = 1;
+	if ((size_t)threads > count)
+		threads = (int)count;
+
+	pthread_t tids[threads > 1 ? threads - 1 : 1];
+	int started = 0;
+	for (int t = 0; t < threads - 1; t++) {
+		if (pthread_create(&tids[t], NULL, parallel_worker, &job) != 0)
+			break;  // run with whatever we managed to start
+		started++;
+	}
+
+	parallel_worker(&job);
+
+	for (int t = 0; t < started; t++)
+		pthread_join(tids[t], NULL);
+}
+
+#endif  // PARALLEL_H
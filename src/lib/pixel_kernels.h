@@ -0,0 +1,459 @@
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Channel swizzles over n pixels of 8-bit interleaved data. Each kernel has a
+// scalar version plus SSSE3/AVX2 (x86, picked at startup from CPUID) or NEON
+// (aarch64) versions. dst and src must not overlap.
+//
+//   rgba_to_rgb   RGBA -> RGB   (drop alpha)
+//   rgba_to_bgr   RGBA -> BGR   (drop alpha, swap R/B)
+//   rgb_swap_rb   RGB <-> BGR
+//   rgba_swap_rb  RGBA <-> BGRA
+//
+// Plus run scans: run_length3/4 count how many of the n pixels at src, from
+// the first, equal px (3 or 4 bytes), for run-length encoders.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_KERNELS_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define PIXEL_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*px_kernel_fn)(uint8_t *dst, const uint8_t *src, size_t n);
+typedef size_t (*px_run_fn)(const uint8_t *src, size_t n, const uint8_t px[4]);
+
+static void px_rgba_to_rgb_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i * 3 + 0] = src[i * 4 + 0];
+		dst[i * 3 + 1] = src[i * 4 + 1];
+		dst[i * 3 + 2] = src[i * 4 + 2];
+	}
+}
+
+static void px_rgba_to_bgr_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i * 3 + 0] = src[i * 4 + 2];
+		dst[i * 3 + 1] = src[i * 4 + 1];
+		dst[i * 3 + 2] = src[i * 4 + 0];
+	}
+}
+
+static void px_rgb_swap_rb_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i * 3 + 0] = src[i * 3 + 2];
+		dst[i * 3 + 1] = src[i * 3 + 1];
+		dst[i * 3 + 2] = src[i * 3 + 0];
+	}
+}
+
+static void px_rgba_swap_rb_scalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		dst[i * 4 + 0] = src[i * 4 + 2];
+		dst[i * 4 + 1] = src[i * 4 + 1];
+		dst[i * 4 + 2] = src[i * 4 + 0];
+		dst[i * 4 + 3] = src[i * 4 + 3];
+	}
+}
+
+static size_t px_run_length3_scalar(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	size_t i = 0;
+	while (i < n && src[i * 3] == px[0] && src[i * 3 + 1] == px[1] && src[i * 3 + 2] == px[2])
+		i++;
+	return i;
+}
+
+static size_t px_run_length4_scalar(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	uint32_t want;
+	memcpy(&want, px, 4);
+	size_t i = 0;
+	for (; i < n; i++) {
+		uint32_t v;
+		memcpy(&v, src + i * 4, 4);
+		if (v != want)
+			break;
+	}
+	return i;
+}
+
+#ifdef PIXEL_KERNELS_X86
+
+// The 3-byte-pixel kernels store 16 bytes at a time but only advance by 12 or
+// 15, so the vector loops stop early enough that no store runs past dst.
+
+#define PX_SHUF_RGBA_TO_RGB  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+#define PX_SHUF_RGBA_TO_BGR  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+#define PX_SHUF_RGBA_SWAP    2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+#define PX_SHUF_RGB_SWAP     2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15
+
+__attribute__((target("ssse3")))
+static void px_rgba_drop_ssse3(uint8_t *dst, const uint8_t *src, size_t n, __m128i mask,
+							   px_kernel_fn tail)
+{
+	size_t i = 0;
+	for (; i + 6 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+	}
+	tail(dst + i * 3, src + i * 4, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void px_rgba_to_rgb_ssse3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_rgba_drop_ssse3(dst, src, n, _mm_setr_epi8(PX_SHUF_RGBA_TO_RGB), px_rgba_to_rgb_scalar);
+}
+
+__attribute__((target("ssse3")))
+static void px_rgba_to_bgr_ssse3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_rgba_drop_ssse3(dst, src, n, _mm_setr_epi8(PX_SHUF_RGBA_TO_BGR), px_rgba_to_bgr_scalar);
+}
+
+__attribute__((target("ssse3")))
+static void px_rgb_swap_rb_ssse3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i mask = _mm_setr_epi8(PX_SHUF_RGB_SWAP);
+	size_t i = 0;
+	// 5 pixels (15 bytes) per step; the 16th byte is rewritten by the next step
+	for (; i + 6 <= n; i += 5) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 3));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+	}
+	px_rgb_swap_rb_scalar(dst + i * 3, src + i * 3, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void px_rgba_swap_rb_ssse3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i mask = _mm_setr_epi8(PX_SHUF_RGBA_SWAP);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+	}
+	px_rgba_swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+// vpshufb works within 128-bit lanes: compact each lane's 4 pixels to 12
+// bytes, then vpermd the two 12-byte halves together.
+__attribute__((target("avx2")))
+static void px_rgba_drop_avx2(uint8_t *dst, const uint8_t *src, size_t n, __m256i mask,
+							  px_kernel_fn tail)
+{
+	const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	size_t i = 0;
+	for (; i + 11 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), pack);
+		_mm256_storeu_si256((__m256i *)(dst + i * 3), v);
+	}
+	tail(dst + i * 3, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static void px_rgba_to_rgb_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_rgba_drop_avx2(dst, src, n, _mm256_setr_epi8(PX_SHUF_RGBA_TO_RGB, PX_SHUF_RGBA_TO_RGB),
+					  px_rgba_to_rgb_ssse3);
+}
+
+__attribute__((target("avx2")))
+static void px_rgba_to_bgr_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_rgba_drop_avx2(dst, src, n, _mm256_setr_epi8(PX_SHUF_RGBA_TO_BGR, PX_SHUF_RGBA_TO_BGR),
+					  px_rgba_to_bgr_ssse3);
+}
+
+__attribute__((target("avx2")))
+static void px_rgba_swap_rb_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m256i mask = _mm256_setr_epi8(PX_SHUF_RGBA_SWAP, PX_SHUF_RGBA_SWAP);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_shuffle_epi8(v, mask));
+	}
+	px_rgba_swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+// Run scans compare a block of bytes against px repeated to the same width; a
+// 3-byte pattern lines up with itself every 3 vectors. The first mismatching
+// byte (lowest clear bit of the movemask) gives the run length.
+
+// px repeated over 8 bytes, starting at channel `phase` (0-2) of the pixel.
+// A 16- or 32-byte vector of the pattern at byte offset o is assembled from
+// these with phase (o + 8k) % 3 for its k-th 8-byte word.
+static inline long long px_pattern3_word(const uint8_t px[4], int phase)
+{
+	uint64_t t = (uint64_t)px[phase % 3] | (uint64_t)px[(phase + 1) % 3] << 8 |
+				 (uint64_t)px[(phase + 2) % 3] << 16;
+	return (long long)(t | t << 24 | t << 48);
+}
+
+__attribute__((target("sse2")))
+static size_t px_run_length3_sse2(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	long long q0 = px_pattern3_word(px, 0), q1 = px_pattern3_word(px, 1), q2 = px_pattern3_word(px, 2);
+	const __m128i p0 = _mm_set_epi64x(q2, q0);
+	const __m128i p1 = _mm_set_epi64x(q0, q1);
+	const __m128i p2 = _mm_set_epi64x(q1, q2);
+
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const uint8_t *b = src + i * 3;
+		uint64_t m = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)b), p0)) |
+					 (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(b + 16)), p1)) << 16 |
+					 (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(b + 32)), p2)) << 32;
+		if (m != 0xffffffffffffull)
+			return i + (size_t)__builtin_ctzll(~m) / 3;
+	}
+	return i + px_run_length3_scalar(src + i * 3, n - i, px);
+}
+
+__attribute__((target("sse2")))
+static size_t px_run_length4_sse2(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	int32_t word;
+	memcpy(&word, px, 4);
+	const __m128i pat = _mm_set1_epi32(word);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, pat));
+		if (m != 0xffff)
+			return i + (size_t)__builtin_ctz(~m) / 4;
+	}
+	return i + px_run_length4_scalar(src + i * 4, n - i, px);
+}
+
+__attribute__((target("avx2")))
+static size_t px_run_length3_avx2(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	long long q0 = px_pattern3_word(px, 0), q1 = px_pattern3_word(px, 1), q2 = px_pattern3_word(px, 2);
+	const __m256i p[3] = {
+		_mm256_set_epi64x(q0, q1, q2, q0),
+		_mm256_set_epi64x(q2, q0, q1, q2),
+		_mm256_set_epi64x(q1, q2, q0, q1),
+	};
+
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		const uint8_t *b = src + i * 3;
+		for (int k = 0; k < 3; k++) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(b + k * 32));
+			unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, p[k]));
+			if (m != 0xffffffffu)
+				return i + ((size_t)k * 32 + (size_t)__builtin_ctz(~m)) / 3;
+		}
+	}
+	return i + px_run_length3_sse2(src + i * 3, n - i, px);
+}
+
+__attribute__((target("avx2")))
+static size_t px_run_length4_avx2(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	int32_t word;
+	memcpy(&word, px, 4);
+	const __m256i pat = _mm256_set1_epi32(word);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat));
+		if (m != 0xffffffffu)
+			return i + (size_t)__builtin_ctz(~m) / 4;
+	}
+	return i + px_run_length4_scalar(src + i * 4, n - i, px);
+}
+
+#endif  // PIXEL_KERNELS_X86
+
+#ifdef PIXEL_KERNELS_NEON
+
+// Structure loads/stores (vld3/vld4, vst3/vst4) de- and re-interleave 16
+// pixels per step, so the swizzle itself is just a register rename.
+
+static void px_rgba_to_rgb_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(src + i * 4);
+		uint8x16x3_t o = { { v.val[0], v.val[1], v.val[2] } };
+		vst3q_u8(dst + i * 3, o);
+	}
+	px_rgba_to_rgb_scalar(dst + i * 3, src + i * 4, n - i);
+}
+
+static void px_rgba_to_bgr_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(src + i * 4);
+		uint8x16x3_t o = { { v.val[2], v.val[1], v.val[0] } };
+		vst3q_u8(dst + i * 3, o);
+	}
+	px_rgba_to_bgr_scalar(dst + i * 3, src + i * 4, n - i);
+}
+
+static void px_rgb_swap_rb_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x3_t v = vld3q_u8(src + i * 3);
+		uint8x16x3_t o = { { v.val[2], v.val[1], v.val[0] } };
+		vst3q_u8(dst + i * 3, o);
+	}
+	px_rgb_swap_rb_scalar(dst + i * 3, src + i * 3, n - i);
+}
+
+static void px_rgba_swap_rb_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(src + i * 4);
+		uint8x16x4_t o = { { v.val[2], v.val[1], v.val[0], v.val[3] } };
+		vst4q_u8(dst + i * 4, o);
+	}
+	px_rgba_swap_rb_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+// Run scans stop at the first block holding a mismatch and let the scalar
+// loop find the exact pixel within it
+static size_t px_run_length3_neon(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	const uint8x16_t r = vdupq_n_u8(px[0]), g = vdupq_n_u8(px[1]), b = vdupq_n_u8(px[2]);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x3_t v = vld3q_u8(src + i * 3);
+		uint8x16_t eq = vandq_u8(vandq_u8(vceqq_u8(v.val[0], r), vceqq_u8(v.val[1], g)),
+								 vceqq_u8(v.val[2], b));
+		if (vminvq_u8(eq) != 0xff)
+			break;
+	}
+	return i + px_run_length3_scalar(src + i * 3, n - i, px);
+}
+
+static size_t px_run_length4_neon(const uint8_t *src, size_t n, const uint8_t px[4])
+{
+	uint32_t word;
+	memcpy(&word, px, 4);
+	const uint32x4_t pat = vdupq_n_u32(word);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+		if (vminvq_u32(vceqq_u32(v, pat)) != 0xffffffffu)
+			break;
+	}
+	return i + px_run_length4_scalar(src + i * 4, n - i, px);
+}
+
+#endif  // PIXEL_KERNELS_NEON
+
+struct pixel_kernels {
+	px_kernel_fn rgba_to_rgb;
+	px_kernel_fn rgba_to_bgr;
+	px_kernel_fn rgb_swap_rb;
+	px_kernel_fn rgba_swap_rb;
+	px_run_fn run_length3;
+	px_run_fn run_length4;
+};
+
+static struct pixel_kernels px_kernels = {
+#if defined(PIXEL_KERNELS_NEON)
+	.rgba_to_rgb = px_rgba_to_rgb_neon,
+	.rgba_to_bgr = px_rgba_to_bgr_neon,
+	.rgb_swap_rb = px_rgb_swap_rb_neon,
+	.rgba_swap_rb = px_rgba_swap_rb_neon,
+	.run_length3 = px_run_length3_neon,
+	.run_length4 = px_run_length4_neon,
+#else
+	.rgba_to_rgb = px_rgba_to_rgb_scalar,
+	.rgba_to_bgr = px_rgba_to_bgr_scalar,
+	.rgb_swap_rb = px_rgb_swap_rb_scalar,
+	.rgba_swap_rb = px_rgba_swap_rb_scalar,
+	.run_length3 = px_run_length3_scalar,
+	.run_length4 = px_run_length4_scalar,
+#endif
+};
+
+#ifdef PIXEL_KERNELS_X86
+__attribute__((constructor))
+static void px_kernels_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		px_kernels.run_length3 = px_run_length3_sse2;
+		px_kernels.run_length4 = px_run_length4_sse2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		px_kernels.rgba_to_rgb = px_rgba_to_rgb_ssse3;
+		px_kernels.rgba_to_bgr = px_rgba_to_bgr_ssse3;
+		px_kernels.rgb_swap_rb = px_rgb_swap_rb_ssse3;
+		px_kernels.rgba_swap_rb = px_rgba_swap_rb_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		px_kernels.rgba_to_rgb = px_rgba_to_rgb_avx2;
+		px_kernels.rgba_to_bgr = px_rgba_to_bgr_avx2;
+		px_kernels.rgba_swap_rb = px_rgba_swap_rb_avx2;
+		px_kernels.run_length3 = px_run_length3_avx2;
+		px_kernels.run_length4 = px_run_length4_avx2;
+	}
+}
+#endif
+
+static inline void px_rgba_to_rgb(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_kernels.rgba_to_rgb(dst, src, n);
+}
+
+static inline void px_rgba_to_bgr(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_kernels.rgba_to_bgr(dst, src, n);
+}
+
+static inline void px_rgb_swap_rb(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_kernels.rgb_swap_rb(dst, src, n);
+}
+
+static inline void px_rgba_swap_rb(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	px_kernels.rgba_swap_rb(dst, src, n);
+}
+
+static inline size_t px_run_length(const uint8_t *src, size_t n, int channels, const uint8_t px[4])
+{
+	return channels == 4 ? px_kernels.run_length4(src, n, px) : px_kernels.run_length3(src, n, px);
+}
+
+// libtiff's packed ABGR raster words (R in the low byte) are already RGBA in
+// memory on little-endian hosts
+static inline void px_abgr32_to_rgba(uint8_t *dst, const uint32_t *src, size_t n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(dst, src, n * 4);
+#else
+	for (size_t i = 0; i < n; i++) {
+		uint32_t p = src[i];
+		dst[i * 4 + 0] = p & 0xff;
+		dst[i * 4 + 1] = (p >> 8) & 0xff;
+		dst[i * 4 + 2] = (p >> 16) & 0xff;
+		dst[i * 4 + 3] = (p >> 24) & 0xff;
+	}
+#endif
+}
+
+#endif  // PIXEL_KERNELS_H
@@ -0,0 +1,97 @@
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// PNG row filters (PNG spec section 9) for encoders that deflate the image
+// data themselves. Each row is written as its filter type byte followed by the
+// filtered bytes; png_row_filter() tries every type in `mask` and keeps the one
+// with the smallest sum of absolute (signed) residuals, libpng's heuristic.
+
+enum png_row_filter {
+	PNG_ROW_NONE,
+	PNG_ROW_SUB,
+	PNG_ROW_UP,
+	PNG_ROW_AVG,
+	PNG_ROW_PAETH,
+};
+
+#define PNG_ROW_MASK(type) (1u << (type))
+#define PNG_ROW_MASK_ALL 0x1fu
+
+static inline uint8_t png_row_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = p > a ? p - a : a - p;
+	int pb = p > b ? p - b : b - p;
+	int pc = p > c ? p - c : c - p;
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filters one row of n bytes with bpp bytes per pixel; prev is the row
+// above, NULL for the first row of the image (treated as zeros). Returns the
+// heuristic's cost.
+static uint64_t png_row_filter_apply(enum png_row_filter type, const uint8_t *row, const uint8_t *prev,
+									 size_t n, int bpp, uint8_t *out)
+{
+	size_t b = (size_t)bpp < n ? (size_t)bpp : n;
+	// With zeros above, Up is None and Paeth always picks the left pixel (Sub)
+	if (!prev && (type == PNG_ROW_UP || type == PNG_ROW_PAETH))
+		type = type == PNG_ROW_UP ? PNG_ROW_NONE : PNG_ROW_SUB;
+	switch (type) {
+		case PNG_ROW_NONE:
+			memcpy(out, row, n);
+			break;
+		case PNG_ROW_SUB:
+			memcpy(out, row, b);
+			for (size_t i = b; i < n; i++)
+				out[i] = (uint8_t)(row[i] - row[i - b]);
+			break;
+		case PNG_ROW_UP:
+			for (size_t i = 0; i < n; i++)
+				out[i] = (uint8_t)(row[i] - prev[i]);
+			break;
+		case PNG_ROW_AVG:
+			for (size_t i = 0; i < b; i++)
+				out[i] = (uint8_t)(row[i] - (prev ? prev[i] >> 1 : 0));
+			for (size_t i = b; i < n; i++)
+				out[i] = (uint8_t)(row[i] - ((row[i - b] + (prev ? prev[i] : 0)) >> 1));
+			break;
+		case PNG_ROW_PAETH:
+			for (size_t i = 0; i < b; i++)
+				out[i] = (uint8_t)(row[i] - prev[i]);
+			for (size_t i = b; i < n; i++)
+				out[i] = (uint8_t)(row[i] - png_row_paeth(row[i - b], prev[i], prev[i - b]));
+			break;
+	}
+	uint64_t cost = 0;
+	for (size_t i = 0; i < n; i++)
+		cost += out[i] < 128 ? out[i] : 256 - out[i];
+	return cost;
+}
+
+// Writes the type byte and the filtered row to out (n + 1 bytes); scratch
+// holds n bytes
+static void png_row_filter(const uint8_t *row, const uint8_t *prev, size_t n, int bpp, unsigned mask,
+						   uint8_t *out, uint8_t *scratch)
+{
+	if ((mask & PNG_ROW_MASK_ALL) == 0)
+		mask = PNG_ROW_MASK(PNG_ROW_NONE);
+	uint64_t best = UINT64_MAX;
+	for (int type = PNG_ROW_NONE; type <= PNG_ROW_PAETH; type++) {
+		if (!(mask & PNG_ROW_MASK(type)))
+			continue;
+		uint8_t *dst = best == UINT64_MAX ? out + 1 : scratch;
+		uint64_t cost = png_row_filter_apply((enum png_row_filter)type, row, prev, n, bpp, dst);
+		if (cost < best) {
+			if (dst != out + 1)
+				memcpy(out + 1, dst, n);
+			out[0] = (uint8_t)type;
+			best = cost;
+		}
+	}
+}
+
+#endif  // PNG_FILTER_H
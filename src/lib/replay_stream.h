@@ -0,0 +1,153 @@
+#ifndef REPLAY_STREAM_H
+#define REPLAY_STREAM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Input from a pipe that can be looked at before it is consumed. Bytes read
+// from fd while recording are kept, so the caller can sniff the magic bytes,
+// hand a stdio FILE to a streaming decoder and, if that decoder turns the
+// input down after reading its header, still slurp the rest and decode the
+// whole buffer. Once recording stops, the FILE replays what was kept and then
+// reads straight through. total counts every byte taken from fd; going over
+// max_size (0 = unlimited) fails with errno = EFBIG. Some decoders take a read
+// error for a truncated file and carry on, so the first one is also kept in
+// error. Needs glibc's fopencookie().
+
+struct replay_stream {
+	int fd;
+	size_t max_size;
+	uint8_t *data;      // recorded bytes
+	size_t size;
+	size_t cap;
+	size_t pos;         // FILE read position within data
+	size_t total;
+	int error;          // errno of the first failed read, 0 = none
+	bool recording;
+};
+
+static void replay_stream_init(struct replay_stream *rs, int fd, size_t max_size)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->fd = fd;
+	rs->max_size = max_size;
+	rs->recording = true;
+}
+
+static bool replay_stream_reserve(struct replay_stream *rs, size_t need)
+{
+	if (need <= rs->cap)
+		return true;
+	size_t cap = rs->cap ? rs->cap : 65536;
+	while (cap < need) {
+		if (cap > SIZE_MAX / 2) {
+			errno = EFBIG;
+			return false;
+		}
+		cap *= 2;
+	}
+	uint8_t *grown = realloc(rs->data, cap);
+	if (!grown)
+		return false;
+	rs->data = grown;
+	rs->cap = cap;
+	return true;
+}
+
+// read() with EINTR retry and the max_size check
+static ssize_t replay_stream_pull(struct replay_stream *rs, void *buf, size_t len)
+{
+	ssize_t n;
+	do {
+		n = read(rs->fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) {
+		rs->total += (size_t)n;
+		if (rs->max_size != 0 && rs->total > rs->max_size) {
+			errno = EFBIG;
+			n = -1;
+		}
+	}
+	if (n < 0 && rs->error == 0)
+		rs->error = errno;
+	return n;
+}
+
+// Records until at least want bytes are held or fd hits EOF
+static bool replay_stream_fill(struct replay_stream *rs, size_t want)
+{
+	if (!replay_stream_reserve(rs, want))
+		return false;
+	while (rs->size < want) {
+		ssize_t n = replay_stream_pull(rs, rs->data + rs->size, rs->cap - rs->size);
+		if (n < 0)
+			return false;
+		if (n == 0)
+			break;
+		rs->size += (size_t)n;
+	}
+	return true;
+}
+
+// Records the rest of fd; afterwards data[0, size) is the whole input
+static bool replay_stream_read_all(struct replay_stream *rs)
+{
+	for (;;) {
+		if (rs->size == rs->cap && !replay_stream_reserve(rs, rs->cap + 1))
+			return false;
+		ssize_t n = replay_stream_pull(rs, rs->data + rs->size, rs->cap - rs->size);
+		if (n < 0)
+			return false;
+		if (n == 0)
+			return true;
+		rs->size += (size_t)n;
+	}
+}
+
+static ssize_t replay_stream_cookie_read(void *cookie, char *buf, size_t len)
+{
+	struct replay_stream *rs = cookie;
+	if (rs->pos == rs->size) {
+		if (!rs->recording)
+			return replay_stream_pull(rs, buf, len);
+		if (!replay_stream_fill(rs, rs->size + 1))
+			return -1;
+		if (rs->pos == rs->size)
+			return 0;  // EOF
+	}
+	size_t n = rs->size - rs->pos;
+	if (n > len)
+		n = len;
+	memcpy(buf, rs->data + rs->pos, n);
+	rs->pos += n;
+	return (ssize_t)n;
+}
+
+// Opens a read-only stream over rs starting at the first recorded byte. The
+// FILE does not own rs; fclose() it before replay_stream_free().
+static FILE *replay_stream_open(struct replay_stream *rs)
+{
+	cookie_io_functions_t io = {
+		.read = replay_stream_cookie_read,
+		.write = NULL,
+		.seek = NULL,
+		.close = NULL,
+	};
+	rs->pos = 0;
+	return fopencookie(rs, "r", io);
+}
+
+static void replay_stream_free(struct replay_stream *rs)
+{
+	free(rs->data);
+	rs->data = NULL;
+	rs->size = rs->cap = rs->pos = 0;
+}
+
+#endif  // REPLAY_STREAM_H
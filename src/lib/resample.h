@@ -0,0 +1,511 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "parallel.h"
+
+// Separable resampling of interleaved 8-bit pixels: a horizontal pass into a
+// float intermediate, then a vertical pass back to 8 bits. Each output pixel
+// is a weighted sum of a short run of input pixels; the weights for one axis
+// are computed once up front. Both passes are split into bands of rows run
+// on parallel_for() threads.
+//
+// Four-channel images are filtered with premultiplied alpha, so colour from
+// transparent pixels does not bleed into their neighbours.
+//
+// The inner loops have SSE2/AVX2 (x86, the vertical pass picked at startup
+// from CPUID) and NEON (aarch64) versions next to the scalar ones.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define RESAMPLE_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum resample_filter {
+	RESAMPLE_BOX,       // area averaging
+	RESAMPLE_BICUBIC,   // Catmull-Rom
+	RESAMPLE_LANCZOS,   // Lanczos, 3 lobes
+};
+
+#define RESAMPLE_BAND_ROWS  16
+#define RESAMPLE_PI         3.14159265358979323846
+
+static bool resample_filter_parse(const char *name, enum resample_filter *filter)
+{
+	if (strcasecmp(name, "box") == 0)
+		*filter = RESAMPLE_BOX;
+	else if (strcasecmp(name, "bicubic") == 0 || strcasecmp(name, "cubic") == 0)
+		*filter = RESAMPLE_BICUBIC;
+	else if (strcasecmp(name, "lanczos") == 0 || strcasecmp(name, "lanczos3") == 0)
+		*filter = RESAMPLE_LANCZOS;
+	else
+		return false;
+	return true;
+}
+
+struct resample_axis {
+	int *first;         // first input index for each output index
+	int *count;         // number of taps for each output index
+	float *weights;     // taps, max_taps per output index
+	int max_taps;
+};
+
+static void resample_axis_free(struct resample_axis *ax)
+{
+	free(ax->first);
+	free(ax->count);
+	free(ax->weights);
+}
+
+static bool resample_axis_alloc(struct resample_axis *ax, int dst, int max_taps)
+{
+	ax->max_taps = max_taps;
+	ax->first = malloc((size_t)dst * sizeof(*ax->first));
+	ax->count = malloc((size_t)dst * sizeof(*ax->count));
+	ax->weights = malloc((size_t)dst * (size_t)max_taps * sizeof(*ax->weights));
+	if (!ax->first || !ax->count || !ax->weights) {
+		resample_axis_free(ax);
+		return false;
+	}
+	return true;
+}
+
+// Area averaging: each output pixel covers src/dst input pixels, each weighted
+// by how much of it falls inside. Exact for integer downscale factors.
+static bool resample_axis_box(struct resample_axis *ax, int src, int dst)
+{
+	double ratio = (double)src / dst;
+	if (!resample_axis_alloc(ax, dst, (int)ratio + 2))
+		return false;
+
+	for (int i = 0; i < dst; i++) {
+		double lo = i * ratio, hi = lo + ratio;
+		int a = (int)floor(lo), b = (int)ceil(hi);
+		if (b > src)
+			b = src;
+		if (b <= a)
+			b = a + 1;
+		if (b - a > ax->max_taps)
+			b = a + ax->max_taps;
+
+		float *w = ax->weights + (size_t)i * (size_t)ax->max_taps;
+		double sum = 0;
+		for (int j = a; j < b; j++) {
+			double cover = (j + 1 < hi ? j + 1 : hi) - (j > lo ? j : lo);
+			w[j - a] = (float)(cover > 0 ? cover : 0);
+			sum += w[j - a];
+		}
+		for (int j = 0; j < b - a; j++)
+			w[j] = sum > 0 ? (float)(w[j] / sum) : 1.0f / (float)(b - a);
+		ax->first[i] = a;
+		ax->count[i] = b - a;
+	}
+	return true;
+}
+
+static double resample_sinc(double x)
+{
+	if (x == 0)
+		return 1;
+	x *= RESAMPLE_PI;
+	return sin(x) / x;
+}
+
+static double resample_kernel(enum resample_filter filter, double x)
+{
+	x = fabs(x);
+	if (filter == RESAMPLE_BICUBIC) {
+		if (x < 1)
+			return (1.5 * x - 2.5) * x * x + 1;
+		if (x < 2)
+			return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+		return 0;
+	}
+	return x < 3 ? resample_sinc(x) * resample_sinc(x / 3) : 0;
+}
+
+// Interpolating kernels: when shrinking, the kernel is stretched by the ratio
+// so that it still low-passes the input instead of skipping over it
+static bool resample_axis_kernel(struct resample_axis *ax, int src, int dst, enum resample_filter filter)
+{
+	double ratio = (double)src / dst;
+	double stretch = ratio > 1 ? ratio : 1;
+	double support = (filter == RESAMPLE_BICUBIC ? 2 : 3) * stretch;
+	if (!resample_axis_alloc(ax, dst, (int)ceil(support) * 2 + 1))
+		return false;
+
+	for (int i = 0; i < dst; i++) {
+		double center = (i + 0.5) * ratio;
+		int a = (int)floor(center - support + 0.5), b = (int)floor(center + support + 0.5);
+		if (a < 0)
+			a = 0;
+		if (b > src)
+			b = src;
+		if (b - a > ax->max_taps)
+			b = a + ax->max_taps;
+		if (b <= a) {
+			a = b - 1 < 0 ? 0 : b - 1;
+			b = a + 1;
+		}
+
+		float *w = ax->weights + (size_t)i * (size_t)ax->max_taps;
+		double sum = 0;
+		for (int j = a; j < b; j++) {
+			double k = resample_kernel(filter, (j + 0.5 - center) / stretch);
+			w[j - a] = (float)k;
+			sum += k;
+		}
+		for (int j = 0; j < b - a; j++)
+			w[j] = sum != 0 ? (float)(w[j] / sum) : 1.0f / (float)(b - a);
+		ax->first[i] = a;
+		ax->count[i] = b - a;
+	}
+	return true;
+}
+
+static bool resample_axis_init(struct resample_axis *ax, int src, int dst, enum resample_filter filter)
+{
+	if (filter == RESAMPLE_BOX)
+		return resample_axis_box(ax, src, dst);
+	return resample_axis_kernel(ax, src, dst, filter);
+}
+
+// ============================================================================
+// Kernels
+// ============================================================================
+
+// Horizontal pass over one row of floats: out[x] = sum of w * in[first[x] + t]
+typedef void (*rs_hpass_fn)(float *out, const float *in, const struct resample_axis *ax, int dst_w,
+							int channels);
+// Vertical pass: acc[i] = sum over t of w[t] * in[t * stride + i], for i < n
+typedef void (*rs_vpass_fn)(float *acc, const float *in, size_t stride, const float *w, int taps, size_t n);
+
+static void rs_hpass_scalar(float *out, const float *in, const struct resample_axis *ax, int dst_w,
+							int channels)
+{
+	for (int x = 0; x < dst_w; x++) {
+		const float *w = ax->weights + (size_t)x * (size_t)ax->max_taps;
+		const float *p = in + (size_t)ax->first[x] * (size_t)channels;
+		for (int c = 0; c < channels; c++) {
+			float acc = 0;
+			for (int t = 0; t < ax->count[x]; t++)
+				acc += w[t] * p[t * channels + c];
+			out[x * channels + c] = acc;
+		}
+	}
+}
+
+static void rs_vpass_scalar(float *acc, const float *in, size_t stride, const float *w, int taps, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		float sum = 0;
+		for (int t = 0; t < taps; t++)
+			sum += w[t] * in[(size_t)t * stride + i];
+		acc[i] = sum;
+	}
+}
+
+#ifdef RESAMPLE_X86
+
+// One pixel per vector: the 3-channel loads read one float past the pixel,
+// which the padded input row allows; the last pixel of a 3-channel output row
+// is stored lane by lane so nothing lands in the next row.
+__attribute__((target("sse2")))
+static void rs_hpass_sse2(float *out, const float *in, const struct resample_axis *ax, int dst_w,
+						  int channels)
+{
+	if (channels < 3) {
+		rs_hpass_scalar(out, in, ax, dst_w, channels);
+		return;
+	}
+	for (int x = 0; x < dst_w; x++) {
+		const float *w = ax->weights + (size_t)x * (size_t)ax->max_taps;
+		const float *p = in + (size_t)ax->first[x] * (size_t)channels;
+		__m128 acc = _mm_setzero_ps();
+		for (int t = 0; t < ax->count[x]; t++)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(p + t * channels)));
+		if (channels == 4 || x + 1 < dst_w) {
+			_mm_storeu_ps(out + x * channels, acc);
+		} else {
+			float lanes[4];
+			_mm_storeu_ps(lanes, acc);
+			memcpy(out + x * channels, lanes, 3 * sizeof(float));
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void rs_vpass_sse2(float *acc, const float *in, size_t stride, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 sum = _mm_setzero_ps();
+		for (int t = 0; t < taps; t++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(in + (size_t)t * stride + i)));
+		_mm_storeu_ps(acc + i, sum);
+	}
+	rs_vpass_scalar(acc + i, in + i, stride, w, taps, n - i);
+}
+
+// 32 floats per step keeps four independent FMA chains in flight
+__attribute__((target("avx2,fma")))
+static void rs_vpass_avx2(float *acc, const float *in, size_t stride, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+		__m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+		for (int t = 0; t < taps; t++) {
+			const float *row = in + (size_t)t * stride + i;
+			__m256 wt = _mm256_set1_ps(w[t]);
+			s0 = _mm256_fmadd_ps(wt, _mm256_loadu_ps(row), s0);
+			s1 = _mm256_fmadd_ps(wt, _mm256_loadu_ps(row + 8), s1);
+			s2 = _mm256_fmadd_ps(wt, _mm256_loadu_ps(row + 16), s2);
+			s3 = _mm256_fmadd_ps(wt, _mm256_loadu_ps(row + 24), s3);
+		}
+		_mm256_storeu_ps(acc + i, s0);
+		_mm256_storeu_ps(acc + i + 8, s1);
+		_mm256_storeu_ps(acc + i + 16, s2);
+		_mm256_storeu_ps(acc + i + 24, s3);
+	}
+	for (; i + 8 <= n; i += 8) {
+		__m256 sum = _mm256_setzero_ps();
+		for (int t = 0; t < taps; t++)
+			sum = _mm256_fmadd_ps(_mm256_set1_ps(w[t]), _mm256_loadu_ps(in + (size_t)t * stride + i), sum);
+		_mm256_storeu_ps(acc + i, sum);
+	}
+	rs_vpass_scalar(acc + i, in + i, stride, w, taps, n - i);
+}
+
+#endif  // RESAMPLE_X86
+
+#ifdef RESAMPLE_NEON
+
+// Same layout rules as the SSE2 version
+static void rs_hpass_neon(float *out, const float *in, const struct resample_axis *ax, int dst_w,
+						  int channels)
+{
+	if (channels < 3) {
+		rs_hpass_scalar(out, in, ax, dst_w, channels);
+		return;
+	}
+	for (int x = 0; x < dst_w; x++) {
+		const float *w = ax->weights + (size_t)x * (size_t)ax->max_taps;
+		const float *p = in + (size_t)ax->first[x] * (size_t)channels;
+		float32x4_t acc = vdupq_n_f32(0);
+		for (int t = 0; t < ax->count[x]; t++)
+			acc = vfmaq_n_f32(acc, vld1q_f32(p + t * channels), w[t]);
+		if (channels == 4 || x + 1 < dst_w) {
+			vst1q_f32(out + x * channels, acc);
+		} else {
+			float lanes[4];
+			vst1q_f32(lanes, acc);
+			memcpy(out + x * channels, lanes, 3 * sizeof(float));
+		}
+	}
+}
+
+static void rs_vpass_neon(float *acc, const float *in, size_t stride, const float *w, int taps, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		float32x4_t s0 = vdupq_n_f32(0), s1 = s0, s2 = s0, s3 = s0;
+		for (int t = 0; t < taps; t++) {
+			const float *row = in + (size_t)t * stride + i;
+			s0 = vfmaq_n_f32(s0, vld1q_f32(row), w[t]);
+			s1 = vfmaq_n_f32(s1, vld1q_f32(row + 4), w[t]);
+			s2 = vfmaq_n_f32(s2, vld1q_f32(row + 8), w[t]);
+			s3 = vfmaq_n_f32(s3, vld1q_f32(row + 12), w[t]);
+		}
+		vst1q_f32(acc + i, s0);
+		vst1q_f32(acc + i + 4, s1);
+		vst1q_f32(acc + i + 8, s2);
+		vst1q_f32(acc + i + 12, s3);
+	}
+	rs_vpass_scalar(acc + i, in + i, stride, w, taps, n - i);
+}
+
+#endif  // RESAMPLE_NEON
+
+struct resample_kernels {
+	rs_hpass_fn hpass;
+	rs_vpass_fn vpass;
+};
+
+static struct resample_kernels rs_kernels = {
+#if defined(RESAMPLE_NEON)
+	.hpass = rs_hpass_neon,
+	.vpass = rs_vpass_neon,
+#elif defined(RESAMPLE_X86) && defined(__SSE2__)
+	.hpass = rs_hpass_sse2,
+	.vpass = rs_vpass_sse2,
+#else
+	.hpass = rs_hpass_scalar,
+	.vpass = rs_vpass_scalar,
+#endif
+};
+
+#ifdef RESAMPLE_X86
+__attribute__((constructor))
+static void rs_kernels_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		rs_kernels.hpass = rs_hpass_sse2;
+		rs_kernels.vpass = rs_vpass_sse2;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		rs_kernels.vpass = rs_vpass_avx2;
+}
+#endif
+
+static inline uint8_t resample_clamp_u8(float v)
+{
+	if (v <= 0.0f)
+		return 0;
+	if (v >= 255.0f)
+		return 255;
+	return (uint8_t)(v + 0.5f);
+}
+
+// Widens one row to floats, premultiplying colour by alpha if asked
+static void rs_load_row(float *out, const uint8_t *in, size_t pixels, int channels, bool premul)
+{
+	size_t n = pixels * (size_t)channels;
+	if (!premul) {
+		for (size_t i = 0; i < n; i++)
+			out[i] = in[i];
+		return;
+	}
+	for (size_t i = 0; i < n; i += 4) {
+		float a = in[i + 3] * (1.0f / 255.0f);
+		out[i + 0] = in[i + 0] * a;
+		out[i + 1] = in[i + 1] * a;
+		out[i + 2] = in[i + 2] * a;
+		out[i + 3] = in[i + 3];
+	}
+}
+
+// Narrows one filtered row back to 8 bits, undoing the premultiplication
+static void rs_store_row(uint8_t *out, const float *in, size_t pixels, int channels, bool premul)
+{
+	size_t n = pixels * (size_t)channels;
+	if (!premul) {
+		for (size_t i = 0; i < n; i++)
+			out[i] = resample_clamp_u8(in[i]);
+		return;
+	}
+	for (size_t i = 0; i < n; i += 4) {
+		uint8_t a = resample_clamp_u8(in[i + 3]);
+		float f = a ? 255.0f / in[i + 3] : 0.0f;
+		out[i + 0] = resample_clamp_u8(in[i + 0] * f);
+		out[i + 1] = resample_clamp_u8(in[i + 1] * f);
+		out[i + 2] = resample_clamp_u8(in[i + 2] * f);
+		out[i + 3] = a;
+	}
+}
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+struct resample_job {
+	const uint8_t *src;
+	size_t src_stride;          // bytes per src row
+	uint8_t *dst;
+	int src_w, src_h, dst_w, dst_h, channels;
+	bool premul;
+	struct resample_axis ax, ay;
+	float *tmp;                 // src_h rows of dst_w pixels
+	size_t tmp_stride;          // floats per tmp row
+	atomic_bool failed;
+};
+
+static void resample_hband(void *ctx, size_t band)
+{
+	struct resample_job *job = ctx;
+	int y0 = (int)band * RESAMPLE_BAND_ROWS;
+	int y1 = y0 + RESAMPLE_BAND_ROWS < job->src_h ? y0 + RESAMPLE_BAND_ROWS : job->src_h;
+	size_t row_len = (size_t)job->src_w * (size_t)job->channels;
+	// One spare float for the vector kernels' 3-channel over-read
+	float *row = malloc((row_len + 1) * sizeof(*row));
+	if (!row) {
+		atomic_store(&job->failed, true);
+		return;
+	}
+	row[row_len] = 0;
+	for (int y = y0; y < y1; y++) {
+		rs_load_row(row, job->src + (size_t)y * job->src_stride, (size_t)job->src_w, job->channels, job->premul);
+		rs_kernels.hpass(job->tmp + (size_t)y * job->tmp_stride, row, &job->ax, job->dst_w, job->channels);
+	}
+	free(row);
+}
+
+static void resample_vband(void *ctx, size_t band)
+{
+	struct resample_job *job = ctx;
+	int y0 = (int)band * RESAMPLE_BAND_ROWS;
+	int y1 = y0 + RESAMPLE_BAND_ROWS < job->dst_h ? y0 + RESAMPLE_BAND_ROWS : job->dst_h;
+	float *acc = malloc(job->tmp_stride * sizeof(*acc));
+	if (!acc) {
+		atomic_store(&job->failed, true);
+		return;
+	}
+	for (int y = y0; y < y1; y++) {
+		const struct resample_axis *ay = &job->ay;
+		rs_kernels.vpass(acc, job->tmp + (size_t)ay->first[y] * job->tmp_stride, job->tmp_stride,
+						 ay->weights + (size_t)y * (size_t)ay->max_taps, ay->count[y], job->tmp_stride);
+		rs_store_row(job->dst + (size_t)y * job->tmp_stride, acc, (size_t)job->dst_w, job->channels,
+					 job->premul);
+	}
+	free(acc);
+}
+
+// Resamples a src_w x src_h image with rows src_stride bytes apart into a
+// tightly packed dst_w x dst_h one, on up to `threads` threads
+static bool resample(const uint8_t *src, int src_w, int src_h, size_t src_stride, uint8_t *dst, int dst_w,
+					 int dst_h, int channels, enum resample_filter filter, int threads)
+{
+	struct resample_job job = {
+		.src = src, .src_stride = src_stride, .dst = dst,
+		.src_w = src_w, .src_h = src_h, .dst_w = dst_w, .dst_h = dst_h, .channels = channels,
+		.premul = channels == 4,
+		.tmp_stride = (size_t)dst_w * (size_t)channels,
+	};
+	atomic_init(&job.failed, false);
+	if (!resample_axis_init(&job.ax, src_w, dst_w, filter))
+		return false;
+	if (!resample_axis_init(&job.ay, src_h, dst_h, filter)) {
+		resample_axis_free(&job.ax);
+		return false;
+	}
+	job.tmp = malloc((size_t)src_h * job.tmp_stride * sizeof(*job.tmp));
+	if (!job.tmp) {
+		resample_axis_free(&job.ax);
+		resample_axis_free(&job.ay);
+		return false;
+	}
+
+	parallel_for(((size_t)src_h + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS, threads, resample_hband, &job);
+	if (!atomic_load(&job.failed))
+		parallel_for(((size_t)dst_h + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS, threads, resample_vband,
+					 &job);
+
+	free(job.tmp);
+	resample_axis_free(&job.ax);
+	resample_axis_free(&job.ay);
+	return !atomic_load(&job.failed);
+}
+
+#endif  // RESAMPLE_H
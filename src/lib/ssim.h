@@ -0,0 +1,64 @@
+#ifndef SSIM_H
+#define SSIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Structural similarity (Wang et al., 2004) of two 8-bit luma planes: the mean
+// over 8x8 windows placed every 4 pixels, with flat rather than Gaussian
+// weighting. 1.0 is identical; around 0.95-0.98 is a typical web encode.
+
+#define SSIM_WINDOW 8
+#define SSIM_STEP 4
+
+// BT.601 luma of an RGB or RGBA image, width bytes per output row
+static void ssim_luma(const uint8_t *pixels, int width, int height, int channels, size_t stride,
+					  uint8_t *luma)
+{
+	for (int y = 0; y < height; y++) {
+		const uint8_t *src = pixels + (size_t)y * stride;
+		uint8_t *dst = luma + (size_t)y * (size_t)width;
+		for (int x = 0; x < width; x++, src += channels)
+			dst[x] = (uint8_t)((77 * src[0] + 150 * src[1] + 29 * src[2] + 128) >> 8);
+	}
+}
+
+static double ssim_plane(const uint8_t *a, const uint8_t *b, int width, int height)
+{
+	// Images smaller than a window are one window
+	int ww = width < SSIM_WINDOW ? width : SSIM_WINDOW;
+	int wh = height < SSIM_WINDOW ? height : SSIM_WINDOW;
+	double n = (double)ww * wh;
+	const double c1 = (0.01 * 255) * (0.01 * 255);
+	const double c2 = (0.03 * 255) * (0.03 * 255);
+
+	double total = 0;
+	size_t windows = 0;
+	for (int y = 0; y + wh <= height; y += SSIM_STEP) {
+		for (int x = 0; x + ww <= width; x += SSIM_STEP) {
+			uint32_t sa = 0, sb = 0;
+			uint64_t saa = 0, sbb = 0, sab = 0;
+			for (int j = 0; j < wh; j++) {
+				const uint8_t *pa = a + (size_t)(y + j) * (size_t)width + x;
+				const uint8_t *pb = b + (size_t)(y + j) * (size_t)width + x;
+				for (int i = 0; i < ww; i++) {
+					uint32_t va = pa[i], vb = pb[i];
+					sa += va;
+					sb += vb;
+					saa += va * va;
+					sbb += vb * vb;
+					sab += va * vb;
+				}
+			}
+			double ma = sa / n, mb = sb / n;
+			double var_a = saa / n - ma * ma, var_b = sbb / n - mb * mb;
+			double cov = sab / n - ma * mb;
+			total += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+					 ((ma * ma + mb * mb + c1) * (var_a + var_b + c2));
+			windows++;
+		}
+	}
+	return windows ? total / (double)windows : 1.0;
+}
+
+#endif  // SSIM_H
@@ -23,7 +23,7 @@
 #define STDIO_HELPERS_UNUSED
 #endif
 
-static char stdio_printf_buf[256] STDIO_HELPERS_UNUSED;
+static _Thread_local char stdio_printf_buf[256] STDIO_HELPERS_UNUSED;
 
 #define PRINTF(format, ...) \
 	do { \
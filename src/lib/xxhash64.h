@@ -0,0 +1,107 @@
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), one-shot over a buffer. Fast
+// enough to hash an input file in a fraction of the time its decode takes; not
+// a cryptographic hash.
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t xxh64_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH64_PRIME2;
+	acc = xxh64_rotl(acc, 31);
+	return acc * XXH64_PRIME1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH64_PRIME1 + XXH64_PRIME2;
+		uint64_t v2 = seed + XXH64_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH64_PRIME1;
+		const uint8_t *limit = end - 32;
+		do {
+			v1 = xxh64_round(v1, xxh64_read64(p));
+			v2 = xxh64_round(v2, xxh64_read64(p + 8));
+			v3 = xxh64_round(v3, xxh64_read64(p + 16));
+			v4 = xxh64_round(v4, xxh64_read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+		h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+		h = xxh64_merge_round(h, v1);
+		h = xxh64_merge_round(h, v2);
+		h = xxh64_merge_round(h, v3);
+		h = xxh64_merge_round(h, v4);
+	} else {
+		h = seed + XXH64_PRIME5;
+	}
+	h += (uint64_t)len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, xxh64_read64(p));
+		h = xxh64_rotl(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)xxh64_read32(p) * XXH64_PRIME1;
+		h = xxh64_rotl(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH64_PRIME5;
+		h = xxh64_rotl(h, 11) * XXH64_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH64_PRIME2;
+	h ^= h >> 29;
+	h *= XXH64_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+#endif  // XXHASH64_H